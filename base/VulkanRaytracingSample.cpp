@@ -169,6 +169,7 @@ void VulkanRaytracingSample::createAccelerationStructure(AccelerationStructure&
 	VK_CHECK_RESULT(vkAllocateMemory(vulkanDevice->logicalDevice, &memoryAllocateInfo, nullptr, &accelerationStructure.memory));
 	VK_CHECK_RESULT(vkBindBufferMemory(vulkanDevice->logicalDevice, accelerationStructure.buffer, accelerationStructure.memory, 0));
 	// Acceleration structure
+	accelerationStructure.size = buildSizeInfo.accelerationStructureSize;
 	VkAccelerationStructureCreateInfoKHR accelerationStructureCreate_info{};
 	accelerationStructureCreate_info.sType = VK_STRUCTURE_TYPE_ACCELERATION_STRUCTURE_CREATE_INFO_KHR;
 	accelerationStructureCreate_info.buffer = accelerationStructure.buffer;
@@ -189,6 +190,278 @@ void VulkanRaytracingSample::deleteAccelerationStructure(AccelerationStructure&
 	vkDestroyAccelerationStructureKHR(device, accelerationStructure.handle, nullptr);
 }
 
+VkDeviceSize VulkanRaytracingSample::compactAccelerationStructures(std::vector<AccelerationStructure*> accelerationStructures)
+{
+	const uint32_t count = static_cast<uint32_t>(accelerationStructures.size());
+	if (count == 0) {
+		return 0;
+	}
+
+	// Query the compacted sizes of all structures at once
+	VkQueryPoolCreateInfo queryPoolCreateInfo{};
+	queryPoolCreateInfo.sType = VK_STRUCTURE_TYPE_QUERY_POOL_CREATE_INFO;
+	queryPoolCreateInfo.queryType = VK_QUERY_TYPE_ACCELERATION_STRUCTURE_COMPACTED_SIZE_KHR;
+	queryPoolCreateInfo.queryCount = count;
+	VkQueryPool queryPool;
+	VK_CHECK_RESULT(vkCreateQueryPool(device, &queryPoolCreateInfo, nullptr, &queryPool));
+
+	std::vector<VkAccelerationStructureKHR> handles(count);
+	for (uint32_t i = 0; i < count; i++) {
+		handles[i] = accelerationStructures[i]->handle;
+	}
+	VkCommandBuffer commandBuffer = vulkanDevice->createCommandBuffer(VK_COMMAND_BUFFER_LEVEL_PRIMARY, true);
+	vkCmdResetQueryPool(commandBuffer, queryPool, 0, count);
+	vkCmdWriteAccelerationStructuresPropertiesKHR(commandBuffer, count, handles.data(), VK_QUERY_TYPE_ACCELERATION_STRUCTURE_COMPACTED_SIZE_KHR, queryPool, 0);
+	vulkanDevice->flushCommandBuffer(commandBuffer, queue);
+
+	std::vector<VkDeviceSize> compactedSizes(count);
+	VK_CHECK_RESULT(vkGetQueryPoolResults(device, queryPool, 0, count, count * sizeof(VkDeviceSize), compactedSizes.data(), sizeof(VkDeviceSize), VK_QUERY_RESULT_64_BIT | VK_QUERY_RESULT_WAIT_BIT));
+	vkDestroyQueryPool(device, queryPool, nullptr);
+
+	// Copy into right sized structures in one submission, then release the originals
+	std::vector<AccelerationStructure> compacted(count);
+	commandBuffer = vulkanDevice->createCommandBuffer(VK_COMMAND_BUFFER_LEVEL_PRIMARY, true);
+	for (uint32_t i = 0; i < count; i++) {
+		VkAccelerationStructureBuildSizesInfoKHR buildSizeInfo = vks::initializers::accelerationStructureBuildSizesInfoKHR();
+		buildSizeInfo.accelerationStructureSize = compactedSizes[i];
+		createAccelerationStructure(compacted[i], VK_ACCELERATION_STRUCTURE_TYPE_BOTTOM_LEVEL_KHR, buildSizeInfo);
+		VkCopyAccelerationStructureInfoKHR copyInfo{};
+		copyInfo.sType = VK_STRUCTURE_TYPE_COPY_ACCELERATION_STRUCTURE_INFO_KHR;
+		copyInfo.src = accelerationStructures[i]->handle;
+		copyInfo.dst = compacted[i].handle;
+		copyInfo.mode = VK_COPY_ACCELERATION_STRUCTURE_MODE_COMPACT_KHR;
+		vkCmdCopyAccelerationStructureKHR(commandBuffer, &copyInfo);
+	}
+	vulkanDevice->flushCommandBuffer(commandBuffer, queue);
+
+	VkDeviceSize saved = 0;
+	for (uint32_t i = 0; i < count; i++) {
+		saved += accelerationStructures[i]->size - compacted[i].size;
+		deleteAccelerationStructure(*accelerationStructures[i]);
+		*accelerationStructures[i] = compacted[i];
+	}
+	return saved;
+}
+
+// Layout of an acceleration structure cache file: the header, one serialized size per structure, then the serialized structures at 256 byte aligned offsets
+struct AccelerationStructureCacheHeader {
+	uint32_t ident;
+	uint32_t version;
+	uint64_t key;
+	uint8_t pipelineCacheUUID[VK_UUID_SIZE];
+	uint32_t vendorID;
+	uint32_t deviceID;
+	uint32_t driverVersion;
+	uint32_t count;
+	uint64_t dataSize;
+};
+
+#define ASCACHE_IDENT (('C' << 24) + ('S' << 16) + ('A' << 8) + 'R')
+#define ASCACHE_VERSION 1
+// Required alignment of the addresses serialized structures are copied from and to
+#define ASCACHE_ALIGN 256
+
+static void initAccelerationStructureCacheHeader(AccelerationStructureCacheHeader& header, const VkPhysicalDeviceProperties& properties, uint64_t key, uint32_t count)
+{
+	memset(&header, 0, sizeof(header));
+	header.ident = ASCACHE_IDENT;
+	header.version = ASCACHE_VERSION;
+	header.key = key;
+	memcpy(header.pipelineCacheUUID, properties.pipelineCacheUUID, VK_UUID_SIZE);
+	header.vendorID = properties.vendorID;
+	header.deviceID = properties.deviceID;
+	header.driverVersion = properties.driverVersion;
+	header.count = count;
+}
+
+bool VulkanRaytracingSample::writeAccelerationStructureCache(const std::string& path, uint64_t key, const std::vector<AccelerationStructure*>& accelerationStructures)
+{
+	const uint32_t count = static_cast<uint32_t>(accelerationStructures.size());
+	if (count == 0) {
+		return false;
+	}
+
+	// Query the serialized sizes of all structures at once
+	VkQueryPoolCreateInfo queryPoolCreateInfo{};
+	queryPoolCreateInfo.sType = VK_STRUCTURE_TYPE_QUERY_POOL_CREATE_INFO;
+	queryPoolCreateInfo.queryType = VK_QUERY_TYPE_ACCELERATION_STRUCTURE_SERIALIZATION_SIZE_KHR;
+	queryPoolCreateInfo.queryCount = count;
+	VkQueryPool queryPool;
+	VK_CHECK_RESULT(vkCreateQueryPool(device, &queryPoolCreateInfo, nullptr, &queryPool));
+
+	std::vector<VkAccelerationStructureKHR> handles(count);
+	for (uint32_t i = 0; i < count; i++) {
+		handles[i] = accelerationStructures[i]->handle;
+	}
+	VkCommandBuffer commandBuffer = vulkanDevice->createCommandBuffer(VK_COMMAND_BUFFER_LEVEL_PRIMARY, true);
+	vkCmdResetQueryPool(commandBuffer, queryPool, 0, count);
+	vkCmdWriteAccelerationStructuresPropertiesKHR(commandBuffer, count, handles.data(), VK_QUERY_TYPE_ACCELERATION_STRUCTURE_SERIALIZATION_SIZE_KHR, queryPool, 0);
+	vulkanDevice->flushCommandBuffer(commandBuffer, queue);
+
+	std::vector<uint64_t> serializedSizes(count);
+	VK_CHECK_RESULT(vkGetQueryPoolResults(device, queryPool, 0, count, count * sizeof(uint64_t), serializedSizes.data(), sizeof(uint64_t), VK_QUERY_RESULT_64_BIT | VK_QUERY_RESULT_WAIT_BIT));
+	vkDestroyQueryPool(device, queryPool, nullptr);
+
+	std::vector<VkDeviceSize> offsets(count);
+	VkDeviceSize dataSize = 0;
+	for (uint32_t i = 0; i < count; i++) {
+		offsets[i] = dataSize;
+		dataSize = (dataSize + serializedSizes[i] + ASCACHE_ALIGN - 1) & ~(VkDeviceSize)(ASCACHE_ALIGN - 1);
+	}
+
+	// Serialize into a host visible buffer in one submission, padded so every structure can start on an aligned address
+	vks::Buffer serialized;
+	VK_CHECK_RESULT(vulkanDevice->createBuffer(
+		VK_BUFFER_USAGE_SHADER_DEVICE_ADDRESS_BIT | VK_BUFFER_USAGE_STORAGE_BUFFER_BIT,
+		VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT,
+		&serialized,
+		dataSize + ASCACHE_ALIGN));
+	const uint64_t bufferAddress = getBufferDeviceAddress(serialized.buffer);
+	const VkDeviceSize base = ((bufferAddress + ASCACHE_ALIGN - 1) & ~(uint64_t)(ASCACHE_ALIGN - 1)) - bufferAddress;
+	commandBuffer = vulkanDevice->createCommandBuffer(VK_COMMAND_BUFFER_LEVEL_PRIMARY, true);
+	for (uint32_t i = 0; i < count; i++) {
+		VkCopyAccelerationStructureToMemoryInfoKHR copyInfo{};
+		copyInfo.sType = VK_STRUCTURE_TYPE_COPY_ACCELERATION_STRUCTURE_TO_MEMORY_INFO_KHR;
+		copyInfo.src = handles[i];
+		copyInfo.dst.deviceAddress = bufferAddress + base + offsets[i];
+		copyInfo.mode = VK_COPY_ACCELERATION_STRUCTURE_MODE_SERIALIZE_KHR;
+		vkCmdCopyAccelerationStructureToMemoryKHR(commandBuffer, &copyInfo);
+	}
+	vulkanDevice->flushCommandBuffer(commandBuffer, queue);
+
+	AccelerationStructureCacheHeader header;
+	initAccelerationStructureCacheHeader(header, vulkanDevice->properties, key, count);
+	header.dataSize = dataSize;
+
+	// Written under a temporary name and renamed, so a reader never sees a partial cache
+	VK_CHECK_RESULT(serialized.map());
+	const std::string tempPath = path + ".tmp";
+	bool written = false;
+	FILE* file = fopen(tempPath.c_str(), "wb");
+	if (file) {
+		written = fwrite(&header, sizeof(header), 1, file) == 1
+			&& fwrite(serializedSizes.data(), sizeof(uint64_t), count, file) == count
+			&& fwrite((const uint8_t*)serialized.mapped + base, 1, dataSize, file) == dataSize;
+		written = (fclose(file) == 0) && written;
+	}
+	serialized.destroy();
+	if (written) {
+#if defined(_WIN32)
+		remove(path.c_str()); // rename does not replace on Windows
+#endif
+		written = rename(tempPath.c_str(), path.c_str()) == 0;
+	}
+	if (!written) {
+		std::cerr << "Could not write acceleration structure cache " << path << std::endl;
+		remove(tempPath.c_str());
+	}
+	return written;
+}
+
+bool VulkanRaytracingSample::loadAccelerationStructureCache(const std::string& path, uint64_t key, const std::vector<AccelerationStructure*>& accelerationStructures)
+{
+	const uint32_t count = static_cast<uint32_t>(accelerationStructures.size());
+	FILE* file = fopen(path.c_str(), "rb");
+	if (!file) {
+		return false;
+	}
+
+	AccelerationStructureCacheHeader header, expected;
+	initAccelerationStructureCacheHeader(expected, vulkanDevice->properties, key, count);
+	std::vector<uint64_t> serializedSizes(count);
+	if (fread(&header, sizeof(header), 1, file) != 1
+		|| memcmp(&header, &expected, offsetof(AccelerationStructureCacheHeader, dataSize)) != 0
+		|| fread(serializedSizes.data(), sizeof(uint64_t), count, file) != count) {
+		fclose(file);
+		std::cout << "Acceleration structure cache " << path << " is stale, rebuilding" << std::endl;
+		return false;
+	}
+
+	// The data size comes from the file, it must not ask for more than the file holds before anything is allocated for it
+	const long dataStart = ftell(file);
+	long fileSize = -1;
+	if (dataStart >= 0 && fseek(file, 0, SEEK_END) == 0) {
+		fileSize = ftell(file);
+	}
+	if (fileSize < dataStart || header.dataSize > (uint64_t)(fileSize - dataStart) || fseek(file, dataStart, SEEK_SET) != 0) {
+		fclose(file);
+		std::cout << "Acceleration structure cache " << path << " is truncated, rebuilding" << std::endl;
+		return false;
+	}
+
+	// The serialized data is read straight into the buffer it is deserialized from
+	vks::Buffer serialized;
+	VK_CHECK_RESULT(vulkanDevice->createBuffer(
+		VK_BUFFER_USAGE_SHADER_DEVICE_ADDRESS_BIT | VK_BUFFER_USAGE_STORAGE_BUFFER_BIT,
+		VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT,
+		&serialized,
+		header.dataSize + ASCACHE_ALIGN));
+	VK_CHECK_RESULT(serialized.map());
+	const uint64_t bufferAddress = getBufferDeviceAddress(serialized.buffer);
+	const VkDeviceSize base = ((bufferAddress + ASCACHE_ALIGN - 1) & ~(uint64_t)(ASCACHE_ALIGN - 1)) - bufferAddress;
+	const uint8_t* data = (const uint8_t*)serialized.mapped + base;
+	bool valid = fread((uint8_t*)serialized.mapped + base, 1, header.dataSize, file) == header.dataSize;
+	fclose(file);
+
+	// No structure can deserialize to more than the largest device local heap holds
+	VkDeviceSize maxDeserializedSize = 0;
+	for (uint32_t i = 0; i < vulkanDevice->memoryProperties.memoryHeapCount; i++) {
+		const VkMemoryHeap& heap = vulkanDevice->memoryProperties.memoryHeaps[i];
+		if ((heap.flags & VK_MEMORY_HEAP_DEVICE_LOCAL_BIT) && heap.size > maxDeserializedSize) {
+			maxDeserializedSize = heap.size;
+		}
+	}
+
+	// Every serialized structure starts with the driver and compatibility UUIDs, its serialized size and the size it deserializes to.
+	// The sizes come from the file, so they are checked against what was read before they are used for offsets or allocations
+	std::vector<VkDeviceSize> offsets(count);
+	std::vector<VkDeviceSize> deserializedSizes(count);
+	VkDeviceSize offset = 0;
+	for (uint32_t i = 0; valid && i < count; i++) {
+		if (serializedSizes[i] < 2 * VK_UUID_SIZE + 3 * sizeof(uint64_t) || serializedSizes[i] > header.dataSize - offset) {
+			valid = false;
+			break;
+		}
+		offsets[i] = offset;
+		offset = std::min<VkDeviceSize>((offset + serializedSizes[i] + ASCACHE_ALIGN - 1) & ~(VkDeviceSize)(ASCACHE_ALIGN - 1), header.dataSize);
+		uint64_t embeddedSizes[2];
+		memcpy(embeddedSizes, data + offsets[i] + 2 * VK_UUID_SIZE, sizeof(embeddedSizes));
+		deserializedSizes[i] = embeddedSizes[1];
+		if (embeddedSizes[0] != serializedSizes[i] || deserializedSizes[i] == 0 || deserializedSizes[i] > maxDeserializedSize) {
+			valid = false;
+			break;
+		}
+		VkAccelerationStructureVersionInfoKHR versionInfo{};
+		versionInfo.sType = VK_STRUCTURE_TYPE_ACCELERATION_STRUCTURE_VERSION_INFO_KHR;
+		versionInfo.pVersionData = data + offsets[i];
+		VkAccelerationStructureCompatibilityKHR compatibility = VK_ACCELERATION_STRUCTURE_COMPATIBILITY_INCOMPATIBLE_KHR;
+		vkGetDeviceAccelerationStructureCompatibilityKHR(device, &versionInfo, &compatibility);
+		valid = compatibility == VK_ACCELERATION_STRUCTURE_COMPATIBILITY_COMPATIBLE_KHR;
+	}
+	if (!valid) {
+		serialized.destroy();
+		std::cout << "Acceleration structure cache " << path << " is not compatible with this device, rebuilding" << std::endl;
+		return false;
+	}
+
+	// Deserialize all structures in one submission
+	VkCommandBuffer commandBuffer = vulkanDevice->createCommandBuffer(VK_COMMAND_BUFFER_LEVEL_PRIMARY, true);
+	for (uint32_t i = 0; i < count; i++) {
+		VkAccelerationStructureBuildSizesInfoKHR buildSizeInfo = vks::initializers::accelerationStructureBuildSizesInfoKHR();
+		buildSizeInfo.accelerationStructureSize = deserializedSizes[i];
+		createAccelerationStructure(*accelerationStructures[i], VK_ACCELERATION_STRUCTURE_TYPE_BOTTOM_LEVEL_KHR, buildSizeInfo);
+		VkCopyMemoryToAccelerationStructureInfoKHR copyInfo{};
+		copyInfo.sType = VK_STRUCTURE_TYPE_COPY_MEMORY_TO_ACCELERATION_STRUCTURE_INFO_KHR;
+		copyInfo.src.deviceAddress = bufferAddress + base + offsets[i];
+		copyInfo.dst = accelerationStructures[i]->handle;
+		copyInfo.mode = VK_COPY_ACCELERATION_STRUCTURE_MODE_DESERIALIZE_KHR;
+		vkCmdCopyMemoryToAccelerationStructureKHR(commandBuffer, &copyInfo);
+	}
+	vulkanDevice->flushCommandBuffer(commandBuffer, queue);
+	serialized.destroy();
+	return true;
+}
+
 uint64_t VulkanRaytracingSample::getBufferDeviceAddress(VkBuffer buffer)
 {
 	VkBufferDeviceAddressInfoKHR bufferDeviceAI{};
@@ -197,61 +470,323 @@ uint64_t VulkanRaytracingSample::getBufferDeviceAddress(VkBuffer buffer)
 	return vkGetBufferDeviceAddressKHR(vulkanDevice->logicalDevice, &bufferDeviceAI);
 }
 
-void VulkanRaytracingSample::createStorageImage(VkFormat format, VkExtent3D extent)
+void VulkanRaytracingSample::addAccelerationStructureBuild(AccelerationStructureBuildBatch& batch, AccelerationStructure& accelerationStructure, VkAccelerationStructureTypeKHR type, VkBuildAccelerationStructureFlagsKHR flags, const VkAccelerationStructureGeometryKHR* geometries, const VkAccelerationStructureBuildRangeInfoKHR* buildRanges, uint32_t geometryCount)
+{
+	std::vector<uint32_t> maxPrimitiveCounts(geometryCount);
+	for (uint32_t i = 0; i < geometryCount; i++) {
+		maxPrimitiveCounts[i] = buildRanges[i].primitiveCount;
+	}
+
+	// Get size info
+	VkAccelerationStructureBuildGeometryInfoKHR accelerationStructureBuildGeometryInfo = vks::initializers::accelerationStructureBuildGeometryInfoKHR();
+	accelerationStructureBuildGeometryInfo.type = type;
+	accelerationStructureBuildGeometryInfo.flags = flags;
+	accelerationStructureBuildGeometryInfo.geometryCount = geometryCount;
+	accelerationStructureBuildGeometryInfo.pGeometries = geometries;
+	VkAccelerationStructureBuildSizesInfoKHR accelerationStructureBuildSizesInfo = vks::initializers::accelerationStructureBuildSizesInfoKHR();
+	vkGetAccelerationStructureBuildSizesKHR(device, VK_ACCELERATION_STRUCTURE_BUILD_TYPE_DEVICE_KHR, &accelerationStructureBuildGeometryInfo, maxPrimitiveCounts.data(), &accelerationStructureBuildSizesInfo);
+
+	createAccelerationStructure(accelerationStructure, type, accelerationStructureBuildSizesInfo);
+
+	// Builds in the same command must not share scratch memory, each one gets its own aligned region of the arena
+	const VkDeviceSize alignment = std::max<VkDeviceSize>(accelerationStructureProperties.minAccelerationStructureScratchOffsetAlignment, 1);
+	AccelerationStructureBuildBatch::Build build{};
+	build.accelerationStructure = &accelerationStructure;
+	build.type = type;
+	build.flags = flags;
+	build.firstGeometry = static_cast<uint32_t>(batch.geometries.size());
+	build.geometryCount = geometryCount;
+	build.scratchOffset = (batch.scratchSize + alignment - 1) / alignment * alignment;
+	batch.scratchSize = build.scratchOffset + accelerationStructureBuildSizesInfo.buildScratchSize;
+	batch.builds.push_back(build);
+	batch.geometries.insert(batch.geometries.end(), geometries, geometries + geometryCount);
+	batch.buildRanges.insert(batch.buildRanges.end(), buildRanges, buildRanges + geometryCount);
+}
+
+void VulkanRaytracingSample::buildAccelerationStructures(AccelerationStructureBuildBatch& batch)
+{
+	if (batch.builds.empty()) {
+		return;
+	}
+
+	// The buffer itself may be less aligned than the scratch offsets have to be
+	const VkDeviceSize alignment = std::max<VkDeviceSize>(accelerationStructureProperties.minAccelerationStructureScratchOffsetAlignment, 1);
+	ScratchBuffer scratchBuffer = createScratchBuffer(batch.scratchSize + alignment);
+	const uint64_t scratchBase = (scratchBuffer.deviceAddress + alignment - 1) / alignment * alignment;
+
+	std::vector<VkAccelerationStructureBuildGeometryInfoKHR> accelerationBuildGeometryInfos(batch.builds.size());
+	std::vector<const VkAccelerationStructureBuildRangeInfoKHR*> accelerationBuildStructureRangeInfos(batch.builds.size());
+	for (size_t i = 0; i < batch.builds.size(); i++) {
+		const AccelerationStructureBuildBatch::Build& build = batch.builds[i];
+		VkAccelerationStructureBuildGeometryInfoKHR& accelerationBuildGeometryInfo = accelerationBuildGeometryInfos[i];
+		accelerationBuildGeometryInfo = vks::initializers::accelerationStructureBuildGeometryInfoKHR();
+		accelerationBuildGeometryInfo.type = build.type;
+		accelerationBuildGeometryInfo.flags = build.flags;
+		accelerationBuildGeometryInfo.mode = VK_BUILD_ACCELERATION_STRUCTURE_MODE_BUILD_KHR;
+		accelerationBuildGeometryInfo.dstAccelerationStructure = build.accelerationStructure->handle;
+		accelerationBuildGeometryInfo.geometryCount = build.geometryCount;
+		accelerationBuildGeometryInfo.pGeometries = &batch.geometries[build.firstGeometry];
+		accelerationBuildGeometryInfo.scratchData.deviceAddress = scratchBase + build.scratchOffset;
+		accelerationBuildStructureRangeInfos[i] = &batch.buildRanges[build.firstGeometry];
+	}
+
+	// Build the acceleration structures on the device via a one-time command buffer submission
+	VkCommandBuffer commandBuffer = vulkanDevice->createCommandBuffer(VK_COMMAND_BUFFER_LEVEL_PRIMARY, true);
+	vkCmdBuildAccelerationStructuresKHR(
+		commandBuffer,
+		static_cast<uint32_t>(accelerationBuildGeometryInfos.size()),
+		accelerationBuildGeometryInfos.data(),
+		accelerationBuildStructureRangeInfos.data());
+	vulkanDevice->flushCommandBuffer(commandBuffer, queue);
+
+	deleteScratchBuffer(scratchBuffer);
+	batch = AccelerationStructureBuildBatch();
+}
+
+static VkAccelerationStructureGeometryKHR topLevelGeometry(uint64_t instanceDataDeviceAddress)
+{
+	VkAccelerationStructureGeometryKHR accelerationStructureGeometry = vks::initializers::accelerationStructureGeometryKHR();
+	accelerationStructureGeometry.geometryType = VK_GEOMETRY_TYPE_INSTANCES_KHR;
+	accelerationStructureGeometry.flags = VK_GEOMETRY_OPAQUE_BIT_KHR;
+	accelerationStructureGeometry.geometry.instances.sType = VK_STRUCTURE_TYPE_ACCELERATION_STRUCTURE_GEOMETRY_INSTANCES_DATA_KHR;
+	accelerationStructureGeometry.geometry.instances.arrayOfPointers = VK_FALSE;
+	accelerationStructureGeometry.geometry.instances.data.deviceAddress = instanceDataDeviceAddress;
+	return accelerationStructureGeometry;
+}
+
+void VulkanRaytracingSample::createPersistentTopLevelAS(PersistentTopLevelAS& topLevelAS, uint32_t maxInstances, uint32_t frames)
+{
+	topLevelAS.maxInstances = maxInstances;
+	topLevelAS.frames = frames;
+	topLevelAS.slot = 0;
+	topLevelAS.built = false;
+
+	VK_CHECK_RESULT(vulkanDevice->createBuffer(
+		VK_BUFFER_USAGE_SHADER_DEVICE_ADDRESS_BIT | VK_BUFFER_USAGE_ACCELERATION_STRUCTURE_BUILD_INPUT_READ_ONLY_BIT_KHR,
+		VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT,
+		&topLevelAS.instanceBuffer,
+		(VkDeviceSize)maxInstances * frames * sizeof(VkAccelerationStructureInstanceKHR)));
+	VK_CHECK_RESULT(topLevelAS.instanceBuffer.map());
+	topLevelAS.instanceBufferDeviceAddress = getBufferDeviceAddress(topLevelAS.instanceBuffer.buffer);
+
+	// Sized for the most instances there will ever be
+	VkAccelerationStructureGeometryKHR accelerationStructureGeometry = topLevelGeometry(0);
+	VkAccelerationStructureBuildGeometryInfoKHR accelerationStructureBuildGeometryInfo = vks::initializers::accelerationStructureBuildGeometryInfoKHR();
+	accelerationStructureBuildGeometryInfo.type = VK_ACCELERATION_STRUCTURE_TYPE_TOP_LEVEL_KHR;
+	accelerationStructureBuildGeometryInfo.flags = VK_BUILD_ACCELERATION_STRUCTURE_PREFER_FAST_TRACE_BIT_KHR | VK_BUILD_ACCELERATION_STRUCTURE_ALLOW_UPDATE_BIT_KHR;
+	accelerationStructureBuildGeometryInfo.geometryCount = 1;
+	accelerationStructureBuildGeometryInfo.pGeometries = &accelerationStructureGeometry;
+	VkAccelerationStructureBuildSizesInfoKHR accelerationStructureBuildSizesInfo = vks::initializers::accelerationStructureBuildSizesInfoKHR();
+	vkGetAccelerationStructureBuildSizesKHR(device, VK_ACCELERATION_STRUCTURE_BUILD_TYPE_DEVICE_KHR, &accelerationStructureBuildGeometryInfo, &maxInstances, &accelerationStructureBuildSizesInfo);
+
+	createAccelerationStructure(topLevelAS.accelerationStructure, VK_ACCELERATION_STRUCTURE_TYPE_TOP_LEVEL_KHR, accelerationStructureBuildSizesInfo);
+
+	// The buffer itself may be less aligned than the scratch address has to be
+	const VkDeviceSize alignment = std::max<VkDeviceSize>(accelerationStructureProperties.minAccelerationStructureScratchOffsetAlignment, 1);
+	topLevelAS.scratchBuffer = createScratchBuffer(std::max(accelerationStructureBuildSizesInfo.buildScratchSize, accelerationStructureBuildSizesInfo.updateScratchSize) + alignment);
+	topLevelAS.scratchAddress = (topLevelAS.scratchBuffer.deviceAddress + alignment - 1) / alignment * alignment;
+}
+
+void VulkanRaytracingSample::updatePersistentTopLevelAS(PersistentTopLevelAS& topLevelAS, VkCommandBuffer commandBuffer, const VkAccelerationStructureInstanceKHR* instances, uint32_t instanceCount)
+{
+	assert(instanceCount <= topLevelAS.maxInstances);
+
+	// The slot used last may still be read by a frame in flight
+	topLevelAS.slot = (topLevelAS.slot + 1) % topLevelAS.frames;
+	const VkDeviceSize slotOffset = (VkDeviceSize)topLevelAS.slot * topLevelAS.maxInstances * sizeof(VkAccelerationStructureInstanceKHR);
+	memcpy((uint8_t*)topLevelAS.instanceBuffer.mapped + slotOffset, instances, instanceCount * sizeof(VkAccelerationStructureInstanceKHR));
+
+	const bool update = topLevelAS.built && topLevelAS.builtInstances == instanceCount && topLevelAS.updatesSinceBuild < topLevelAS.rebuildInterval;
+
+	VkAccelerationStructureGeometryKHR accelerationStructureGeometry = topLevelGeometry(topLevelAS.instanceBufferDeviceAddress + slotOffset);
+	VkAccelerationStructureBuildGeometryInfoKHR accelerationBuildGeometryInfo = vks::initializers::accelerationStructureBuildGeometryInfoKHR();
+	accelerationBuildGeometryInfo.type = VK_ACCELERATION_STRUCTURE_TYPE_TOP_LEVEL_KHR;
+	accelerationBuildGeometryInfo.flags = VK_BUILD_ACCELERATION_STRUCTURE_PREFER_FAST_TRACE_BIT_KHR | VK_BUILD_ACCELERATION_STRUCTURE_ALLOW_UPDATE_BIT_KHR;
+	accelerationBuildGeometryInfo.mode = update ? VK_BUILD_ACCELERATION_STRUCTURE_MODE_UPDATE_KHR : VK_BUILD_ACCELERATION_STRUCTURE_MODE_BUILD_KHR;
+	accelerationBuildGeometryInfo.srcAccelerationStructure = update ? topLevelAS.accelerationStructure.handle : VK_NULL_HANDLE;
+	accelerationBuildGeometryInfo.dstAccelerationStructure = topLevelAS.accelerationStructure.handle;
+	accelerationBuildGeometryInfo.geometryCount = 1;
+	accelerationBuildGeometryInfo.pGeometries = &accelerationStructureGeometry;
+	accelerationBuildGeometryInfo.scratchData.deviceAddress = topLevelAS.scratchAddress;
+
+	VkAccelerationStructureBuildRangeInfoKHR accelerationStructureBuildRangeInfo{};
+	accelerationStructureBuildRangeInfo.primitiveCount = instanceCount;
+	const VkAccelerationStructureBuildRangeInfoKHR* accelerationBuildStructureRangeInfo = &accelerationStructureBuildRangeInfo;
+
+	// Earlier traces and builds of this structure, and the shared scratch buffer, have to be done first
+	VkMemoryBarrier memoryBarrier = vks::initializers::memoryBarrier();
+	memoryBarrier.srcAccessMask = VK_ACCESS_ACCELERATION_STRUCTURE_READ_BIT_KHR | VK_ACCESS_ACCELERATION_STRUCTURE_WRITE_BIT_KHR;
+	memoryBarrier.dstAccessMask = VK_ACCESS_ACCELERATION_STRUCTURE_READ_BIT_KHR | VK_ACCESS_ACCELERATION_STRUCTURE_WRITE_BIT_KHR;
+	vkCmdPipelineBarrier(commandBuffer,
+		VK_PIPELINE_STAGE_ACCELERATION_STRUCTURE_BUILD_BIT_KHR | VK_PIPELINE_STAGE_RAY_TRACING_SHADER_BIT_KHR,
+		VK_PIPELINE_STAGE_ACCELERATION_STRUCTURE_BUILD_BIT_KHR,
+		0, 1, &memoryBarrier, 0, nullptr, 0, nullptr);
+
+	vkCmdBuildAccelerationStructuresKHR(commandBuffer, 1, &accelerationBuildGeometryInfo, &accelerationBuildStructureRangeInfo);
+
+	memoryBarrier.srcAccessMask = VK_ACCESS_ACCELERATION_STRUCTURE_WRITE_BIT_KHR;
+	memoryBarrier.dstAccessMask = VK_ACCESS_ACCELERATION_STRUCTURE_READ_BIT_KHR;
+	vkCmdPipelineBarrier(commandBuffer,
+		VK_PIPELINE_STAGE_ACCELERATION_STRUCTURE_BUILD_BIT_KHR,
+		VK_PIPELINE_STAGE_RAY_TRACING_SHADER_BIT_KHR,
+		0, 1, &memoryBarrier, 0, nullptr, 0, nullptr);
+
+	if (update) {
+		topLevelAS.updatesSinceBuild++;
+	} else {
+		topLevelAS.built = true;
+		topLevelAS.builtInstances = instanceCount;
+		topLevelAS.updatesSinceBuild = 0;
+	}
+}
+
+void VulkanRaytracingSample::deletePersistentTopLevelAS(PersistentTopLevelAS& topLevelAS)
 {
-	// Release ressources if image is to be recreated
-	if (storageImage.image != VK_NULL_HANDLE) {
-		vkDestroyImageView(device, storageImage.view, nullptr);
-		vkDestroyImage(device, storageImage.image, nullptr);
-		vkFreeMemory(device, storageImage.memory, nullptr);
-		storageImage = {};
-	}
-
-	VkImageCreateInfo image = vks::initializers::imageCreateInfo();
-	image.imageType = VK_IMAGE_TYPE_2D;
-	image.format = format;
-	image.extent = extent;
-	image.mipLevels = 1;
-	image.arrayLayers = 1;
-	image.samples = VK_SAMPLE_COUNT_1_BIT;
-	image.tiling = VK_IMAGE_TILING_OPTIMAL;
-	image.usage = VK_IMAGE_USAGE_TRANSFER_SRC_BIT | VK_IMAGE_USAGE_STORAGE_BIT;
-	image.initialLayout = VK_IMAGE_LAYOUT_UNDEFINED;
-	VK_CHECK_RESULT(vkCreateImage(vulkanDevice->logicalDevice, &image, nullptr, &storageImage.image));
-
-	VkMemoryRequirements memReqs;
-	vkGetImageMemoryRequirements(vulkanDevice->logicalDevice, storageImage.image, &memReqs);
-	VkMemoryAllocateInfo memoryAllocateInfo = vks::initializers::memoryAllocateInfo();
-	memoryAllocateInfo.allocationSize = memReqs.size;
-	memoryAllocateInfo.memoryTypeIndex = vulkanDevice->getMemoryType(memReqs.memoryTypeBits, VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT);
-	VK_CHECK_RESULT(vkAllocateMemory(vulkanDevice->logicalDevice, &memoryAllocateInfo, nullptr, &storageImage.memory));
-	VK_CHECK_RESULT(vkBindImageMemory(vulkanDevice->logicalDevice, storageImage.image, storageImage.memory, 0));
-
-	VkImageViewCreateInfo colorImageView = vks::initializers::imageViewCreateInfo();
-	colorImageView.viewType = VK_IMAGE_VIEW_TYPE_2D;
-	colorImageView.format = format;
-	colorImageView.subresourceRange = {};
-	colorImageView.subresourceRange.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT;
-	colorImageView.subresourceRange.baseMipLevel = 0;
-	colorImageView.subresourceRange.levelCount = 1;
-	colorImageView.subresourceRange.baseArrayLayer = 0;
-	colorImageView.subresourceRange.layerCount = 1;
-	colorImageView.image = storageImage.image;
-	VK_CHECK_RESULT(vkCreateImageView(vulkanDevice->logicalDevice, &colorImageView, nullptr, &storageImage.view));
+	deleteScratchBuffer(topLevelAS.scratchBuffer);
+	topLevelAS.instanceBuffer.destroy();
+	deleteAccelerationStructure(topLevelAS.accelerationStructure);
+}
+
+void VulkanRaytracingSample::createStorageImages(VkFormat format, VkExtent3D extent)
+{
+	// Release ressources if images are to be recreated
+	deleteStorageImages();
+
+	storageImages.resize(swapChain.imageCount);
+	storageImagesInSwapChain = (swapChain.imageUsage & VK_IMAGE_USAGE_STORAGE_BIT) && format == swapChain.colorFormat;
+	if (storageImagesInSwapChain) {
+		// The swap chain images are written by the ray generation shader directly, their layout is set per frame
+		for (uint32_t i = 0; i < swapChain.imageCount; i++) {
+			storageImages[i].image = swapChain.buffers[i].image;
+			storageImages[i].view = swapChain.buffers[i].view;
+			storageImages[i].format = format;
+		}
+		return;
+	}
 
 	VkCommandBuffer cmdBuffer = vulkanDevice->createCommandBuffer(VK_COMMAND_BUFFER_LEVEL_PRIMARY, true);
-	vks::tools::setImageLayout(cmdBuffer, storageImage.image,
-		VK_IMAGE_LAYOUT_UNDEFINED,
-		VK_IMAGE_LAYOUT_GENERAL,
-		{ VK_IMAGE_ASPECT_COLOR_BIT, 0, 1, 0, 1 });
+	for (StorageImage& storageImage : storageImages) {
+		VkImageCreateInfo image = vks::initializers::imageCreateInfo();
+		image.imageType = VK_IMAGE_TYPE_2D;
+		image.format = format;
+		image.extent = extent;
+		image.mipLevels = 1;
+		image.arrayLayers = 1;
+		image.samples = VK_SAMPLE_COUNT_1_BIT;
+		image.tiling = VK_IMAGE_TILING_OPTIMAL;
+		image.usage = VK_IMAGE_USAGE_TRANSFER_SRC_BIT | VK_IMAGE_USAGE_STORAGE_BIT;
+		image.initialLayout = VK_IMAGE_LAYOUT_UNDEFINED;
+		VK_CHECK_RESULT(vkCreateImage(vulkanDevice->logicalDevice, &image, nullptr, &storageImage.image));
+		storageImage.format = format;
+
+		VkMemoryRequirements memReqs;
+		vkGetImageMemoryRequirements(vulkanDevice->logicalDevice, storageImage.image, &memReqs);
+		VkMemoryAllocateInfo memoryAllocateInfo = vks::initializers::memoryAllocateInfo();
+		memoryAllocateInfo.allocationSize = memReqs.size;
+		memoryAllocateInfo.memoryTypeIndex = vulkanDevice->getMemoryType(memReqs.memoryTypeBits, VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT);
+		VK_CHECK_RESULT(vkAllocateMemory(vulkanDevice->logicalDevice, &memoryAllocateInfo, nullptr, &storageImage.memory));
+		VK_CHECK_RESULT(vkBindImageMemory(vulkanDevice->logicalDevice, storageImage.image, storageImage.memory, 0));
+
+		VkImageViewCreateInfo colorImageView = vks::initializers::imageViewCreateInfo();
+		colorImageView.viewType = VK_IMAGE_VIEW_TYPE_2D;
+		colorImageView.format = format;
+		colorImageView.subresourceRange = {};
+		colorImageView.subresourceRange.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT;
+		colorImageView.subresourceRange.baseMipLevel = 0;
+		colorImageView.subresourceRange.levelCount = 1;
+		colorImageView.subresourceRange.baseArrayLayer = 0;
+		colorImageView.subresourceRange.layerCount = 1;
+		colorImageView.image = storageImage.image;
+		VK_CHECK_RESULT(vkCreateImageView(vulkanDevice->logicalDevice, &colorImageView, nullptr, &storageImage.view));
+
+		// Storage images stay in the general layout, the copy to the swap chain reads them from there
+		vks::tools::setImageLayout(cmdBuffer, storageImage.image,
+			VK_IMAGE_LAYOUT_UNDEFINED,
+			VK_IMAGE_LAYOUT_GENERAL,
+			{ VK_IMAGE_ASPECT_COLOR_BIT, 0, 1, 0, 1 });
+	}
 	vulkanDevice->flushCommandBuffer(cmdBuffer, queue);
 }
 
-void VulkanRaytracingSample::deleteStorageImage()
+void VulkanRaytracingSample::deleteStorageImages()
 {
-	vkDestroyImageView(vulkanDevice->logicalDevice, storageImage.view, nullptr);
-	vkDestroyImage(vulkanDevice->logicalDevice, storageImage.image, nullptr);
-	vkFreeMemory(vulkanDevice->logicalDevice, storageImage.memory, nullptr);
+	for (StorageImage& storageImage : storageImages) {
+		// Swap chain images are owned by the swap chain
+		if (storageImage.memory == VK_NULL_HANDLE) {
+			continue;
+		}
+		vkDestroyImageView(vulkanDevice->logicalDevice, storageImage.view, nullptr);
+		vkDestroyImage(vulkanDevice->logicalDevice, storageImage.image, nullptr);
+		vkFreeMemory(vulkanDevice->logicalDevice, storageImage.memory, nullptr);
+	}
+	storageImages.clear();
+}
+
+void VulkanRaytracingSample::recordStorageImageWriteBarrier(VkCommandBuffer commandBuffer, uint32_t imageIndex)
+{
+	const VkImageSubresourceRange subresourceRange = { VK_IMAGE_ASPECT_COLOR_BIT, 0, 1, 0, 1 };
+	// The swap chain image is acquired by waiting at the color attachment output stage, chaining on that stage orders the transitions after the acquire
+	VkImageMemoryBarrier barriers[2];
+	barriers[0] = vks::initializers::imageMemoryBarrier();
+	barriers[0].image = swapChain.images[imageIndex];
+	barriers[0].subresourceRange = subresourceRange;
+	barriers[0].srcAccessMask = 0;
+	barriers[0].oldLayout = VK_IMAGE_LAYOUT_UNDEFINED;
+	if (storageImagesInSwapChain) {
+		barriers[0].dstAccessMask = VK_ACCESS_SHADER_WRITE_BIT;
+		barriers[0].newLayout = VK_IMAGE_LAYOUT_GENERAL;
+		vkCmdPipelineBarrier(commandBuffer, VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT, VK_PIPELINE_STAGE_RAY_TRACING_SHADER_BIT_KHR, 0, 0, nullptr, 0, nullptr, 1, barriers);
+		return;
+	}
+	// The swap chain image goes to transfer destination ahead of time, the storage image has to wait for the previous copy out of it
+	barriers[0].dstAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT;
+	barriers[0].newLayout = VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL;
+	barriers[1] = vks::initializers::imageMemoryBarrier();
+	barriers[1].image = storageImages[imageIndex].image;
+	barriers[1].subresourceRange = subresourceRange;
+	barriers[1].srcAccessMask = VK_ACCESS_TRANSFER_READ_BIT;
+	barriers[1].dstAccessMask = VK_ACCESS_SHADER_WRITE_BIT;
+	barriers[1].oldLayout = VK_IMAGE_LAYOUT_GENERAL;
+	barriers[1].newLayout = VK_IMAGE_LAYOUT_GENERAL;
+	vkCmdPipelineBarrier(commandBuffer, VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT | VK_PIPELINE_STAGE_TRANSFER_BIT, VK_PIPELINE_STAGE_RAY_TRACING_SHADER_BIT_KHR | VK_PIPELINE_STAGE_TRANSFER_BIT, 0, 0, nullptr, 0, nullptr, 2, barriers);
+}
+
+void VulkanRaytracingSample::recordStorageImagePresent(VkCommandBuffer commandBuffer, uint32_t imageIndex, VkExtent2D extent)
+{
+	const VkImageSubresourceRange subresourceRange = { VK_IMAGE_ASPECT_COLOR_BIT, 0, 1, 0, 1 };
+	VkImageMemoryBarrier barrier = vks::initializers::imageMemoryBarrier();
+	barrier.subresourceRange = subresourceRange;
+	barrier.dstAccessMask = 0;
+	barrier.newLayout = VK_IMAGE_LAYOUT_PRESENT_SRC_KHR;
+	barrier.image = swapChain.images[imageIndex];
+	if (storageImagesInSwapChain) {
+		barrier.srcAccessMask = VK_ACCESS_SHADER_WRITE_BIT;
+		barrier.oldLayout = VK_IMAGE_LAYOUT_GENERAL;
+		vkCmdPipelineBarrier(commandBuffer, VK_PIPELINE_STAGE_RAY_TRACING_SHADER_BIT_KHR, VK_PIPELINE_STAGE_BOTTOM_OF_PIPE_BIT, 0, 0, nullptr, 0, nullptr, 1, &barrier);
+		return;
+	}
+
+	// Make the traced result visible to the copy, the storage image is read in the general layout
+	VkImageMemoryBarrier storageBarrier = vks::initializers::imageMemoryBarrier();
+	storageBarrier.image = storageImages[imageIndex].image;
+	storageBarrier.subresourceRange = subresourceRange;
+	storageBarrier.srcAccessMask = VK_ACCESS_SHADER_WRITE_BIT;
+	storageBarrier.dstAccessMask = VK_ACCESS_TRANSFER_READ_BIT;
+	storageBarrier.oldLayout = VK_IMAGE_LAYOUT_GENERAL;
+	storageBarrier.newLayout = VK_IMAGE_LAYOUT_GENERAL;
+	vkCmdPipelineBarrier(commandBuffer, VK_PIPELINE_STAGE_RAY_TRACING_SHADER_BIT_KHR, VK_PIPELINE_STAGE_TRANSFER_BIT, 0, 0, nullptr, 0, nullptr, 1, &storageBarrier);
+
+	VkImageCopy copyRegion{};
+	copyRegion.srcSubresource = { VK_IMAGE_ASPECT_COLOR_BIT, 0, 0, 1 };
+	copyRegion.srcOffset = { 0, 0, 0 };
+	copyRegion.dstSubresource = { VK_IMAGE_ASPECT_COLOR_BIT, 0, 0, 1 };
+	copyRegion.dstOffset = { 0, 0, 0 };
+	copyRegion.extent = { extent.width, extent.height, 1 };
+	vkCmdCopyImage(commandBuffer, storageImages[imageIndex].image, VK_IMAGE_LAYOUT_GENERAL, swapChain.images[imageIndex], VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL, 1, &copyRegion);
+
+	barrier.srcAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT;
+	barrier.oldLayout = VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL;
+	vkCmdPipelineBarrier(commandBuffer, VK_PIPELINE_STAGE_TRANSFER_BIT, VK_PIPELINE_STAGE_BOTTOM_OF_PIPE_BIT, 0, 0, nullptr, 0, nullptr, 1, &barrier);
 }
 
 void VulkanRaytracingSample::prepare()
@@ -262,6 +797,8 @@ void VulkanRaytracingSample::prepare()
 	VkPhysicalDeviceProperties2 deviceProperties2{};
 	deviceProperties2.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_PROPERTIES_2;
 	deviceProperties2.pNext = &rayTracingPipelineProperties;
+	accelerationStructureProperties.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_ACCELERATION_STRUCTURE_PROPERTIES_KHR;
+	rayTracingPipelineProperties.pNext = &accelerationStructureProperties;
 	vkGetPhysicalDeviceProperties2(physicalDevice, &deviceProperties2);
 	accelerationStructureFeatures.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_ACCELERATION_STRUCTURE_FEATURES_KHR;
 	VkPhysicalDeviceFeatures2 deviceFeatures2{};
@@ -279,6 +816,11 @@ void VulkanRaytracingSample::prepare()
 	vkCmdTraceRaysKHR = reinterpret_cast<PFN_vkCmdTraceRaysKHR>(vkGetDeviceProcAddr(device, "vkCmdTraceRaysKHR"));
 	vkGetRayTracingShaderGroupHandlesKHR = reinterpret_cast<PFN_vkGetRayTracingShaderGroupHandlesKHR>(vkGetDeviceProcAddr(device, "vkGetRayTracingShaderGroupHandlesKHR"));
 	vkCreateRayTracingPipelinesKHR = reinterpret_cast<PFN_vkCreateRayTracingPipelinesKHR>(vkGetDeviceProcAddr(device, "vkCreateRayTracingPipelinesKHR"));
+	vkCmdWriteAccelerationStructuresPropertiesKHR = reinterpret_cast<PFN_vkCmdWriteAccelerationStructuresPropertiesKHR>(vkGetDeviceProcAddr(device, "vkCmdWriteAccelerationStructuresPropertiesKHR"));
+	vkCmdCopyAccelerationStructureKHR = reinterpret_cast<PFN_vkCmdCopyAccelerationStructureKHR>(vkGetDeviceProcAddr(device, "vkCmdCopyAccelerationStructureKHR"));
+	vkCmdCopyAccelerationStructureToMemoryKHR = reinterpret_cast<PFN_vkCmdCopyAccelerationStructureToMemoryKHR>(vkGetDeviceProcAddr(device, "vkCmdCopyAccelerationStructureToMemoryKHR"));
+	vkCmdCopyMemoryToAccelerationStructureKHR = reinterpret_cast<PFN_vkCmdCopyMemoryToAccelerationStructureKHR>(vkGetDeviceProcAddr(device, "vkCmdCopyMemoryToAccelerationStructureKHR"));
+	vkGetDeviceAccelerationStructureCompatibilityKHR = reinterpret_cast<PFN_vkGetDeviceAccelerationStructureCompatibilityKHR>(vkGetDeviceProcAddr(device, "vkGetDeviceAccelerationStructureCompatibilityKHR"));
 	// Update the render pass to keep the color attachment contents, so we can draw the UI on top of the ray traced output
 	if (!rayQueryOnly) {
 		updateRenderPass();
@@ -30,10 +30,16 @@ public:
 	PFN_vkCmdTraceRaysKHR vkCmdTraceRaysKHR;
 	PFN_vkGetRayTracingShaderGroupHandlesKHR vkGetRayTracingShaderGroupHandlesKHR;
 	PFN_vkCreateRayTracingPipelinesKHR vkCreateRayTracingPipelinesKHR;
+	PFN_vkCmdWriteAccelerationStructuresPropertiesKHR vkCmdWriteAccelerationStructuresPropertiesKHR;
+	PFN_vkCmdCopyAccelerationStructureKHR vkCmdCopyAccelerationStructureKHR;
+	PFN_vkCmdCopyAccelerationStructureToMemoryKHR vkCmdCopyAccelerationStructureToMemoryKHR;
+	PFN_vkCmdCopyMemoryToAccelerationStructureKHR vkCmdCopyMemoryToAccelerationStructureKHR;
+	PFN_vkGetDeviceAccelerationStructureCompatibilityKHR vkGetDeviceAccelerationStructureCompatibilityKHR;
 
 	// Available features and properties
 	VkPhysicalDeviceRayTracingPipelinePropertiesKHR  rayTracingPipelineProperties{};
 	VkPhysicalDeviceAccelerationStructureFeaturesKHR accelerationStructureFeatures{};
+	VkPhysicalDeviceAccelerationStructurePropertiesKHR accelerationStructureProperties{};
 
 	// Enabled features and properties
 	VkPhysicalDeviceBufferDeviceAddressFeatures enabledBufferDeviceAddresFeatures{};
@@ -54,15 +60,57 @@ public:
 		uint64_t deviceAddress = 0;
 		VkDeviceMemory memory;
 		VkBuffer buffer;
+		VkDeviceSize size = 0;
 	};
 
-	// Holds information for a storage image that the ray tracing shaders output to
+	// Top level acceleration structure that is created once and built or updated in place from the frame's command buffer
+	struct PersistentTopLevelAS {
+		AccelerationStructure accelerationStructure;
+		// Host visible ring with one slot of maxInstances per frame in flight, mapped for the whole lifetime
+		vks::Buffer instanceBuffer;
+		uint64_t instanceBufferDeviceAddress = 0;
+		// Large enough for both builds and updates, used from scratchAddress which is rounded up to the scratch alignment
+		ScratchBuffer scratchBuffer;
+		uint64_t scratchAddress = 0;
+		uint32_t maxInstances = 0;
+		uint32_t frames = 0;
+		uint32_t slot = 0;
+		// Instance count of the last build, updates need the same count
+		uint32_t builtInstances = 0;
+		uint32_t updatesSinceBuild = 0;
+		// Trace quality degrades with every update, after this many a full build is recorded instead
+		uint32_t rebuildInterval = 64;
+		bool built = false;
+	};
+
+	// Collects acceleration structure builds so they share one scratch arena and are recorded with a single command
+	struct AccelerationStructureBuildBatch {
+		struct Build {
+			AccelerationStructure* accelerationStructure;
+			VkAccelerationStructureTypeKHR type;
+			VkBuildAccelerationStructureFlagsKHR flags;
+			uint32_t firstGeometry;
+			uint32_t geometryCount;
+			// Offset of this build's region in the scratch arena
+			VkDeviceSize scratchOffset;
+		};
+		std::vector<Build> builds;
+		std::vector<VkAccelerationStructureGeometryKHR> geometries;
+		std::vector<VkAccelerationStructureBuildRangeInfoKHR> buildRanges;
+		VkDeviceSize scratchSize = 0;
+	};
+
+	// Holds information for a storage image that the ray tracing shaders output to, memory is null if it is a swap chain image
 	struct StorageImage {
 		VkDeviceMemory memory = VK_NULL_HANDLE;
 		VkImage image = VK_NULL_HANDLE;
 		VkImageView view = VK_NULL_HANDLE;
 		VkFormat format;
-	} storageImage;
+	};
+	// One storage image per swap chain image, so frames in flight never share an output
+	std::vector<StorageImage> storageImages;
+	// Set if the swap chain images were created with storage usage and are traced into directly, without a copy
+	bool storageImagesInSwapChain = false;
 
 	// Extends the buffer class and holds information for a shader binding table
 	class ShaderBindingTable : public vks::Buffer {
@@ -72,15 +120,36 @@ public:
 
 	// Set to true, to denote that the sample only uses ray queries (changes extension and render pass handling)
 	bool rayQueryOnly = false;
+	// Set to true to build static acceleration structures with ALLOW_COMPACTION and shrink them with compactAccelerationStructures
+	bool accelerationStructureCompaction = false;
 
 	void enableExtensions();
 	ScratchBuffer createScratchBuffer(VkDeviceSize size);
 	void deleteScratchBuffer(ScratchBuffer& scratchBuffer);
 	void createAccelerationStructure(AccelerationStructure& accelerationStructure, VkAccelerationStructureTypeKHR type, VkAccelerationStructureBuildSizesInfoKHR buildSizeInfo);
 	void deleteAccelerationStructure(AccelerationStructure& accelerationStructure);
+	// Replaces each bottom level structure with a copy at its compacted size, all of them must have been built with ALLOW_COMPACTION. Returns the bytes saved
+	VkDeviceSize compactAccelerationStructures(std::vector<AccelerationStructure*> accelerationStructures);
+	// Serializes the bottom level structures to a cache file tagged with key and the device and driver that wrote it. Returns false if the file could not be written
+	bool writeAccelerationStructureCache(const std::string& path, uint64_t key, const std::vector<AccelerationStructure*>& accelerationStructures);
+	// Recreates the bottom level structures from a cache file in one submission. Returns false without creating anything if the file is missing, was written for another key, device or driver, or the driver rejects it
+	bool loadAccelerationStructureCache(const std::string& path, uint64_t key, const std::vector<AccelerationStructure*>& accelerationStructures);
 	uint64_t getBufferDeviceAddress(VkBuffer buffer);
-	void createStorageImage(VkFormat format, VkExtent3D extent);
-	void deleteStorageImage();
+	// Sizes and creates the acceleration structure and appends its build to the batch, the geometries' device data has to stay valid until the batch is built
+	void addAccelerationStructureBuild(AccelerationStructureBuildBatch& batch, AccelerationStructure& accelerationStructure, VkAccelerationStructureTypeKHR type, VkBuildAccelerationStructureFlagsKHR flags, const VkAccelerationStructureGeometryKHR* geometries, const VkAccelerationStructureBuildRangeInfoKHR* buildRanges, uint32_t geometryCount);
+	// Builds everything in the batch with one vkCmdBuildAccelerationStructuresKHR in a single submission and clears it
+	void buildAccelerationStructures(AccelerationStructureBuildBatch& batch);
+	void createPersistentTopLevelAS(PersistentTopLevelAS& topLevelAS, uint32_t maxInstances, uint32_t frames);
+	// Copies the instances to the next ring slot and records a build, or an update if the last build had the same instance count, followed by a barrier for the ray tracing stages
+	void updatePersistentTopLevelAS(PersistentTopLevelAS& topLevelAS, VkCommandBuffer commandBuffer, const VkAccelerationStructureInstanceKHR* instances, uint32_t instanceCount);
+	void deletePersistentTopLevelAS(PersistentTopLevelAS& topLevelAS);
+	// (Re)creates the storage images for the current swap chain, these are the swap chain images themselves if they support storage usage
+	void createStorageImages(VkFormat format, VkExtent3D extent);
+	void deleteStorageImages();
+	// Records the barrier that makes storage image imageIndex writable by the ray tracing stages
+	void recordStorageImageWriteBarrier(VkCommandBuffer commandBuffer, uint32_t imageIndex);
+	// Records whatever is left to get the traced result of imageIndex on screen, a copy to the swap chain image or just its transition for presenting
+	void recordStorageImagePresent(VkCommandBuffer commandBuffer, uint32_t imageIndex, VkExtent2D extent);
 	VkStridedDeviceAddressRegionKHR getSbtEntryStridedDeviceAddressRegion(VkBuffer buffer, uint32_t handleCount);
 	void createShaderBindingTable(ShaderBindingTable& shaderBindingTable, uint32_t handleCount);
 	// Draw the ImGUI UI overlay using a render pass
@@ -352,6 +352,18 @@ void VulkanSwapChain::create(uint32_t *width, uint32_t *height, bool vsync)
 		swapchainCI.imageUsage |= VK_IMAGE_USAGE_TRANSFER_DST_BIT;
 	}
 
+	// Optional usage requested by the sample, e.g. storage for ray tracing straight into the swap chain
+	VkImageUsageFlags optionalUsage = optionalImageUsage & surfCaps.supportedUsageFlags;
+	if (optionalUsage & VK_IMAGE_USAGE_STORAGE_BIT) {
+		VkFormatProperties formatProperties;
+		vkGetPhysicalDeviceFormatProperties(physicalDevice, colorFormat, &formatProperties);
+		if (!(formatProperties.optimalTilingFeatures & VK_FORMAT_FEATURE_STORAGE_IMAGE_BIT)) {
+			optionalUsage &= ~VK_IMAGE_USAGE_STORAGE_BIT;
+		}
+	}
+	swapchainCI.imageUsage |= optionalUsage;
+	imageUsage = swapchainCI.imageUsage;
+
 	VK_CHECK_RESULT(fpCreateSwapchainKHR(device, &swapchainCI, nullptr, &swapChain));
 
 	// If an existing swap chain is re-created, destroy the old swap chain
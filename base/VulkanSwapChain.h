@@ -53,6 +53,10 @@ public:
 	std::vector<VkImage> images;
 	std::vector<SwapChainBuffer> buffers;
 	uint32_t queueNodeIndex = UINT32_MAX;
+	// Usage a sample would like on top of the defaults, only the flags the surface and color format support are added
+	VkImageUsageFlags optionalImageUsage = 0;
+	// Usage the current swap chain images were created with
+	VkImageUsageFlags imageUsage = 0;
 
 #if defined(VK_USE_PLATFORM_WIN32_KHR)
 	void initSurface(void* platformHandle, void* platformWindow);
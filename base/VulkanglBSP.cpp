@@ -11,12 +11,71 @@
 #define TINYGLTF_NO_STB_IMAGE_WRITE
 
 #include "VulkanglBSP.h"
+#include "threadpool.hpp"
+
+#include <atomic>
+#include <cfloat>
+#include <exception>
+
+#include <sys/stat.h>
+
+#if defined(_WIN32)
+#include <direct.h>
+#include <windows.h>
+#else
+#include <dirent.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#endif
+
+// SIMD kernels are built for x86-64 and picked at runtime, other targets use
+// the scalar versions
+#if defined(__x86_64__) || defined(_M_X64)
+#define VKGLBSP_X64 1
+#include <immintrin.h>
+#if defined(_MSC_VER)
+#include <intrin.h>
+#define VKGLBSP_TARGET_AVX2
+#else
+#define VKGLBSP_TARGET_AVX2 __attribute__((target("avx2")))
+#endif
+#endif
 
 VkDescriptorSetLayout vkglBSP::descriptorSetLayoutImage = VK_NULL_HANDLE;
 VkDescriptorSetLayout vkglBSP::descriptorSetLayoutUbo = VK_NULL_HANDLE;
 VkMemoryPropertyFlags vkglBSP::memoryPropertyFlags = 0;
 uint32_t vkglBSP::descriptorBindingFlags =
     vkglBSP::DescriptorBindingFlags::ImageBaseColor;
+vkglBSP::SimdLevel vkglBSP::simdLevel = vkglBSP::simdSupported();
+
+vkglBSP::SimdLevel vkglBSP::simdSupported() {
+#if defined(VKGLBSP_X64)
+  // SSE2 is part of x86-64, AVX2 needs both the CPU and the OS (saved YMM state)
+  static const SimdLevel level = [] {
+#if defined(_MSC_VER)
+    int info[4];
+    __cpuid(info, 0);
+    const int maxLeaf = info[0];
+    __cpuid(info, 1);
+    const bool osAvx = (info[2] & (1 << 27)) && (info[2] & (1 << 28))
+        && (_xgetbv(0) & 6) == 6;
+    bool avx2 = false;
+    if (osAvx && maxLeaf >= 7) {
+      __cpuidex(info, 7, 0);
+      avx2 = (info[1] & (1 << 5)) != 0;
+    }
+    return avx2 ? SimdAVX2 : SimdSSE2;
+#else
+    __builtin_cpu_init();
+    return __builtin_cpu_supports("avx2") ? SimdAVX2 : SimdSSE2;
+#endif
+  }();
+  return level;
+#else
+  return SimdScalar;
+#endif
+}
 
 /*
  We use a custom image loading function with tinyglTF, so we can do custom stuff loading ktx textures
@@ -707,6 +766,190 @@ VkPipelineVertexInputStateCreateInfo* vkglBSP::Vertex::getPipelineVertexInputSta
   return &pipelineVertexInputStateCreateInfo;
 }
 
+/*
+ Maps a whole file read only. Returns nullptr with size set to -1 when the
+ file can't be opened, and nullptr with size 0 when it is empty or can't be mapped.
+ The mapping stays valid until sysUnmapFile, the file handle is not kept open.
+ */
+static const byte* sysMapFile(const char *path, size_t *size) {
+  const byte *base = nullptr;
+  *size = 0;
+
+#if defined(_WIN32)
+  HANDLE file = CreateFileA(path, GENERIC_READ, FILE_SHARE_READ, nullptr,
+      OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr);
+  if (file == INVALID_HANDLE_VALUE) {
+    *size = (size_t) -1;
+    return nullptr;
+  }
+  LARGE_INTEGER fileSize;
+  GetFileSizeEx(file, &fileSize);
+  *size = (size_t) fileSize.QuadPart;
+  if (*size > 0) {
+    HANDLE mapping = CreateFileMappingA(file, nullptr, PAGE_READONLY, 0, 0,
+        nullptr);
+    if (mapping != nullptr) {
+      base = (const byte*) MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0);
+      // The view keeps its own reference to the mapping
+      CloseHandle(mapping);
+    }
+  }
+  CloseHandle(file);
+#else
+  int fd = open(path, O_RDONLY);
+  if (fd == -1) {
+    *size = (size_t) -1;
+    return nullptr;
+  }
+  struct stat st;
+  if (fstat(fd, &st) == 0 && st.st_size > 0) {
+    *size = (size_t) st.st_size;
+    void *mapped = mmap(nullptr, *size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (mapped != MAP_FAILED) {
+      base = (const byte*) mapped;
+    }
+  }
+  // The mapping stays valid after the descriptor has been closed
+  close(fd);
+#endif
+
+  return base;
+}
+
+static void sysUnmapFile(const byte *base, size_t size) {
+  if (base == nullptr) {
+    return;
+  }
+#if defined(_WIN32)
+  UnmapViewOfFile(base);
+#else
+  munmap(const_cast<byte*>(base), size);
+#endif
+}
+
+/*
+ ============
+ COM_CreatePath
+
+ Creates every directory leading up to the file in path
+ ============
+ */
+static void sysCreatePath(const char *path) {
+  char dir[MAX_OSPATH];
+  vkglBSP::Model::q_strlcpy(dir, path, sizeof(dir));
+  for (char *ofs = dir + 1; *ofs; ofs++) {
+    if (*ofs == '/' || *ofs == '\\') {
+      const char separator = *ofs;
+      *ofs = 0;
+#if defined(_WIN32)
+      _mkdir(dir);
+#else
+      mkdir(dir, 0777);
+#endif
+      *ofs = separator;
+    }
+  }
+}
+
+/*
+ Runs the lump loaders of a map as a dependency graph. Jobs must be added after
+ their dependencies, so insertion order is also a valid serial order. With more
+ than one thread a job is handed to the pool as soon as its last dependency has
+ finished, and the first exception thrown by any job is rethrown by run().
+ */
+class LumpJobGraph {
+public:
+  int add(std::function<void()> load, std::initializer_list<int> dependencies) {
+    const int id = (int) jobs.size();
+    jobs.push_back(Job());
+    jobs[id].load = std::move(load);
+    for (int dependency : dependencies) {
+      jobs[dependency].dependents.push_back(id);
+      jobs[id].pending++;
+    }
+    return id;
+  }
+
+  void run(uint32_t threadCount) {
+    if (threadCount <= 1) {
+      for (auto &job : jobs) {
+        job.load();
+      }
+      return;
+    }
+
+    vks::ThreadPool threadPool;
+    threadPool.setThreadCount(std::min(threadCount, (uint32_t) jobs.size()));
+    pool = &threadPool;
+    remaining = (int) jobs.size();
+    for (int i = 0; i < (int) jobs.size(); i++) {
+      if (jobs[i].pending == 0) {
+        schedule(i);
+      }
+    }
+    {
+      std::unique_lock<std::mutex> lock(mutex);
+      finished.wait(lock, [this] { return remaining == 0; });
+    }
+    threadPool.wait();
+    pool = nullptr;
+
+    if (failure) {
+      std::rethrow_exception(failure);
+    }
+  }
+
+private:
+  struct Job {
+    std::function<void()> load;
+    std::vector<int> dependents;
+    int pending = 0;
+  };
+
+  std::vector<Job> jobs;
+  vks::ThreadPool *pool = nullptr;
+  uint32_t nextThread = 0;
+  int remaining = 0;
+  std::exception_ptr failure;
+  std::mutex mutex;
+  std::condition_variable finished;
+
+  // Called with mutex held or before any job runs
+  void schedule(int id) {
+    vks::Thread *thread = pool->threads[nextThread++ % pool->threads.size()].get();
+    thread->addJob([this, id] { execute(id); });
+  }
+
+  void execute(int id) {
+    bool skip;
+    {
+      std::lock_guard<std::mutex> lock(mutex);
+      skip = (bool) failure;
+    }
+    if (!skip) {
+      try {
+        jobs[id].load();
+      } catch (...) {
+        std::lock_guard<std::mutex> lock(mutex);
+        if (!failure) {
+          failure = std::current_exception();
+        }
+      }
+    }
+
+    std::lock_guard<std::mutex> lock(mutex);
+    // Dependents of a failed job still run through the graph so remaining reaches 0, they just skip loading
+    for (int dependent : jobs[id].dependents) {
+      if (--jobs[dependent].pending == 0) {
+        schedule(dependent);
+      }
+    }
+    if (--remaining == 0) {
+      finished.notify_one();
+    }
+  }
+};
+
 vkglBSP::Texture* vkglBSP::Model::getTexture(uint32_t index) {
 
   if (index < textures.size()) {
@@ -851,10 +1094,269 @@ void vkglBSP::Model::createEmptyTexture(VkQueue transferQueue) {
   emptyTexture.descriptor.sampler = emptyTexture.sampler;
 }
 
+/*
+ Uploads the lightmap atlas pages of loadmodel as the layers of one array
+ texture, so every lit surface is drawn with the same descriptor. A map
+ without lightmaps gets a single white layer.
+ */
+void vkglBSP::Model::createLightmapTexture(vks::VulkanDevice *device,
+    VkQueue transferQueue) {
+  const QModel *mod = loadmodel;
+  lightmapTexture.device = device;
+  lightmapTexture.width = LIGHTMAP_PAGE_SIZE;
+  lightmapTexture.height = LIGHTMAP_PAGE_SIZE;
+  lightmapTexture.layerCount = std::max(1, mod->numlightmaps);
+  lightmapTexture.mipLevels = 1;
+
+  const VkDeviceSize layerSize = (VkDeviceSize) LIGHTMAP_PAGE_SIZE
+      * LIGHTMAP_PAGE_SIZE * 4;
+  const VkDeviceSize bufferSize = layerSize * lightmapTexture.layerCount;
+  // Stays mapped, rUpdateLightmaps regions are uploaded from it
+  vks::Buffer &staging = lightmapStaging;
+  VK_CHECK_RESULT(
+      device->createBuffer(VK_BUFFER_USAGE_TRANSFER_SRC_BIT,
+          VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT
+              | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT, &staging, bufferSize));
+  VK_CHECK_RESULT(staging.map());
+  if (mod->numlightmaps > 0) {
+    memcpy(staging.mapped, mod->lightmaps.data(), bufferSize);
+  } else {
+    memset(staging.mapped, 0xff, bufferSize);
+  }
+
+  // Layers follow each other in the staging buffer, one region copies all
+  VkBufferImageCopy bufferCopyRegion = { };
+  bufferCopyRegion.imageSubresource.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT;
+  bufferCopyRegion.imageSubresource.layerCount = lightmapTexture.layerCount;
+  bufferCopyRegion.imageExtent.width = lightmapTexture.width;
+  bufferCopyRegion.imageExtent.height = lightmapTexture.height;
+  bufferCopyRegion.imageExtent.depth = 1;
+
+  VkImageCreateInfo imageCreateInfo = vks::initializers::imageCreateInfo();
+  imageCreateInfo.imageType = VK_IMAGE_TYPE_2D;
+  imageCreateInfo.format = VK_FORMAT_R8G8B8A8_UNORM;
+  imageCreateInfo.mipLevels = 1;
+  imageCreateInfo.arrayLayers = lightmapTexture.layerCount;
+  imageCreateInfo.samples = VK_SAMPLE_COUNT_1_BIT;
+  imageCreateInfo.tiling = VK_IMAGE_TILING_OPTIMAL;
+  imageCreateInfo.sharingMode = VK_SHARING_MODE_EXCLUSIVE;
+  imageCreateInfo.initialLayout = VK_IMAGE_LAYOUT_UNDEFINED;
+  imageCreateInfo.extent = { lightmapTexture.width, lightmapTexture.height, 1 };
+  imageCreateInfo.usage = VK_IMAGE_USAGE_SAMPLED_BIT
+      | VK_IMAGE_USAGE_TRANSFER_DST_BIT;
+  VK_CHECK_RESULT(
+      vkCreateImage(device->logicalDevice, &imageCreateInfo, nullptr,
+          &lightmapTexture.image));
+
+  VkMemoryRequirements memReqs;
+  vkGetImageMemoryRequirements(device->logicalDevice, lightmapTexture.image,
+      &memReqs);
+  VkMemoryAllocateInfo memAllocInfo = vks::initializers::memoryAllocateInfo();
+  memAllocInfo.allocationSize = memReqs.size;
+  memAllocInfo.memoryTypeIndex = device->getMemoryType(memReqs.memoryTypeBits,
+      VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT);
+  VK_CHECK_RESULT(
+      vkAllocateMemory(device->logicalDevice, &memAllocInfo, nullptr,
+          &lightmapTexture.deviceMemory));
+  VK_CHECK_RESULT(
+      vkBindImageMemory(device->logicalDevice, lightmapTexture.image,
+          lightmapTexture.deviceMemory, 0));
+
+  VkImageSubresourceRange subresourceRange { };
+  subresourceRange.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT;
+  subresourceRange.baseMipLevel = 0;
+  subresourceRange.levelCount = 1;
+  subresourceRange.layerCount = lightmapTexture.layerCount;
+
+  VkCommandBuffer copyCmd = device->createCommandBuffer(
+      VK_COMMAND_BUFFER_LEVEL_PRIMARY, true);
+  vks::tools::setImageLayout(copyCmd, lightmapTexture.image,
+      VK_IMAGE_LAYOUT_UNDEFINED, VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL,
+      subresourceRange);
+  vkCmdCopyBufferToImage(copyCmd, staging.buffer, lightmapTexture.image,
+      VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL, 1, &bufferCopyRegion);
+  vks::tools::setImageLayout(copyCmd, lightmapTexture.image,
+      VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL,
+      VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL, subresourceRange);
+  device->flushCommandBuffer(copyCmd, transferQueue);
+  lightmapTexture.imageLayout = VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL;
+
+  // Coordinates stay inside each surface's block, nothing may wrap
+  VkSamplerCreateInfo samplerCreateInfo =
+      vks::initializers::samplerCreateInfo();
+  samplerCreateInfo.magFilter = VK_FILTER_LINEAR;
+  samplerCreateInfo.minFilter = VK_FILTER_LINEAR;
+  samplerCreateInfo.mipmapMode = VK_SAMPLER_MIPMAP_MODE_NEAREST;
+  samplerCreateInfo.addressModeU = VK_SAMPLER_ADDRESS_MODE_CLAMP_TO_EDGE;
+  samplerCreateInfo.addressModeV = VK_SAMPLER_ADDRESS_MODE_CLAMP_TO_EDGE;
+  samplerCreateInfo.addressModeW = VK_SAMPLER_ADDRESS_MODE_CLAMP_TO_EDGE;
+  samplerCreateInfo.compareOp = VK_COMPARE_OP_NEVER;
+  samplerCreateInfo.maxAnisotropy = 1.0f;
+  VK_CHECK_RESULT(
+      vkCreateSampler(device->logicalDevice, &samplerCreateInfo, nullptr,
+          &lightmapTexture.sampler));
+
+  VkImageViewCreateInfo viewCreateInfo =
+      vks::initializers::imageViewCreateInfo();
+  viewCreateInfo.viewType = VK_IMAGE_VIEW_TYPE_2D_ARRAY;
+  viewCreateInfo.format = VK_FORMAT_R8G8B8A8_UNORM;
+  viewCreateInfo.components = { VK_COMPONENT_SWIZZLE_R, VK_COMPONENT_SWIZZLE_G,
+      VK_COMPONENT_SWIZZLE_B, VK_COMPONENT_SWIZZLE_A };
+  viewCreateInfo.subresourceRange = { VK_IMAGE_ASPECT_COLOR_BIT, 0, 1, 0,
+      lightmapTexture.layerCount };
+  viewCreateInfo.image = lightmapTexture.image;
+  VK_CHECK_RESULT(
+      vkCreateImageView(device->logicalDevice, &viewCreateInfo, nullptr,
+          &lightmapTexture.view));
+
+  lightmapTexture.descriptor.imageLayout =
+      VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL;
+  lightmapTexture.descriptor.imageView = lightmapTexture.view;
+  lightmapTexture.descriptor.sampler = lightmapTexture.sampler;
+}
+
+// A miptex image with its four levels, copied from staging at offset
+static void texCreateImage(vkglBSP::Texture &texture,
+    vks::VulkanDevice *device, VkCommandBuffer copyCmd, VkBuffer staging,
+    VkDeviceSize offset, uint32_t width, uint32_t height) {
+  texture.device = device;
+  texture.width = width;
+  texture.height = height;
+  texture.mipLevels = MIPLEVELS;
+  texture.layerCount = 1;
+
+  VkImageCreateInfo imageCreateInfo = vks::initializers::imageCreateInfo();
+  imageCreateInfo.imageType = VK_IMAGE_TYPE_2D;
+  imageCreateInfo.format = VK_FORMAT_R8G8B8A8_UNORM;
+  imageCreateInfo.mipLevels = texture.mipLevels;
+  imageCreateInfo.arrayLayers = 1;
+  imageCreateInfo.samples = VK_SAMPLE_COUNT_1_BIT;
+  imageCreateInfo.tiling = VK_IMAGE_TILING_OPTIMAL;
+  imageCreateInfo.sharingMode = VK_SHARING_MODE_EXCLUSIVE;
+  imageCreateInfo.initialLayout = VK_IMAGE_LAYOUT_UNDEFINED;
+  imageCreateInfo.extent = { width, height, 1 };
+  imageCreateInfo.usage = VK_IMAGE_USAGE_SAMPLED_BIT
+      | VK_IMAGE_USAGE_TRANSFER_DST_BIT;
+  VK_CHECK_RESULT(
+      vkCreateImage(device->logicalDevice, &imageCreateInfo, nullptr,
+          &texture.image));
+
+  VkMemoryRequirements memReqs;
+  vkGetImageMemoryRequirements(device->logicalDevice, texture.image, &memReqs);
+  VkMemoryAllocateInfo memAllocInfo = vks::initializers::memoryAllocateInfo();
+  memAllocInfo.allocationSize = memReqs.size;
+  memAllocInfo.memoryTypeIndex = device->getMemoryType(memReqs.memoryTypeBits,
+      VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT);
+  VK_CHECK_RESULT(
+      vkAllocateMemory(device->logicalDevice, &memAllocInfo, nullptr,
+          &texture.deviceMemory));
+  VK_CHECK_RESULT(
+      vkBindImageMemory(device->logicalDevice, texture.image,
+          texture.deviceMemory, 0));
+
+  // The levels follow each other in staging
+  VkBufferImageCopy regions[MIPLEVELS] = { };
+  for (uint32_t j = 0; j < MIPLEVELS; j++) {
+    VkBufferImageCopy &region = regions[j];
+    region.bufferOffset = offset;
+    region.imageSubresource.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT;
+    region.imageSubresource.mipLevel = j;
+    region.imageSubresource.layerCount = 1;
+    region.imageExtent = { width >> j, height >> j, 1 };
+    offset += (VkDeviceSize) (width >> j) * (height >> j) * 4;
+  }
+
+  VkImageSubresourceRange subresourceRange { };
+  subresourceRange.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT;
+  subresourceRange.levelCount = texture.mipLevels;
+  subresourceRange.layerCount = 1;
+  vks::tools::setImageLayout(copyCmd, texture.image, VK_IMAGE_LAYOUT_UNDEFINED,
+      VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL, subresourceRange);
+  vkCmdCopyBufferToImage(copyCmd, staging, texture.image,
+      VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL, MIPLEVELS, regions);
+  vks::tools::setImageLayout(copyCmd, texture.image,
+      VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL,
+      VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL, subresourceRange);
+  texture.imageLayout = VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL;
+
+  VkSamplerCreateInfo samplerCreateInfo =
+      vks::initializers::samplerCreateInfo();
+  samplerCreateInfo.magFilter = VK_FILTER_LINEAR;
+  samplerCreateInfo.minFilter = VK_FILTER_LINEAR;
+  samplerCreateInfo.mipmapMode = VK_SAMPLER_MIPMAP_MODE_LINEAR;
+  samplerCreateInfo.addressModeU = VK_SAMPLER_ADDRESS_MODE_REPEAT;
+  samplerCreateInfo.addressModeV = VK_SAMPLER_ADDRESS_MODE_REPEAT;
+  samplerCreateInfo.addressModeW = VK_SAMPLER_ADDRESS_MODE_REPEAT;
+  samplerCreateInfo.compareOp = VK_COMPARE_OP_NEVER;
+  samplerCreateInfo.maxLod = (float) texture.mipLevels;
+  samplerCreateInfo.maxAnisotropy = 1.0f;
+  VK_CHECK_RESULT(
+      vkCreateSampler(device->logicalDevice, &samplerCreateInfo, nullptr,
+          &texture.sampler));
+
+  VkImageViewCreateInfo viewCreateInfo =
+      vks::initializers::imageViewCreateInfo();
+  viewCreateInfo.viewType = VK_IMAGE_VIEW_TYPE_2D;
+  viewCreateInfo.format = VK_FORMAT_R8G8B8A8_UNORM;
+  viewCreateInfo.components = { VK_COMPONENT_SWIZZLE_R, VK_COMPONENT_SWIZZLE_G,
+      VK_COMPONENT_SWIZZLE_B, VK_COMPONENT_SWIZZLE_A };
+  viewCreateInfo.subresourceRange = { VK_IMAGE_ASPECT_COLOR_BIT, 0,
+      texture.mipLevels, 0, 1 };
+  viewCreateInfo.image = texture.image;
+  VK_CHECK_RESULT(
+      vkCreateImageView(device->logicalDevice, &viewCreateInfo, nullptr,
+          &texture.view));
+  texture.updateDescriptor();
+}
+
+/*
+ Every miptex is decoded by texDecodeTextures right into one staging buffer,
+ then all images are filled from it with a single command buffer
+ */
+void vkglBSP::Model::createTextures(vks::VulkanDevice *device,
+    VkQueue transferQueue, uint32_t threads) {
+  QModel *mod = loadmodel;
+  textureImages.assign(mod->textures.size(), vkglBSP::Texture());
+  fullbrightImages.assign(mod->textures.size(), vkglBSP::Texture());
+
+  std::vector<TextureDecode> decodes;
+  const VkDeviceSize bufferSize = texLayoutTextures(mod, decodes);
+  if (decodes.empty())
+    return;
+
+  vks::Buffer staging;
+  VK_CHECK_RESULT(
+      device->createBuffer(VK_BUFFER_USAGE_TRANSFER_SRC_BIT,
+          VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT
+              | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT, &staging, bufferSize));
+  VK_CHECK_RESULT(staging.map());
+  texDecodeTextures(mod, decodes, (byte*) staging.mapped, threads);
+  staging.unmap();
+
+  VkCommandBuffer copyCmd = device->createCommandBuffer(
+      VK_COMMAND_BUFFER_LEVEL_PRIMARY, true);
+  for (const TextureDecode &decode : decodes) {
+    const QTexture &tx = mod->textures[decode.texture];
+    texCreateImage(textureImages[decode.texture], device, copyCmd,
+        staging.buffer, decode.offset, tx.width, tx.height);
+    if (decode.flags & TEXPREF_NOBRIGHT) {
+      texCreateImage(fullbrightImages[decode.texture], device, copyCmd,
+          staging.buffer, decode.fullbrightoffset, tx.width, tx.height);
+    }
+  }
+  device->flushCommandBuffer(copyCmd, transferQueue);
+  staging.destroy();
+}
+
 /*
  glTF model loading and rendering class
  */
 vkglBSP::Model::~Model() {
+  for (auto model : knownModels) {
+    delete model;
+  }
+  visIndexBuffer.destroy();
+  visIndirectBuffer.destroy();
 
   if (device) {
     vkDestroyBuffer(device->logicalDevice, loadmodel->vertexBuffer.buffer, nullptr);
@@ -880,6 +1382,14 @@ vkglBSP::Model::~Model() {
     vkDestroyDescriptorPool(device->logicalDevice, descriptorPool, nullptr);
     emptyTexture.destroy();
   }
+  lightmapTexture.destroy();
+  lightmapStaging.destroy();
+  for (vkglBSP::Texture &texture : textureImages) {
+    texture.destroy();
+  }
+  for (vkglBSP::Texture &texture : fullbrightImages) {
+    texture.destroy();
+  }
 
 }
 
@@ -1377,12 +1887,13 @@ void vkglBSP::Model::loadFromFile(std::string filename,
 
   std::cout << "init completed" << std::endl;
 
-  size_t vertexBufferSize = loadmodel->vertexes.size() * sizeof(MVertex);
-  size_t indexBufferSize = loadmodel->edges.size() * sizeof(uint32_t);
+  size_t vertexBufferSize = loadmodel->polyverts.size() * sizeof(glm::vec4);
+  size_t indexBufferSize = loadmodel->polyindexes.size() * sizeof(uint32_t);
 
   std::cout << "vertex buffer size = " << vertexBufferSize << std::endl;
 
   assert((vertexBufferSize > 0) && (indexBufferSize > 0));
+
 //
 //  struct StagingBuffer {
 //    VkBuffer buffer;
@@ -1600,53 +2111,76 @@ void vkglBSP::Model::bindBuffers(VkCommandBuffer commandBuffer) {
 ////  vkCmdDrawIndexed(commandBuffer, loadmodel->edges.size(), 1, 0, 0, 0);
 //}
 
-void vkglBSP::Model::draw(const VkCommandBuffer commandBuffer,
-    VkPipeline pipeline, VkPipelineLayout pipelineLayout) {
-//  vkCmdBindPipeline(commandBuffer, VK_PIPELINE_BIND_POINT_GRAPHICS, pipeline);
-//    vkCmdBindDescriptorSets(commandBuffer, VK_PIPELINE_BIND_POINT_GRAPHICS, pipelineLayout, 0, 1, &descriptorSet, 0, NULL);
+/*
+ The visible set is rewritten every frame while earlier frames may still
+ draw from theirs, so every frame in flight gets its own slot of indices and
+ indirect draws
+ */
+void vkglBSP::Model::createVisibleSetBuffers(vks::VulkanDevice *device,
+    uint32_t frames) {
+  visIndexBuffer.destroy();
+  visIndirectBuffer.destroy();
+  visFrames = std::max(1u, frames);
+
+  const VkDeviceSize indexSlotSize = std::max<VkDeviceSize>(1,
+      loadmodel->polyindexes.size()) * sizeof(uint32_t);
+  const VkDeviceSize indirectSlotSize = std::max<VkDeviceSize>(1,
+      loadmodel->textures.size()) * sizeof(VkDrawIndexedIndirectCommand);
+  VK_CHECK_RESULT(
+      device->createBuffer(VK_BUFFER_USAGE_INDEX_BUFFER_BIT,
+          VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT
+              | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT, &visIndexBuffer,
+          indexSlotSize * visFrames));
+  VK_CHECK_RESULT(visIndexBuffer.map());
+  VK_CHECK_RESULT(
+      device->createBuffer(VK_BUFFER_USAGE_INDIRECT_BUFFER_BIT,
+          VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT
+              | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT, &visIndirectBuffer,
+          indirectSlotSize * visFrames));
+  VK_CHECK_RESULT(visIndirectBuffer.map());
+  // Nothing is drawn until the first upload
+  memset(visIndirectBuffer.mapped, 0, indirectSlotSize * visFrames);
+}
 
-//    VkDeviceSize offsets[1] = { 0 };
-//    vkCmdBindVertexBuffers(commandBuffer, 0, 1, &loadmodel->vertex_buffer, offsets);
-//    vkCmdBindIndexBuffer(commandBuffer, loadmodel->index_buffer, 0, VK_INDEX_TYPE_UINT32);
-//
-//
-//    for (auto &s : loadmodel->surfaces) {
-//
-//      GlPoly *p = &s.polys;
-//  //    GlPoly *p = &loadmodel->surfaces.at(2).polys;
-//
-//      const int numverts = p->verts.size();
-//      const int numtriangles = (numverts - 2);
-//      const int numindices = numtriangles * 3;
-//
-//      for (const auto &v : p->verts) {
-//        MVertex mv;
-//        mv.position = v;
-//        localVertex.push_back(mv);
-//      }
-//
-//      for (int i = 0; i < numtriangles; ++i) {
-//        localIndex.push_back(currentIndex);
-//        currentIndex++;
-//        localIndex.push_back(currentIndex);
-//        currentIndex++;
-//        localIndex.push_back(currentIndex);
-//        currentIndex++;
-//      }
-//    }
-//
-//
-//
-//    for (int32_t i = 0; i < imDrawData->CmdListsCount; i++)
-//    {
-//      const ImDrawList* cmd_list = imDrawData->CmdLists[i];
-//      for (int32_t j = 0; j < cmd_list->CmdBuffer.Size; j++)
-//      {
-//        vkCmdDrawIndexed(commandBuffer, pcmd->ElemCount, 1, indexOffset, vertexOffset, 0);
-//        indexOffset += pcmd->ElemCount;
-//      }
-//      vertexOffset += cmd_list->VtxBuffer.Size;
-//    }
+void vkglBSP::Model::uploadVisibleSet(uint32_t frame) {
+  assert(frame < visFrames);
+  const std::vector<uint32_t> &indexes = loadmodel->visindexes;
+  const size_t numtextures = loadmodel->textures.size();
+  uint32_t *slotIndexes = (uint32_t*) visIndexBuffer.mapped
+      + (size_t) frame * std::max<size_t>(1, loadmodel->polyindexes.size());
+  VkDrawIndexedIndirectCommand *commands =
+      (VkDrawIndexedIndirectCommand*) visIndirectBuffer.mapped
+          + (size_t) frame * std::max<size_t>(1, numtextures);
+
+  memcpy(slotIndexes, indexes.data(), indexes.size() * sizeof(uint32_t));
+  // One command per texture, the ones without a batch draw nothing
+  memset(commands, 0, numtextures * sizeof(VkDrawIndexedIndirectCommand));
+  for (const VisBatch &batch : loadmodel->visbatches) {
+    VkDrawIndexedIndirectCommand &command = commands[batch.texture];
+    command.indexCount = batch.indexcount;
+    command.instanceCount = 1;
+    command.firstIndex = batch.firstindex;
+  }
+}
+
+void vkglBSP::Model::draw(const VkCommandBuffer commandBuffer, uint32_t frame,
+    VkPipeline pipeline, VkPipelineLayout pipelineLayout) {
+  assert(frame < visFrames);
+  const size_t numtextures = loadmodel->textures.size();
+  if (pipeline != VK_NULL_HANDLE) {
+    vkCmdBindPipeline(commandBuffer, VK_PIPELINE_BIND_POINT_GRAPHICS, pipeline);
+  }
+  vkCmdBindIndexBuffer(commandBuffer, visIndexBuffer.buffer,
+      (VkDeviceSize) frame * std::max<size_t>(1, loadmodel->polyindexes.size())
+          * sizeof(uint32_t), VK_INDEX_TYPE_UINT32);
+  // One draw per command keeps this working without multiDrawIndirect
+  const VkDeviceSize slot = (VkDeviceSize) frame * std::max<size_t>(1,
+      numtextures) * sizeof(VkDrawIndexedIndirectCommand);
+  for (size_t t = 0; t < numtextures; t++) {
+    vkCmdDrawIndexedIndirect(commandBuffer, visIndirectBuffer.buffer,
+        slot + t * sizeof(VkDrawIndexedIndirectCommand), 1,
+        sizeof(VkDrawIndexedIndirectCommand));
+  }
 }
 
 void vkglBSP::Model::getNodeDimensions(Node *node, glm::vec3 &min,
@@ -1813,43 +2347,83 @@ void vkglBSP::Model::prepareNodeDescriptor(vkglBSP::Node *node,
 vkglBSP::QModel* vkglBSP::Model::modForName(const char *name, bool crash) {
   QModel *mod;
 
-//  mod = modFindName (name);
+  mod = modFindName(name);
 
   return modLoadModel(mod, crash);
 }
 
 /*
  ==================
- Mod_LoadModel
+ Mod_FindName
 
- Loads a model into the cache
  ==================
  */
-vkglBSP::QModel* vkglBSP::Model::modLoadModel(vkglBSP::QModel *mod,
-    bool crash) {
-  byte *buf;
-  byte stackbuf[1024];   // avoid dirtying the cache heap
-  int mod_type;
+vkglBSP::QModel* vkglBSP::Model::modFindName(const char *name) {
+  if (!name[0]) {
+    throw std::runtime_error("modFindName: NULL name");
+  }
 
 //
-// load the file
+// search the currently loaded models
 //
-  buf = comLoadStackFile(mod->name, stackbuf, sizeof(stackbuf), &mod->path_id);
-  if (!buf) {
-    if (crash) {
-      snprintf(errorBuff, sizeof(char) * 255, "modLoadModel: %s not found",
-          mod->name);
-      throw std::runtime_error(errorBuff);
+  for (auto model : knownModels) {
+    if (!strcmp(model->name, name)) {
+      return model;
     }
-    return nullptr;
   }
 
-//
-// allocate a new model
-//
-  comFileBase(mod->name, loadname, sizeof(loadname));
+  if (knownModels.size() == MAX_MOD_KNOWN) {
+    throw std::runtime_error("modFindName: mod_numknown == MAX_MOD_KNOWN");
+  }
 
-  loadmodel = mod;
+  QModel *mod = new QModel();
+  q_strlcpy(mod->name, name, sizeof(mod->name));
+  mod->needload = true;
+  knownModels.push_back(mod);
+
+  return mod;
+}
+
+/*
+ ==================
+ Mod_LoadModel
+
+ Loads a model into the cache
+ ==================
+ */
+vkglBSP::QModel* vkglBSP::Model::modLoadModel(vkglBSP::QModel *mod,
+    bool crash) {
+  const byte *buf;
+  int mod_type;
+
+  if (!mod->needload) {
+    return mod;
+  }
+
+//
+// load the file
+//
+  buf = comLoadStackFile(mod->name, &mod->path_id);
+  if (!buf) {
+    if (crash) {
+      snprintf(errorBuff, sizeof(char) * 255, "modLoadModel: %s not found",
+          mod->name);
+      throw std::runtime_error(errorBuff);
+    }
+    return nullptr;
+  }
+  if (loadsize < (int) sizeof(DHeader)) {
+    snprintf(errorBuff, sizeof(char) * 255, "modLoadModel: %s is too short",
+        mod->name);
+    throw std::runtime_error(errorBuff);
+  }
+
+//
+// allocate a new model
+//
+  comFileBase(mod->name, loadname, sizeof(loadname));
+
+  loadmodel = mod;
 
 //
 // fill it in
@@ -1858,6 +2432,20 @@ vkglBSP::QModel* vkglBSP::Model::modLoadModel(vkglBSP::QModel *mod,
 // call the apropriate loader
   mod->needload = false;
 
+  // A cache built from the same file skips parsing altogether
+  char cachePath[MAX_OSPATH];
+  const uint64_t hash = comBlockHash(buf, loadsize);
+  mod->sourcehash = hash;
+  mod->filebase = buf;
+  mod->filesize = loadsize;
+  if (!cacheDir.empty()) {
+    modCachePath(mod->name, "bspc", cachePath, sizeof(cachePath));
+    if (modLoadCache(mod, cachePath, hash, loadsize)) {
+      loadedFromCache = true;
+      return mod;
+    }
+  }
+
   mod_type = (buf[0] | (buf[1] << 8) | (buf[2] << 16) | (buf[3] << 24));
 //  switch (mod_type) {
 //  case IDPOLYHEADER:
@@ -1873,19 +2461,24 @@ vkglBSP::QModel* vkglBSP::Model::modLoadModel(vkglBSP::QModel *mod,
 //    break;
 //  }
 
+  modBuildIndexes();
+
+  if (!cacheDir.empty()) {
+    modWriteCache(mod, cachePath, hash, loadsize);
+  }
+
   return mod;
 }
 
-// uses temp hunk if larger than bufsize
-byte* vkglBSP::Model::comLoadStackFile(const char *path, void *buffer,
-    int bufsize, unsigned int *path_id) {
-  byte *buf;
+// The file system hands out views into its mappings, nothing is copied
+const byte* vkglBSP::Model::comLoadStackFile(const char *path,
+    unsigned int *path_id) {
+  FileView file = fileSystem->loadFile(path, path_id);
 
-  loadbuf = (byte*) buffer;
-  loadsize = bufsize;
-//  buf = comLoadFile(path, LOADFILE_STACK, path_id);
+  loadbuf = file.data;
+  loadsize = (int) file.size;
 
-  return buf;
+  return loadbuf;
 }
 
 void vkglBSP::Model::comFileBase(const char *in, char *out, size_t outsize) {
@@ -1939,19 +2532,81 @@ size_t vkglBSP::Model::q_strlcpy(char *dst, const char *src, size_t siz) {
   return (s - src - 1); /* count does not include NUL */
 }
 
+/*
+ =================
+ Mod_MakeHull0
+
+ Duplicate the drawing hull structure as a clipping hull
+ =================
+ */
+static void modMakeHull0(vkglBSP::QModel *mod) {
+  vkglBSP::Hull *hull = &mod->hulls[0];
+  mod->hull0clipnodes.resize(mod->nodes.size());
+
+  for (size_t i = 0; i < mod->nodes.size(); i++) {
+    const vkglBSP::MNode *in = &mod->nodes[i];
+    vkglBSP::MClipNode *out = &mod->hull0clipnodes[i];
+    out->planenum = (int) (in->plane - mod->planes.data());
+    for (int j = 0; j < 2; j++) {
+      const vkglBSP::MNode *child = in->children[j];
+      out->children[j] = child->contents < 0 ?
+          child->contents : (int) (child - mod->nodes.data());
+    }
+  }
+
+  hull->clipnodes = mod->hull0clipnodes.data();
+  hull->firstclipnode = 0;
+  hull->lastclipnode = (int) mod->nodes.size() - 1;
+  hull->planes = mod->planes.data();
+  hull->clip_mins = glm::vec3(0.0f);
+  hull->clip_maxs = glm::vec3(0.0f);
+}
+
+/*
+ Submodel 0 is the world. Inline brush models share the world's data, they
+ are drawn and clipped through their entry in mod->submodels.
+ */
+static void modSetupWorld(vkglBSP::QModel *mod) {
+  const vkglBSP::DModel *bm = &mod->submodels[0];
+
+  mod->hulls[0].firstclipnode = bm->headnode[0];
+  for (int j = 1; j < MAX_MAP_HULLS; j++) {
+    mod->hulls[j].firstclipnode = bm->headnode[j];
+    mod->hulls[j].lastclipnode = mod->numclipnodes - 1;
+  }
+
+  mod->firstmodelsurface = bm->firstface;
+  mod->nummodelsurfaces = bm->numfaces;
+
+  VectorCopy(bm->maxs, mod->maxs);
+  VectorCopy(bm->mins, mod->mins);
+
+  //johnfitz -- calculate rotate bounds and yaw bounds
+  float radius = glm::length(glm::max(glm::abs(mod->mins), glm::abs(mod->maxs)));
+  mod->rmaxs = mod->ymaxs = glm::vec3(radius);
+  mod->rmins = mod->ymins = glm::vec3(-radius);
+  //johnfitz
+
+  mod->numleafs = bm->visleafs;
+
+  // One bit per visible leaf, leaf 0 is not included
+  const int rowsize = (mod->numleafs + 7) >> 3;
+  mod->pvscache.reset((int) mod->leafs.size(), rowsize, PVS_CACHE_ROWS);
+  mod->novis.assign(mod->pvscache.rowbytes, 0);
+  memset(mod->novis.data(), 0xff, rowsize);
+  mod->fatpvs.assign(mod->pvscache.rowbytes, 0);
+}
+
 /*
  =================
  Mod_LoadBrushModel
  =================
  */
-void vkglBSP::Model::modLoadBrushModel(QModel *mod, void *buffer) {
-  int i, j;
+void vkglBSP::Model::modLoadBrushModel(QModel *mod, const void *buffer) {
   int bsp2;
-  DHeader *header;
-  DModel *bm;
-  float radius; //johnfitz
+  const DHeader *header;
 
-  header = (DHeader*) buffer;
+  header = (const DHeader*) buffer;
 
   //  mod->bspversion = LittleLong(header->version);
   mod->bspversion = header->version;
@@ -1979,23 +2634,36 @@ void vkglBSP::Model::modLoadBrushModel(QModel *mod, void *buffer) {
   }
 
 // swap all the lumps
-  mod_base = (byte*) header;
+  mod_base = (const byte*) header;
 //
 //  for (i = 0; i < (int) sizeof(DHeader) / 4; i++)
 //    ((int*) header)[i] = (((int*) header)[i]);
 
 //// load into heap
 //
-  modLoadVertexes(&header->lumps[LUMP_VERTEXES]);
-  modLoadEdges(&header->lumps[LUMP_EDGES]);
-  modLoadSurfedges(&header->lumps[LUMP_SURFEDGES]);
-  modLoadTextures(&header->lumps[LUMP_TEXTURES]);
-//  Mod_LoadLighting(&header->lumps[LUMP_LIGHTING]);
-//  Mod_LoadPlanes(&header->lumps[LUMP_PLANES]);
-  modLoadTexInfo(&header->lumps[LUMP_TEXINFO]);
-  modLoadFaces(&header->lumps[LUMP_FACES]);
-//  Mod_LoadMarksurfaces(&header->lumps[LUMP_MARKSURFACES], bsp2);
-//
+  // Every loader writes its own part of loadmodel, so independent lumps are
+  // decoded concurrently. Edges point at dependencies that must finish first.
+  const Lump *lumps = header->lumps;
+  LumpJobGraph graph;
+  int vertexes = graph.add([this, lumps] { modLoadVertexes(&lumps[LUMP_VERTEXES]); }, { });
+  int edges = graph.add([this, lumps, bsp2] { modLoadEdges(&lumps[LUMP_EDGES], bsp2); }, { });
+  int surfedges = graph.add([this, lumps] { modLoadSurfedges(&lumps[LUMP_SURFEDGES]); }, { });
+  int textures = graph.add([this, lumps] { modLoadTextures(&lumps[LUMP_TEXTURES]); }, { });
+  int lighting = graph.add([this, lumps] { modLoadLighting(&lumps[LUMP_LIGHTING]); }, { });
+  int visibility = graph.add([this, lumps] { modLoadVisibility(&lumps[LUMP_VISIBILITY]); }, { });
+  int planes = graph.add([this, lumps] { modLoadPlanes(&lumps[LUMP_PLANES]); }, { });
+  int texinfo = graph.add([this, lumps] { modLoadTexInfo(&lumps[LUMP_TEXINFO]); }, { textures });
+  int faces = graph.add([this, lumps, bsp2] { modLoadFaces(&lumps[LUMP_FACES], bsp2 != 0); },
+      { texinfo, vertexes, edges, surfedges, planes, lighting });
+  int marksurfaces = graph.add([this, lumps, bsp2] { modLoadMarksurfaces(&lumps[LUMP_MARKSURFACES], bsp2); },
+      { faces });
+  int leafs = graph.add([this, lumps, bsp2] { modLoadLeafs(&lumps[LUMP_LEAFS], bsp2); },
+      { marksurfaces, visibility });
+  graph.add([this, lumps, bsp2] { modLoadNodes(&lumps[LUMP_NODES], bsp2); }, { planes, leafs, faces });
+  graph.add([this, lumps, bsp2] { modLoadClipnodes(&lumps[LUMP_CLIPNODES], bsp2 != 0); }, { planes });
+  graph.add([this, lumps] { modLoadSubmodels(&lumps[LUMP_MODELS]); }, { faces });
+  graph.run(loaderThreads ? loaderThreads : std::thread::hardware_concurrency());
+
 //  if (!bsp2 && external_vis.value && sv.modelname[0]
 //      && !q_strcasecmp(loadname, sv.name)) {
 //    FILE *fvis;
@@ -2019,13 +2687,8 @@ void vkglBSP::Model::modLoadBrushModel(QModel *mod, void *buffer) {
 //    }
 //  }
 //
-//  Mod_LoadLeafs(&header->lumps[LUMP_LEAFS], bsp2);
-//  visdone: Mod_LoadNodes(&header->lumps[LUMP_NODES], bsp2);
-//  Mod_LoadClipnodes(&header->lumps[LUMP_CLIPNODES], bsp2);
 //  Mod_LoadEntities(&header->lumps[LUMP_ENTITIES]);
-//  Mod_LoadSubmodels(&header->lumps[LUMP_MODELS]);
 //
-//  Mod_PrepareSIMDData();
 //  Mod_MakeHull0();
 //
 //  mod->numframes = 2;   // regular and alternate animation
@@ -2088,380 +2751,1211 @@ void vkglBSP::Model::modLoadBrushModel(QModel *mod, void *buffer) {
 //      mod = loadmodel;
 //    }
 //  }
+
+  modMakeHull0(mod);
+  modSetupWorld(mod);
+  modPrepareSIMDData(mod);
+  modBuildLightmaps(mod);
 }
 
-void vkglBSP::Model::modLoadVertexes(Lump *l) {
-  DVertex *in;
+void vkglBSP::Model::modLoadVertexes(const Lump *l) {
+  const DVertex *in;
   int i, count;
 
-  in = (DVertex*) (mod_base + l->fileofs);
+  in = (const DVertex*) (mod_base + l->fileofs);
   if (l->filelen % sizeof(*in)) {
-    snprintf(errorBuff, 255, "modLoadVertexes: funny lump size in %s",
+    char buff[256];
+    snprintf(buff, 255, "modLoadVertexes: funny lump size in %s",
         loadmodel->name);
-    throw std::runtime_error(errorBuff);
+    throw std::runtime_error(buff);
   }
 
   count = l->filelen / sizeof(*in);
-
-  for (i = 0; i < count; i++, in++) {
-    MVertex v;
-    v.position.x = in->point[0];
-    v.position.y = -in->point[2];
-    v.position.z = -in->point[1];
-    loadmodel->vertexes.push_back(v);
+  loadmodel->vertexes.resize(count);
+  MVertex *out = loadmodel->vertexes.data();
+
+  for (i = 0; i < count; i++, in++, out++) {
+    out->position.x = in->point[0];
+    out->position.y = -in->point[2];
+    out->position.z = -in->point[1];
+    out->position.w = 0.0f;
   }
 
   loadmodel->numvertexes = count;
 }
 
 void vkglBSP::Model::init() {
-  char pakfile[MAX_OSPATH];
-  snprintf(pakfile, sizeof(pakfile), "id1/pak1.pak");
-  Pack pak = comLoadPackFile(pakfile);
-  pak0 = &pak;
-
-  PackFile startBSP = comFindFile("maps/start.bsp");
-
-  byte *bspBytes = new byte[sizeof(byte) * (startBSP.filelen + 1)];
-
-  fseek(pak.handle, startBSP.filepos, SEEK_SET);
-  std::cout << "fileln = " << startBSP.filelen;
-
-  fread(bspBytes, 1, startBSP.filelen, pak.handle);
-  std::cout << " filepos = " << startBSP.filepos << std::endl;
-
-  int modType = (bspBytes[0] | (bspBytes[1] << 8) | (bspBytes[2] << 16)
-      | (bspBytes[3] << 24));
-  std::cout << "modType " << modType << std::endl;
-
-  loadmodel = &mod;
-  mod_base = bspBytes;
+  if (fileSystem == nullptr) {
+    fileSystem = &defaultFileSystem;
+  }
+  if (fileSystem->searchPaths.empty()) {
+    fileSystem->addGameDirectory(gameDir.c_str());
+  }
 
-  modLoadBrushModel(&mod, bspBytes);
+  // The BSP is parsed straight out of the file system mapping, no intermediate copy
+  loadedFromCache = false;
+  r_viewleaf = r_oldviewleaf = nullptr;
+  modForName(mapName.c_str(), true);
 
-  std::vector<MVertex> localVertex;
-  std::vector<uint32_t> localIndex;
+  std::cout << "Done Loading " << loadmodel->surfaces.size()
+      << " surfaces vertex size = " << loadmodel->polyverts.size()
+      << " index size = " << loadmodel->polyindexes.size()
+      << (loadedFromCache ? " (cached)" : "") << std::endl;
 
-  std::cout << "Surface size = " << loadmodel->surfaces.size() << std::endl;
+  mod_base = nullptr;
+}
 
-  int baseIndex = 0;
+/*
+ Triangle fans for every drawn surface polygon, ready for the index buffer
+ */
+void vkglBSP::Model::modBuildIndexes() {
+  const SurfaceTable &table = loadmodel->surftable;
+  size_t numindexes = 0;
+  for (int s = 0; s < table.size(); s++) {
+    if (table.numverts[s] >= 3 && !(table.flags[s] & SURF_TRIGGER)) {
+      numindexes += (table.numverts[s] - 2) * 3;
+    }
+  }
 
-  for (auto &s : loadmodel->surfaces) {
+  std::vector<uint32_t> &indexes = loadmodel->polyindexes;
+  indexes.clear();
+  indexes.reserve(numindexes);
 
-    GlPoly *p = &s.polys;
+  for (int s = 0; s < table.size(); s++) {
+    if (table.flags[s] & SURF_TRIGGER) {
+      continue;
+    }
+    const uint32_t baseIndex = table.firstvert[s];
+    const int numverts = table.numverts[s];
 
-    baseIndex = s.firstedge;
+    for (int i = 0; i < numverts - 2; ++i) {
+      indexes.push_back(baseIndex);
+      indexes.push_back(baseIndex + i + 1);
+      indexes.push_back(baseIndex + i + 2);
+    }
+  }
+}
 
-    std::cout << "baseIndex = " << baseIndex << std::endl;
+vkglBSP::FileSystem::~FileSystem() {
+  shutdown();
+}
 
-    const int numverts = p->verts.size();
-    const int vertexCount = p->numverts - 2;
+void vkglBSP::FileSystem::shutdown() {
+  unmapLooseFiles();
+  for (auto &path : searchPaths) {
+    closePackFile(path.pack);
+  }
+  searchPaths.clear();
+  entries.clear();
+  hashIndex.clear();
+  nextPathId = 1;
+}
 
-    std::cout << "numVerts = " << numverts << std::endl;
-    std::cout << "vertexCount = " << vertexCount << std::endl;
-    for (const auto &v : p->verts) {
-      MVertex mv;
-      mv.position = v;
-      localVertex.push_back(mv);
-    }
+/*
+ ================
+ COM_AddGameDirectory
 
-    for (int i = 0; i < vertexCount; ++i) {
-      localIndex.push_back(baseIndex);
-      localIndex.push_back(baseIndex + i + 1);
-      localIndex.push_back(baseIndex + i + 2);
+ Sets com_gamedir, adds the directory to the head of the path,
+ then loads and adds pak1.pak pak2.pak ...
+ ================
+ */
+void vkglBSP::FileSystem::addGameDirectory(const char *dir) {
+  char pakfile[MAX_OSPATH];
+  const unsigned int path_id = nextPathId;
+  nextPathId <<= 1;
+
+  // add the directory to the search path
+  SearchPath loose;
+  loose.path_id = path_id;
+  Model::q_strlcpy(loose.filename, dir, sizeof(loose.filename));
+  loose.pack = nullptr;
+  searchPaths.insert(searchPaths.begin(), loose);
+
+  // add any pak files in the format pak0.pak pak1.pak, ...
+  for (int i = 0;; i++) {
+    snprintf(pakfile, sizeof(pakfile), "%s/pak%i.pak", dir, i);
+    struct stat st;
+    if (stat(pakfile, &st) != 0) {
+      break;
     }
+    SearchPath search;
+    search.path_id = path_id;
+    search.filename[0] = '\0';
+    search.pack = loadPackFile(pakfile);
+    searchPaths.insert(searchPaths.begin(), search);
   }
 
-  loadmodel->vertexes = localVertex;
-  loadmodel->edges = localIndex;
-  std::cout << "Done Loading surfaces vertex size = " << localVertex.size()
-      << " index size = " << localIndex.size() << std::endl;
-
-  delete[] bspBytes;
-  fclose(pak.handle);
-
+  buildIndex();
 }
 
-vkglBSP::Pack vkglBSP::Model::comLoadPackFile(const char *packfile) {
-  int packhandle;
-  Pack pack;
+/*
+ =================
+ COM_LoadPackFile
+
+ Maps the whole pack file into memory and parses its directory
+ =================
+ */
+vkglBSP::Pack* vkglBSP::FileSystem::loadPackFile(const char *packfile) {
   DPackHeader header;
-  DPackFile info[MAX_FILES_IN_PACK];
-  FILE *f;
-  int retval;
+  const DPackFile *info;
   int numPackFiles;
+  size_t size = 0;
+  const byte *base = sysMapFile(packfile, &size);
 
-  f = fopen(packfile, "rb");
-
-  if (f == nullptr) {
+  if (base == nullptr && size == (size_t) -1) {
     snprintf(errorBuff, sizeof(char) * 256, "sysFileOpenRead failed! %s",
         packfile);
     throw std::runtime_error(errorBuff);
   }
 
-  retval = sysFileLength(f);
+  Pack *pack = new Pack();
+  pack->base = base;
+  pack->size = size;
+  Model::q_strlcpy(pack->filename, packfile, sizeof(pack->filename));
+
+  if (base == nullptr || size < sizeof(header)) {
+    closePackFile(pack);
+    snprintf(errorBuff, sizeof(char) * 256, "Could not map packfile %s",
+        packfile);
+    throw std::runtime_error(errorBuff);
+  }
 
-  fread((void*) &header, 1, sizeof(header), f);
+  memcpy(&header, base, sizeof(header));
 
   if (header.id[0] != 'P' || header.id[1] != 'A' || header.id[2] != 'C'
       || header.id[3] != 'K') {
+    closePackFile(pack);
     snprintf(errorBuff, sizeof(char) * 256, "%s is not a packfile", packfile);
     throw std::runtime_error(errorBuff);
   }
 
-  numPackFiles = header.dirlen / sizeof(DPackFile);
-
-  if (header.dirlen < 0 || header.dirofs < 0) {
+  if (header.dirlen < 0 || header.dirofs < 0
+      || (size_t) header.dirofs + header.dirlen > size) {
+    closePackFile(pack);
     snprintf(errorBuff, sizeof(char) * 256,
         "Invalid packfile %s (dirlen: %i, dirofs: %i)", packfile, header.dirlen,
         header.dirofs);
     throw std::runtime_error(errorBuff);
   }
 
+  numPackFiles = header.dirlen / sizeof(DPackFile);
+
   if (!numPackFiles) {
     std::cerr << "WARNING: " << packfile << " has no files, ignored"
         << std::endl;
-    fclose(f);
     return pack;
   }
 
-  if (numPackFiles > MAX_FILES_IN_PACK) {
-    snprintf(errorBuff, sizeof(char) * 256, "Max files of %d in %s pack file",
-        numPackFiles, packfile);
-    throw std::runtime_error(errorBuff);
-  }
-
-  fseek(f, header.dirofs, SEEK_SET);
-  fread((void*) info, 1, header.dirlen, f);
+  // The directory is read in place from the mapping
+  info = (const DPackFile*) (base + header.dirofs);
 
-  std::vector<PackFile> newFiles;
   // parse the directory
+  pack->files.resize(numPackFiles);
   for (int i = 0; i < numPackFiles; i++) {
-    PackFile newFile;
-    strncpy(newFile.name, info[i].name, sizeof(newFile.name));
-    newFile.filepos = info[i].filepos;
-    newFile.filelen = info[i].filelen;
-    newFiles.push_back(newFile);
-    std::cout << "Found: " << newFile.name << std::endl;
+    PackFile &newFile = pack->files[i];
+    memset(newFile.name, 0, sizeof(newFile.name));
+    memcpy(newFile.name, info[i].name, sizeof(info[i].name));
+    newFile.name[sizeof(info[i].name) - 1] = '\0';
+    memcpy(&newFile.filepos, &info[i].filepos, sizeof(newFile.filepos));
+    memcpy(&newFile.filelen, &info[i].filelen, sizeof(newFile.filelen));
   }
+  pack->numfiles = numPackFiles;
 
-  strncpy(pack.filename, packfile, sizeof(pack.filename));
-
-  pack.handle = f;
-  pack.numfiles = numPackFiles;
-  pack.files = newFiles;
+  std::cout << "Added packfile " << packfile << " (" << numPackFiles
+      << " files)" << std::endl;
 
   return pack;
 }
 
-long vkglBSP::Model::sysFileLength(FILE *f) {
-  long pos, end;
+void vkglBSP::FileSystem::closePackFile(Pack *pack) {
+  if (pack == nullptr) {
+    return;
+  }
+  sysUnmapFile(pack->base, pack->size);
+  delete pack;
+}
+
+// Walks a loose game directory, names are stored relative to the game directory with '/' separators
+void vkglBSP::FileSystem::addLooseFiles(int searchPath, const char *dir,
+    const char *prefix) {
+  char path[MAX_OSPATH];
+  char name[MAX_OSPATH];
+
+#if defined(_WIN32)
+  WIN32_FIND_DATAA data;
+  snprintf(path, sizeof(path), "%s/*", dir);
+  HANDLE find = FindFirstFileA(path, &data);
+  if (find == INVALID_HANDLE_VALUE) {
+    return;
+  }
+  do {
+    const char *entry = data.cFileName;
+    const bool isDirectory = (data.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY) != 0;
+    const int64_t length = ((int64_t) data.nFileSizeHigh << 32) | data.nFileSizeLow;
+#else
+  DIR *handle = opendir(dir);
+  if (handle == nullptr) {
+    return;
+  }
+  struct dirent *dirEntry;
+  while ((dirEntry = readdir(handle)) != nullptr) {
+    const char *entry = dirEntry->d_name;
+    struct stat st;
+    snprintf(path, sizeof(path), "%s/%s", dir, entry);
+    if (stat(path, &st) != 0) {
+      continue;
+    }
+    const bool isDirectory = S_ISDIR(st.st_mode);
+    const int64_t length = (int64_t) st.st_size;
+#endif
+    if (entry[0] == '.') {
+      continue;
+    }
+    snprintf(path, sizeof(path), "%s/%s", dir, entry);
+    snprintf(name, sizeof(name), "%s%s", prefix, entry);
+
+    if (isDirectory) {
+      snprintf(name, sizeof(name), "%s%s/", prefix, entry);
+      addLooseFiles(searchPath, path, name);
+      continue;
+    }
 
-  pos = ftell(f);
-  fseek(f, 0, SEEK_END);
-  end = ftell(f);
-  fseek(f, pos, SEEK_SET);
+    // The packs of this directory are already mounted as their own search paths
+    size_t len = strlen(name);
+    if (prefix[0] == '\0' && len > 4 && !Model::q_strcasecmp(name + len - 4, ".pak")) {
+      continue;
+    }
+    if (len >= MAX_QPATH || length > INT32_MAX) {
+      continue;
+    }
 
-  return end;
+    FileEntry file;
+    Model::q_strlcpy(file.name, name, sizeof(file.name));
+    file.searchPath = searchPath;
+    file.filepos = 0;
+    file.filelen = (int) length;
+    file.mapped = nullptr;
+    entries.push_back(file);
+#if defined(_WIN32)
+  } while (FindNextFileA(find, &data));
+  FindClose(find);
+#else
+  }
+  closedir(handle);
+#endif
 }
 
-vkglBSP::PackFile vkglBSP::Model::comFindFile(const char *filename) {
-  for (const auto &f : this->pak0->files) {
-    if (strcmp(f.name, filename) != 0) {
-      continue;
+/*
+ Rebuilds the merged index from scratch, walking the search paths from the
+ highest precedence down so the first name inserted is the one that wins.
+ Loose files mapped so far stay mapped, views of them may still be in use
+ */
+void vkglBSP::FileSystem::buildIndex() {
+  entries.clear();
+
+  for (int i = 0; i < (int) searchPaths.size(); i++) {
+    const SearchPath &search = searchPaths[i];
+    if (search.pack) {
+      for (const auto &packFile : search.pack->files) {
+        FileEntry file;
+        memcpy(file.name, packFile.name, sizeof(file.name));
+        file.searchPath = i;
+        file.filepos = packFile.filepos;
+        file.filelen = packFile.filelen;
+        file.mapped = nullptr;
+        entries.push_back(file);
+      }
+    } else {
+      addLooseFiles(i, search.filename, "");
     }
+  }
 
-    return f;
+  // Keep the load factor at or below 0.5 so probe sequences stay short
+  size_t tableSize = 16;
+  while (tableSize < entries.size() * 2) {
+    tableSize <<= 1;
+  }
+  hashIndex.assign(tableSize, -1);
+  const uint32_t mask = (uint32_t) tableSize - 1;
+
+  for (int i = 0; i < (int) entries.size(); i++) {
+    uint32_t slot = hashName(entries[i].name) & mask;
+    bool overridden = false;
+    while (hashIndex[slot] != -1) {
+      if (!Model::q_strcasecmp(entries[hashIndex[slot]].name, entries[i].name)) {
+        overridden = true;
+        break;
+      }
+      slot = (slot + 1) & mask;
+    }
+    if (!overridden) {
+      hashIndex[slot] = i;
+    }
   }
+}
 
-  std::cerr << "File " << filename << " not found" << std::endl;
-  return PackFile();
+void vkglBSP::FileSystem::unmapLooseFiles() {
+  for (auto &file : entries) {
+    file.mapped = nullptr;
+  }
+  for (const FileView &mapping : looseMappings) {
+    sysUnmapFile(mapping.data, mapping.size);
+  }
+  looseMappings.clear();
 }
 
-void vkglBSP::Model::modLoadEdges(Lump *l) {
-  int i, count;
+// FNV-1a over the lower case name, Quake paths are case insensitive
+uint32_t vkglBSP::FileSystem::hashName(const char *name) {
+  uint32_t hash = 2166136261u;
+  for (const char *c = name; *c; c++) {
+    hash ^= (uint32_t) Model::q_tolower((unsigned char) *c);
+    hash *= 16777619u;
+  }
+  return hash;
+}
 
-  DSEdge *in = (DSEdge*) (mod_base + l->fileofs);
+/*
+ ===========
+ COM_FindFile
 
-  if (l->filelen % sizeof(*in)) {
-    snprintf(errorBuff, 255, "modLoadEdges: funny lump size in %s",
-        loadmodel->name);
-    throw std::runtime_error(errorBuff);
+ Finds the file in the search path
+ ===========
+ */
+const vkglBSP::FileEntry* vkglBSP::FileSystem::findFile(
+    const char *filename) const {
+  if (hashIndex.empty()) {
+    return nullptr;
+  }
+  const uint32_t mask = (uint32_t) hashIndex.size() - 1;
+  uint32_t slot = hashName(filename) & mask;
+  while (hashIndex[slot] != -1) {
+    const FileEntry &file = entries[hashIndex[slot]];
+    if (!Model::q_strcasecmp(file.name, filename)) {
+      return &file;
+    }
+    slot = (slot + 1) & mask;
   }
+  return nullptr;
+}
 
-  count = l->filelen / sizeof(*in);
+vkglBSP::FileView vkglBSP::FileSystem::loadFile(const char *filename,
+    unsigned int *path_id) {
+  FileView fileView;
+  const FileEntry *found = findFile(filename);
+  if (found == nullptr) {
+    std::cerr << "File " << filename << " not found" << std::endl;
+    return fileView;
+  }
 
-  for (i = 0; i < count; i++, in++) {
-    MEdge edge;
-    edge.v[0] = in->v[0];
-    edge.v[1] = in->v[1];
+  FileEntry &file = entries[found - entries.data()];
+  const SearchPath &search = searchPaths[file.searchPath];
+  if (path_id) {
+    *path_id = search.path_id;
+  }
+
+  if (search.pack) {
+    PackFile packFile;
+    memcpy(packFile.name, file.name, sizeof(packFile.name));
+    packFile.filepos = file.filepos;
+    packFile.filelen = file.filelen;
+    fileView = search.pack->view(packFile);
+    if (fileView.missing()) {
+      snprintf(errorBuff, sizeof(char) * 256, "%s exceeds the bounds of %s",
+          filename, search.pack->filename);
+      throw std::runtime_error(errorBuff);
+    }
+    return fileView;
+  }
 
-    loadmodel->medges.push_back(edge);
+  if (file.mapped == nullptr && file.filelen > 0) {
+    char path[MAX_OSPATH];
+    size_t size = 0;
+    snprintf(path, sizeof(path), "%s/%s", search.filename, file.name);
+    file.mapped = sysMapFile(path, &size);
+    if (file.mapped == nullptr || size != (size_t) file.filelen) {
+      sysUnmapFile(file.mapped, size);
+      file.mapped = nullptr;
+      snprintf(errorBuff, sizeof(char) * 256, "Could not map %s", path);
+      throw std::runtime_error(errorBuff);
+    }
+    FileView mapping;
+    mapping.data = file.mapped;
+    mapping.size = size;
+    looseMappings.push_back(mapping);
   }
+  // Nothing is mapped for a zero length file, it still gets a non-null view
+  static const byte emptyFile[1] = { 0 };
+  fileView.data = file.filelen > 0 ? file.mapped : emptyFile;
+  fileView.size = (size_t) file.filelen;
+  return fileView;
+}
 
-  loadmodel->numedges = count;
-  std::cout << "Edges computed" << std::endl;
+vkglBSP::FileView vkglBSP::Pack::view(const PackFile &file) const {
+  FileView fileView;
+  if (file.filepos < 0 || file.filelen < 0
+      || (size_t) file.filepos + (size_t) file.filelen > size) {
+    return fileView;
+  }
+  fileView.data = base + file.filepos;
+  fileView.size = (size_t) file.filelen;
+  return fileView;
 }
 
-void vkglBSP::Model::modLoadSurfedges(Lump *l) {
-  int i, count;
-  int *in;
-  std::vector<int> out;
+/*
+ Quake is Z up, everything is loaded into the Y down render space used for
+ vertexes: (x, y, z) becomes (x, -z, -y). The mapping is orthogonal, so
+ plane distances and dot products are unchanged.
+ */
+static inline glm::vec3 modRenderSpace(float x, float y, float z) {
+  return glm::vec3(x, -z, -y);
+}
+
+template<typename T>
+static void modRenderSpaceBounds(const T *mins, const T *maxs, float *minmaxs) {
+  minmaxs[0] = (float) mins[0];
+  minmaxs[1] = -(float) maxs[2];
+  minmaxs[2] = -(float) maxs[1];
+  minmaxs[3] = (float) maxs[0];
+  minmaxs[4] = -(float) mins[2];
+  minmaxs[5] = -(float) mins[1];
+}
+
+/*
+ =================
+ Mod_LoadPlanes
+ =================
+ */
+void vkglBSP::Model::modLoadPlanes(const Lump *l) {
+  int i, j, count;
+  int bits;
+  const DPlane *in;
 
-  in = (int*) (mod_base + l->fileofs);
+  in = (const DPlane*) (mod_base + l->fileofs);
   if (l->filelen % sizeof(*in)) {
-    snprintf(errorBuff, 255, "modLoadSurfedges: funny lump size in %s",
+    char buff[256];
+    snprintf(buff, 255, "modLoadPlanes: funny lump size in %s",
         loadmodel->name);
-    throw std::runtime_error(errorBuff);
+    throw std::runtime_error(buff);
   }
+
   count = l->filelen / sizeof(*in);
-  loadmodel->numsurfedges = count;
+  loadmodel->planes.resize(count);
+  loadmodel->numplanes = count;
+  MPlane *out = loadmodel->planes.data();
+
+  for (i = 0; i < count; i++, in++, out++) {
+    out->normal = modRenderSpace(in->normal[0], in->normal[1], in->normal[2]);
+    out->dist = in->dist;
+
+    bits = 0;
+    for (j = 0; j < 3; j++) {
+      if (out->normal[j] < 0)
+        bits |= 1 << j;
+    }
+    out->signbits = bits;
 
-  for (i = 0; i < count; i++) {
-    out.push_back(in[i]);
+    // Only +x stays axial, the other axes flip sign in render space
+    switch (in->type) {
+    case PLANE_X:
+    case PLANE_ANYX:
+      out->type = in->type;
+      break;
+    case PLANE_Y:
+    case PLANE_ANYY:
+      out->type = PLANE_ANYZ;
+      break;
+    default:
+      out->type = PLANE_ANYY;
+      break;
+    }
+    out->pad[0] = out->pad[1] = 0;
   }
-
-  loadmodel->surfedges = out;
-  std::cout << "surface completed" << std::endl;
 }
 
-void vkglBSP::Model::modLoadFaces(Lump *l) {
-  DSFace *ins;
-  DLFace *inl;
-  int i, count, surfnum, lofs;
-  int planenum, side, texinfon;
-
-  ins = (DSFace*) (mod_base + l->fileofs);
-  inl = nullptr;
+/*
+ =================
+ Mod_LoadMarksurfaces
+ =================
+ */
+void vkglBSP::Model::modLoadMarksurfaces(const Lump *l, int bsp2) {
+  int i, j, count;
+  const size_t size = bsp2 ? sizeof(unsigned int) : sizeof(unsigned short);
 
-  if (l->filelen % sizeof(*ins)) {
-    snprintf(errorBuff, 255, "modLoadFaces: funny lump size in %s",
+  if (l->filelen % size) {
+    char buff[256];
+    snprintf(buff, 255, "modLoadMarksurfaces: funny lump size in %s",
         loadmodel->name);
-    throw std::runtime_error(errorBuff);
+    throw std::runtime_error(buff);
   }
 
-  count = l->filelen / sizeof(*ins);
-
-  loadmodel->numsurfaces = count;
+  count = l->filelen / size;
+  loadmodel->marksurfaces.resize(count);
+  loadmodel->nummarksurfaces = count;
 
-  MTexInfo *mti = loadmodel->texinfo.data();
+  const byte *in = mod_base + l->fileofs;
+  for (i = 0; i < count; i++) {
+    if (bsp2) {
+      unsigned int mark;
+      memcpy(&mark, in + i * size, sizeof(mark));
+      j = (int) mark;
+    } else {
+      unsigned short mark; //johnfitz -- explicit cast as unsigned short
+      memcpy(&mark, in + i * size, sizeof(mark));
+      j = mark;
+    }
+    if (j < 0 || j >= loadmodel->numsurfaces) {
+      char buff[256];
+      snprintf(buff, 255, "modLoadMarksurfaces: bad surface number %i in %s",
+          j, loadmodel->name);
+      throw std::runtime_error(buff);
+    }
+    loadmodel->marksurfaces[i] = j;
+  }
+}
 
-  for (surfnum = 0; surfnum < count; surfnum++) {
-    MSurface out;
-    out.firstedge = ins->firstedge;
-    out.numedges = ins->numedges;
-    planenum = ins->planenum;
-    side = ins->side;
-    texinfon = ins->texinfo;
-    lofs = ins->lightofs;
+template<typename T>
+static void modProcessLeafs(vkglBSP::QModel *loadmodel, const T *in,
+    int count) {
+  loadmodel->leafs.resize(count);
+  loadmodel->numleafs = count;
+  vkglBSP::MLeaf *out = loadmodel->leafs.data();
+
+  for (int i = 0; i < count; i++, in++, out++) {
+    modRenderSpaceBounds(in->mins, in->maxs, out->minmaxs);
+
+    out->contents = in->contents;
+    out->visframe = 0;
+    out->parent = nullptr;
+
+    const unsigned int firstmarksurface = in->firstmarksurface;
+    const unsigned int nummarksurfaces = in->nummarksurfaces;
+    if ((size_t) firstmarksurface + nummarksurfaces
+        > (size_t) loadmodel->nummarksurfaces) {
+      char buff[256];
+      snprintf(buff, 255, "modLoadLeafs: wrong marksurfaces position in %s",
+          loadmodel->name);
+      throw std::runtime_error(buff);
+    }
+    out->firstmarksurface = loadmodel->marksurfaces.data() + firstmarksurface;
+    out->nummarksurfaces = (int) nummarksurfaces;
 
-    ins++;
+    const int visofs = in->visofs;
+    if (visofs < 0 || visofs >= (int) loadmodel->visdata.size())
+      out->compressed_vis = nullptr;
+    else
+      out->compressed_vis = loadmodel->visdata.data() + visofs;
+    out->efrags = nullptr;
+    out->key = 0;
 
-    out.flags = 0;
+    for (int j = 0; j < 4; j++)
+      out->ambient_sound_level[j] = in->ambient_level[j];
 
-    if (side)
-      out.flags |= SURF_PLANEBACK;
+    //johnfitz -- removed code to mark surfaces as SURF_UNDERWATER
+  }
+}
 
-//    out.plane = loadmodel->planes + planenum;
+/*
+ =================
+ Mod_LoadLeafs
+ =================
+ */
+void vkglBSP::Model::modLoadLeafs(const Lump *l, int bsp2) {
+  const size_t size = bsp2 == 2 ? sizeof(DL2Leaf)
+      : bsp2 ? sizeof(DL1Leaf) : sizeof(DSLeaf);
 
-    out.texinfo = mti + texinfon;
+  if (l->filelen % size) {
+    char buff[256];
+    snprintf(buff, 255, "modLoadLeafs: funny lump size in %s", loadmodel->name);
+    throw std::runtime_error(buff);
+  }
 
-    std::cout << "modLoadFaces: " << out.texinfo->texture.name << std::endl;
+  const int count = l->filelen / size;
+  if (count > 32767 && !bsp2) {
+    char buff[256];
+    snprintf(buff, 255, "modLoadLeafs: %i leafs exceeds limit of 32767", count);
+    throw std::runtime_error(buff);
+  }
 
-//    CalcSurfaceExtents(out);
+  if (bsp2 == 2)
+    modProcessLeafs(loadmodel, (const DL2Leaf*) (mod_base + l->fileofs), count);
+  else if (bsp2)
+    modProcessLeafs(loadmodel, (const DL1Leaf*) (mod_base + l->fileofs), count);
+  else
+    modProcessLeafs(loadmodel, (const DSLeaf*) (mod_base + l->fileofs), count);
+}
 
-    // lighting info
-//    if (lofs == -1)
-//      out.samples = nullptr;
-//    else
-//      out.samples = loadmodel->lightdata + (lofs * 3); //johnfitz -- lit support via lordhavoc (was "+ i")
+template<typename T>
+static void modProcessNodes(vkglBSP::QModel *loadmodel, const T *in,
+    int count) {
+  loadmodel->nodes.resize(count);
+  loadmodel->numnodes = count;
+  vkglBSP::MNode *out = loadmodel->nodes.data();
+
+  for (int i = 0; i < count; i++, in++, out++) {
+    modRenderSpaceBounds(in->mins, in->maxs, out->minmaxs);
+
+    out->contents = 0;
+    out->visframe = 0;
+    out->parent = nullptr;
+
+    const int planenum = in->planenum;
+    if (planenum < 0 || planenum >= loadmodel->numplanes) {
+      char buff[256];
+      snprintf(buff, 255, "modLoadNodes: planenum out of bounds in %s",
+          loadmodel->name);
+      throw std::runtime_error(buff);
+    }
+    out->plane = loadmodel->planes.data() + planenum;
+
+    out->firstsurface = in->firstface;
+    out->numsurfaces = in->numfaces;
+    if ((size_t) out->firstsurface + out->numsurfaces
+        > (size_t) loadmodel->numsurfaces) {
+      char buff[256];
+      snprintf(buff, 255, "modLoadNodes: bad surface range in %s",
+          loadmodel->name);
+      throw std::runtime_error(buff);
+    }
 
-    //johnfitz -- this section rewritten
+    for (int j = 0; j < 2; j++) {
+      // johnfitz -- hack to handle nodes > 32k, adapted from darkplaces. Short
+      // children are read unsigned, so leafs count down from 65535 instead of -1
+      int p = in->children[j];
+      if (sizeof(in->children[j]) == sizeof(short)) {
+        p = (unsigned short) in->children[j];
+        if (p >= count)
+          p = p - 65536;
+      }
+      if (p >= 0 && p < count) {
+        out->children[j] = loadmodel->nodes.data() + p;
+      } else {
+        p = -1 - p;
+        if (p >= 0 && p < loadmodel->numleafs) {
+          out->children[j] = (vkglBSP::MNode*) (loadmodel->leafs.data() + p);
+        } else {
+          std::cerr << "modLoadNodes: invalid leaf index " << p
+              << " (file has only " << loadmodel->numleafs << " leafs)"
+              << std::endl;
+          //map it to the solid leaf
+          out->children[j] = (vkglBSP::MNode*) (loadmodel->leafs.data());
+        }
+      }
+    }
+  }
+}
 
-//    if (!q_strncasecmp(out.texinfo->texture.name, "sky", 3)) // sky surface //also note -- was Q_strncmp, changed to match qbsp
-//        {
-//      out.flags |= (SURF_DRAWSKY | SURF_DRAWTILED);
-//      modPolyForUnlitSurface(&out); //no more subdivision
-//
-//    } else if (out.texinfo->texture.name[0] == '*') // warp surface
-//        {
-//      out.flags |= (SURF_DRAWTURB | SURF_DRAWTILED);
-//
-//      // detect special liquid types
-//      if (!strncmp(out.texinfo->texture.name, "*lava", 5))
-//        out.flags |= SURF_DRAWLAVA;
-//      else if (!strncmp(out.texinfo->texture.name, "*slime", 6))
-//        out.flags |= SURF_DRAWSLIME;
-//      else if (!strncmp(out.texinfo->texture.name, "*tele", 5))
-//        out.flags |= SURF_DRAWTELE;
-//      else
-//        out.flags |= SURF_DRAWWATER;
-////
-//      modPolyForUnlitSurface(&out);
-//      glSubdivideSurface(&out);
-//
-//    } else if (out.texinfo->texture.name[0] == '{') // ericw -- fence textures
-//        {
-//      out.flags |= SURF_DRAWFENCE;
-//    } else if (out.texinfo->flags & TEX_MISSING) // texture is missing from bsp
-//    {
-//      if (out.samples) //lightmapped
-//      {
-//        out.flags |= SURF_NOTEXTURE;
-//      } else // not lightmapped
-//      {
-//        out.flags |= (SURF_NOTEXTURE | SURF_DRAWTILED);
-//        modPolyForUnlitSurface(&out);
-//      }
-//    }
-    if (strncmp(out.texinfo->texture.name, "trigger", 7)) {
-      modPolyForUnlitSurface(&out);
-      loadmodel->surfaces.push_back(out);
+/*
+ =================
+ Mod_LoadNodes
+ =================
+ */
+void vkglBSP::Model::modLoadNodes(const Lump *l, int bsp2) {
+  const size_t size = bsp2 == 2 ? sizeof(DL2Node)
+      : bsp2 ? sizeof(DL1Node) : sizeof(DSNode);
+
+  if (l->filelen % size) {
+    char buff[256];
+    snprintf(buff, 255, "modLoadNodes: funny lump size in %s", loadmodel->name);
+    throw std::runtime_error(buff);
+  }
+
+  const int count = l->filelen / size;
+  if (count > 32767 && !bsp2) {
+    char buff[256];
+    snprintf(buff, 255, "modLoadNodes: %i nodes exceeds limit of 32767", count);
+    throw std::runtime_error(buff);
+  }
+
+  if (bsp2 == 2)
+    modProcessNodes(loadmodel, (const DL2Node*) (mod_base + l->fileofs), count);
+  else if (bsp2)
+    modProcessNodes(loadmodel, (const DL1Node*) (mod_base + l->fileofs), count);
+  else
+    modProcessNodes(loadmodel, (const DSNode*) (mod_base + l->fileofs), count);
+
+  if (count > 0)
+    modSetParent(loadmodel->nodes.data(), nullptr); // sets nodes and leafs
+}
+
+/*
+ =================
+ Mod_SetParent
+ =================
+ */
+void vkglBSP::Model::modSetParent(MNode *node, MNode *parent) {
+  // Iterative so degenerate trees can't exhaust the stack
+  std::vector<std::pair<MNode*, MNode*>> stack;
+  stack.push_back(std::make_pair(node, parent));
+  while (!stack.empty()) {
+    node = stack.back().first;
+    parent = stack.back().second;
+    stack.pop_back();
+
+    node->parent = parent;
+    if (node->contents < 0)
+      continue;
+    stack.push_back(std::make_pair(node->children[0], node));
+    stack.push_back(std::make_pair(node->children[1], node));
+  }
+}
+
+/*
+ Points hulls 1 and 2 at the clipnodes and planes of the model. Their player
+ and monster boxes are converted to render space like everything else.
+ */
+static void modInitClipHulls(vkglBSP::QModel *mod) {
+  const float hullMins[2][3] = { { -16, -16, -24 }, { -32, -32, -24 } };
+  const float hullMaxs[2][3] = { { 16, 16, 32 }, { 32, 32, 64 } };
+  float minmaxs[6];
+
+  for (int i = 0; i < 2; i++) {
+    vkglBSP::Hull *hull = &mod->hulls[i + 1];
+    hull->clipnodes = mod->clipnodes.data();
+    hull->firstclipnode = 0;
+    hull->lastclipnode = mod->numclipnodes - 1;
+    hull->planes = mod->planes.data();
+    modRenderSpaceBounds(hullMins[i], hullMaxs[i], minmaxs);
+    hull->clip_mins = glm::vec3(minmaxs[0], minmaxs[1], minmaxs[2]);
+    hull->clip_maxs = glm::vec3(minmaxs[3], minmaxs[4], minmaxs[5]);
+  }
+}
+
+/*
+ =================
+ Mod_LoadClipnodes
+ =================
+ */
+void vkglBSP::Model::modLoadClipnodes(const Lump *l, bool bsp2) {
+  int i, count;
+  const size_t size = bsp2 ? sizeof(DLClipNode) : sizeof(DSClipNode);
+
+  if (l->filelen % size) {
+    char buff[256];
+    snprintf(buff, 255, "modLoadClipnodes: funny lump size in %s",
+        loadmodel->name);
+    throw std::runtime_error(buff);
+  }
+
+  count = l->filelen / size;
+  loadmodel->clipnodes.resize(count);
+  loadmodel->numclipnodes = count;
+  MClipNode *out = loadmodel->clipnodes.data();
+
+  //johnfitz -- warn about exceeding old limits
+  if (count > 32767 && !bsp2)
+    std::cout << count << " clipnodes exceeds standard limit of 32767"
+        << std::endl;
+
+  modInitClipHulls(loadmodel);
+
+  const DSClipNode *ins = (const DSClipNode*) (mod_base + l->fileofs);
+  const DLClipNode *inl = (const DLClipNode*) (mod_base + l->fileofs);
+
+  for (i = 0; i < count; i++, out++) {
+    if (bsp2) {
+      out->planenum = inl[i].planenum;
+      out->children[0] = inl[i].children[0];
+      out->children[1] = inl[i].children[1];
+    } else {
+      out->planenum = ins[i].planenum;
+      //johnfitz -- support clipnodes > 32k
+      out->children[0] = (unsigned short) ins[i].children[0];
+      out->children[1] = (unsigned short) ins[i].children[1];
+      if (out->children[0] >= count)
+        out->children[0] -= 65536;
+      if (out->children[1] >= count)
+        out->children[1] -= 65536;
+    }
+
+    //johnfitz -- bounds check
+    if (out->planenum < 0 || out->planenum >= loadmodel->numplanes) {
+      char buff[256];
+      snprintf(buff, 255, "modLoadClipnodes: planenum out of bounds in %s",
+          loadmodel->name);
+      throw std::runtime_error(buff);
+    }
+  }
+}
+
+/*
+ =================
+ Mod_LoadSubmodels
+ =================
+ */
+void vkglBSP::Model::modLoadSubmodels(const Lump *l) {
+  const DModel *in;
+  int i, j, count;
+
+  in = (const DModel*) (mod_base + l->fileofs);
+  if (l->filelen % sizeof(*in)) {
+    char buff[256];
+    snprintf(buff, 255, "modLoadSubmodels: funny lump size in %s",
+        loadmodel->name);
+    throw std::runtime_error(buff);
+  }
+
+  count = l->filelen / sizeof(*in);
+  if (count < 1) {
+    char buff[256];
+    snprintf(buff, 255, "modLoadSubmodels: no world model in %s",
+        loadmodel->name);
+    throw std::runtime_error(buff);
+  }
+
+  loadmodel->submodels.resize(count);
+  loadmodel->numsubmodels = count;
+  DModel *out = loadmodel->submodels.data();
+
+  for (i = 0; i < count; i++, in++, out++) {
+    float mins[3], maxs[3], minmaxs[6];
+    for (j = 0; j < 3; j++) { // spread the mins / maxs by a pixel
+      mins[j] = in->mins[j] - 1;
+      maxs[j] = in->maxs[j] + 1;
+    }
+    modRenderSpaceBounds(mins, maxs, minmaxs);
+    glm::vec3 origin = modRenderSpace(in->origin[0], in->origin[1],
+        in->origin[2]);
+    for (j = 0; j < 3; j++) {
+      out->mins[j] = minmaxs[j];
+      out->maxs[j] = minmaxs[3 + j];
+      out->origin[j] = origin[j];
+    }
+    for (j = 0; j < MAX_MAP_HULLS; j++)
+      out->headnode[j] = in->headnode[j];
+    out->visleafs = in->visleafs;
+    out->firstface = in->firstface;
+    out->numfaces = in->numfaces;
+
+    if (out->firstface < 0 || out->numfaces < 0
+        || out->firstface + out->numfaces > loadmodel->numsurfaces) {
+      char buff[256];
+      snprintf(buff, 255, "modLoadSubmodels: bad face range in %s",
+          loadmodel->name);
+      throw std::runtime_error(buff);
+    }
+  }
+
+  // johnfitz -- check world visleafs -- adapted from bjp
+  out = loadmodel->submodels.data();
+  if (out->visleafs > 8192)
+    std::cout << out->visleafs << " visleafs exceeds standard limit of 8192"
+        << std::endl;
+}
+
+void vkglBSP::Model::modLoadEdges(const Lump *l, int bsp2) {
+  int i, count;
+  const size_t size = bsp2 ? sizeof(DLEdge) : sizeof(DSEdge);
+
+  if (l->filelen % size) {
+    char buff[256];
+    snprintf(buff, 255, "modLoadEdges: funny lump size in %s",
+        loadmodel->name);
+    throw std::runtime_error(buff);
+  }
+
+  count = l->filelen / size;
+  loadmodel->medges.resize(count);
+  MEdge *out = loadmodel->medges.data();
+
+  if (bsp2) {
+    const DLEdge *in = (const DLEdge*) (mod_base + l->fileofs);
+    for (i = 0; i < count; i++, in++, out++) {
+      out->v[0] = in->v[0];
+      out->v[1] = in->v[1];
+      out->cachededgeoffset = 0;
+    }
+  } else {
+    const DSEdge *in = (const DSEdge*) (mod_base + l->fileofs);
+    for (i = 0; i < count; i++, in++, out++) {
+      out->v[0] = in->v[0];
+      out->v[1] = in->v[1];
+      out->cachededgeoffset = 0;
+    }
+  }
+
+  loadmodel->numedges = count;
+}
+
+void vkglBSP::Model::modLoadSurfedges(const Lump *l) {
+  int count;
+  const int *in;
+
+  in = (const int*) (mod_base + l->fileofs);
+  if (l->filelen % sizeof(*in)) {
+    char buff[256];
+    snprintf(buff, 255, "modLoadSurfedges: funny lump size in %s",
+        loadmodel->name);
+    throw std::runtime_error(buff);
+  }
+  count = l->filelen / sizeof(*in);
+  loadmodel->numsurfedges = count;
+
+  loadmodel->surfedges.assign(in, in + count);
+}
+
+/*
+ =================
+ Mod_LoadLighting
+ =================
+ */
+void vkglBSP::Model::modLoadLighting(const Lump *l) {
+  loadmodel->lightdata.clear();
+  if (!l->filelen) {
+    return;
+  }
+
+  // johnfitz -- lit support, without a .lit file every mono sample becomes a grey RGB one
+  const byte *in = mod_base + l->fileofs;
+  loadmodel->lightdata.resize((size_t) l->filelen * 3);
+  byte *out = loadmodel->lightdata.data();
+  for (int i = 0; i < l->filelen; i++, out += 3) {
+    out[0] = out[1] = out[2] = in[i];
+  }
+}
+
+/*
+ =================
+ Mod_LoadVisibility
+ =================
+ */
+void vkglBSP::Model::modLoadVisibility(const Lump *l) {
+  loadmodel->viswarn = false;
+  loadmodel->visdata.clear();
+  if (!l->filelen) {
+    return;
+  }
+  const byte *in = mod_base + l->fileofs;
+  loadmodel->visdata.assign(in, in + l->filelen);
+}
+
+void vkglBSP::Model::modLoadFaces(const Lump *l, bool bsp2) {
+  const DSFace *ins;
+  const DLFace *inl;
+  int i, count, surfnum, lofs;
+  int planenum, side, texinfon;
+
+  if (bsp2) {
+    ins = nullptr;
+    inl = (const DLFace*) (mod_base + l->fileofs);
+    if (l->filelen % sizeof(*inl)) {
+      char buff[256];
+      snprintf(buff, 255, "modLoadFaces: funny lump size in %s",
+          loadmodel->name);
+      throw std::runtime_error(buff);
+    }
+    count = l->filelen / sizeof(*inl);
+  } else {
+    ins = (const DSFace*) (mod_base + l->fileofs);
+    inl = nullptr;
+    if (l->filelen % sizeof(*ins)) {
+      char buff[256];
+      snprintf(buff, 255, "modLoadFaces: funny lump size in %s",
+          loadmodel->name);
+      throw std::runtime_error(buff);
+    }
+    count = l->filelen / sizeof(*ins);
+  }
+
+  //johnfitz -- warn mappers about exceeding old limits
+  if (count > 32767 && !bsp2)
+    std::cout << count << " faces exceeds standard limit of 32767" << std::endl;
+
+  loadmodel->numsurfaces = count;
+  loadmodel->surfaces.clear();
+  loadmodel->surfaces.resize(count);
+  loadmodel->surftable.clear();
+  loadmodel->surftable.reserve(count);
+
+  MTexInfo *mti = loadmodel->texinfo.data();
+
+  for (surfnum = 0; surfnum < count; surfnum++) {
+    MSurface &out = loadmodel->surfaces[surfnum];
+    const byte *styles;
+    if (bsp2) {
+      out.firstedge = inl->firstedge;
+      out.numedges = inl->numedges;
+      planenum = inl->planenum;
+      side = inl->side;
+      texinfon = inl->texinfo;
+      styles = inl->styles;
+      lofs = inl->lightofs;
+      inl++;
+    } else {
+      out.firstedge = ins->firstedge;
+      out.numedges = ins->numedges;
+      planenum = ins->planenum;
+      side = ins->side;
+      texinfon = ins->texinfo;
+      styles = ins->styles;
+      lofs = ins->lightofs;
+      ins++;
+    }
+
+    out.flags = 0;
+
+    if (side)
+      out.flags |= SURF_PLANEBACK;
+
+    if (planenum < 0 || planenum >= loadmodel->numplanes) {
+      char buff[256];
+      snprintf(buff, 255, "modLoadFaces: bad planenum %i in %s", planenum,
+          loadmodel->name);
+      throw std::runtime_error(buff);
     }
+    out.plane = loadmodel->planes.data() + planenum;
+
+    for (i = 0; i < MAXLIGHTMAPS; i++)
+      out.styles[i] = styles[i];
+
+    if (texinfon < 0 || texinfon >= loadmodel->numtexinfo) {
+      char buff[256];
+      snprintf(buff, 255, "modLoadFaces: bad texinfo %i in %s", texinfon,
+          loadmodel->name);
+      throw std::runtime_error(buff);
+    }
+    out.texinfo = mti + texinfon;
+
+    // lighting info
+    if (lofs < 0 || (size_t) lofs * 3 >= loadmodel->lightdata.size())
+      out.samples = nullptr;
+    else
+      out.samples = loadmodel->lightdata.data() + (lofs * 3); //johnfitz -- lit support via lordhavoc (was "+ i")
+
+    //johnfitz -- this section rewritten
+
+    // Sky, fence and missing textures are drawn like any other lit surface,
+    // only the warps are cut up for the turbulence
+    if (out.texinfo->texture->name[0] == '*') { // warp surface
+      out.flags |= (SURF_DRAWTURB | SURF_DRAWTILED);
+
+      // detect special liquid types
+      if (!strncmp(out.texinfo->texture->name, "*lava", 5))
+        out.flags |= SURF_DRAWLAVA;
+      else if (!strncmp(out.texinfo->texture->name, "*slime", 6))
+        out.flags |= SURF_DRAWSLIME;
+      else if (!strncmp(out.texinfo->texture->name, "*tele", 5))
+        out.flags |= SURF_DRAWTELE;
+      else
+        out.flags |= SURF_DRAWWATER;
+    }
+    // Surfaces keep their face index, marksurfaces, nodes and submodels refer to them by it
+    if (!strncmp(out.texinfo->texture->name, "trigger", 7)) {
+      out.flags |= SURF_TRIGGER;
+    }
+    out.polys = -1;
+
+    SurfaceTable &table = loadmodel->surftable;
+    table.planenum.push_back(planenum);
+    table.texinfo.push_back(texinfon);
+    table.flags.push_back(out.flags);
+  }
+
+  modPolysForUnlitSurfaces();
+  for (surfnum = 0; surfnum < count; surfnum++) {
+    calcSurfaceExtents(surfnum);
   }
 
+  // The warp polys go after the surface ranges in the vertex pool
+  for (surfnum = 0; surfnum < count; surfnum++) {
+    if (loadmodel->surftable.flags[surfnum] & SURF_DRAWTURB) {
+      glSubdivideSurface(&loadmodel->surfaces[surfnum]);
+    }
+  }
+}
+
+/*
+ ================
+ CalcSurfaceExtents
+
+ Fills in s->texturemins[] and s->extents[]
+ ================
+ */
+void vkglBSP::Model::calcSurfaceExtents(int surfnum) {
+  MSurface *s = &loadmodel->surfaces[surfnum];
+  const MTexInfo *tex = s->texinfo;
+  const glm::vec4 *verts = loadmodel->polyverts.data()
+      + loadmodel->surftable.firstvert[surfnum];
+  const int numverts = loadmodel->surftable.numverts[surfnum];
+  double mins[2] = { 999999, 999999 };
+  double maxs[2] = { -99999, -99999 };
+
+  for (int i = 0; i < numverts; i++) {
+    // The texinfo vectors are still in Quake space
+    const double v[3] = { verts[i].x, -verts[i].z, -verts[i].y };
+    for (int j = 0; j < 2; j++) {
+      /* The following calculation is sensitive to floating-point
+       * precision.  It needs to produce the same result that the
+       * light compiler does, because R_BuildLightMap uses surf->
+       * extents to know the width/height of a surface's lightmap,
+       * and incorrect rounding here manifests itself as patches
+       * of "corrupted" looking lightmaps.
+       * Most light compilers are win32 executables, so they use
+       * x87 floating point.  This means the multiplies and adds
+       * are done at 80-bit precision, and the result is rounded
+       * down to 32-bits and stored in val.
+       * Adding the casts to double seems to be good enough to fix
+       * lighting glitches when Quakespasm is compiled as x86_64
+       * and using SSE2 floating-point.  A potential trouble spot
+       * is the hallway at the beginning of mfxsp17.  -- ericw
+       */
+      const float val = (float) (v[0] * (double) tex->vecs[j][0]
+          + v[1] * (double) tex->vecs[j][1] + v[2] * (double) tex->vecs[j][2]
+          + (double) tex->vecs[j][3]);
+
+      if (val < mins[j])
+        mins[j] = val;
+      if (val > maxs[j])
+        maxs[j] = val;
+    }
+  }
+
+  for (int i = 0; i < 2; i++) {
+    const int bmin = (int) floor(mins[i] / 16);
+    const int bmax = (int) ceil(maxs[i] / 16);
+
+    s->texturemins[i] = bmin * 16;
+    s->extents[i] = (bmax - bmin) * 16;
+
+    //johnfitz -- was 512 in glquake, 256 in winquake
+    if (!(tex->flags & TEX_SPECIAL) && s->extents[i] > 2000) {
+      char buff[256];
+      snprintf(buff, 255, "calcSurfaceExtents: bad surface extents %i in %s",
+          s->extents[i], loadmodel->name);
+      throw std::runtime_error(buff);
+    }
+  }
 }
 
-void vkglBSP::Model::boundPoly(int numverts, std::vector<glm::vec3> &verts,
+void vkglBSP::Model::boundPoly(int numverts, const glm::vec3 *verts,
     glm::vec3 & mins, glm::vec3 &maxs) {
   int i, j;
-  float *v;
 
   mins[0] = mins[1] = mins[2] = FLT_MAX;
   maxs[0] = maxs[1] = maxs[2] = -FLT_MAX;
-  v = &verts[0].x;
   for (i = 0; i < numverts; i++)
-    for (j = 0; j < 3; j++, v++) {
-      if (*v < mins[j])
-        mins[j] = *v;
-      if (*v > maxs[j])
-        maxs[j] = *v;
+    for (j = 0; j < 3; j++) {
+      if (verts[i][j] < mins[j])
+        mins[j] = verts[i][j];
+      if (verts[i][j] > maxs[j])
+        maxs[j] = verts[i][j];
     }
 }
 
-void vkglBSP::Model::subdividePolygon(int numverts,
-    std::vector<glm::vec3> &verts) {
-  int i, j, k;
+void vkglBSP::Model::subdividePolygon(int numverts, glm::vec3 *verts) {
+  int i, j;
   glm::vec3 mins, maxs;
   float m;
-  float *v;
-  std::vector<glm::vec3> front, back;
+  glm::vec3 front[64], back[64];
   int f, b;
-  std::vector<glm::vec3> dist;
+  float dist[64];
   float frac;
-  GlPoly *poly;
-  float s, t;
 
   if (numverts > 60) {
-    snprintf(errorBuff, 255, "numverts = %i", numverts);
-    throw std::runtime_error(errorBuff);
+    char buff[256];
+    snprintf(buff, 255, "subdividePolygon: numverts = %i in %s", numverts,
+        loadmodel->name);
+    throw std::runtime_error(buff);
   }
-  dist.resize(numverts);
-  front.resize(64);
-  back.resize(64);
-
-
-
 
   boundPoly(numverts, verts, mins, maxs);
 
@@ -2474,128 +3968,165 @@ void vkglBSP::Model::subdividePolygon(int numverts,
       continue;
 
     // cut it
-    v = &verts[i].x;
-
-    float * dist2 = &dist[0].x;
-
-    for (j = 0; j < numverts; j++, v+= 3)
-      dist2[j] = *v - m;
+    for (j = 0; j < numverts; j++)
+      dist[j] = verts[j][i] - m;
 
     // wrap cases
-    dist2[j] = dist2[0];
-
-    verts.at(i) = glm::vec3(*(v+1), *(v+2), *(v+3));
+    dist[j] = dist[0];
+    verts[numverts] = verts[0];
 
     f = b = 0;
-
-    std::cout << "2 " << std::endl;
-
-    for (j = 0; j < numverts; j++, v+= 3) {
-      if (dist2[j] >= 0) {
-        front[f] =  glm::vec3(*(v+1), *(v+2), *(v+3));
+    for (j = 0; j < numverts; j++) {
+      if (dist[j] >= 0) {
+        front[f] = verts[j];
         f++;
       }
-      if (dist2[j] <= 0) {
-        back[b] =  glm::vec3(*(v+1), *(v+2), *(v+3));
+      if (dist[j] <= 0) {
+        back[b] = verts[j];
         b++;
       }
-      if (dist2[j] == 0 || dist2[j + 1] == 0)
+      if (dist[j] == 0 || dist[j + 1] == 0)
         continue;
-      if ((dist2[j] > 0) != (dist2[j + 1] > 0)) {
+      if ((dist[j] > 0) != (dist[j + 1] > 0)) {
         // clip point
-        frac = dist2[j] / (dist2[j] - dist2[j + 1]);
-
-        front[f].x = back[b].x = v[0] + frac * (v[3 + 0] - v[0]);
-        front[f].y = back[b].y = v[1] + frac * (v[3 + 1] - v[1]);
-        front[f].z = back[b].z = v[2] + frac * (v[3 + 2] - v[2]);
-
+        frac = dist[j] / (dist[j] - dist[j + 1]);
+        front[f] = back[b] = verts[j] + frac * (verts[j + 1] - verts[j]);
         f++;
         b++;
       }
     }
-    std::cout << "3 " << std::endl;
+
     subdividePolygon(f, front);
     subdividePolygon(b, back);
     return;
   }
 
-  std::cout << "4 " << std::endl;
-
-  GlPoly poly2;
-  poly2.next = warpface->polys.next;
-  poly2.numverts = numverts;
-
+  // The pools own the new polygon, it is linked in by index so growing them never leaves dangling links
+  GlPoly poly;
+  poly.next = warpface->polys;
+  poly.numverts = numverts;
+  poly.firstvert = (int) loadmodel->polyverts.size();
 
   for (i = 0; i < numverts; i++) {
-    std::cout << verts.size() << " - vert index = " << i << " out of " << numverts << std::endl;
-
-    poly2.verts.push_back(glm::vec4(verts[i].x, verts[i].y, verts[i].z, 0));
-    s = DotProduct(verts[i], warpface->texinfo->vecs[0]);
-    t = DotProduct(verts[i], warpface->texinfo->vecs[1]);
-//    poly2.verts[i][3] = s;
-//    poly2.verts[i][4] = t;
+    loadmodel->polyverts.push_back(glm::vec4(verts[i], 0.0f));
   }
-  std::cout << "5 " << std::endl;
-  warpface->polys.next = &poly2;
-  std::cout << "6 " << std::endl;
-  polygons.push_back(poly2);
+
+  warpface->polys = (int) loadmodel->polys.size();
+  loadmodel->polys.push_back(poly);
 }
 
+/*
+ ================
+ GL_SubdivideSurface
+
+ Breaks a polygon up along axial 128 unit boundaries so that turbulent and
+ sky warps can be done reasonably.
+ ================
+ */
 void vkglBSP::Model::glSubdivideSurface(MSurface *fa) {
-  std::vector<glm::vec3> verts;
-  int i;
+  glm::vec3 verts[64];
+  const int surfnum = (int) (fa - loadmodel->surfaces.data());
+  const int firstvert = loadmodel->surftable.firstvert[surfnum];
+  const int numverts = loadmodel->surftable.numverts[surfnum];
+
+  if (numverts > 60) {
+    char buff[256];
+    snprintf(buff, 255, "glSubdivideSurface: numverts = %i in %s", numverts,
+        loadmodel->name);
+    throw std::runtime_error(buff);
+  }
 
   warpface = fa;
 
-  //the first poly in the chain is the undivided poly for newwater rendering.
-  //grab the verts from that.
-  for (i = 0; i < fa->polys.numverts; i++)
-    verts.push_back(fa->polys.verts[i]);
+  for (int i = 0; i < numverts; i++)
+    verts[i] = glm::vec3(loadmodel->polyverts[firstvert + i]);
 
-  subdividePolygon(fa->polys.numverts, verts);
+  subdividePolygon(numverts, verts);
 }
 
-void vkglBSP::Model::modPolyForUnlitSurface(MSurface *fa) {
-  int numverts, i, lindex;
-
-  float texscale;
+/*
+ ================
+ Mod_PolyForUnlitSurface
 
-//  if (fa->flags & (SURF_DRAWTURB | SURF_DRAWSKY))
-//    texscale = (1.0/128.0); //warp animation repeats every 128
-//  else
-  texscale = (1.0 / 32.0); //to match r_notexture_mip
+ Converts the edges of a face back into a polygon, out must have room for
+ fa->numedges vertices
+ ================
+ */
+void vkglBSP::Model::modPolyForUnlitSurface(MSurface *fa, glm::vec4 *out) {
+  const int *surfedges = loadmodel->surfedges.data();
+  const MEdge *pedges = loadmodel->medges.data();
+  const MVertex *vertexes = loadmodel->vertexes.data();
+  const int numedges = (int) loadmodel->medges.size();
+  const unsigned int numvertexes = (unsigned int) loadmodel->vertexes.size();
+
+  char buff[256];
+
+  if (fa->firstedge < 0 || fa->numedges < 0
+      || fa->firstedge + fa->numedges > (int) loadmodel->surfedges.size()) {
+    snprintf(buff, 255, "modPolyForUnlitSurface: bad surfedges in %s",
+        loadmodel->name);
+    throw std::runtime_error(buff);
+  }
 
   // convert edges back to a normal polygon
-  numverts = 0;
-
-  std::vector<MEdge> pedges = loadmodel->medges;
-
-  for (i = 0; i < fa->numedges; i++) {
-    glm::vec4 vec;
-
-    lindex = loadmodel->surfedges.at(fa->firstedge + i);
-    if (lindex > 0) {
-      MEdge idx = pedges.at(lindex);
-      vec = loadmodel->vertexes.at(idx.v[1]).position;
+  for (int i = 0; i < fa->numedges; i++) {
+    int lindex = surfedges[fa->firstedge + i];
+    unsigned int vertex;
+
+    if (lindex > 0 && lindex < numedges) {
+      vertex = pedges[lindex].v[1];
+    } else if (lindex <= 0 && lindex > -numedges) {
+      vertex = pedges[-lindex].v[0];
     } else {
-      MEdge idx = pedges.at(-lindex);
-      vec = loadmodel->vertexes.at(idx.v[0]).position;
+      snprintf(buff, 255, "modPolyForUnlitSurface: bad edge %i in %s",
+          lindex, loadmodel->name);
+      throw std::runtime_error(buff);
+    }
+
+    if (vertex >= numvertexes) {
+      snprintf(buff, 255, "modPolyForUnlitSurface: bad vertex %u in %s",
+          vertex, loadmodel->name);
+      throw std::runtime_error(buff);
     }
+    out[i] = vertexes[vertex].position;
+  }
+}
 
-    fa->polys.verts.push_back(vec);
-    numverts++;
+/*
+ Builds the polygons of all surfaces in a single pass. The vertex arena is
+ sized from the edge counts up front, so it is allocated exactly once.
+ */
+void vkglBSP::Model::modPolysForUnlitSurfaces() {
+  size_t numverts = 0;
+  for (const auto &surf : loadmodel->surfaces) {
+    numverts += surf.numedges;
   }
-  fa->polys.numverts = numverts;
 
+  loadmodel->polyverts.clear();
+  loadmodel->polyverts.resize(numverts);
+  loadmodel->polys.clear();
+
+  SurfaceTable &table = loadmodel->surftable;
+  table.firstvert.resize(loadmodel->surfaces.size());
+  table.numverts.resize(loadmodel->surfaces.size());
+
+  int firstvert = 0;
+  for (size_t i = 0; i < loadmodel->surfaces.size(); i++) {
+    MSurface &surf = loadmodel->surfaces[i];
+    table.firstvert[i] = firstvert;
+    table.numverts[i] = surf.numedges;
+    modPolyForUnlitSurface(&surf, loadmodel->polyverts.data() + firstvert);
+    firstvert += surf.numedges;
+  }
 }
 
-void vkglBSP::Model::modLoadTextures(Lump *l) {
+void vkglBSP::Model::modLoadTextures(const Lump *l) {
   int i, j, pixels, num, maxanim, altmax;
-  MipTex *mt;
+  const MipTex *mt;
   QTexture tx2;
   QTexture *anims[10];
   QTexture *altanims[10];
-  DMipTexLump *m;
+  const DMipTexLump *m;
 //johnfitz -- more variables
   char texturename[64];
   int nummiptex;
@@ -2611,24 +4142,28 @@ void vkglBSP::Model::modLoadTextures(Lump *l) {
     std::cout << "modLoadTextures: no textures in bsp file" << std::endl;
     nummiptex = 0;
   } else {
-    m = (DMipTexLump*) (mod_base + l->fileofs);
+    m = (const DMipTexLump*) (mod_base + l->fileofs);
     nummiptex = m->nummiptex;
   }
   //johnfitz
 
   loadmodel->numtextures = nummiptex + 2; //johnfitz -- need 2 dummy texture chains for missing textures
 
+  // Sized once so texinfo can point into it, slots keep the miptex index of the lump
+  loadmodel->textures.assign(loadmodel->numtextures, QTexture());
+
   for (i = 0; i < nummiptex; i++) {
-    QTexture tx;
+    QTexture &tx = loadmodel->textures[i];
 
     if (m->dataofs[i] == -1)
       continue;
 
-    mt = (MipTex*) ((byte*) m + m->dataofs[i]);
+    mt = (const MipTex*) ((const byte*) m + m->dataofs[i]);
 
     if ((mt->width & 15) || (mt->height & 15)) {
-      snprintf(errorBuff, 255, "Texture %s is not 16 aligned", mt->name);
-      throw std::runtime_error(errorBuff);
+      char buff[256];
+      snprintf(buff, 255, "Texture %s is not 16 aligned", mt->name);
+      throw std::runtime_error(buff);
     }
 
     pixels = mt->width * mt->height / 64 * 85;
@@ -2636,21 +4171,28 @@ void vkglBSP::Model::modLoadTextures(Lump *l) {
     memcpy(tx.name, mt->name, sizeof(tx.name));
     tx.width = mt->width;
     tx.height = mt->height;
-    std::cout << "Loading texture.." << tx.name << std::endl;
 
+    // The pixels stay in the file mapping, texDecodeTextures reads them from there
     for (j = 0; j < MIPLEVELS; j++)
-      tx.offsets[j] = mt->offsets[j] + sizeof(QTexture) - sizeof(MipTex);
-    // the pixels immediately follow the structures
+      tx.offsets[j] = (unsigned) ((const byte*) mt - mod_base) + mt->offsets[j];
 
     // ericw -- check for pixels extending past the end of the lump.
     // appears in the wild; e.g. jam2_tronyn.bsp (func_mapjam2),
     // kellbase1.bsp (quoth), and can lead to a segfault if we read past
     // the end of the .bsp file buffer
-    if (((byte*) (mt + 1) + pixels) > (mod_base + l->fileofs + l->filelen)) {
+    if (((const byte*) (mt + 1) + pixels) > (mod_base + l->fileofs + l->filelen)) {
       std::cout << "Texture " << mt->name << " extends past end of lump"
           << std::endl;
       pixels = q_max(0,
-          (mod_base + l->fileofs + l->filelen) - (byte* ) (mt + 1));
+          (mod_base + l->fileofs + l->filelen) - (const byte*) (mt + 1));
+    }
+    for (j = 0; j < MIPLEVELS; j++) {
+      const size_t size = (size_t) (tx.width >> j) * (tx.height >> j);
+      if (mt->offsets[j] < sizeof(MipTex) || tx.offsets[j] + size
+          > (size_t) (l->fileofs + l->filelen)) {
+        memset(tx.offsets, 0, sizeof(tx.offsets));
+        break;
+      }
     }
 
 //    QTexture * qt = &tx;
@@ -2704,7 +4246,7 @@ void vkglBSP::Model::modLoadTextures(Lump *l) {
 //      else //regular texture
 //      {
 //        // ericw -- fence textures
-    int extraflags;
+    int extraflags = 0;
 //
 //        extraflags = 0;
     if (tx.name[0] == '{')
@@ -2764,13 +4306,11 @@ void vkglBSP::Model::modLoadTextures(Lump *l) {
 //      }
 //    }
     //johnfitz
-
-    loadmodel->textures.push_back(tx);
   }
 
   //johnfitz -- last 2 slots in array should be filled with dummy textures
-//  loadmodel->textures[loadmodel->numtextures-2] = r_notexture_mip; //for lightmapped surfs
-//  loadmodel->textures[loadmodel->numtextures-1] = r_notexture_mip2; //for SURF_DRAWTILED surfs
+  strcpy(loadmodel->textures[loadmodel->numtextures - 2].name, "notexture"); //for lightmapped surfs
+  strcpy(loadmodel->textures[loadmodel->numtextures - 1].name, "notexture2"); //for SURF_DRAWTILED surfs
 //
 ////
 //// sequence the animations
@@ -2864,28 +4404,28 @@ void vkglBSP::Model::modLoadTextures(Lump *l) {
 //        tx2->alternate_anims = anims[0];
 //    }
 //  }
-
-  std::cout << "Done loading textures " << std::endl;
 }
 
-void vkglBSP::Model::modLoadTexInfo(Lump *l) {
-  TexInfo *in;
+void vkglBSP::Model::modLoadTexInfo(const Lump *l) {
+  const TexInfo *in;
   int i, j, count, miptex;
   int missing = 0; //johnfitz
 
-  in = (TexInfo*) (mod_base + l->fileofs);
+  in = (const TexInfo*) (mod_base + l->fileofs);
   if (l->filelen % sizeof(*in)) {
-    snprintf(errorBuff, 255, "MOD_LoadBmodel: funny lump size in %s",
+    char buff[256];
+    snprintf(buff, 255, "MOD_LoadBmodel: funny lump size in %s",
         loadmodel->name);
-    throw std::runtime_error(errorBuff);
+    throw std::runtime_error(buff);
   }
 
   count = l->filelen / sizeof(*in);
 
   loadmodel->numtexinfo = count;
+  loadmodel->texinfo.resize(count);
 
   for (i = 0; i < count; i++, in++) {
-    MTexInfo out;
+    MTexInfo &out = loadmodel->texinfo[i];
     for (j = 0; j < 4; j++) {
       out.vecs[0][j] = (in->vecs[0][j]);
       out.vecs[1][j] = (in->vecs[1][j]);
@@ -2895,22 +4435,18 @@ void vkglBSP::Model::modLoadTexInfo(Lump *l) {
     out.flags = (in->flags);
 
     //johnfitz -- rewrote this section
-    if (miptex >= loadmodel->numtextures - 1) {
+    if (miptex < 0 || miptex >= loadmodel->numtextures - 2
+        || !loadmodel->textures[miptex].name[0]) {
       if (out.flags & TEX_SPECIAL)
-        out.texture = loadmodel->textures[loadmodel->numtextures - 1];
+        out.texture = &loadmodel->textures[loadmodel->numtextures - 1];
       else
-        out.texture = loadmodel->textures[loadmodel->numtextures - 2];
+        out.texture = &loadmodel->textures[loadmodel->numtextures - 2];
       out.flags |= TEX_MISSING;
       missing++;
     } else {
-      out.texture = loadmodel->textures[miptex];
+      out.texture = &loadmodel->textures[miptex];
     }
     //johnfitz
-
-    std::cout << "MTextInfo = " << out.vecs[0][2] << std::endl;
-
-    loadmodel->texinfo.push_back(out);
-
   }
 
   //johnfitz: report missing textures
@@ -2922,3 +4458,3228 @@ void vkglBSP::Model::modLoadTexInfo(Lump *l) {
   //johnfitz
 }
 
+
+static inline uint64_t comRotl64(uint64_t x, int r) {
+  return (x << r) | (x >> (64 - r));
+}
+
+static inline uint64_t comHashRound(uint64_t acc, uint64_t word) {
+  acc += word * 0xC2B2AE3D27D4EB4Full;
+  return comRotl64(acc, 31) * 0x9E3779B185EBCA87ull;
+}
+
+/*
+ 64 bit hash that keys and checksums the .bspc caches. Four independent lanes
+ of multiply-rotate rounds, as in xxHash64, keep it close to memory speed so
+ validating a cache costs far less than parsing the map again.
+ */
+uint64_t vkglBSP::Model::comBlockHash(const byte *data, size_t size) {
+  const uint64_t p1 = 0x9E3779B185EBCA87ull, p2 = 0xC2B2AE3D27D4EB4Full;
+  uint64_t lanes[4] = { p1 + p2, p2, 0, 0 - p1 };
+  size_t i = 0;
+
+  for (; i + 32 <= size; i += 32) {
+    uint64_t words[4];
+    memcpy(words, data + i, sizeof(words));
+    for (int k = 0; k < 4; k++)
+      lanes[k] = comHashRound(lanes[k], words[k]);
+  }
+
+  uint64_t hash = comRotl64(lanes[0], 1) + comRotl64(lanes[1], 7)
+      + comRotl64(lanes[2], 12) + comRotl64(lanes[3], 18);
+  hash += size;
+  for (; i + 8 <= size; i += 8) {
+    uint64_t word;
+    memcpy(&word, data + i, sizeof(word));
+    hash = comRotl64(hash ^ comHashRound(0, word), 27) * p1;
+  }
+  for (; i < size; i++)
+    hash = comRotl64(hash ^ (data[i] * p2), 11) * p1;
+
+  hash ^= hash >> 33;
+  hash *= p2;
+  hash ^= hash >> 29;
+  hash *= 0x165667B19E3779F9ull;
+  hash ^= hash >> 32;
+  return hash;
+}
+
+void vkglBSP::Model::modCachePath(const char *name, const char *extension,
+    char *out, size_t outsize) {
+  char base[MAX_QPATH];
+  comStripExtension(name, base, sizeof(base));
+  snprintf(out, outsize, "%s/%s.%s", cacheDir.c_str(), base, extension);
+}
+
+/*
+ Bounds checked access to the sections of a mapped .bspc
+ */
+struct BspcView {
+  const byte *base;
+  size_t size;
+
+  const vkglBSP::BspcHeader* header() const {
+    return (const vkglBSP::BspcHeader*) base;
+  }
+
+  template<typename T>
+  bool get(int section, const T *&data, int &count) const {
+    const vkglBSP::Lump &l = header()->sections[section];
+    if (l.fileofs < (int) sizeof(vkglBSP::BspcHeader) || l.filelen < 0
+        || (size_t) l.fileofs + (size_t) l.filelen > size
+        || l.fileofs % BSPC_ALIGN || l.filelen % sizeof(T)) {
+      return false;
+    }
+    data = (const T*) (base + l.fileofs);
+    count = l.filelen / (int) sizeof(T);
+    return true;
+  }
+};
+
+template<typename T>
+static bool modCheckRange(const T *data, int count, int limit) {
+  for (int i = 0; i < count; i++) {
+    if (data[i] < 0 || data[i] >= limit)
+      return false;
+  }
+  return true;
+}
+
+/*
+ Everything is validated before the first write to mod, a rejected cache
+ leaves the model untouched for the BSP loader
+ */
+static bool modReadCache(vkglBSP::QModel *mod,
+    const BspcView &view, uint64_t sourcehash, size_t sourcelen) {
+  using namespace vkglBSP;
+
+  if (view.size < sizeof(BspcHeader))
+    return false;
+  const BspcHeader *header = view.header();
+  if (header->ident != BSPC_IDENT || header->version != BSPC_VERSION
+      || header->sourcehash != sourcehash
+      || header->sourcelen != (unsigned int) sourcelen)
+    return false;
+  if (Model::comBlockHash(view.base + sizeof(BspcHeader),
+      view.size - sizeof(BspcHeader)) != header->datahash)
+    return false;
+
+  const glm::vec4 *polyverts;
+  const uint32_t *polyindexes;
+  const GlPoly *polys;
+  const int *firstvert, *numverts, *planenum, *texinfonum, *flags;
+  const BspcSurface *surfaces;
+  const MPlane *planes;
+  const BspcNode *nodes;
+  const BspcLeaf *leafs;
+  const int *marksurfaces;
+  const MClipNode *clipnodes;
+  const DModel *submodels;
+  const BspcTexture *textures;
+  const BspcTexInfo *texinfo;
+  const byte *visdata, *lightdata;
+  int numpolyverts, numpolyindexes, numpolys, numfirstvert, numnumverts,
+      numplanenum, numtexinfonum, numflags, numsurfaces, numplanes, numnodes,
+      numleafs, nummarksurfaces, numclipnodes, numsubmodels, numtextures,
+      numtexinfo, numvisdata, numlightdata;
+
+  if (!view.get(BSPC_POLYVERTS, polyverts, numpolyverts)
+      || !view.get(BSPC_POLYINDEXES, polyindexes, numpolyindexes)
+      || !view.get(BSPC_POLYS, polys, numpolys)
+      || !view.get(BSPC_SURF_FIRSTVERT, firstvert, numfirstvert)
+      || !view.get(BSPC_SURF_NUMVERTS, numverts, numnumverts)
+      || !view.get(BSPC_SURF_PLANENUM, planenum, numplanenum)
+      || !view.get(BSPC_SURF_TEXINFO, texinfonum, numtexinfonum)
+      || !view.get(BSPC_SURF_FLAGS, flags, numflags)
+      || !view.get(BSPC_SURFACES, surfaces, numsurfaces)
+      || !view.get(BSPC_PLANES, planes, numplanes)
+      || !view.get(BSPC_NODES, nodes, numnodes)
+      || !view.get(BSPC_LEAFS, leafs, numleafs)
+      || !view.get(BSPC_MARKSURFACES, marksurfaces, nummarksurfaces)
+      || !view.get(BSPC_CLIPNODES, clipnodes, numclipnodes)
+      || !view.get(BSPC_SUBMODELS, submodels, numsubmodels)
+      || !view.get(BSPC_TEXTURES, textures, numtextures)
+      || !view.get(BSPC_TEXINFO, texinfo, numtexinfo)
+      || !view.get(BSPC_VISIBILITY, visdata, numvisdata)
+      || !view.get(BSPC_LIGHTING, lightdata, numlightdata))
+    return false;
+
+  // Every index that becomes a pointer or addresses another array
+  if (numfirstvert != numsurfaces || numnumverts != numsurfaces
+      || numplanenum != numsurfaces || numtexinfonum != numsurfaces
+      || numflags != numsurfaces || numsubmodels < 1 || numtextures < 2
+      || numleafs < 1)
+    return false;
+  for (int i = 0; i < numsurfaces; i++) {
+    if (firstvert[i] < 0 || numverts[i] < 0
+        || firstvert[i] + numverts[i] > numpolyverts)
+      return false;
+    if (surfaces[i].lightofs < -1 || surfaces[i].lightofs >= numlightdata
+        || surfaces[i].polys < -1 || surfaces[i].polys >= numpolys)
+      return false;
+  }
+  if (!modCheckRange(planenum, numsurfaces, numplanes)
+      || !modCheckRange(texinfonum, numsurfaces, numtexinfo)
+      || !modCheckRange(marksurfaces, nummarksurfaces, numsurfaces))
+    return false;
+  for (int i = 0; i < numpolys; i++) {
+    if (polys[i].next < -1 || polys[i].next >= numpolys
+        || polys[i].firstvert < 0 || polys[i].numverts < 0
+        || polys[i].firstvert + polys[i].numverts > numpolyverts)
+      return false;
+  }
+  for (int i = 0; i < numnodes; i++) {
+    if (nodes[i].planenum < 0 || nodes[i].planenum >= numplanes)
+      return false;
+    for (int j = 0; j < 2; j++) {
+      const int p = nodes[i].children[j];
+      if (p >= numnodes || -1 - p >= numleafs)
+        return false;
+    }
+  }
+  for (int i = 0; i < numleafs; i++) {
+    if (leafs[i].visofs < -1 || leafs[i].visofs >= numvisdata
+        || leafs[i].firstmarksurface < 0 || leafs[i].nummarksurfaces < 0
+        || leafs[i].firstmarksurface + leafs[i].nummarksurfaces
+            > nummarksurfaces)
+      return false;
+  }
+  // Clipnode children and hull 1-3 head nodes are clipnodes or contents
+  for (int i = 0; i < numclipnodes; i++) {
+    if (clipnodes[i].planenum < 0 || clipnodes[i].planenum >= numplanes)
+      return false;
+    for (int j = 0; j < 2; j++) {
+      const int child = clipnodes[i].children[j];
+      if (child >= numclipnodes || child < CONTENTS_CURRENT_DOWN)
+        return false;
+    }
+  }
+  for (int i = 0; i < numsubmodels; i++) {
+    if (submodels[i].firstface < 0 || submodels[i].numfaces < 0
+        || submodels[i].firstface + submodels[i].numfaces > numsurfaces)
+      return false;
+    // hull 0 is made from the nodes by Mod_MakeHull0
+    if (submodels[i].headnode[0] < 0 || submodels[i].headnode[0] >= numnodes)
+      return false;
+    for (int h = 1; h < MAX_MAP_HULLS; h++) {
+      const int headnode = submodels[i].headnode[h];
+      if (headnode >= numclipnodes || headnode < CONTENTS_CURRENT_DOWN)
+        return false;
+    }
+  }
+  for (int i = 0; i < numtexinfo; i++) {
+    if (texinfo[i].texture < 0 || texinfo[i].texture >= numtextures)
+      return false;
+  }
+  // Miptex pixels are read from the source file
+  for (int i = 0; i < numtextures; i++) {
+    const BspcTexture &texture = textures[i];
+    for (int j = 0; j < MIPLEVELS && texture.offsets[0]; j++) {
+      if ((size_t) texture.offsets[j] + (size_t) (texture.width >> j)
+          * (texture.height >> j) > sourcelen)
+        return false;
+    }
+  }
+
+  // Flat arrays are copied as they are. The QModel owns its arrays and
+  // outlives the mapping, so they are not pointed into it
+  mod->bspversion = header->bspversion;
+  mod->polyverts.assign(polyverts, polyverts + numpolyverts);
+  mod->polyindexes.assign(polyindexes, polyindexes + numpolyindexes);
+  mod->polys.assign(polys, polys + numpolys);
+  mod->surftable.firstvert.assign(firstvert, firstvert + numsurfaces);
+  mod->surftable.numverts.assign(numverts, numverts + numsurfaces);
+  mod->surftable.planenum.assign(planenum, planenum + numsurfaces);
+  mod->surftable.texinfo.assign(texinfonum, texinfonum + numsurfaces);
+  mod->surftable.flags.assign(flags, flags + numsurfaces);
+  mod->planes.assign(planes, planes + numplanes);
+  mod->numplanes = numplanes;
+  mod->marksurfaces.assign(marksurfaces, marksurfaces + nummarksurfaces);
+  mod->nummarksurfaces = nummarksurfaces;
+  mod->clipnodes.assign(clipnodes, clipnodes + numclipnodes);
+  mod->numclipnodes = numclipnodes;
+  mod->submodels.assign(submodels, submodels + numsubmodels);
+  mod->numsubmodels = numsubmodels;
+  mod->visdata.assign(visdata, visdata + numvisdata);
+  mod->lightdata.assign(lightdata, lightdata + numlightdata);
+  mod->viswarn = false;
+
+  // Records holding pointers are rebuilt from their indices
+  mod->textures.assign(numtextures, QTexture());
+  mod->numtextures = numtextures;
+  for (int i = 0; i < numtextures; i++) {
+    QTexture &out = mod->textures[i];
+    memcpy(out.name, textures[i].name, sizeof(out.name));
+    out.width = textures[i].width;
+    out.height = textures[i].height;
+    memcpy(out.offsets, textures[i].offsets, sizeof(out.offsets));
+  }
+
+  mod->texinfo.assign(numtexinfo, MTexInfo());
+  mod->numtexinfo = numtexinfo;
+  for (int i = 0; i < numtexinfo; i++) {
+    MTexInfo &out = mod->texinfo[i];
+    memcpy(out.vecs, texinfo[i].vecs, sizeof(out.vecs));
+    out.texture = &mod->textures[texinfo[i].texture];
+    out.flags = texinfo[i].flags;
+  }
+
+  mod->surfaces.assign(numsurfaces, MSurface());
+  mod->numsurfaces = numsurfaces;
+  for (int i = 0; i < numsurfaces; i++) {
+    MSurface &out = mod->surfaces[i];
+    const BspcSurface &in = surfaces[i];
+    out.plane = &mod->planes[planenum[i]];
+    out.flags = flags[i];
+    out.firstedge = in.firstedge;
+    out.numedges = in.numedges;
+    out.texturemins[0] = in.texturemins[0];
+    out.texturemins[1] = in.texturemins[1];
+    out.extents[0] = in.extents[0];
+    out.extents[1] = in.extents[1];
+    out.light_s = in.light_s;
+    out.light_t = in.light_t;
+    out.polys = in.polys;
+    out.texinfo = &mod->texinfo[texinfonum[i]];
+    memcpy(out.styles, in.styles, sizeof(out.styles));
+    out.samples = in.lightofs < 0 ? nullptr : mod->lightdata.data() + in.lightofs;
+  }
+
+  mod->leafs.assign(numleafs, MLeaf());
+  for (int i = 0; i < numleafs; i++) {
+    MLeaf &out = mod->leafs[i];
+    const BspcLeaf &in = leafs[i];
+    out.contents = in.contents;
+    memcpy(out.minmaxs, in.minmaxs, sizeof(out.minmaxs));
+    out.compressed_vis = in.visofs < 0 ? nullptr : mod->visdata.data() + in.visofs;
+    out.firstmarksurface = mod->marksurfaces.data() + in.firstmarksurface;
+    out.nummarksurfaces = in.nummarksurfaces;
+    memcpy(out.ambient_sound_level, in.ambient_level,
+        sizeof(out.ambient_sound_level));
+  }
+
+  mod->nodes.assign(numnodes, MNode());
+  mod->numnodes = numnodes;
+  for (int i = 0; i < numnodes; i++) {
+    MNode &out = mod->nodes[i];
+    const BspcNode &in = nodes[i];
+    memcpy(out.minmaxs, in.minmaxs, sizeof(out.minmaxs));
+    out.plane = &mod->planes[in.planenum];
+    out.firstsurface = in.firstsurface;
+    out.numsurfaces = in.numsurfaces;
+    for (int j = 0; j < 2; j++) {
+      const int p = in.children[j];
+      out.children[j] = p >= 0 ? &mod->nodes[p]
+          : (MNode*) &mod->leafs[-1 - p];
+    }
+  }
+
+  return true;
+}
+
+/*
+ =================
+ Mod_LoadCache
+ =================
+ */
+bool vkglBSP::Model::modLoadCache(QModel *mod, const char *path,
+    uint64_t sourcehash, size_t sourcelen) {
+  BspcView view;
+  view.base = sysMapFile(path, &view.size);
+  if (view.base == nullptr) {
+    return false;
+  }
+
+  const bool loaded = modReadCache(mod, view, sourcehash, sourcelen);
+  sysUnmapFile(view.base, view.size);
+  if (!loaded) {
+    std::cout << "modLoadCache: " << path << " is stale, rebuilding" << std::endl;
+    return false;
+  }
+
+  if (mod->numnodes > 0)
+    modSetParent(mod->nodes.data(), nullptr);
+  modInitClipHulls(mod);
+  modMakeHull0(mod);
+  modSetupWorld(mod);
+  modPrepareSIMDData(mod);
+  modBuildLightmaps(mod);
+  return true;
+}
+
+template<typename T>
+static void modCacheSection(std::vector<byte> &file, int section,
+    const T *data, size_t count) {
+  while (file.size() % BSPC_ALIGN) {
+    file.push_back(0);
+  }
+  vkglBSP::BspcHeader *header = (vkglBSP::BspcHeader*) file.data();
+  header->sections[section].fileofs = (int) file.size();
+  header->sections[section].filelen = (int) (count * sizeof(T));
+  const byte *bytes = (const byte*) data;
+  file.insert(file.end(), bytes, bytes + count * sizeof(T));
+}
+
+/*
+ =================
+ Mod_WriteCache
+
+ Failing to write a cache is not an error, the map is simply parsed again
+ next time. The file is written under a temporary name and renamed, so a
+ reader never sees a partial cache.
+ =================
+ */
+void vkglBSP::Model::modWriteCache(QModel *mod, const char *path,
+    uint64_t sourcehash, size_t sourcelen) {
+  std::vector<BspcSurface> surfaces(mod->surfaces.size());
+  for (size_t i = 0; i < surfaces.size(); i++) {
+    const MSurface &in = mod->surfaces[i];
+    BspcSurface &out = surfaces[i];
+    memset(&out, 0, sizeof(out));
+    out.firstedge = in.firstedge;
+    out.numedges = in.numedges;
+    out.texturemins[0] = in.texturemins[0];
+    out.texturemins[1] = in.texturemins[1];
+    out.extents[0] = in.extents[0];
+    out.extents[1] = in.extents[1];
+    out.light_s = in.light_s;
+    out.light_t = in.light_t;
+    out.polys = in.polys;
+    out.lightofs = in.samples ? (int) (in.samples - mod->lightdata.data()) : -1;
+    memcpy(out.styles, in.styles, sizeof(out.styles));
+  }
+
+  std::vector<BspcNode> nodes(mod->nodes.size());
+  for (size_t i = 0; i < nodes.size(); i++) {
+    const MNode &in = mod->nodes[i];
+    BspcNode &out = nodes[i];
+    out.planenum = (int) (in.plane - mod->planes.data());
+    for (int j = 0; j < 2; j++) {
+      if (in.children[j]->contents < 0)
+        out.children[j] = -1
+            - (int) ((MLeaf*) in.children[j] - mod->leafs.data());
+      else
+        out.children[j] = (int) (in.children[j] - mod->nodes.data());
+    }
+    memcpy(out.minmaxs, in.minmaxs, sizeof(out.minmaxs));
+    out.firstsurface = in.firstsurface;
+    out.numsurfaces = in.numsurfaces;
+  }
+
+  std::vector<BspcLeaf> leafs(mod->leafs.size());
+  for (size_t i = 0; i < leafs.size(); i++) {
+    const MLeaf &in = mod->leafs[i];
+    BspcLeaf &out = leafs[i];
+    out.contents = in.contents;
+    out.visofs = in.compressed_vis ?
+        (int) (in.compressed_vis - mod->visdata.data()) : -1;
+    out.firstmarksurface = (int) (in.firstmarksurface - mod->marksurfaces.data());
+    out.nummarksurfaces = in.nummarksurfaces;
+    memcpy(out.minmaxs, in.minmaxs, sizeof(out.minmaxs));
+    memcpy(out.ambient_level, in.ambient_sound_level, sizeof(out.ambient_level));
+  }
+
+  std::vector<BspcTexture> textures(mod->textures.size());
+  for (size_t i = 0; i < textures.size(); i++) {
+    const QTexture &in = mod->textures[i];
+    BspcTexture &out = textures[i];
+    memcpy(out.name, in.name, sizeof(out.name));
+    out.width = in.width;
+    out.height = in.height;
+    memcpy(out.offsets, in.offsets, sizeof(out.offsets));
+  }
+
+  std::vector<BspcTexInfo> texinfo(mod->texinfo.size());
+  for (size_t i = 0; i < texinfo.size(); i++) {
+    const MTexInfo &in = mod->texinfo[i];
+    BspcTexInfo &out = texinfo[i];
+    memcpy(out.vecs, in.vecs, sizeof(out.vecs));
+    out.texture = (int) (in.texture - mod->textures.data());
+    out.flags = in.flags;
+  }
+
+  const SurfaceTable &table = mod->surftable;
+  std::vector<byte> file(sizeof(BspcHeader), 0);
+  modCacheSection(file, BSPC_POLYVERTS, mod->polyverts.data(), mod->polyverts.size());
+  modCacheSection(file, BSPC_POLYINDEXES, mod->polyindexes.data(), mod->polyindexes.size());
+  modCacheSection(file, BSPC_POLYS, mod->polys.data(), mod->polys.size());
+  modCacheSection(file, BSPC_SURF_FIRSTVERT, table.firstvert.data(), table.firstvert.size());
+  modCacheSection(file, BSPC_SURF_NUMVERTS, table.numverts.data(), table.numverts.size());
+  modCacheSection(file, BSPC_SURF_PLANENUM, table.planenum.data(), table.planenum.size());
+  modCacheSection(file, BSPC_SURF_TEXINFO, table.texinfo.data(), table.texinfo.size());
+  modCacheSection(file, BSPC_SURF_FLAGS, table.flags.data(), table.flags.size());
+  modCacheSection(file, BSPC_SURFACES, surfaces.data(), surfaces.size());
+  modCacheSection(file, BSPC_PLANES, mod->planes.data(), mod->planes.size());
+  modCacheSection(file, BSPC_NODES, nodes.data(), nodes.size());
+  modCacheSection(file, BSPC_LEAFS, leafs.data(), leafs.size());
+  modCacheSection(file, BSPC_MARKSURFACES, mod->marksurfaces.data(), mod->marksurfaces.size());
+  modCacheSection(file, BSPC_CLIPNODES, mod->clipnodes.data(), mod->clipnodes.size());
+  modCacheSection(file, BSPC_SUBMODELS, mod->submodels.data(), mod->submodels.size());
+  modCacheSection(file, BSPC_TEXTURES, textures.data(), textures.size());
+  modCacheSection(file, BSPC_TEXINFO, texinfo.data(), texinfo.size());
+  modCacheSection(file, BSPC_VISIBILITY, mod->visdata.data(), mod->visdata.size());
+  modCacheSection(file, BSPC_LIGHTING, mod->lightdata.data(), mod->lightdata.size());
+
+  if (file.size() > 0x7fffffff) {
+    std::cerr << "modWriteCache: " << mod->name << " is too large to cache"
+        << std::endl;
+    return;
+  }
+
+  BspcHeader *header = (BspcHeader*) file.data();
+  header->ident = BSPC_IDENT;
+  header->version = BSPC_VERSION;
+  header->sourcelen = (unsigned int) sourcelen;
+  header->bspversion = mod->bspversion;
+  header->sourcehash = sourcehash;
+  header->datahash = comBlockHash(file.data() + sizeof(BspcHeader),
+      file.size() - sizeof(BspcHeader));
+
+  char tempPath[MAX_OSPATH];
+  snprintf(tempPath, sizeof(tempPath), "%s.tmp", path);
+  sysCreatePath(tempPath);
+  FILE *f = fopen(tempPath, "wb");
+  if (f == nullptr) {
+    std::cerr << "modWriteCache: could not write " << tempPath << std::endl;
+    return;
+  }
+  const bool written = fwrite(file.data(), 1, file.size(), f) == file.size();
+  if (fclose(f) != 0 || !written) {
+    std::cerr << "modWriteCache: could not write " << tempPath << std::endl;
+    remove(tempPath);
+    return;
+  }
+#if defined(_WIN32)
+  remove(path); // rename does not replace on Windows
+#endif
+  if (rename(tempPath, path) != 0) {
+    std::cerr << "modWriteCache: could not rename " << tempPath << std::endl;
+    remove(tempPath);
+  }
+}
+
+void vkglBSP::PVSCache::reset(int numleafs, int rowsize, int capacity) {
+  rowbytes = (rowsize + PVS_ROW_ALIGN - 1) & ~(PVS_ROW_ALIGN - 1);
+  rows.assign((size_t) rowbytes * capacity, 0);
+  slotOfLeaf.assign(numleafs, -1);
+  leafOfSlot.assign(capacity, -1);
+  prev.assign(capacity, -1);
+  next.assign(capacity, -1);
+  head = tail = -1;
+  used = 0;
+  hits = misses = 0;
+}
+
+void vkglBSP::PVSCache::unlink(int slot) {
+  if (prev[slot] >= 0)
+    next[prev[slot]] = next[slot];
+  else
+    head = next[slot];
+  if (next[slot] >= 0)
+    prev[next[slot]] = prev[slot];
+  else
+    tail = prev[slot];
+}
+
+void vkglBSP::PVSCache::pushFront(int slot) {
+  prev[slot] = -1;
+  next[slot] = head;
+  if (head >= 0)
+    prev[head] = slot;
+  head = slot;
+  if (tail < 0)
+    tail = slot;
+}
+
+byte* vkglBSP::PVSCache::find(int leaf) {
+  const int slot = slotOfLeaf[leaf];
+  if (slot < 0) {
+    misses++;
+    return nullptr;
+  }
+  hits++;
+  if (slot != head) {
+    unlink(slot);
+    pushFront(slot);
+  }
+  return rows.data() + (size_t) slot * rowbytes;
+}
+
+byte* vkglBSP::PVSCache::insert(int leaf) {
+  int slot;
+  if (used < (int) leafOfSlot.size()) {
+    slot = used++;
+  } else {
+    slot = tail;
+    slotOfLeaf[leafOfSlot[slot]] = -1;
+    unlink(slot);
+  }
+  leafOfSlot[slot] = leaf;
+  slotOfLeaf[leaf] = slot;
+  pushFront(slot);
+  return rows.data() + (size_t) slot * rowbytes;
+}
+
+/*
+ ===============
+ Mod_PointInLeaf
+ ===============
+ */
+vkglBSP::MLeaf* vkglBSP::Model::modPointInLeaf(const glm::vec3 &p,
+    QModel *model) {
+  if (model->nodes.empty()) {
+    throw std::runtime_error("modPointInLeaf: bad model");
+  }
+
+  MNode *node = model->nodes.data();
+  while (node->contents >= 0) {
+    const MPlane *plane = node->plane;
+    const float d = glm::dot(p, plane->normal) - plane->dist;
+    node = node->children[d > 0 ? 0 : 1];
+  }
+
+  return (MLeaf*) node;
+}
+
+/*
+ ===================
+ Mod_DecompressVis
+
+ Zero runs are filled with memset instead of byte by byte. Input is bounds
+ checked against visdata, a row that runs short is completed with zeros.
+ ===================
+ */
+void vkglBSP::Model::modDecompressVis(const byte *in, QModel *model, byte *out) {
+  const int row = (model->numleafs + 7) >> 3;
+  byte *outend = out + row;
+
+  if (!in) { // no vis info, so make all visible
+    memset(out, 0xff, row);
+    return;
+  }
+
+  const byte *inend = model->visdata.data() + model->visdata.size();
+  while (out < outend && in < inend) {
+    if (*in) {
+      *out++ = *in++;
+      continue;
+    }
+    if (in + 1 >= inend)
+      break;
+
+    size_t c = in[1];
+    in += 2;
+    if (c > (size_t) (outend - out)) {
+      if (!model->viswarn) {
+        model->viswarn = true;
+        std::cerr << "modDecompressVis: output overrun on model "
+            << model->name << std::endl;
+      }
+      c = outend - out;
+    }
+    memset(out, 0, c);
+    out += c;
+  }
+
+  if (out < outend)
+    memset(out, 0, outend - out);
+}
+
+byte* vkglBSP::Model::modNoVisPVS(QModel *model) {
+  return model->novis.data();
+}
+
+byte* vkglBSP::Model::modLeafPVS(MLeaf *leaf, QModel *model) {
+  if (leaf == model->leafs.data())
+    return modNoVisPVS(model);
+
+  const int leafnum = (int) (leaf - model->leafs.data());
+  byte *row = model->pvscache.find(leafnum);
+  if (row == nullptr) {
+    row = model->pvscache.insert(leafnum);
+    modDecompressVis(leaf->compressed_vis, model, row);
+  }
+  return row;
+}
+
+/*
+ =============
+ SV_FatPVS
+
+ The PVS must include a small area around the client to allow head bobbing
+ or other small motion on the client side, otherwise a bob might cause an
+ entity that should be visible to not show up, especially when the bob
+ crosses a waterline.
+ =============
+ */
+byte* vkglBSP::Model::modFatPVS(const glm::vec3 &org, float radius,
+    QModel *model) {
+  byte *fat = model->fatpvs.data();
+  const size_t rowbytes = model->fatpvs.size();
+  memset(fat, 0, rowbytes);
+  if (model->nodes.empty())
+    return modNoVisPVS(model);
+
+  MNode *stack[1024];
+  int depth = 0;
+  stack[depth++] = model->nodes.data();
+  while (depth > 0) {
+    MNode *node = stack[--depth];
+    if (node->contents < 0) {
+      if (node->contents != CONTENTS_SOLID)
+        modUnionPVS(fat, modLeafPVS((MLeaf*) node, model), rowbytes);
+      continue;
+    }
+
+    const MPlane *plane = node->plane;
+    const float d = glm::dot(org, plane->normal) - plane->dist;
+    // A single child always fits in the slot just popped, a tree too deep
+    // for the stack sees everything
+    if (d > radius) {
+      stack[depth++] = node->children[0];
+    } else if (d < -radius) {
+      stack[depth++] = node->children[1];
+    } else if (depth + 2 <= (int) (sizeof(stack) / sizeof(stack[0]))) {
+      stack[depth++] = node->children[0];
+      stack[depth++] = node->children[1];
+    } else {
+      return modNoVisPVS(model);
+    }
+  }
+  return fat;
+}
+
+/*
+ ====================
+ SV_FindTouchedLeafs
+ ====================
+ */
+void vkglBSP::Model::modBoxLeafs(const glm::vec3 &mins, const glm::vec3 &maxs,
+    QModel *model, std::vector<int> &leafs) {
+  leafs.clear();
+  if (model->nodes.empty())
+    return;
+
+  MNode *stack[1024];
+  int depth = 0;
+  stack[depth++] = model->nodes.data();
+  while (depth > 0) {
+    MNode *node = stack[--depth];
+    if (node->contents < 0) {
+      if (node->contents != CONTENTS_SOLID)
+        leafs.push_back((int) ((MLeaf*) node - model->leafs.data()));
+      continue;
+    }
+
+    // Box corners nearest to and furthest along the plane normal
+    const MPlane *plane = node->plane;
+    glm::vec3 nearest, furthest;
+    for (int i = 0; i < 3; i++) {
+      const bool negative = (plane->signbits >> i) & 1;
+      nearest[i] = negative ? maxs[i] : mins[i];
+      furthest[i] = negative ? mins[i] : maxs[i];
+    }
+    const bool front = glm::dot(furthest, plane->normal) - plane->dist > 0;
+    const bool back = glm::dot(nearest, plane->normal) - plane->dist <= 0;
+    // A box on both sides of a plane too deep for the stack touches the leafs
+    // found so far only, which is what Quake's entity leaf limit does too
+    if (front && (!back || depth + 2 <= (int) (sizeof(stack) / sizeof(stack[0]))))
+      stack[depth++] = node->children[0];
+    if (back && depth < (int) (sizeof(stack) / sizeof(stack[0])))
+      stack[depth++] = node->children[1];
+  }
+}
+
+bool vkglBSP::Model::modLeafsVisible(const std::vector<int> &leafs,
+    const byte *vis, int numleafs) {
+  for (int leafnum : leafs) {
+    // leaf 0 and leafs past the visible ones have no bit in the row
+    if (leafnum < 1 || leafnum > numleafs)
+      continue;
+    const int bit = leafnum - 1;
+    if (vis[bit >> 3] & (1 << (bit & 7)))
+      return true;
+  }
+  return false;
+}
+
+template<bool Intersect>
+static void modCombinePVSScalar(byte *dst, const byte *src, size_t size) {
+  size_t i = 0;
+  for (; i + 8 <= size; i += 8) {
+    uint64_t a, b;
+    memcpy(&a, dst + i, sizeof(a));
+    memcpy(&b, src + i, sizeof(b));
+    a = Intersect ? a & b : a | b;
+    memcpy(dst + i, &a, sizeof(a));
+  }
+  for (; i < size; i++)
+    dst[i] = Intersect ? dst[i] & src[i] : dst[i] | src[i];
+}
+
+#if defined(VKGLBSP_X64)
+template<bool Intersect>
+static void modCombinePVSSSE2(byte *dst, const byte *src, size_t size) {
+  size_t i = 0;
+  for (; i + 16 <= size; i += 16) {
+    const __m128i a = _mm_loadu_si128((const __m128i*) (dst + i));
+    const __m128i b = _mm_loadu_si128((const __m128i*) (src + i));
+    _mm_storeu_si128((__m128i*) (dst + i),
+        Intersect ? _mm_and_si128(a, b) : _mm_or_si128(a, b));
+  }
+  modCombinePVSScalar<Intersect>(dst + i, src + i, size - i);
+}
+
+template<bool Intersect>
+VKGLBSP_TARGET_AVX2 static void modCombinePVSAVX2(byte *dst, const byte *src,
+    size_t size) {
+  size_t i = 0;
+  for (; i + 32 <= size; i += 32) {
+    const __m256i a = _mm256_loadu_si256((const __m256i*) (dst + i));
+    const __m256i b = _mm256_loadu_si256((const __m256i*) (src + i));
+    _mm256_storeu_si256((__m256i*) (dst + i),
+        Intersect ? _mm256_and_si256(a, b) : _mm256_or_si256(a, b));
+  }
+  modCombinePVSScalar<Intersect>(dst + i, src + i, size - i);
+}
+#endif
+
+template<bool Intersect>
+static void modCombinePVS(byte *dst, const byte *src, size_t size) {
+#if defined(VKGLBSP_X64)
+  if (vkglBSP::simdLevel >= vkglBSP::SimdAVX2) {
+    modCombinePVSAVX2<Intersect>(dst, src, size);
+    return;
+  }
+  if (vkglBSP::simdLevel >= vkglBSP::SimdSSE2) {
+    modCombinePVSSSE2<Intersect>(dst, src, size);
+    return;
+  }
+#endif
+  modCombinePVSScalar<Intersect>(dst, src, size);
+}
+
+void vkglBSP::Model::modUnionPVS(byte *dst, const byte *src, size_t size) {
+  modCombinePVS<false>(dst, src, size);
+}
+
+void vkglBSP::Model::modIntersectPVS(byte *dst, const byte *src, size_t size) {
+  modCombinePVS<true>(dst, src, size);
+}
+
+/*
+ ===============
+ Mod_PrepareSIMDData
+
+ Leaf bounds and surface planes are stored 8 at a time as structures of
+ arrays so the culling kernels test 8 of them per instruction. Surface
+ planes are flipped for SURF_PLANEBACK, a surface faces the viewer when its
+ plane distance is positive. Padding entries never pass either test.
+ ===============
+ */
+void vkglBSP::Model::modPrepareSIMDData(QModel *mod) {
+  const int numleafs = std::max(0, std::min(mod->numleafs,
+      (int) mod->leafs.size() - 1));
+  const int leafgroups = (numleafs + 7) / 8;
+  const int surfgroups = (mod->numsurfaces + 7) / 8;
+  const size_t aabbfloats = sizeof(soa_aabb_t) / sizeof(float);
+  const size_t planefloats = sizeof(soa_plane_t) / sizeof(float);
+
+  // 8 spare floats to align the groups for full width loads
+  mod->simddata.assign(leafgroups * aabbfloats + surfgroups * planefloats + 8,
+      0.0f);
+  float *base = mod->simddata.data();
+  base += ((32 - ((uintptr_t) base & 31)) & 31) / sizeof(float);
+  mod->soa_leafbounds = (soa_aabb_t*) base;
+  mod->soa_surfplanes = (soa_plane_t*) (base + leafgroups * aabbfloats);
+
+  for (int i = 0; i < leafgroups * 8; i++) {
+    float *group = mod->soa_leafbounds[i / 8];
+    for (int j = 0; j < 6; j++) {
+      if (i < numleafs)
+        group[j * 8 + i % 8] = mod->leafs[i + 1].minmaxs[j];
+      else // inside out box, outside of every plane
+        group[j * 8 + i % 8] = j < 3 ? 1e30f : -1e30f;
+    }
+  }
+
+  for (int i = 0; i < surfgroups * 8; i++) {
+    float *group = mod->soa_surfplanes[i / 8];
+    if (i < mod->numsurfaces) {
+      const MSurface &surf = mod->surfaces[i];
+      const float side = (surf.flags & SURF_PLANEBACK) ? -1.0f : 1.0f;
+      for (int j = 0; j < 3; j++)
+        group[j * 8 + i % 8] = surf.plane->normal[j] * side;
+      group[3 * 8 + i % 8] = -surf.plane->dist * side;
+    } else {
+      group[3 * 8 + i % 8] = -1.0f;
+    }
+  }
+
+  mod->leafvis.assign(leafgroups, 0);
+  mod->surfvis.assign(surfgroups, 0);
+}
+
+// Box corner furthest along each plane normal, picked per axis by signbits
+static inline int modPlaneSignbits(const glm::vec4 &plane) {
+  return (plane.x < 0 ? 1 : 0) | (plane.y < 0 ? 2 : 0) | (plane.z < 0 ? 4 : 0);
+}
+
+static void modCullLeafsScalar(const soa_aabb_t *boxes, int groups,
+    const glm::vec4 *planes, int numplanes, byte *leafvis) {
+  for (int g = 0; g < groups; g++) {
+    int mask = leafvis[g];
+    if (!mask)
+      continue;
+    const float *box = boxes[g];
+    for (int p = 0; p < numplanes && mask; p++) {
+      const glm::vec4 &plane = planes[p];
+      const int bits = modPlaneSignbits(plane);
+      const float *x = box + ((bits & 1) ? 0 : 24);
+      const float *y = box + ((bits & 2) ? 8 : 32);
+      const float *z = box + ((bits & 4) ? 16 : 40);
+      int outside = 0;
+      for (int i = 0; i < 8; i++) {
+        const float d = plane.x * x[i] + plane.y * y[i] + plane.z * z[i] + plane.w;
+        outside |= (d < 0) << i;
+      }
+      mask &= ~outside;
+    }
+    leafvis[g] = (byte) mask;
+  }
+}
+
+static void modCullBackFacesScalar(const soa_plane_t *planes, int groups,
+    const glm::vec3 &origin, byte *surfvis) {
+  for (int g = 0; g < groups; g++) {
+    int mask = surfvis[g];
+    if (!mask)
+      continue;
+    const float *plane = planes[g];
+    int back = 0;
+    for (int i = 0; i < 8; i++) {
+      const float d = origin.x * plane[i] + origin.y * plane[8 + i]
+          + origin.z * plane[16 + i] + plane[24 + i];
+      back |= (d < 0) << i;
+    }
+    surfvis[g] = (byte) (mask & ~back);
+  }
+}
+
+#if defined(VKGLBSP_X64)
+static void modCullLeafsSSE2(const soa_aabb_t *boxes, int groups,
+    const glm::vec4 *planes, int numplanes, byte *leafvis) {
+  const __m128 zero = _mm_setzero_ps();
+  for (int g = 0; g < groups; g++) {
+    int mask = leafvis[g];
+    if (!mask)
+      continue;
+    const float *box = boxes[g];
+    for (int p = 0; p < numplanes && mask; p++) {
+      const glm::vec4 &plane = planes[p];
+      const int bits = modPlaneSignbits(plane);
+      const float *x = box + ((bits & 1) ? 0 : 24);
+      const float *y = box + ((bits & 2) ? 8 : 32);
+      const float *z = box + ((bits & 4) ? 16 : 40);
+      const __m128 nx = _mm_set1_ps(plane.x), ny = _mm_set1_ps(plane.y);
+      const __m128 nz = _mm_set1_ps(plane.z), w = _mm_set1_ps(plane.w);
+      for (int half = 0; half < 8; half += 4) {
+        __m128 d = _mm_add_ps(_mm_mul_ps(nx, _mm_load_ps(x + half)), w);
+        d = _mm_add_ps(d, _mm_mul_ps(ny, _mm_load_ps(y + half)));
+        d = _mm_add_ps(d, _mm_mul_ps(nz, _mm_load_ps(z + half)));
+        mask &= ~(_mm_movemask_ps(_mm_cmplt_ps(d, zero)) << half);
+      }
+    }
+    leafvis[g] = (byte) mask;
+  }
+}
+
+static void modCullBackFacesSSE2(const soa_plane_t *planes, int groups,
+    const glm::vec3 &origin, byte *surfvis) {
+  const __m128 ox = _mm_set1_ps(origin.x), oy = _mm_set1_ps(origin.y);
+  const __m128 oz = _mm_set1_ps(origin.z), zero = _mm_setzero_ps();
+  for (int g = 0; g < groups; g++) {
+    int mask = surfvis[g];
+    if (!mask)
+      continue;
+    const float *plane = planes[g];
+    for (int half = 0; half < 8; half += 4) {
+      __m128 d = _mm_add_ps(_mm_mul_ps(ox, _mm_load_ps(plane + half)),
+          _mm_load_ps(plane + 24 + half));
+      d = _mm_add_ps(d, _mm_mul_ps(oy, _mm_load_ps(plane + 8 + half)));
+      d = _mm_add_ps(d, _mm_mul_ps(oz, _mm_load_ps(plane + 16 + half)));
+      mask &= ~(_mm_movemask_ps(_mm_cmplt_ps(d, zero)) << half);
+    }
+    surfvis[g] = (byte) mask;
+  }
+}
+
+VKGLBSP_TARGET_AVX2 static void modCullLeafsAVX2(const soa_aabb_t *boxes,
+    int groups, const glm::vec4 *planes, int numplanes, byte *leafvis) {
+  const __m256 zero = _mm256_setzero_ps();
+  for (int g = 0; g < groups; g++) {
+    int mask = leafvis[g];
+    if (!mask)
+      continue;
+    const float *box = boxes[g];
+    for (int p = 0; p < numplanes && mask; p++) {
+      const glm::vec4 &plane = planes[p];
+      const int bits = modPlaneSignbits(plane);
+      const float *x = box + ((bits & 1) ? 0 : 24);
+      const float *y = box + ((bits & 2) ? 8 : 32);
+      const float *z = box + ((bits & 4) ? 16 : 40);
+      __m256 d = _mm256_add_ps(
+          _mm256_mul_ps(_mm256_set1_ps(plane.x), _mm256_load_ps(x)),
+          _mm256_set1_ps(plane.w));
+      d = _mm256_add_ps(d,
+          _mm256_mul_ps(_mm256_set1_ps(plane.y), _mm256_load_ps(y)));
+      d = _mm256_add_ps(d,
+          _mm256_mul_ps(_mm256_set1_ps(plane.z), _mm256_load_ps(z)));
+      mask &= ~_mm256_movemask_ps(_mm256_cmp_ps(d, zero, _CMP_LT_OQ));
+    }
+    leafvis[g] = (byte) mask;
+  }
+}
+
+VKGLBSP_TARGET_AVX2 static void modCullBackFacesAVX2(const soa_plane_t *planes,
+    int groups, const glm::vec3 &origin, byte *surfvis) {
+  const __m256 ox = _mm256_set1_ps(origin.x), oy = _mm256_set1_ps(origin.y);
+  const __m256 oz = _mm256_set1_ps(origin.z), zero = _mm256_setzero_ps();
+  for (int g = 0; g < groups; g++) {
+    int mask = surfvis[g];
+    if (!mask)
+      continue;
+    const float *plane = planes[g];
+    __m256 d = _mm256_add_ps(_mm256_mul_ps(ox, _mm256_load_ps(plane)),
+        _mm256_load_ps(plane + 24));
+    d = _mm256_add_ps(d, _mm256_mul_ps(oy, _mm256_load_ps(plane + 8)));
+    d = _mm256_add_ps(d, _mm256_mul_ps(oz, _mm256_load_ps(plane + 16)));
+    mask &= ~_mm256_movemask_ps(_mm256_cmp_ps(d, zero, _CMP_LT_OQ));
+    surfvis[g] = (byte) mask;
+  }
+}
+#endif
+
+void vkglBSP::Model::modCullLeafs(QModel *model, const glm::vec4 *planes,
+    int numplanes, byte *leafvis) {
+  const int groups = (int) model->leafvis.size();
+#if defined(VKGLBSP_X64)
+  if (simdLevel >= SimdAVX2) {
+    modCullLeafsAVX2(model->soa_leafbounds, groups, planes, numplanes, leafvis);
+    return;
+  }
+  if (simdLevel >= SimdSSE2) {
+    modCullLeafsSSE2(model->soa_leafbounds, groups, planes, numplanes, leafvis);
+    return;
+  }
+#endif
+  modCullLeafsScalar(model->soa_leafbounds, groups, planes, numplanes, leafvis);
+}
+
+void vkglBSP::Model::modCullBackFaces(QModel *model, const glm::vec3 &origin,
+    byte *surfvis) {
+  const int groups = (int) model->surfvis.size();
+#if defined(VKGLBSP_X64)
+  if (simdLevel >= SimdAVX2) {
+    modCullBackFacesAVX2(model->soa_surfplanes, groups, origin, surfvis);
+    return;
+  }
+  if (simdLevel >= SimdSSE2) {
+    modCullBackFacesSSE2(model->soa_surfplanes, groups, origin, surfvis);
+    return;
+  }
+#endif
+  modCullBackFacesScalar(model->soa_surfplanes, groups, origin, surfvis);
+}
+
+void vkglBSP::Model::modMarkVisSurfaces(QModel *model, const byte *vis,
+    const vks::Frustum &frustum, const glm::vec3 &origin) {
+  byte *leafvis = model->leafvis.data();
+  byte *surfvis = model->surfvis.data();
+  const int leafgroups = (int) model->leafvis.size();
+
+  memcpy(leafvis, vis, leafgroups);
+  // Only the four side planes, like Quake. The near and far planes vks::Frustum
+  // derives assume a -1..1 depth range, which this renderer does not use.
+  modCullLeafs(model, frustum.planes.data(), 4, leafvis);
+
+  memset(surfvis, 0, model->surfvis.size());
+  for (int g = 0; g < leafgroups; g++) {
+    int mask = leafvis[g];
+    for (int bit = 0; mask; bit++, mask >>= 1) {
+      if (!(mask & 1))
+        continue;
+      const MLeaf &leaf = model->leafs[1 + g * 8 + bit];
+      for (int i = 0; i < leaf.nummarksurfaces; i++) {
+        const int s = leaf.firstmarksurface[i];
+        surfvis[s >> 3] |= 1 << (s & 7);
+      }
+    }
+  }
+
+  modCullBackFaces(model, origin, surfvis);
+}
+
+/*
+ =============================================================================
+
+ WORLD RENDERING
+
+ =============================================================================
+ */
+
+void vkglBSP::Model::rSetFrustum(const vks::Frustum &frustum) {
+  for (int i = 0; i < 4; i++) {
+    const glm::vec4 &plane = frustum.planes[i];
+    MPlane &out = this->frustum[i];
+    out.normal = glm::vec3(plane);
+    out.dist = -plane.w;
+    out.type = PLANE_ANYZ;
+    out.signbits = (byte) modPlaneSignbits(plane);
+  }
+}
+
+/*
+ ===============
+ R_MarkSurfaces
+
+ The PVS only changes with the view leaf, so walking the same leaf again
+ keeps the marks of the last frame
+ ===============
+ */
+void vkglBSP::Model::rMarkSurfaces(const glm::vec3 &origin) {
+  QModel *model = loadmodel;
+
+  r_viewleaf = modPointInLeaf(origin, model);
+  if (r_viewleaf == r_oldviewleaf)
+    return;
+  r_oldviewleaf = r_viewleaf;
+  r_visframecount++;
+
+  const byte *vis = modLeafPVS(r_viewleaf, model);
+  const int rowsize = (model->numleafs + 7) >> 3;
+  for (int i = 0; i < rowsize; i++) {
+    int bits = vis[i];
+    for (int bit = 0; bits; bit++, bits >>= 1) {
+      if (!(bits & 1))
+        continue;
+      const int leafnum = 1 + i * 8 + bit;
+      if (leafnum > model->numleafs)
+        break;
+      MNode *node = (MNode*) &model->leafs[leafnum];
+      do {
+        if (node->visframe == r_visframecount)
+          break;
+        node->visframe = r_visframecount;
+        node = node->parent;
+      } while (node);
+    }
+  }
+}
+
+int vkglBSP::Model::rCullBox(const float *minmaxs, int clipflags) {
+  for (int i = 0; i < 4; i++) {
+    if (!(clipflags & (1 << i)))
+      continue;
+    const MPlane &plane = frustum[i];
+    const int bits = plane.signbits;
+
+    // Corner furthest along the normal decides outside, the nearest one
+    // decides whether the children still have to be tested
+    const float far = plane.normal.x * minmaxs[(bits & 1) ? 0 : 3]
+        + plane.normal.y * minmaxs[(bits & 2) ? 1 : 4]
+        + plane.normal.z * minmaxs[(bits & 4) ? 2 : 5];
+    if (far < plane.dist)
+      return -1;
+    const float near = plane.normal.x * minmaxs[(bits & 1) ? 3 : 0]
+        + plane.normal.y * minmaxs[(bits & 2) ? 4 : 1]
+        + plane.normal.z * minmaxs[(bits & 4) ? 5 : 2];
+    if (near >= plane.dist)
+      clipflags &= ~(1 << i);
+  }
+  return clipflags;
+}
+
+/*
+ ================
+ R_RecursiveWorldNode
+
+ Iterative, the stack holds each node twice: once to walk the side of the
+ viewer and once more to chain the node surfaces and walk the far side
+ ================
+ */
+void vkglBSP::Model::rRecursiveWorldNode(MNode *headnode,
+    const glm::vec3 &origin) {
+  QModel *model = loadmodel;
+
+  walkstack.clear();
+  walkstack.push_back( { headnode, 15, -1 });
+  while (!walkstack.empty()) {
+    WalkEntry &entry = walkstack.back();
+    MNode *node = entry.node;
+
+    if (entry.side >= 0) {
+      const int side = entry.side;
+      const int clipflags = entry.clipflags;
+      walkstack.pop_back();
+
+      // Surfaces on the plane are drawn when they face the viewer and one of
+      // the leafs walked so far marked them
+      const int sidebit = side ? SURF_PLANEBACK : 0;
+      MSurface *surf = &model->surfaces[node->firstsurface];
+      for (unsigned int i = 0; i < node->numsurfaces; i++, surf++) {
+        if (surf->visframe != r_framecount)
+          continue;
+        if ((surf->flags & (SURF_PLANEBACK | SURF_TRIGGER)) != sidebit)
+          continue;
+        QTexture *texture = surf->texinfo->texture;
+        surf->texturechain = texture->texturechains[0];
+        texture->texturechains[0] = surf;
+      }
+
+      walkstack.push_back( { node->children[!side], clipflags, -1 });
+      continue;
+    }
+
+    if (node->contents == CONTENTS_SOLID || node->visframe != r_visframecount) {
+      walkstack.pop_back();
+      continue;
+    }
+    if (entry.clipflags) {
+      entry.clipflags = rCullBox(node->minmaxs, entry.clipflags);
+      if (entry.clipflags < 0) {
+        walkstack.pop_back();
+        continue;
+      }
+    }
+
+    if (node->contents < 0) {
+      // leaf, its surfaces get chained by the nodes they lie on
+      const MLeaf *leaf = (MLeaf*) node;
+      const int *mark = leaf->firstmarksurface;
+      for (int i = 0; i < leaf->nummarksurfaces; i++) {
+        model->surfaces[mark[i]].visframe = r_framecount;
+      }
+      walkstack.pop_back();
+      continue;
+    }
+
+    const MPlane *plane = node->plane;
+    float dot;
+    if (plane->type < 3)
+      dot = origin[plane->type] - plane->dist;
+    else
+      dot = glm::dot(origin, plane->normal) - plane->dist;
+
+    const int side = dot >= 0 ? 0 : 1;
+    const int clipflags = entry.clipflags;
+    entry.side = side;
+    walkstack.push_back( { node->children[side], clipflags, -1 });
+  }
+}
+
+/*
+ Packs the texture chains into triangle lists, one VisBatch per texture, and
+ empties the chains for the next frame
+ */
+void vkglBSP::Model::rEmitTextureChains() {
+  QModel *model = loadmodel;
+  const SurfaceTable &table = model->surftable;
+  std::vector<uint32_t> &indexes = model->visindexes;
+
+  indexes.clear();
+  model->visbatches.clear();
+  for (size_t t = 0; t < model->textures.size(); t++) {
+    QTexture &texture = model->textures[t];
+    if (!texture.texturechains[0])
+      continue;
+
+    VisBatch batch;
+    batch.texture = (int) t;
+    batch.firstindex = (uint32_t) indexes.size();
+    for (MSurface *surf = texture.texturechains[0]; surf;
+        surf = surf->texturechain) {
+      const int s = (int) (surf - model->surfaces.data());
+      const uint32_t baseIndex = table.firstvert[s];
+      const int numverts = table.numverts[s];
+      for (int i = 0; i < numverts - 2; ++i) {
+        indexes.push_back(baseIndex);
+        indexes.push_back(baseIndex + i + 1);
+        indexes.push_back(baseIndex + i + 2);
+      }
+    }
+    batch.indexcount = (uint32_t) indexes.size() - batch.firstindex;
+    model->visbatches.push_back(batch);
+    texture.texturechains[0] = nullptr;
+  }
+}
+
+void vkglBSP::Model::rRenderWorld(const glm::vec3 &origin,
+    const vks::Frustum &frustum) {
+  QModel *model = loadmodel;
+  if (model->visindexes.capacity() < model->polyindexes.size()) {
+    model->visindexes.reserve(model->polyindexes.size());
+  }
+
+  r_framecount++;
+  rSetFrustum(frustum);
+  rMarkSurfaces(origin);
+  rRecursiveWorldNode(model->nodes.data(), origin);
+  rEmitTextureChains();
+}
+
+/*
+ =============================================================================
+
+ LIGHTMAPS
+
+ =============================================================================
+ */
+
+void vkglBSP::LightmapSkyline::reset(int width, int height) {
+  this->width = width;
+  this->height = height;
+  skyline.assign(1, Segment { 0, 0, width });
+}
+
+bool vkglBSP::LightmapSkyline::alloc(int w, int h, int &x, int &y) {
+  int best = -1;
+  int besty = height - h + 1;
+  for (size_t i = 0; i < skyline.size() && skyline[i].x + w <= width; i++) {
+    // The block rests on the highest segment below it
+    int top = 0;
+    for (size_t j = i, covered = 0; covered < (size_t) w; j++) {
+      top = std::max(top, skyline[j].y);
+      covered += skyline[j].width;
+    }
+    if (top < besty) {
+      best = (int) i;
+      besty = top;
+    }
+  }
+  if (best < 0) {
+    return false;
+  }
+
+  x = skyline[best].x;
+  y = besty;
+  skyline.insert(skyline.begin() + best, Segment { x, y + h, w });
+
+  // Cut what the block covers out of the segments to its right
+  size_t next = best + 1;
+  while (next < skyline.size() && skyline[next].x < x + w) {
+    const int end = skyline[next].x + skyline[next].width;
+    if (end <= x + w) {
+      skyline.erase(skyline.begin() + next);
+    } else {
+      skyline[next].x = x + w;
+      skyline[next].width = end - (x + w);
+      break;
+    }
+  }
+
+  for (size_t i = 0; i + 1 < skyline.size();) {
+    if (skyline[i].y == skyline[i + 1].y) {
+      skyline[i].width += skyline[i + 1].width;
+      skyline.erase(skyline.begin() + i + 1);
+    } else {
+      i++;
+    }
+  }
+  return true;
+}
+
+// blocklights += lightmap * scale over count samples
+static void rAccumulateLightmapScalar(unsigned *bl, const byte *lightmap,
+    unsigned scale, int count) {
+  for (int i = 0; i < count; i++) {
+    bl[i] += lightmap[i] * scale;
+  }
+}
+
+#if defined(VKGLBSP_X64)
+// 16 bit halves of the products from mullo and mulhi, interleaved back to 32 bits
+static void rAccumulateLightmapSSE2(unsigned *bl, const byte *lightmap,
+    unsigned scale, int count) {
+  const __m128i zero = _mm_setzero_si128();
+  const __m128i scale16 = _mm_set1_epi16((short) scale);
+  int i = 0;
+  for (; i + 16 <= count; i += 16) {
+    const __m128i samples = _mm_loadu_si128((const __m128i*) (lightmap + i));
+    for (int half = 0; half < 2; half++) {
+      const __m128i s16 = half ? _mm_unpackhi_epi8(samples, zero)
+          : _mm_unpacklo_epi8(samples, zero);
+      const __m128i lo = _mm_mullo_epi16(s16, scale16);
+      const __m128i hi = _mm_mulhi_epu16(s16, scale16);
+      __m128i *out = (__m128i*) (bl + i + half * 8);
+      _mm_storeu_si128(out,
+          _mm_add_epi32(_mm_loadu_si128(out), _mm_unpacklo_epi16(lo, hi)));
+      _mm_storeu_si128(out + 1,
+          _mm_add_epi32(_mm_loadu_si128(out + 1), _mm_unpackhi_epi16(lo, hi)));
+    }
+  }
+  rAccumulateLightmapScalar(bl + i, lightmap + i, scale, count - i);
+}
+
+VKGLBSP_TARGET_AVX2 static void rAccumulateLightmapAVX2(unsigned *bl,
+    const byte *lightmap, unsigned scale, int count) {
+  const __m256i scale32 = _mm256_set1_epi32((int) scale);
+  int i = 0;
+  for (; i + 16 <= count; i += 16) {
+    const __m256i a = _mm256_cvtepu8_epi32(
+        _mm_loadl_epi64((const __m128i*) (lightmap + i)));
+    const __m256i b = _mm256_cvtepu8_epi32(
+        _mm_loadl_epi64((const __m128i*) (lightmap + i + 8)));
+    __m256i *out = (__m256i*) (bl + i);
+    _mm256_storeu_si256(out,
+        _mm256_add_epi32(_mm256_loadu_si256(out),
+            _mm256_mullo_epi32(a, scale32)));
+    _mm256_storeu_si256(out + 1,
+        _mm256_add_epi32(_mm256_loadu_si256(out + 1),
+            _mm256_mullo_epi32(b, scale32)));
+  }
+  rAccumulateLightmapScalar(bl + i, lightmap + i, scale, count - i);
+}
+#endif
+
+static void rAccumulateLightmap(unsigned *bl, const byte *lightmap,
+    unsigned scale, int count) {
+#if defined(VKGLBSP_X64)
+  if (vkglBSP::simdLevel >= vkglBSP::SimdAVX2) {
+    rAccumulateLightmapAVX2(bl, lightmap, scale, count);
+    return;
+  }
+  // The SSE2 products are split into 16 bit halves
+  if (vkglBSP::simdLevel >= vkglBSP::SimdSSE2 && scale < 65536) {
+    rAccumulateLightmapSSE2(bl, lightmap, scale, count);
+    return;
+  }
+#endif
+  rAccumulateLightmapScalar(bl, lightmap, scale, count);
+}
+
+/*
+ ===============
+ R_BuildLightMap
+
+ Combine and scale multiple lightmaps into the 8.8 format in blocklights.
+ The result is stored at half intensity, the shaders scale it by 2 like
+ FitzQuake's overbright lighting.
+ ===============
+ */
+void vkglBSP::Model::rBuildLightMap(QModel *mod, MSurface *surf, byte *dest,
+    int stride) {
+  const int smax = (surf->extents[0] >> 4) + 1;
+  const int tmax = (surf->extents[1] >> 4) + 1;
+  const int size = smax * tmax;
+  const byte *lightmap = surf->samples;
+
+  blocklights.resize((size_t) size * 3);
+  unsigned *bl = blocklights.data();
+
+  if (mod->lightdata.empty()) {
+    // set to full bright if no light data
+    std::fill(bl, bl + size * 3, 255u << 8);
+  } else {
+    // clear to no light
+    std::fill(bl, bl + size * 3, 0u);
+
+    // add all the lightmaps
+    if (lightmap) {
+      for (int maps = 0; maps < MAXLIGHTMAPS && surf->styles[maps] != 255;
+          maps++) {
+        const unsigned scale = surf->styles[maps] < MAX_LIGHTSTYLES ?
+            lightstylevalue[surf->styles[maps]] : 264;
+        surf->cached_light[maps] = scale; // 8.8 fraction
+        rAccumulateLightmap(bl, lightmap, scale, size * 3);
+        lightmap += size * 3; // skip to next lightmap
+      }
+    }
+
+    // add all the dynamic lights
+    surf->cached_dlight = surf->dlightframe == r_dlightframecount;
+    if (surf->cached_dlight)
+      rAddDynamicLights(surf);
+  }
+
+  // bound, shift and store
+  for (int t = 0; t < tmax; t++, dest += stride) {
+    byte *out = dest;
+    for (int s = 0; s < smax; s++, bl += 3, out += 4) {
+      out[0] = (byte) std::min(bl[0] >> 8, 255u);
+      out[1] = (byte) std::min(bl[1] >> 8, 255u);
+      out[2] = (byte) std::min(bl[2] >> 8, 255u);
+      out[3] = 255;
+    }
+  }
+}
+
+void vkglBSP::Model::modBuildLightmaps(QModel *mod) {
+  const int numsurfaces = (int) mod->surfaces.size();
+  const size_t numlightdata = mod->lightdata.size();
+
+  // Sky and liquids have no lightmap, triggers are never drawn
+  std::vector<int> lit;
+  lit.reserve(numsurfaces);
+  mod->lightstylesurfaces.assign(MAX_LIGHTSTYLES, std::vector<int>());
+  for (int i = 0; i < numsurfaces; i++) {
+    MSurface &surf = mod->surfaces[i];
+    surf.lightmaptexturenum = -1;
+    surf.dlightframe = -1;
+    surf.cached_dlight = false;
+    if ((surf.texinfo->flags & TEX_SPECIAL) || (surf.flags & SURF_TRIGGER)) {
+      continue;
+    }
+    if (surf.samples) {
+      int maps = 0;
+      while (maps < MAXLIGHTMAPS && surf.styles[maps] != 255)
+        maps++;
+      const size_t size = (size_t) ((surf.extents[0] >> 4) + 1)
+          * ((surf.extents[1] >> 4) + 1) * 3;
+      if ((size_t) (surf.samples - mod->lightdata.data()) + size * maps
+          > numlightdata) {
+        snprintf(errorBuff, 255,
+            "modBuildLightmaps: lightmap of surface %i is out of bounds in %s",
+            i, mod->name);
+        throw std::runtime_error(errorBuff);
+      }
+      for (int j = 0; j < maps; j++) {
+        if (surf.styles[j] < MAX_LIGHTSTYLES)
+          mod->lightstylesurfaces[surf.styles[j]].push_back(i);
+      }
+    }
+    lit.push_back(i);
+  }
+
+  // Tallest first keeps the skyline flat, so the pages fill up evenly
+  std::stable_sort(lit.begin(), lit.end(), [mod](int a, int b) {
+    const MSurface &sa = mod->surfaces[a], &sb = mod->surfaces[b];
+    if (sa.extents[1] != sb.extents[1])
+      return sa.extents[1] > sb.extents[1];
+    return sa.extents[0] > sb.extents[0];
+  });
+
+  std::vector<LightmapSkyline> pages;
+  for (int i : lit) {
+    MSurface &surf = mod->surfaces[i];
+    const int smax = (surf.extents[0] >> 4) + 1;
+    const int tmax = (surf.extents[1] >> 4) + 1;
+    int page = 0;
+    while (page < (int) pages.size()
+        && !pages[page].alloc(smax, tmax, surf.light_s, surf.light_t)) {
+      page++;
+    }
+    if (page == (int) pages.size()) {
+      pages.emplace_back();
+      pages.back().reset(LIGHTMAP_PAGE_SIZE, LIGHTMAP_PAGE_SIZE);
+      if (!pages.back().alloc(smax, tmax, surf.light_s, surf.light_t)) {
+        snprintf(errorBuff, 255, "modBuildLightmaps: surface %i is too large",
+            i);
+        throw std::runtime_error(errorBuff);
+      }
+    }
+    surf.lightmaptexturenum = page;
+  }
+
+  const int stride = LIGHTMAP_PAGE_SIZE * 4;
+  const size_t pagesize = (size_t) LIGHTMAP_PAGE_SIZE * stride;
+  mod->numlightmaps = (int) pages.size();
+  mod->lightmaps.assign(pagesize * mod->numlightmaps, 0);
+  mod->lightmapdirty.assign((size_t) mod->numlightmaps * 64, 0);
+  mod->lightmapstylevalue = lightstylevalue;
+  dlitsurfaces.clear();
+  lastdlitsurfaces.clear();
+  for (int i : lit) {
+    MSurface &surf = mod->surfaces[i];
+    byte *dest = mod->lightmaps.data() + pagesize * surf.lightmaptexturenum
+        + (size_t) surf.light_t * stride + surf.light_s * 4;
+    rBuildLightMap(mod, &surf, dest, stride);
+  }
+
+  // BuildSurfaceDisplayList, lightmap coordinates land on texel centers
+  const SurfaceTable &table = mod->surftable;
+  mod->polylightmapcoords.assign(mod->polyverts.size(), glm::vec3(0.0f));
+  for (int i : lit) {
+    const MSurface &surf = mod->surfaces[i];
+    const MTexInfo *tex = surf.texinfo;
+    for (int v = 0; v < table.numverts[i]; v++) {
+      const glm::vec4 &p = mod->polyverts[table.firstvert[i] + v];
+      const glm::vec3 quake(p.x, -p.z, -p.y);
+      float s = glm::dot(quake, glm::make_vec3(tex->vecs[0])) + tex->vecs[0][3];
+      s -= surf.texturemins[0];
+      s += surf.light_s * 16;
+      s += 8;
+      s /= LIGHTMAP_PAGE_SIZE * 16;
+
+      float t = glm::dot(quake, glm::make_vec3(tex->vecs[1])) + tex->vecs[1][3];
+      t -= surf.texturemins[1];
+      t += surf.light_t * 16;
+      t += 8;
+      t /= LIGHTMAP_PAGE_SIZE * 16;
+
+      mod->polylightmapcoords[table.firstvert[i] + v] = glm::vec3(s, t,
+          (float) surf.lightmaptexturenum);
+    }
+  }
+}
+
+std::vector<std::string> vkglBSP::Model::defaultLightStyles() {
+  std::vector<std::string> styles(MAX_LIGHTSTYLES);
+  // 0 normal
+  styles[0] = "m";
+  // 1 FLICKER (first variety)
+  styles[1] = "mmnmmommommnonmmonqnmmo";
+  // 2 SLOW STRONG PULSE
+  styles[2] = "abcdefghijklmnopqrstuvwxyzyxwvutsrqponmlkjihgfedcba";
+  // 3 CANDLE (first variety)
+  styles[3] = "mmmmmaaaaammmmmaaaaaabcdefgabcdefg";
+  // 4 FAST STROBE
+  styles[4] = "mamamamamama";
+  // 5 GENTLE PULSE 1
+  styles[5] = "jklmnopqrstuvwxyzyxwvutsrqponmlkj";
+  // 6 FLICKER (second variety)
+  styles[6] = "nmonqnmomnmomomno";
+  // 7 CANDLE (second variety)
+  styles[7] = "mmmaaaabcdefgmmmmaaaammmaamm";
+  // 8 CANDLE (third variety)
+  styles[8] = "mmmaaammmaaammmabcdefaaaammmmabcdefmmmaaaa";
+  // 9 SLOW STROBE (fourth variety)
+  styles[9] = "aaaaaaaazzzzzzzz";
+  // 10 FLUORESCENT FLICKER
+  styles[10] = "mmamammmmammamamaaamammma";
+  // 11 SLOW PULSE NOT FADE TO BLACK
+  styles[11] = "abcdefghijklmnopqrrqponmlkjihgfedcba";
+  // styles 32-62 are assigned by the light program for switchable lights
+  // 63 testing
+  styles[63] = "a";
+  return styles;
+}
+
+/*
+ ==================
+ R_AnimateLight
+ ==================
+ */
+void vkglBSP::Model::rAnimateLight(double time) {
+  // light animations
+  // 'm' is normal light, 'a' is no light, 'z' is double bright
+  const int i = (int) (time * 10);
+  for (int j = 0; j < MAX_LIGHTSTYLES; j++) {
+    const std::string &map = lightstyles[j];
+    if (map.empty()) {
+      lightstylevalue[j] = 256;
+      continue;
+    }
+    const int k = map[i % map.size()] - 'a';
+    lightstylevalue[j] = k * 22;
+  }
+}
+
+/*
+ =============
+ R_MarkLights
+ =============
+ */
+void vkglBSP::Model::rMarkLights(const DLight *light, int num,
+    MNode *headnode) {
+  const float maxdist = light->radius * light->radius;
+  markstack.clear();
+  markstack.push_back(headnode);
+  while (!markstack.empty()) {
+    MNode *node = markstack.back();
+    markstack.pop_back();
+    if (node->contents < 0)
+      continue;
+
+    const MPlane *splitplane = node->plane;
+    const float dist = splitplane->type < 3 ?
+        light->origin[splitplane->type] - splitplane->dist :
+        glm::dot(light->origin, splitplane->normal) - splitplane->dist;
+
+    if (dist > light->radius) {
+      markstack.push_back(node->children[0]);
+      continue;
+    }
+    if (dist < -light->radius) {
+      markstack.push_back(node->children[1]);
+      continue;
+    }
+
+    // mark the polygons, they all lie on the node's plane
+    const glm::vec3 impact = light->origin - splitplane->normal * dist;
+    // The texinfo vectors are still in Quake space
+    const glm::vec3 quake(impact.x, -impact.z, -impact.y);
+    for (unsigned int i = 0; i < node->numsurfaces; i++) {
+      MSurface *surf = &loadmodel->surfaces[node->firstsurface + i];
+      if (surf->lightmaptexturenum < 0)
+        continue;
+      const MTexInfo *tex = surf->texinfo;
+
+      // clamp center of light to corner and check brightness
+      float l = glm::dot(quake, glm::make_vec3(tex->vecs[0])) + tex->vecs[0][3]
+          - surf->texturemins[0];
+      int s = (int) (l + 0.5f);
+      s = std::min(std::max(s, 0), (int) surf->extents[0]);
+      const float sd = l - s;
+      l = glm::dot(quake, glm::make_vec3(tex->vecs[1])) + tex->vecs[1][3]
+          - surf->texturemins[1];
+      int t = (int) (l + 0.5f);
+      t = std::min(std::max(t, 0), (int) surf->extents[1]);
+      const float td = l - t;
+
+      // compare to minimum light
+      if (sd * sd + td * td + dist * dist < maxdist) {
+        if (surf->dlightframe != r_dlightframecount) { // not dynamic until now
+          memset(surf->dlightbits, 0, sizeof(surf->dlightbits));
+          surf->dlightframe = r_dlightframecount;
+          dlitsurfaces.push_back(node->firstsurface + i);
+        }
+        surf->dlightbits[num >> 5] |= 1U << (num & 31);
+      }
+    }
+
+    markstack.push_back(node->children[0]);
+    markstack.push_back(node->children[1]);
+  }
+}
+
+/*
+ =============
+ R_PushDlights
+ =============
+ */
+void vkglBSP::Model::rPushDlights(double time) {
+  r_dlightframecount++;
+  std::swap(dlitsurfaces, lastdlitsurfaces);
+  dlitsurfaces.clear();
+  if (loadmodel->nodes.empty())
+    return;
+  for (int i = 0; i < MAX_DLIGHTS; i++) {
+    const DLight &l = dlights[i];
+    if (l.die < time || !l.radius)
+      continue;
+    rMarkLights(&l, i, loadmodel->nodes.data());
+  }
+}
+
+/*
+ ===============
+ R_AddDynamicLights
+ ===============
+ */
+void vkglBSP::Model::rAddDynamicLights(MSurface *surf) {
+  const int smax = (surf->extents[0] >> 4) + 1;
+  const int tmax = (surf->extents[1] >> 4) + 1;
+  const MTexInfo *tex = surf->texinfo;
+
+  for (int lnum = 0; lnum < MAX_DLIGHTS; lnum++) {
+    if (!(surf->dlightbits[lnum >> 5] & (1U << (lnum & 31))))
+      continue;   // not lit by this light
+
+    const DLight &light = dlights[lnum];
+    float rad = light.radius;
+    const float dist = glm::dot(light.origin, surf->plane->normal)
+        - surf->plane->dist;
+    rad -= fabsf(dist);
+    float minlight = light.minlight;
+    if (rad < minlight)
+      continue;
+    minlight = rad - minlight;
+
+    const glm::vec3 impact = light.origin - surf->plane->normal * dist;
+    const glm::vec3 quake(impact.x, -impact.z, -impact.y);
+    float local[2];
+    local[0] = glm::dot(quake, glm::make_vec3(tex->vecs[0])) + tex->vecs[0][3];
+    local[1] = glm::dot(quake, glm::make_vec3(tex->vecs[1])) + tex->vecs[1][3];
+    local[0] -= surf->texturemins[0];
+    local[1] -= surf->texturemins[1];
+
+    //johnfitz -- lit support via lordhavoc
+    unsigned *bl = blocklights.data();
+    const float cred = light.color[0] * 256.0f;
+    const float cgreen = light.color[1] * 256.0f;
+    const float cblue = light.color[2] * 256.0f;
+    for (int t = 0; t < tmax; t++) {
+      const int td = abs((int) local[1] - t * 16);
+      for (int s = 0; s < smax; s++, bl += 3) {
+        const int sd = abs((int) local[0] - s * 16);
+        const int d = sd > td ? sd + (td >> 1) : td + (sd >> 1);
+        if (d < minlight) {
+          const float brightness = rad - d;
+          bl[0] += (int) (brightness * cred);
+          bl[1] += (int) (brightness * cgreen);
+          bl[2] += (int) (brightness * cblue);
+        }
+      }
+    }
+  }
+}
+
+// Marks the tiles of surf's lightmap block as changed
+static void modMarkLightmapDirty(vkglBSP::QModel *mod,
+    const vkglBSP::MSurface *surf) {
+  const int smax = (surf->extents[0] >> 4) + 1;
+  const int tmax = (surf->extents[1] >> 4) + 1;
+  const int x0 = surf->light_s / LIGHTMAP_TILE;
+  const int x1 = (surf->light_s + smax - 1) / LIGHTMAP_TILE;
+  const int y0 = surf->light_t / LIGHTMAP_TILE;
+  const int y1 = (surf->light_t + tmax - 1) / LIGHTMAP_TILE;
+  const uint64_t bits = (x1 - x0 == 63 ? ~0ull : (2ull << (x1 - x0)) - 1) << x0;
+  uint64_t *rows = mod->lightmapdirty.data()
+      + (size_t) surf->lightmaptexturenum * 64;
+  for (int y = y0; y <= y1; y++) {
+    rows[y] |= bits;
+  }
+}
+
+/*
+ Turns the dirty tiles of every page into rectangles and clears them. Runs
+ of tiles in a row become one rectangle that grows downwards for as long as
+ the rows below have the same run.
+ */
+static void modLightmapRegions(vkglBSP::QModel *mod,
+    std::vector<VkBufferImageCopy> &regions) {
+  struct Run {
+    int x, width, y;
+  };
+  std::vector<Run> open, next;
+  const VkDeviceSize stride = LIGHTMAP_PAGE_SIZE * 4;
+  for (int page = 0; page < mod->numlightmaps; page++) {
+    uint64_t *rows = mod->lightmapdirty.data() + (size_t) page * 64;
+    open.clear();
+    for (int y = 0; y <= 64; y++) {
+      uint64_t mask = 0;
+      if (y < 64) {
+        mask = rows[y];
+        rows[y] = 0;
+      }
+      if (!mask && open.empty())
+        continue;
+
+      next.clear();
+      for (int x = 0; mask; x++, mask >>= 1) {
+        if (!(mask & 1))
+          continue;
+        Run run { x, 0, y };
+        while (mask & 1) {
+          run.width++;
+          x++;
+          mask >>= 1;
+        }
+        for (Run &o : open) {
+          if (o.x == run.x && o.width == run.width) {
+            run.y = o.y;
+            o.width = 0;
+            break;
+          }
+        }
+        next.push_back(run);
+        if (!mask)
+          break;
+      }
+
+      for (const Run &o : open) {
+        if (!o.width)
+          continue;
+        VkBufferImageCopy region = { };
+        region.bufferOffset = (VkDeviceSize) page * LIGHTMAP_PAGE_SIZE * stride
+            + (VkDeviceSize) o.y * LIGHTMAP_TILE * stride
+            + (VkDeviceSize) o.x * LIGHTMAP_TILE * 4;
+        region.bufferRowLength = LIGHTMAP_PAGE_SIZE;
+        region.imageSubresource.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT;
+        region.imageSubresource.baseArrayLayer = page;
+        region.imageSubresource.layerCount = 1;
+        region.imageOffset = { o.x * LIGHTMAP_TILE, o.y * LIGHTMAP_TILE, 0 };
+        region.imageExtent = { (uint32_t) (o.width * LIGHTMAP_TILE),
+            (uint32_t) ((y - o.y) * LIGHTMAP_TILE), 1 };
+        regions.push_back(region);
+      }
+      std::swap(open, next);
+    }
+  }
+}
+
+void vkglBSP::Model::rUpdateLightmaps(double time,
+    std::vector<VkBufferImageCopy> &regions) {
+  QModel *mod = loadmodel;
+  regions.clear();
+  if (mod->numlightmaps == 0)
+    return;
+
+  rAnimateLight(time);
+  rPushDlights(time);
+
+  // Surfaces using a style that changed, lit by a dlight now or last time
+  lightmapqueued.resize(mod->surfaces.size(), 0);
+  lightmapupdates.clear();
+  auto queue = [this](int surfnum) {
+    if (!lightmapqueued[surfnum]) {
+      lightmapqueued[surfnum] = 1;
+      lightmapupdates.push_back(surfnum);
+    }
+  };
+  for (int style = 0; style < MAX_LIGHTSTYLES; style++) {
+    if (lightstylevalue[style] == mod->lightmapstylevalue[style])
+      continue;
+    mod->lightmapstylevalue[style] = lightstylevalue[style];
+    for (int surfnum : mod->lightstylesurfaces[style])
+      queue(surfnum);
+  }
+  for (int surfnum : dlitsurfaces)
+    queue(surfnum);
+  for (int surfnum : lastdlitsurfaces)
+    queue(surfnum);
+
+  const int stride = LIGHTMAP_PAGE_SIZE * 4;
+  const size_t pagesize = (size_t) LIGHTMAP_PAGE_SIZE * stride;
+  for (int surfnum : lightmapupdates) {
+    MSurface *surf = &mod->surfaces[surfnum];
+    lightmapqueued[surfnum] = 0;
+    byte *dest = mod->lightmaps.data() + pagesize * surf->lightmaptexturenum
+        + (size_t) surf->light_t * stride + surf->light_s * 4;
+    rBuildLightMap(mod, surf, dest, stride);
+    modMarkLightmapDirty(mod, surf);
+  }
+
+  if (!lightmapupdates.empty())
+    modLightmapRegions(mod, regions);
+}
+
+void vkglBSP::Model::recordLightmapUpload(VkCommandBuffer commandBuffer,
+    const std::vector<VkBufferImageCopy> &regions) {
+  if (regions.empty())
+    return;
+
+  // The staging buffer mirrors loadmodel->lightmaps, only the rows of each
+  // region are copied over
+  const QModel *mod = loadmodel;
+  const size_t stride = LIGHTMAP_PAGE_SIZE * 4;
+  byte *staging = (byte*) lightmapStaging.mapped;
+  for (const VkBufferImageCopy &region : regions) {
+    const size_t rowbytes = region.imageExtent.width * 4;
+    for (uint32_t y = 0; y < region.imageExtent.height; y++) {
+      const size_t offset = region.bufferOffset + y * stride;
+      memcpy(staging + offset, mod->lightmaps.data() + offset, rowbytes);
+    }
+  }
+
+  VkImageSubresourceRange subresourceRange { };
+  subresourceRange.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT;
+  subresourceRange.levelCount = 1;
+  subresourceRange.layerCount = lightmapTexture.layerCount;
+  vks::tools::setImageLayout(commandBuffer, lightmapTexture.image,
+      VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL,
+      VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL, subresourceRange,
+      VK_PIPELINE_STAGE_RAY_TRACING_SHADER_BIT_KHR
+          | VK_PIPELINE_STAGE_FRAGMENT_SHADER_BIT,
+      VK_PIPELINE_STAGE_TRANSFER_BIT);
+  vkCmdCopyBufferToImage(commandBuffer, lightmapStaging.buffer,
+      lightmapTexture.image, VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL,
+      static_cast<uint32_t>(regions.size()), regions.data());
+  vks::tools::setImageLayout(commandBuffer, lightmapTexture.image,
+      VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL,
+      VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL, subresourceRange,
+      VK_PIPELINE_STAGE_TRANSFER_BIT,
+      VK_PIPELINE_STAGE_RAY_TRACING_SHADER_BIT_KHR
+          | VK_PIPELINE_STAGE_FRAGMENT_SHADER_BIT);
+}
+
+/*
+ =============================================================================
+
+ TEXTURES
+
+ =============================================================================
+ */
+
+/*
+ =================
+ TexMgr_LoadPalette
+ =================
+ */
+void vkglBSP::Model::texLoadPalette() {
+  const byte *pal = nullptr;
+  if (fileSystem && fileSystem->findFile("gfx/palette.lmp")) {
+    FileView file = fileSystem->loadFile("gfx/palette.lmp", nullptr);
+    if (file.size >= 768)
+      pal = file.data;
+  }
+  if (!pal) {
+    std::cout << "texLoadPalette: no gfx/palette.lmp, using a grey ramp"
+        << std::endl;
+  }
+
+  // RGBA8 in memory order, index 255 is the fence textures' transparent pixel
+  d_8to24table.resize(256);
+  for (int i = 0; i < 256; i++) {
+    const unsigned r = pal ? pal[i * 3] : i;
+    const unsigned g = pal ? pal[i * 3 + 1] : i;
+    const unsigned b = pal ? pal[i * 3 + 2] : i;
+    d_8to24table[i] = r | (g << 8) | (b << 16) | 0xff000000u;
+  }
+  d_8to24table_fence = d_8to24table;
+  d_8to24table_fence[255] = 0;
+}
+
+static bool modCheckFullbrightsScalar(const byte *pixels, size_t count) {
+  for (size_t i = 0; i < count; i++) {
+    if (pixels[i] > 223)
+      return true;
+  }
+  return false;
+}
+
+#if defined(VKGLBSP_X64)
+static bool modCheckFullbrightsSSE2(const byte *pixels, size_t count) {
+  // max(x, 224) == x only for the fullbright indexes
+  const __m128i bright = _mm_set1_epi8((char) 224);
+  __m128i acc = _mm_setzero_si128();
+  size_t i = 0;
+  for (; i + 16 <= count; i += 16) {
+    acc = _mm_max_epu8(acc, _mm_loadu_si128((const __m128i*) (pixels + i)));
+  }
+  if (_mm_movemask_epi8(_mm_cmpeq_epi8(_mm_max_epu8(acc, bright), acc)))
+    return true;
+  return modCheckFullbrightsScalar(pixels + i, count - i);
+}
+
+VKGLBSP_TARGET_AVX2 static bool modCheckFullbrightsAVX2(const byte *pixels,
+    size_t count) {
+  const __m256i bright = _mm256_set1_epi8((char) 224);
+  __m256i acc = _mm256_setzero_si256();
+  size_t i = 0;
+  for (; i + 32 <= count; i += 32) {
+    acc = _mm256_max_epu8(acc,
+        _mm256_loadu_si256((const __m256i*) (pixels + i)));
+  }
+  if (_mm256_movemask_epi8(
+      _mm256_cmpeq_epi8(_mm256_max_epu8(acc, bright), acc)))
+    return true;
+  return modCheckFullbrightsScalar(pixels + i, count - i);
+}
+#endif
+
+/*
+ ===============
+ Mod_CheckFullbrights
+ ===============
+ */
+bool vkglBSP::Model::modCheckFullbrights(const byte *pixels, size_t count) {
+#if defined(VKGLBSP_X64)
+  if (simdLevel >= SimdAVX2)
+    return modCheckFullbrightsAVX2(pixels, count);
+  if (simdLevel >= SimdSSE2)
+    return modCheckFullbrightsSSE2(pixels, count);
+#endif
+  return modCheckFullbrightsScalar(pixels, count);
+}
+
+/*
+ Palette lookup of count indexed pixels into out. With a fullbright mask the
+ fullbright colors (224 and up) are black in out and everything else is
+ black in fullbright, which is what the TEXPREF_NOBRIGHT and
+ TEXPREF_FULLBRIGHT palettes do. A transparent pixel stays transparent in
+ both.
+ */
+static void texDecodeIndexedScalar(const byte *in, size_t count,
+    const uint32_t *table, uint32_t *out, uint32_t *fullbright) {
+  if (!fullbright) {
+    for (size_t i = 0; i < count; i++) {
+      out[i] = table[in[i]];
+    }
+    return;
+  }
+  for (size_t i = 0; i < count; i++) {
+    const uint32_t c = table[in[i]];
+    if (in[i] > 223) {
+      out[i] = c & 0xff000000u;
+      fullbright[i] = c;
+    } else {
+      out[i] = c;
+      fullbright[i] = 0xff000000u;
+    }
+  }
+}
+
+#if defined(VKGLBSP_X64)
+static void texDecodeIndexedSSE2(const byte *in, size_t count,
+    const uint32_t *table, uint32_t *out, uint32_t *fullbright) {
+  const __m128i zero = _mm_setzero_si128();
+  const __m128i rgb = _mm_set1_epi32(0x00ffffff);
+  const __m128i alpha = _mm_set1_epi32((int) 0xff000000u);
+  const __m128i bright = _mm_set1_epi32(223);
+  size_t i = 0;
+  for (; i + 4 <= count; i += 4) {
+    const __m128i c = _mm_setr_epi32((int) table[in[i]],
+        (int) table[in[i + 1]], (int) table[in[i + 2]], (int) table[in[i + 3]]);
+    if (!fullbright) {
+      _mm_storeu_si128((__m128i*) (out + i), c);
+      continue;
+    }
+    int packed;
+    memcpy(&packed, in + i, sizeof(packed));
+    const __m128i index = _mm_unpacklo_epi16(
+        _mm_unpacklo_epi8(_mm_cvtsi32_si128(packed), zero), zero);
+    const __m128i mask = _mm_cmpgt_epi32(index, bright);
+    _mm_storeu_si128((__m128i*) (out + i),
+        _mm_andnot_si128(_mm_and_si128(mask, rgb), c));
+    _mm_storeu_si128((__m128i*) (fullbright + i),
+        _mm_or_si128(_mm_and_si128(mask, c), _mm_andnot_si128(mask, alpha)));
+  }
+  texDecodeIndexedScalar(in + i, count - i, table, out + i,
+      fullbright ? fullbright + i : nullptr);
+}
+
+VKGLBSP_TARGET_AVX2 static void texDecodeIndexedAVX2(const byte *in,
+    size_t count, const uint32_t *table, uint32_t *out, uint32_t *fullbright) {
+  const __m256i rgb = _mm256_set1_epi32(0x00ffffff);
+  const __m256i alpha = _mm256_set1_epi32((int) 0xff000000u);
+  const __m256i bright = _mm256_set1_epi32(223);
+  size_t i = 0;
+  for (; i + 8 <= count; i += 8) {
+    const __m256i index = _mm256_cvtepu8_epi32(
+        _mm_loadl_epi64((const __m128i*) (in + i)));
+    const __m256i c = _mm256_i32gather_epi32((const int*) table, index, 4);
+    if (!fullbright) {
+      _mm256_storeu_si256((__m256i*) (out + i), c);
+      continue;
+    }
+    const __m256i mask = _mm256_cmpgt_epi32(index, bright);
+    _mm256_storeu_si256((__m256i*) (out + i),
+        _mm256_andnot_si256(_mm256_and_si256(mask, rgb), c));
+    _mm256_storeu_si256((__m256i*) (fullbright + i),
+        _mm256_or_si256(_mm256_and_si256(mask, c),
+            _mm256_andnot_si256(mask, alpha)));
+  }
+  texDecodeIndexedScalar(in + i, count - i, table, out + i,
+      fullbright ? fullbright + i : nullptr);
+}
+#endif
+
+static void texDecodeIndexed(const byte *in, size_t count,
+    const uint32_t *table, uint32_t *out, uint32_t *fullbright) {
+#if defined(VKGLBSP_X64)
+  if (vkglBSP::simdLevel >= vkglBSP::SimdAVX2) {
+    texDecodeIndexedAVX2(in, count, table, out, fullbright);
+    return;
+  }
+  if (vkglBSP::simdLevel >= vkglBSP::SimdSSE2) {
+    texDecodeIndexedSSE2(in, count, table, out, fullbright);
+    return;
+  }
+#endif
+  texDecodeIndexedScalar(in, count, table, out, fullbright);
+}
+
+// RGBA8 bytes of a miptex's four levels
+static VkDeviceSize texMipChainSize(const vkglBSP::QTexture &tx) {
+  VkDeviceSize size = 0;
+  for (int j = 0; j < MIPLEVELS; j++) {
+    size += (VkDeviceSize) (tx.width >> j) * (tx.height >> j) * 4;
+  }
+  return size;
+}
+
+VkDeviceSize vkglBSP::Model::texLayoutTextures(QModel *mod,
+    std::vector<TextureDecode> &decodes) {
+  decodes.clear();
+  VkDeviceSize size = 0;
+  for (size_t i = 0; i < mod->textures.size(); i++) {
+    const QTexture &tx = mod->textures[i];
+    if (!tx.offsets[0] || !tx.width || !tx.height)
+      continue;
+
+    TextureDecode decode { };
+    decode.texture = (int) i;
+    // ericw -- fence textures
+    if (tx.name[0] == '{')
+      decode.flags |= TEXPREF_ALPHA;
+    // Sky and warping textures are loaded without a fullbright mask
+    if (tx.name[0] != '*' && strncmp(tx.name, "sky", 3)) {
+      for (int j = 0; j < MIPLEVELS; j++) {
+        if (modCheckFullbrights(mod->filebase + tx.offsets[j],
+            (size_t) (tx.width >> j) * (tx.height >> j))) {
+          decode.flags |= TEXPREF_NOBRIGHT;
+          break;
+        }
+      }
+    }
+
+    const VkDeviceSize chain = texMipChainSize(tx);
+    decode.offset = size;
+    size += chain;
+    if (decode.flags & TEXPREF_NOBRIGHT) {
+      decode.fullbrightoffset = size;
+      size += chain;
+    }
+    decodes.push_back(decode);
+  }
+  return size;
+}
+
+void vkglBSP::Model::texDecodeTextures(QModel *mod,
+    const std::vector<TextureDecode> &decodes, byte *staging,
+    uint32_t threads) {
+  if (d_8to24table.empty())
+    texLoadPalette();
+
+  std::atomic<size_t> next(0);
+  auto decodeTextures = [&] {
+    for (size_t i = next++; i < decodes.size(); i = next++) {
+      const TextureDecode &decode = decodes[i];
+      const QTexture &tx = mod->textures[decode.texture];
+      const uint32_t *table = (decode.flags & TEXPREF_ALPHA) ?
+          d_8to24table_fence.data() : d_8to24table.data();
+      VkDeviceSize level = 0;
+      for (int j = 0; j < MIPLEVELS; j++) {
+        const size_t count = (size_t) (tx.width >> j) * (tx.height >> j);
+        uint32_t *fullbright = (decode.flags & TEXPREF_NOBRIGHT) ?
+            (uint32_t*) (staging + decode.fullbrightoffset + level) : nullptr;
+        texDecodeIndexed(mod->filebase + tx.offsets[j], count, table,
+            (uint32_t*) (staging + decode.offset + level), fullbright);
+        level += count * 4;
+      }
+    }
+  };
+
+  if (threads == 0) {
+    threads = std::max(1u, std::thread::hardware_concurrency());
+  }
+  threads = (uint32_t) std::min<size_t>(threads, decodes.size());
+  if (threads <= 1) {
+    decodeTextures();
+    return;
+  }
+  vks::ThreadPool threadPool;
+  threadPool.setThreadCount(threads);
+  for (auto &thread : threadPool.threads) {
+    thread->addJob(decodeTextures);
+  }
+  threadPool.wait();
+}
+
+/*
+ =============================================================================
+
+ HULL TRACING
+
+ =============================================================================
+ */
+
+// 1/32 epsilon to keep floating point happy
+#define DIST_EPSILON 0.03125f
+// Splits whose far side is still to be walked, deeper than any Quake tree
+#define HULL_STACK 256
+
+// The far side of a split, waiting for the near side to be walked
+struct HullCheckFrame {
+  int num;
+  int side;
+  float p1f, p2f;
+  float frac;
+  glm::vec3 p1, p2;
+};
+
+static inline float hullPlaneDist(const vkglBSP::MPlane *plane,
+    const glm::vec3 &p) {
+  if (plane->type < 3)
+    return p[plane->type] - plane->dist;
+  return glm::dot(plane->normal, p) - plane->dist;
+}
+
+int vkglBSP::Model::hullPointContents(const Hull *hull, int num,
+    const glm::vec3 &p) {
+  while (num >= 0) {
+    const MClipNode *node = hull->clipnodes + num;
+    const float d = hullPlaneDist(hull->planes + node->planenum, p);
+    num = node->children[d < 0 ? 1 : 0];
+  }
+  return num;
+}
+
+bool vkglBSP::Model::hullCheck(const Hull *hull, int num, float p1f,
+    float p2f, const glm::vec3 &start, const glm::vec3 &end, Trace &trace) {
+  HullCheckFrame stack[HULL_STACK];
+  int depth = 0;
+  glm::vec3 p1 = start, p2 = end;
+
+  for (;;) {
+    // Down the near side of every split to a leaf
+    while (num >= 0) {
+      const MClipNode *node = hull->clipnodes + num;
+      const MPlane *plane = hull->planes + node->planenum;
+      const float t1 = hullPlaneDist(plane, p1);
+      const float t2 = hullPlaneDist(plane, p2);
+      if (t1 >= 0 && t2 >= 0) {
+        num = node->children[0];
+        continue;
+      }
+      if (t1 < 0 && t2 < 0) {
+        num = node->children[1];
+        continue;
+      }
+
+      // put the crosspoint DIST_EPSILON pixels on the near side
+      float frac = t1 < 0 ? (t1 + DIST_EPSILON) / (t1 - t2)
+          : (t1 - DIST_EPSILON) / (t1 - t2);
+      frac = std::min(std::max(frac, 0.0f), 1.0f);
+      const int side = t1 < 0 ? 1 : 0;
+
+      // Out of stack, stop at the start of this segment instead of passing
+      // through something
+      if (depth == HULL_STACK) {
+        trace.fraction = p1f;
+        trace.endpos = p1;
+        trace.plane.normal = side ? -plane->normal : plane->normal;
+        trace.plane.dist = side ? -plane->dist : plane->dist;
+        return false;
+      }
+      HullCheckFrame &frame = stack[depth++];
+      frame.num = num;
+      frame.side = side;
+      frame.p1f = p1f;
+      frame.p2f = p2f;
+      frame.frac = frac;
+      frame.p1 = p1;
+      frame.p2 = p2;
+
+      p2f = p1f + (p2f - p1f) * frac;
+      p2 = p1 + frac * (p2 - p1);
+      num = node->children[side];
+    }
+
+    // empty leafs clear allsolid
+    if (num != CONTENTS_SOLID) {
+      trace.allsolid = false;
+      if (num == CONTENTS_EMPTY)
+        trace.inopen = true;
+      else
+        trace.inwater = true;
+    } else {
+      trace.startsolid = true;
+    }
+
+    // The near side came through, go past the innermost split
+    if (depth == 0)
+      return true;
+    const HullCheckFrame &frame = stack[--depth];
+    const MClipNode *node = hull->clipnodes + frame.num;
+    float frac = frame.frac;
+    float midf = frame.p1f + (frame.p2f - frame.p1f) * frac;
+    glm::vec3 mid = frame.p1 + frac * (frame.p2 - frame.p1);
+
+    if (hullPointContents(hull, node->children[frame.side ^ 1], mid)
+        != CONTENTS_SOLID) {
+      num = node->children[frame.side ^ 1];
+      p1f = midf;
+      p2f = frame.p2f;
+      p1 = mid;
+      p2 = frame.p2;
+      continue;
+    }
+
+    if (trace.allsolid)
+      return false;   // never got out of the solid area
+
+    // the other side of the node is solid, this is the impact point
+    const MPlane *plane = hull->planes + node->planenum;
+    trace.plane.normal = frame.side ? -plane->normal : plane->normal;
+    trace.plane.dist = frame.side ? -plane->dist : plane->dist;
+
+    while (hullPointContents(hull, hull->firstclipnode, mid)
+        == CONTENTS_SOLID) {
+      // shouldn't really happen, but does occasionally
+      frac -= 0.1f;
+      if (frac < 0) {
+        break;
+      }
+      midf = frame.p1f + (frame.p2f - frame.p1f) * frac;
+      mid = frame.p1 + frac * (frame.p2 - frame.p1);
+    }
+
+    trace.fraction = midf;
+    trace.endpos = mid;
+    return false;
+  }
+}
+
+int vkglBSP::Model::modPointContents(QModel *model, const glm::vec3 &p) {
+  const Hull *hull = &model->hulls[0];
+  return hullPointContents(hull, model->submodels[0].headnode[0], p);
+}
+
+const vkglBSP::Hull* vkglBSP::Model::modHullForBox(QModel *model,
+    int submodel, const glm::vec3 &mins, const glm::vec3 &maxs,
+    glm::vec3 &offset, int &headnode) {
+  // x is the same axis in render space, so the hull sizes still apply
+  const float size = maxs.x - mins.x;
+  int h;
+  if (size < 3)
+    h = 0;
+  else if (size <= 32)
+    h = 1;
+  else
+    h = 2;
+
+  const Hull *hull = &model->hulls[h];
+  offset = hull->clip_mins - mins;
+  headnode = model->submodels[submodel].headnode[h];
+  return hull;
+}
+
+vkglBSP::Trace vkglBSP::Model::modTraceBox(QModel *model, int submodel,
+    const glm::vec3 &start, const glm::vec3 &mins, const glm::vec3 &maxs,
+    const glm::vec3 &end) {
+  // fill in a default trace
+  Trace trace { };
+  trace.fraction = 1;
+  trace.allsolid = true;
+  trace.endpos = end;
+
+  glm::vec3 offset;
+  int headnode;
+  const Hull *hull = modHullForBox(model, submodel, mins, maxs, offset,
+      headnode);
+  hullCheck(hull, headnode, 0, 1, start - offset, end - offset, trace);
+
+  // fix trace up by the offset
+  if (trace.fraction != 1)
+    trace.endpos += offset;
+  return trace;
+}
+
+void vkglBSP::Model::modTraceBoxes(QModel *model, int submodel,
+    const TraceBox *boxes, Trace *traces, size_t count, uint32_t threads) {
+  // Chunks are small enough to balance traces of very different lengths
+  const size_t chunk = 256;
+  std::atomic<size_t> next(0);
+  auto traceChunks = [&] {
+    for (;;) {
+      const size_t first = next.fetch_add(chunk);
+      if (first >= count)
+        break;
+      const size_t last = std::min(first + chunk, count);
+      for (size_t i = first; i < last; i++) {
+        const TraceBox &box = boxes[i];
+        traces[i] = modTraceBox(model, submodel, box.start, box.mins,
+            box.maxs, box.end);
+      }
+    }
+  };
+
+  if (threads == 0) {
+    threads = std::max(1u, std::thread::hardware_concurrency());
+  }
+  threads = (uint32_t) std::min<size_t>(threads, (count + chunk - 1) / chunk);
+  if (threads <= 1) {
+    traceChunks();
+    return;
+  }
+  vks::ThreadPool threadPool;
+  threadPool.setThreadCount(threads);
+  for (uint32_t i = 0; i < threads; i++) {
+    threadPool.threads[i]->addJob(traceChunks);
+  }
+  threadPool.wait();
+}
+
+#define MAX_CLIP_PLANES 5
+#define STOP_EPSILON 0.1f
+
+/*
+ ==================
+ ClipVelocity
+
+ Slide off of the impacting object
+ ==================
+ */
+static glm::vec3 modClipVelocity(const glm::vec3 &in, const glm::vec3 &normal,
+    float overbounce) {
+  const float backoff = glm::dot(in, normal) * overbounce;
+  glm::vec3 out = in - normal * backoff;
+  for (int i = 0; i < 3; i++) {
+    if (out[i] > -STOP_EPSILON && out[i] < STOP_EPSILON)
+      out[i] = 0;
+  }
+  return out;
+}
+
+glm::vec3 vkglBSP::Model::modFlyMove(QModel *model, const glm::vec3 &start,
+    const glm::vec3 &mins, const glm::vec3 &maxs, const glm::vec3 &move) {
+  glm::vec3 origin = start;
+  glm::vec3 velocity = move;
+  const glm::vec3 primal_velocity = move;
+  glm::vec3 original_velocity = move;
+  glm::vec3 planes[MAX_CLIP_PLANES];
+  int numplanes = 0;
+  float time_left = 1.0f;
+
+  for (int bumpcount = 0; bumpcount < 4; bumpcount++) {
+    if (velocity == glm::vec3(0.0f))
+      break;
+
+    const glm::vec3 end = origin + time_left * velocity;
+    const Trace trace = modTraceBox(model, 0, origin, mins, maxs, end);
+
+    if (trace.allsolid) {
+      // entity is trapped in another solid, stay where it is
+      return origin;
+    }
+
+    if (trace.fraction > 0) { // actually covered some distance
+      origin = trace.endpos;
+      original_velocity = velocity;
+      numplanes = 0;
+    }
+
+    if (trace.fraction == 1)
+      break;    // moved the entire distance
+
+    time_left -= time_left * trace.fraction;
+
+    // cliped to another plane
+    if (numplanes >= MAX_CLIP_PLANES) {
+      break;
+    }
+    planes[numplanes++] = trace.plane.normal;
+
+    // modify original_velocity so it parallels all of the clip planes
+    glm::vec3 new_velocity;
+    int i;
+    for (i = 0; i < numplanes; i++) {
+      new_velocity = modClipVelocity(original_velocity, planes[i], 1);
+      int j;
+      for (j = 0; j < numplanes; j++) {
+        if (j != i && glm::dot(new_velocity, planes[j]) < 0)
+          break;  // not ok
+      }
+      if (j == numplanes)
+        break;
+    }
+
+    if (i != numplanes) { // go along this plane
+      velocity = new_velocity;
+    } else {  // go along the crease
+      if (numplanes != 2) {
+        break;
+      }
+      const glm::vec3 dir = glm::cross(planes[0], planes[1]);
+      velocity = dir * glm::dot(dir, velocity);
+    }
+
+    // if original velocity is against the original velocity, stop dead
+    // to avoid tiny occilations in sloping corners
+    if (glm::dot(velocity, primal_velocity) <= 0) {
+      break;
+    }
+  }
+
+  return origin;
+}
+
+glm::vec3 vkglBSP::Model::modWalkMove(QModel *model, const glm::vec3 &origin,
+    const glm::vec3 &mins, const glm::vec3 &maxs, const glm::vec3 &move) {
+  // Quake's up is -y in render space
+  const glm::vec3 up(0.0f, -1.0f, 0.0f);
+  const glm::vec3 flat = move - up * glm::dot(move, up);
+
+  // Try the move as it is and, when something was in the way, once more
+  // stepped up. Like SV_WalkMove the step is only kept if it got further
+  // and the push back down ends on ground flat enough to stand on
+  glm::vec3 result = modFlyMove(model, origin, mins, maxs, flat);
+  const glm::vec3 plainMove = result - origin;
+  const float plainDist = glm::dot(plainMove, plainMove)
+      - glm::dot(plainMove, up) * glm::dot(plainMove, up);
+  if (plainDist < glm::dot(flat, flat) * 0.99f) {
+    const glm::vec3 raised = modFlyMove(model, origin, mins, maxs,
+        up * (float) STEPSIZE);
+    const glm::vec3 stepped = modFlyMove(model, raised, mins, maxs, flat);
+    const glm::vec3 steppedMove = stepped - origin;
+    const float steppedDist = glm::dot(steppedMove, steppedMove)
+        - glm::dot(steppedMove, up) * glm::dot(steppedMove, up);
+    if (steppedDist > plainDist) {
+      const Trace trace = modTraceBox(model, 0, stepped, mins, maxs,
+          stepped - up * (float) STEPSIZE);
+      if (!trace.allsolid && trace.fraction < 1
+          && glm::dot(trace.plane.normal, up) > 0.7f) {
+        return trace.endpos;
+      }
+    }
+  }
+
+  // Follow floors down stairs and slopes, but never more than a step. Off a
+  // ledge the box stays where it is, falling is up to the caller
+  const Trace trace = modTraceBox(model, 0, result, mins, maxs,
+      result - up * (float) STEPSIZE);
+  if (!trace.allsolid && trace.fraction < 1
+      && glm::dot(trace.plane.normal, up) > 0.7f) {
+    result = trace.endpos;
+  }
+  return result;
+}
+
+/*
+ =============================================================================
+
+ CPU RAY TRACING
+
+ =============================================================================
+ */
+
+// Relative SAH costs of visiting a node and testing a packet of BVH_WIDTH triangles
+#define BVH_NODE_COST 1.0f
+#define BVH_PACKET_COST 1.0f
+// Below this depth ranges are halved instead of SAH split, so traversal stacks stay bounded
+#define BVH_MAX_DEPTH 48
+#define BVH_STACK 256
+
+struct BVHBuildPrim {
+  glm::vec3 mins, maxs;
+  glm::vec3 centroid;
+  uint32_t id;
+};
+
+struct BVHBuildNode {
+  glm::vec3 mins, maxs;
+  int children[2];    // -1 in leafs
+  int first, count;   // range of BVHBuildPrims
+};
+
+// A subtree that is built on its own thread and stitched in at node
+struct BVHBuildTask {
+  int node;
+  int first, count;
+  int depth;
+  std::vector<BVHBuildNode> nodes;
+};
+
+struct BVHRay {
+  glm::vec3 origin, direction;
+  float inv[3];
+  float originInv[3];
+  int nearRow[3];   // bounds row the ray enters through on each axis
+  int farRow[3];
+};
+
+static float bvhArea(const glm::vec3 &mins, const glm::vec3 &maxs) {
+  const glm::vec3 d = maxs - mins;
+  return d.x * d.y + d.y * d.z + d.z * d.x;
+}
+
+static int bvhBin(const BVHBuildPrim &prim, int axis, float cmin, float scale) {
+  return std::min(BVH_BINS - 1, (int) ((prim.centroid[axis] - cmin) * scale));
+}
+
+/*
+ Finds the binned SAH split of prims[first, first + count) and partitions
+ the range around it. Returns the size of the left side, 0 for a leaf.
+ */
+static int bvhSplit(BVHBuildPrim *prims, int first, int count, int depth,
+    const glm::vec3 &mins, const glm::vec3 &maxs) {
+  if (count <= BVH_WIDTH) {
+    return 0;
+  }
+  if (depth >= BVH_MAX_DEPTH) {
+    return count / 2;
+  }
+
+  glm::vec3 cmin = prims[first].centroid, cmax = cmin;
+  for (int i = first + 1; i < first + count; i++) {
+    cmin = glm::min(cmin, prims[i].centroid);
+    cmax = glm::max(cmax, prims[i].centroid);
+  }
+
+  struct Bin {
+    glm::vec3 mins, maxs;
+    int count;
+  };
+  float bestCost = FLT_MAX;
+  int bestAxis = -1, bestBin = 0;
+  for (int axis = 0; axis < 3; axis++) {
+    const float extent = cmax[axis] - cmin[axis];
+    if (extent <= 0.0f) {
+      continue;
+    }
+    const float scale = BVH_BINS / extent;
+    Bin bins[BVH_BINS];
+    for (Bin &bin : bins) {
+      bin.mins = glm::vec3(FLT_MAX);
+      bin.maxs = glm::vec3(-FLT_MAX);
+      bin.count = 0;
+    }
+    for (int i = first; i < first + count; i++) {
+      Bin &bin = bins[bvhBin(prims[i], axis, cmin[axis], scale)];
+      bin.mins = glm::min(bin.mins, prims[i].mins);
+      bin.maxs = glm::max(bin.maxs, prims[i].maxs);
+      bin.count++;
+    }
+
+    // Sweep from the right for the cost of everything after each split
+    float rightCost[BVH_BINS];
+    glm::vec3 rmins(FLT_MAX), rmaxs(-FLT_MAX);
+    int rcount = 0;
+    for (int b = BVH_BINS - 1; b > 0; b--) {
+      rmins = glm::min(rmins, bins[b].mins);
+      rmaxs = glm::max(rmaxs, bins[b].maxs);
+      rcount += bins[b].count;
+      rightCost[b] = rcount ? rcount * bvhArea(rmins, rmaxs) : -1.0f;
+    }
+    glm::vec3 lmins(FLT_MAX), lmaxs(-FLT_MAX);
+    int lcount = 0;
+    for (int b = 0; b < BVH_BINS - 1; b++) {
+      lmins = glm::min(lmins, bins[b].mins);
+      lmaxs = glm::max(lmaxs, bins[b].maxs);
+      lcount += bins[b].count;
+      if (lcount == 0 || rightCost[b + 1] < 0.0f) {
+        continue;
+      }
+      const float cost = lcount * bvhArea(lmins, lmaxs) + rightCost[b + 1];
+      if (cost < bestCost) {
+        bestCost = cost;
+        bestAxis = axis;
+        bestBin = b;
+      }
+    }
+  }
+
+  // Every centroid is the same point, only a split by position helps
+  if (bestAxis < 0) {
+    return count <= BVH_MAX_LEAF ? 0 : count / 2;
+  }
+
+  const float area = bvhArea(mins, maxs);
+  const float leafCost = BVH_PACKET_COST * area
+      * ((count + BVH_WIDTH - 1) / BVH_WIDTH);
+  const float splitCost = BVH_NODE_COST * area
+      + BVH_PACKET_COST * bestCost / BVH_WIDTH;
+  if (count <= BVH_MAX_LEAF && leafCost <= splitCost) {
+    return 0;
+  }
+
+  const float scale = BVH_BINS / (cmax[bestAxis] - cmin[bestAxis]);
+  const float cminAxis = cmin[bestAxis];
+  BVHBuildPrim *mid = std::partition(prims + first, prims + first + count,
+      [=](const BVHBuildPrim &prim) {
+        return bvhBin(prim, bestAxis, cminAxis, scale) <= bestBin;
+      });
+  const int left = (int) (mid - (prims + first));
+  return (left == 0 || left == count) ? count / 2 : left;
+}
+
+/*
+ Builds the binary tree over prims[first, first + count) into nodes and
+ returns its root. With tasks, ranges of at most grain primitives are
+ left as placeholder leafs and queued to be built separately.
+ */
+static int bvhBuildNode(BVHBuildPrim *prims, std::vector<BVHBuildNode> &nodes,
+    int first, int count, int depth, int grain,
+    std::vector<BVHBuildTask> *tasks) {
+  const int index = (int) nodes.size();
+  nodes.push_back(BVHBuildNode());
+  BVHBuildNode node;
+  node.mins = prims[first].mins;
+  node.maxs = prims[first].maxs;
+  for (int i = first + 1; i < first + count; i++) {
+    node.mins = glm::min(node.mins, prims[i].mins);
+    node.maxs = glm::max(node.maxs, prims[i].maxs);
+  }
+  node.children[0] = node.children[1] = -1;
+  node.first = first;
+  node.count = count;
+  nodes[index] = node;
+
+  if (tasks && count <= grain) {
+    BVHBuildTask task;
+    task.node = index;
+    task.first = first;
+    task.count = count;
+    task.depth = depth;
+    tasks->push_back(std::move(task));
+    return index;
+  }
+
+  const int left = bvhSplit(prims, first, count, depth, node.mins, node.maxs);
+  if (left == 0) {
+    return index;
+  }
+  const int l = bvhBuildNode(prims, nodes, first, left, depth + 1, grain, tasks);
+  const int r = bvhBuildNode(prims, nodes, first + left, count - left,
+      depth + 1, grain, tasks);
+  nodes[index].children[0] = l;
+  nodes[index].children[1] = r;
+  return index;
+}
+
+static void bvhPackLeaf(vkglBSP::BVH &bvh, const BVHBuildPrim *prims,
+    const BVHBuildNode &leaf, const glm::vec4 *vertices,
+    const uint32_t *indexes) {
+  for (int i = 0; i < leaf.count; i += BVH_WIDTH) {
+    vkglBSP::BVHTriangles packet;
+    memset(&packet, 0, sizeof(packet));
+    for (int lane = 0; lane < BVH_WIDTH && i + lane < leaf.count; lane++) {
+      const uint32_t id = prims[leaf.first + i + lane].id;
+      const glm::vec3 v0 = glm::vec3(vertices[indexes[3 * id]]);
+      const glm::vec3 e1 = glm::vec3(vertices[indexes[3 * id + 1]]) - v0;
+      const glm::vec3 e2 = glm::vec3(vertices[indexes[3 * id + 2]]) - v0;
+      for (int a = 0; a < 3; a++) {
+        packet.v0[a][lane] = v0[a];
+        packet.e1[a][lane] = e1[a];
+        packet.e2[a][lane] = e2[a];
+      }
+      packet.id[lane] = id;
+    }
+    bvh.triangles.push_back(packet);
+  }
+}
+
+/*
+ Fills bvh.nodes[wide] from the binary node, opening the inner child with
+ the largest area until all BVH_WIDTH slots are used. Adds the SAH cost of
+ everything below to cost.
+ */
+static void bvhCollapse(vkglBSP::BVH &bvh,
+    const std::vector<BVHBuildNode> &nodes, const BVHBuildPrim *prims,
+    const glm::vec4 *vertices, const uint32_t *indexes, int binary, int wide,
+    float &cost) {
+  int children[BVH_WIDTH];
+  int numchildren = 0;
+  if (nodes[binary].children[0] < 0) {
+    children[numchildren++] = binary;   // a root that is a single leaf
+  } else {
+    children[numchildren++] = nodes[binary].children[0];
+    children[numchildren++] = nodes[binary].children[1];
+  }
+  while (numchildren < BVH_WIDTH) {
+    int open = -1;
+    float openArea = -1.0f;
+    for (int i = 0; i < numchildren; i++) {
+      const BVHBuildNode &child = nodes[children[i]];
+      const float area = bvhArea(child.mins, child.maxs);
+      if (child.children[0] >= 0 && area > openArea) {
+        open = i;
+        openArea = area;
+      }
+    }
+    if (open < 0) {
+      break;
+    }
+    const BVHBuildNode &child = nodes[children[open]];
+    children[numchildren++] = child.children[1];
+    children[open] = child.children[0];
+  }
+
+  for (int i = 0; i < BVH_WIDTH; i++) {
+    vkglBSP::BVHNode &out = bvh.nodes[wide];
+    if (i >= numchildren) {
+      for (int a = 0; a < 3; a++) {
+        out.bounds[a][i] = FLT_MAX;
+        out.bounds[a + 3][i] = -FLT_MAX;
+      }
+      out.child[i] = -1;
+      out.count[i] = 0;
+      continue;
+    }
+    const BVHBuildNode &child = nodes[children[i]];
+    for (int a = 0; a < 3; a++) {
+      out.bounds[a][i] = child.mins[a];
+      out.bounds[a + 3][i] = child.maxs[a];
+    }
+    const float area = bvhArea(child.mins, child.maxs);
+    if (child.children[0] < 0) {
+      out.child[i] = (int) bvh.triangles.size();
+      bvhPackLeaf(bvh, prims, child, vertices, indexes);
+      out.count[i] = (int) bvh.triangles.size() - out.child[i];
+      cost += BVH_PACKET_COST * area * out.count[i];
+    } else {
+      const int node = (int) bvh.nodes.size();
+      out.child[i] = node;
+      out.count[i] = 0;
+      bvh.nodes.push_back(vkglBSP::BVHNode());
+      cost += BVH_NODE_COST * area;
+      bvhCollapse(bvh, nodes, prims, vertices, indexes, children[i], node, cost);
+    }
+  }
+}
+
+void vkglBSP::BVH::build(const glm::vec4 *vertices, const uint32_t *indexes,
+    uint32_t numTriangles, uint32_t threads) {
+  nodes.clear();
+  triangles.clear();
+  sahCost = 0.0f;
+  if (numTriangles == 0) {
+    return;
+  }
+  if (threads == 0) {
+    threads = std::max(1u, std::thread::hardware_concurrency());
+  }
+
+  std::vector<BVHBuildPrim> prims(numTriangles);
+  for (uint32_t i = 0; i < numTriangles; i++) {
+    const glm::vec3 v0 = glm::vec3(vertices[indexes[3 * i]]);
+    const glm::vec3 v1 = glm::vec3(vertices[indexes[3 * i + 1]]);
+    const glm::vec3 v2 = glm::vec3(vertices[indexes[3 * i + 2]]);
+    BVHBuildPrim &prim = prims[i];
+    prim.mins = glm::min(v0, glm::min(v1, v2));
+    prim.maxs = glm::max(v0, glm::max(v1, v2));
+    prim.centroid = (prim.mins + prim.maxs) * 0.5f;
+    prim.id = i;
+  }
+
+  // The top of the tree is split serially until every thread has a few
+  // subtrees to build, the subtrees go to whichever thread is free
+  std::vector<BVHBuildNode> buildNodes;
+  std::vector<BVHBuildTask> tasks;
+  const int grain = threads > 1 ?
+      std::max(1024, (int) (numTriangles / (threads * 4))) : (int) numTriangles;
+  bvhBuildNode(prims.data(), buildNodes, 0, (int) numTriangles, 0, grain, &tasks);
+
+  std::atomic<int> nextTask(0);
+  auto buildTasks = [&] {
+    for (int i = nextTask++; i < (int) tasks.size(); i = nextTask++) {
+      BVHBuildTask &task = tasks[i];
+      bvhBuildNode(prims.data(), task.nodes, task.first, task.count,
+          task.depth, 0, nullptr);
+    }
+  };
+  if (threads > 1 && tasks.size() > 1) {
+    vks::ThreadPool threadPool;
+    threadPool.setThreadCount(std::min(threads, (uint32_t) tasks.size()));
+    for (auto &thread : threadPool.threads) {
+      thread->addJob(buildTasks);
+    }
+    threadPool.wait();
+  } else {
+    buildTasks();
+  }
+
+  for (BVHBuildTask &task : tasks) {
+    const int offset = (int) buildNodes.size();
+    for (BVHBuildNode node : task.nodes) {
+      if (node.children[0] >= 0) {
+        node.children[0] += offset;
+        node.children[1] += offset;
+      }
+      buildNodes.push_back(node);
+    }
+    buildNodes[task.node] = buildNodes[offset];
+  }
+
+  const BVHBuildNode &root = buildNodes[0];
+  const float rootArea = bvhArea(root.mins, root.maxs);
+  float cost = BVH_NODE_COST * rootArea;
+  nodes.push_back(BVHNode());
+  bvhCollapse(*this, buildNodes, prims.data(), vertices, indexes, 0, 0, cost);
+  sahCost = rootArea > 0.0f ? cost / rootArea : 0.0f;
+}
+
+static void bvhSetupRay(BVHRay &ray, const glm::vec3 &origin,
+    const glm::vec3 &direction) {
+  ray.origin = origin;
+  ray.direction = direction;
+  for (int a = 0; a < 3; a++) {
+    // Keeps the slab distances finite, 0 * inf would poison them
+    float d = direction[a];
+    if (fabsf(d) < 1e-20f) {
+      d = d < 0.0f ? -1e-20f : 1e-20f;
+    }
+    ray.inv[a] = 1.0f / d;
+    ray.originInv[a] = origin[a] * ray.inv[a];
+    ray.nearRow[a] = ray.inv[a] >= 0.0f ? a : a + 3;
+    ray.farRow[a] = ray.inv[a] >= 0.0f ? a + 3 : a;
+  }
+}
+
+static int bvhNodeScalar(const vkglBSP::BVHNode &node, const BVHRay &ray,
+    float tmin, float tmax, float *tnear) {
+  int mask = 0;
+  for (int i = 0; i < BVH_WIDTH; i++) {
+    float t0 = tmin, t1 = tmax;
+    for (int a = 0; a < 3; a++) {
+      t0 = std::max(t0,
+          node.bounds[ray.nearRow[a]][i] * ray.inv[a] - ray.originInv[a]);
+      t1 = std::min(t1,
+          node.bounds[ray.farRow[a]][i] * ray.inv[a] - ray.originInv[a]);
+    }
+    tnear[i] = t0;
+    mask |= (t0 <= t1) << i;
+  }
+  return mask;
+}
+
+static int bvhTrianglesScalar(const vkglBSP::BVHTriangles &tris,
+    const BVHRay &ray, float tmin, float tmax, float *t, float *u, float *v) {
+  const glm::vec3 &d = ray.direction;
+  int mask = 0;
+  for (int i = 0; i < BVH_WIDTH; i++) {
+    const glm::vec3 e1(tris.e1[0][i], tris.e1[1][i], tris.e1[2][i]);
+    const glm::vec3 e2(tris.e2[0][i], tris.e2[1][i], tris.e2[2][i]);
+    const glm::vec3 p = glm::cross(d, e2);
+    const float det = glm::dot(e1, p);
+    if (det == 0.0f) {
+      continue;
+    }
+    const float inv = 1.0f / det;
+    const glm::vec3 s = ray.origin
+        - glm::vec3(tris.v0[0][i], tris.v0[1][i], tris.v0[2][i]);
+    u[i] = glm::dot(s, p) * inv;
+    const glm::vec3 q = glm::cross(s, e1);
+    v[i] = glm::dot(d, q) * inv;
+    t[i] = glm::dot(e2, q) * inv;
+    mask |= (u[i] >= 0.0f && v[i] >= 0.0f && u[i] + v[i] <= 1.0f
+        && t[i] > tmin && t[i] < tmax) << i;
+  }
+  return mask;
+}
+
+#if defined(VKGLBSP_X64)
+static int bvhNodeSSE2(const vkglBSP::BVHNode &node, const BVHRay &ray,
+    float tmin, float tmax, float *tnear) {
+  __m128 t0 = _mm_set1_ps(tmin), t1 = _mm_set1_ps(tmax);
+  for (int a = 0; a < 3; a++) {
+    const __m128 inv = _mm_set1_ps(ray.inv[a]);
+    const __m128 originInv = _mm_set1_ps(ray.originInv[a]);
+    t0 = _mm_max_ps(t0, _mm_sub_ps(
+        _mm_mul_ps(_mm_loadu_ps(node.bounds[ray.nearRow[a]]), inv), originInv));
+    t1 = _mm_min_ps(t1, _mm_sub_ps(
+        _mm_mul_ps(_mm_loadu_ps(node.bounds[ray.farRow[a]]), inv), originInv));
+  }
+  _mm_storeu_ps(tnear, t0);
+  return _mm_movemask_ps(_mm_cmple_ps(t0, t1));
+}
+
+static int bvhTrianglesSSE2(const vkglBSP::BVHTriangles &tris,
+    const BVHRay &ray, float tmin, float tmax, float *t, float *u, float *v) {
+  const __m128 dx = _mm_set1_ps(ray.direction.x);
+  const __m128 dy = _mm_set1_ps(ray.direction.y);
+  const __m128 dz = _mm_set1_ps(ray.direction.z);
+  const __m128 e1x = _mm_loadu_ps(tris.e1[0]), e1y = _mm_loadu_ps(tris.e1[1]);
+  const __m128 e1z = _mm_loadu_ps(tris.e1[2]);
+  const __m128 e2x = _mm_loadu_ps(tris.e2[0]), e2y = _mm_loadu_ps(tris.e2[1]);
+  const __m128 e2z = _mm_loadu_ps(tris.e2[2]);
+
+  // p = d x e2, det = e1 . p
+  const __m128 px = _mm_sub_ps(_mm_mul_ps(dy, e2z), _mm_mul_ps(dz, e2y));
+  const __m128 py = _mm_sub_ps(_mm_mul_ps(dz, e2x), _mm_mul_ps(dx, e2z));
+  const __m128 pz = _mm_sub_ps(_mm_mul_ps(dx, e2y), _mm_mul_ps(dy, e2x));
+  const __m128 det = _mm_add_ps(_mm_add_ps(_mm_mul_ps(e1x, px),
+      _mm_mul_ps(e1y, py)), _mm_mul_ps(e1z, pz));
+  const __m128 inv = _mm_div_ps(_mm_set1_ps(1.0f), det);
+
+  // s = origin - v0, u = (s . p) / det
+  const __m128 sx = _mm_sub_ps(_mm_set1_ps(ray.origin.x), _mm_loadu_ps(tris.v0[0]));
+  const __m128 sy = _mm_sub_ps(_mm_set1_ps(ray.origin.y), _mm_loadu_ps(tris.v0[1]));
+  const __m128 sz = _mm_sub_ps(_mm_set1_ps(ray.origin.z), _mm_loadu_ps(tris.v0[2]));
+  const __m128 uu = _mm_mul_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(sx, px),
+      _mm_mul_ps(sy, py)), _mm_mul_ps(sz, pz)), inv);
+
+  // q = s x e1, v = (d . q) / det, t = (e2 . q) / det
+  const __m128 qx = _mm_sub_ps(_mm_mul_ps(sy, e1z), _mm_mul_ps(sz, e1y));
+  const __m128 qy = _mm_sub_ps(_mm_mul_ps(sz, e1x), _mm_mul_ps(sx, e1z));
+  const __m128 qz = _mm_sub_ps(_mm_mul_ps(sx, e1y), _mm_mul_ps(sy, e1x));
+  const __m128 vv = _mm_mul_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(dx, qx),
+      _mm_mul_ps(dy, qy)), _mm_mul_ps(dz, qz)), inv);
+  const __m128 tt = _mm_mul_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(e2x, qx),
+      _mm_mul_ps(e2y, qy)), _mm_mul_ps(e2z, qz)), inv);
+
+  const __m128 zero = _mm_setzero_ps();
+  __m128 hit = _mm_cmpneq_ps(det, zero);
+  hit = _mm_and_ps(hit, _mm_cmpge_ps(uu, zero));
+  hit = _mm_and_ps(hit, _mm_cmpge_ps(vv, zero));
+  hit = _mm_and_ps(hit, _mm_cmple_ps(_mm_add_ps(uu, vv), _mm_set1_ps(1.0f)));
+  hit = _mm_and_ps(hit, _mm_cmpgt_ps(tt, _mm_set1_ps(tmin)));
+  hit = _mm_and_ps(hit, _mm_cmplt_ps(tt, _mm_set1_ps(tmax)));
+  _mm_storeu_ps(t, tt);
+  _mm_storeu_ps(u, uu);
+  _mm_storeu_ps(v, vv);
+  return _mm_movemask_ps(hit);
+}
+#endif
+
+typedef int (*BVHNodeKernel)(const vkglBSP::BVHNode&, const BVHRay&, float,
+    float, float*);
+typedef int (*BVHTrianglesKernel)(const vkglBSP::BVHTriangles&, const BVHRay&,
+    float, float, float*, float*, float*);
+
+/*
+ Stack based traversal that visits hit children nearest first. AnyHit
+ returns at the first triangle found, for shadow rays.
+ */
+template<bool AnyHit, BVHNodeKernel testNode, BVHTrianglesKernel testTriangles>
+static bool bvhTraverse(const vkglBSP::BVH &bvh, const BVHRay &ray, float tmin,
+    float tmax, vkglBSP::BVHHit *hit) {
+  if (bvh.nodes.empty()) {
+    return false;
+  }
+
+  struct Entry {
+    int child, count;
+    float tnear;
+  };
+  Entry stack[BVH_STACK];
+  int sp = 0;
+  stack[sp++] = { 0, 0, tmin };
+  float best = tmax;
+  bool found = false;
+
+  while (sp > 0) {
+    const Entry entry = stack[--sp];
+    if (entry.tnear > best) {
+      continue;
+    }
+
+    if (entry.count == 0) {
+      const vkglBSP::BVHNode &node = bvh.nodes[entry.child];
+      float tnear[BVH_WIDTH];
+      int mask = testNode(node, ray, tmin, best, tnear);
+
+      // Far children go on the stack first so the nearest is popped next
+      Entry hits[BVH_WIDTH];
+      int numhits = 0;
+      for (int i = 0; mask; i++, mask >>= 1) {
+        if (!(mask & 1)) {
+          continue;
+        }
+        Entry e = { node.child[i], node.count[i], tnear[i] };
+        int j = numhits++;
+        for (; j > 0 && hits[j - 1].tnear < e.tnear; j--) {
+          hits[j] = hits[j - 1];
+        }
+        hits[j] = e;
+      }
+      for (int i = 0; i < numhits; i++) {
+        stack[sp++] = hits[i];
+      }
+      continue;
+    }
+
+    for (int p = entry.child; p < entry.child + entry.count; p++) {
+      float t[BVH_WIDTH], u[BVH_WIDTH], v[BVH_WIDTH];
+      int mask = testTriangles(bvh.triangles[p], ray, tmin, best, t, u, v);
+      if (!mask) {
+        continue;
+      }
+      if (AnyHit) {
+        return true;
+      }
+      for (int i = 0; mask; i++, mask >>= 1) {
+        if ((mask & 1) && t[i] < best) {
+          best = t[i];
+          hit->t = t[i];
+          hit->u = u[i];
+          hit->v = v[i];
+          hit->triangle = bvh.triangles[p].id[i];
+          found = true;
+        }
+      }
+    }
+  }
+  return found;
+}
+
+bool vkglBSP::BVH::intersect(const glm::vec3 &origin,
+    const glm::vec3 &direction, float tmin, float tmax, BVHHit &hit) const {
+  BVHRay ray;
+  bvhSetupRay(ray, origin, direction);
+#if defined(VKGLBSP_X64)
+  if (simdLevel >= SimdSSE2) {
+    return bvhTraverse<false, bvhNodeSSE2, bvhTrianglesSSE2>(*this, ray, tmin,
+        tmax, &hit);
+  }
+#endif
+  return bvhTraverse<false, bvhNodeScalar, bvhTrianglesScalar>(*this, ray,
+      tmin, tmax, &hit);
+}
+
+bool vkglBSP::BVH::occluded(const glm::vec3 &origin,
+    const glm::vec3 &direction, float tmin, float tmax) const {
+  BVHRay ray;
+  bvhSetupRay(ray, origin, direction);
+#if defined(VKGLBSP_X64)
+  if (simdLevel >= SimdSSE2) {
+    return bvhTraverse<true, bvhNodeSSE2, bvhTrianglesSSE2>(*this, ray, tmin,
+        tmax, nullptr);
+  }
+#endif
+  return bvhTraverse<true, bvhNodeScalar, bvhTrianglesScalar>(*this, ray,
+      tmin, tmax, nullptr);
+}
+
+void vkglBSP::Model::rTraceImage(const BVH &bvh, const glm::mat4 &view,
+    const glm::mat4 &perspective, const glm::vec4 &lightPos, uint32_t width,
+    uint32_t height, uint32_t threads, uint32_t *rgba) {
+  const QModel *model = loadmodel;
+  const SurfaceTable &table = model->surftable;
+
+  // Triangles follow the surfaces in the order modBuildIndexes emits them,
+  // each one gets the plane normal of its surface like the vertex stream
+  std::vector<glm::vec3> normals;
+  normals.reserve(model->polyindexes.size() / 3);
+  for (int s = 0; s < table.size(); s++) {
+    if (table.flags[s] & SURF_TRIGGER) {
+      continue;
+    }
+    glm::vec3 normal = model->planes[table.planenum[s]].normal;
+    if (table.flags[s] & SURF_PLANEBACK) {
+      normal = -normal;
+    }
+    for (int i = 0; i < table.numverts[s] - 2; i++) {
+      normals.push_back(normal);
+    }
+  }
+
+  const glm::mat4 viewInverse = glm::inverse(view);
+  const glm::mat4 projInverse = glm::inverse(perspective);
+  // raygen.rgen transforms (1, 1, 1) rather than the eye, kept so the images match
+  const glm::vec3 origin = glm::vec3(viewInverse * glm::vec4(1.0f, 1.0f, 1.0f, 1.0f));
+  const glm::vec3 lightVector = glm::normalize(glm::vec3(lightPos));
+
+  auto traceRows = [&](uint32_t firstRow, uint32_t step) {
+    for (uint32_t y = firstRow; y < height; y += step) {
+      for (uint32_t x = 0; x < width; x++) {
+        const float dx = ((float) x + 0.5f) / (float) width * 2.0f - 1.0f;
+        const float dy = ((float) y + 0.5f) / (float) height * 2.0f - 1.0f;
+        const glm::vec4 target = projInverse * glm::vec4(dx, dy, 1.0f, 1.0f);
+        const glm::vec3 direction = glm::vec3(viewInverse
+            * glm::vec4(glm::normalize(glm::vec3(target) / target.w), 0.0f));
+
+        // Miss shader color, then the closest hit shader's lighting and shadow
+        glm::vec3 color(0.0f, 0.0f, 0.2f);
+        BVHHit hit;
+        if (bvh.intersect(origin, direction, 0.001f, 10000.0f, hit)) {
+          const float light = std::max(glm::dot(lightVector,
+              normals[hit.triangle]), 0.2f);
+          color = glm::vec3(0.7f * light);
+          const glm::vec3 position = origin + direction * hit.t;
+          if (bvh.occluded(position, lightVector, 0.001f, 1000.0f)) {
+            color *= 0.3f;
+          }
+        }
+
+        uint32_t pixel = 0xff000000;
+        for (int c = 0; c < 3; c++) {
+          const float value = std::min(std::max(color[c], 0.0f), 1.0f);
+          pixel |= (uint32_t) (value * 255.0f + 0.5f) << (8 * c);
+        }
+        rgba[y * width + x] = pixel;
+      }
+    }
+  };
+
+  if (threads == 0) {
+    threads = std::max(1u, std::thread::hardware_concurrency());
+  }
+  threads = std::min(threads, height);
+  if (threads <= 1) {
+    traceRows(0, 1);
+    return;
+  }
+  // Rows are interleaved so every thread gets a share of the busy parts
+  vks::ThreadPool threadPool;
+  threadPool.setThreadCount(threads);
+  for (uint32_t i = 0; i < threads; i++) {
+    threadPool.threads[i]->addJob([&traceRows, i, threads] {
+      traceRows(i, threads);
+    });
+  }
+  threadPool.wait();
+}
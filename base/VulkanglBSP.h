@@ -8,6 +8,7 @@
 
 #include "vulkan/vulkan.h"
 #include "VulkanDevice.h"
+#include "frustum.hpp"
 
 #include <ktx.h>
 #include <ktxvulkan.h>
@@ -38,12 +39,17 @@
 
 #define MAX_QPATH 64    // max length of a quake game pathname
 #define MAX_MAP_HULLS   4
+#define STEPSIZE  18  // highest ledge modWalkMove climbs
+#define DEFAULT_VIEWHEIGHT  22  // eye above the player origin
 #define NUM_AMBIENTS      4   // automatic ambient sounds
 #define ES_SOLID_NOT 0
 #define ES_SOLID_BSP 31
 #define ES_SOLID_HULL1 0x80201810
 #define ES_SOLID_HULL2 0x80401820
 #define MAXLIGHTMAPS  4
+#define MAX_LIGHTSTYLES 64
+#define LIGHTMAP_PAGE_SIZE  1024  // texels per side of a lightmap atlas page
+#define LIGHTMAP_TILE (LIGHTMAP_PAGE_SIZE / 64)  // dirty tracking, a row of tiles is one 64 bit mask
 #define MAX_DLIGHTS   64 //johnfitz -- was 32
 #define VERTEXSIZE  7
 #define IDPOLYHEADER  (('O'<<24)+('P'<<16)+('D'<<8)+'I')
@@ -76,8 +82,14 @@
 
 #define LOADFILE_STACK    4
 #define MAX_OSPATH 1024
+
+#define GAMENAME "id1"    // directory to look in by default
 #define MAX_HANDLES   32  /* johnfitz -- was 10 */
 #define MAX_FILES_IN_PACK 2048
+#define MAX_MOD_KNOWN 2048
+
+#define PVS_CACHE_ROWS  256 // decompressed PVS rows kept per model
+#define PVS_ROW_ALIGN 32  // rows are padded to whole AVX2 vectors
 
 #define SURF_PLANEBACK    2
 #define SURF_DRAWSKY    4
@@ -92,6 +104,32 @@
 #define SURF_DRAWSLIME    0x800
 #define SURF_DRAWTELE   0x1000
 #define SURF_DRAWWATER    0x2000
+#define SURF_TRIGGER      0x4000  // trigger brush faces, loaded but never drawn
+
+// 0-2 are axial planes
+#define PLANE_X     0
+#define PLANE_Y     1
+#define PLANE_Z     2
+
+// 3-5 are non-axial planes snapped to the nearest
+#define PLANE_ANYX    3
+#define PLANE_ANYY    4
+#define PLANE_ANYZ    5
+
+#define CONTENTS_EMPTY    -1
+#define CONTENTS_SOLID    -2
+#define CONTENTS_WATER    -3
+#define CONTENTS_SLIME    -4
+#define CONTENTS_LAVA     -5
+#define CONTENTS_SKY      -6
+#define CONTENTS_ORIGIN   -7  // removed at csg time
+#define CONTENTS_CLIP     -8  // changed to contents_solid
+#define CONTENTS_CURRENT_0    -9
+#define CONTENTS_CURRENT_90   -10
+#define CONTENTS_CURRENT_180  -11
+#define CONTENTS_CURRENT_270  -12
+#define CONTENTS_CURRENT_UP   -13
+#define CONTENTS_CURRENT_DOWN -14
 
 #define TEXPREF_NONE      0x0000
 #define TEXPREF_MIPMAP      0x0001  // generate mipmaps
@@ -139,6 +177,17 @@ extern VkDescriptorSetLayout descriptorSetLayoutUbo;
 extern VkMemoryPropertyFlags memoryPropertyFlags;
 extern uint32_t descriptorBindingFlags;
 
+// Instruction sets the SIMD kernels are built for, higher levels include the lower ones
+enum SimdLevel {
+  SimdScalar, SimdSSE2, SimdAVX2
+};
+
+// Best level the CPU and OS support, detected once
+SimdLevel simdSupported();
+// Level the kernels dispatch on, starts at simdSupported(). Benchmarks lower it
+// to compare implementations, it must never be raised above simdSupported().
+extern SimdLevel simdLevel;
+
 struct Node;
 struct QTexture;
 struct MTexInfo;
@@ -186,6 +235,88 @@ struct DLFace {
   int lightofs;   // start of [numstyles*surfsize] samples
 };
 
+struct DPlane {
+  float normal[3];
+  float dist;
+  int type;   // PLANE_X - PLANE_ANYZ ?remove? trivial to regenerate
+};
+
+struct DSNode {
+  int planenum;
+  short children[2];  // negative numbers are -(leafs+1), not nodes
+  short mins[3];    // for sphere culling
+  short maxs[3];
+  unsigned short firstface;
+  unsigned short numfaces;  // counting both sides
+};
+
+struct DL1Node {
+  int planenum;
+  int children[2];  // negative numbers are -(leafs+1), not nodes
+  short mins[3];    // for sphere culling
+  short maxs[3];
+  unsigned int firstface;
+  unsigned int numfaces;  // counting both sides
+};
+
+struct DL2Node {
+  int planenum;
+  int children[2];  // negative numbers are -(leafs+1), not nodes
+  float mins[3];    // for sphere culling
+  float maxs[3];
+  unsigned int firstface;
+  unsigned int numfaces;  // counting both sides
+};
+
+struct DSClipNode {
+  int planenum;
+  short children[2];  // negative numbers are contents
+};
+
+struct DLClipNode {
+  int planenum;
+  int children[2];  // negative numbers are contents
+};
+
+struct DSLeaf {
+  int contents;
+  int visofs;       // -1 = no visibility info
+
+  short mins[3];      // for frustum culling
+  short maxs[3];
+
+  unsigned short firstmarksurface;
+  unsigned short nummarksurfaces;
+
+  byte ambient_level[NUM_AMBIENTS];
+};
+
+struct DL1Leaf {
+  int contents;
+  int visofs;       // -1 = no visibility info
+
+  short mins[3];      // for frustum culling
+  short maxs[3];
+
+  unsigned int firstmarksurface;
+  unsigned int nummarksurfaces;
+
+  byte ambient_level[NUM_AMBIENTS];
+};
+
+struct DL2Leaf {
+  int contents;
+  int visofs;       // -1 = no visibility info
+
+  float mins[3];      // for frustum culling
+  float maxs[3];
+
+  unsigned int firstmarksurface;
+  unsigned int nummarksurfaces;
+
+  byte ambient_level[NUM_AMBIENTS];
+};
+
 struct DMipTexLump {
   int nummiptex;
   int dataofs[4];   // [nummiptex]
@@ -286,6 +417,15 @@ struct MClipNode {
   int children[2]; // negative numbers are contents
 };
 
+// dlight_t, origin in render space
+struct DLight {
+  glm::vec3 origin = glm::vec3(0.0f);
+  float radius = 0.0f;
+  float die = 0.0f;       // stop lighting after this time
+  float minlight = 0.0f;  // don't add when contributing less
+  glm::vec3 color = glm::vec3(1.0f);  //johnfitz -- lit support via lordhavoc
+};
+
 struct EFrag {
   struct EFrag *leafnext;
   struct entity_s *entity;
@@ -308,13 +448,75 @@ struct Hull {
   glm::vec3 clip_maxs;
 };
 
+struct TracePlane {
+  glm::vec3 normal;
+  float dist;
+};
+
+struct Trace {
+  bool allsolid;    // if true, plane is not valid
+  bool startsolid;  // if true, the initial point was in a solid area
+  bool inopen, inwater;
+  float fraction;   // time completed, 1.0 = didn't hit anything
+  glm::vec3 endpos; // final position
+  TracePlane plane; // surface normal at impact
+};
+
+// One box move for Model::modTraceBoxes
+struct TraceBox {
+  glm::vec3 start, end;
+  glm::vec3 mins, maxs;
+};
+
 struct GlPoly {
-  struct GlPoly *next;
+  int next;         // index into QModel::polys, -1 ends the chain
   int numverts;
 //  float verts[4][VERTEXSIZE]; // variable sized (xyz s1t1 s2t2)
-  std::vector<glm::vec4> verts;
+  int firstvert;    // index into QModel::polyverts
 };
 
+/*
+ Per surface data the renderer walks every frame, as parallel arrays indexed
+ like QModel::surfaces. The polygon of surface i is numverts[i] vertices
+ starting at firstvert[i] in QModel::polyverts.
+ */
+struct SurfaceTable {
+  std::vector<int> firstvert;
+  std::vector<int> numverts;
+  std::vector<int> planenum;    // index into QModel::planes
+  std::vector<int> texinfo;     // index into QModel::texinfo
+  std::vector<int> flags;       // SURF_ flags, same as MSurface::flags
+
+  int size() const {
+    return (int) firstvert.size();
+  }
+
+  void reserve(size_t count) {
+    firstvert.reserve(count);
+    numverts.reserve(count);
+    planenum.reserve(count);
+    texinfo.reserve(count);
+    flags.reserve(count);
+  }
+
+  void clear() {
+    firstvert.clear();
+    numverts.clear();
+    planenum.clear();
+    texinfo.clear();
+    flags.clear();
+  }
+};
+
+/*
+ One draw of R_RenderWorld, indexcount indices starting at firstindex in
+ QModel::visindexes that all use QModel::textures[texture]
+ */
+struct VisBatch {
+  int texture;
+  uint32_t firstindex;
+  uint32_t indexcount;
+};
 
 struct MSurface {
   int visframe;   // should be drawn when node is crossed
@@ -330,7 +532,7 @@ struct MSurface {
 
   int light_s, light_t; // gl lightmap coordinates
 
-  GlPoly polys;       // multiple if warped
+  int polys;        // subdivided warp polygons in QModel::polys, -1 if none
   MSurface *texturechain;
 
   MTexInfo *texinfo;
@@ -380,13 +582,23 @@ struct QTexture {
   int anim_min, anim_max;   // time for this frame min <=time< max
   QTexture *anim_next;   // in the animation sequence
   QTexture *alternate_anims; // bmodels in frmae 1 use these
-  unsigned offsets[MIPLEVELS];   // four mip maps stored
+  // Byte offset of each mip level's indexed pixels in QModel::filebase, 0 when
+  // the miptex is missing or its pixels run past the end of the lump
+  unsigned offsets[MIPLEVELS];
+};
+
+// Where Model::texDecodeTextures puts one miptex in the staging buffer
+struct TextureDecode {
+  int texture;          // into QModel::textures
+  int flags;            // TEXPREF_ALPHA, TEXPREF_NOBRIGHT when there is a fullbright mask
+  VkDeviceSize offset;  // RGBA8 mip chain, level after level
+  VkDeviceSize fullbrightoffset;  // mask mip chain for TEXPREF_NOBRIGHT
 };
 
 
 struct MTexInfo {
   float vecs[2][4];
-  QTexture texture;
+  QTexture *texture;    // into QModel::textures
   int flags;
 };
 
@@ -411,6 +623,55 @@ struct MLeaf {
   byte ambient_sound_level[NUM_AMBIENTS];
 };
 
+/*
+ Least recently used cache of decompressed PVS rows, indexed by leaf number.
+ Rows live in one arena and are padded to PVS_ROW_ALIGN bytes with zeros, so
+ they can be combined with full vectors and no tail handling.
+ */
+class PVSCache {
+public:
+  int rowbytes = 0;   // padded row size
+  int hits = 0, misses = 0;
+
+  void reset(int numleafs, int rowsize, int capacity);
+  // Returns nullptr when leaf is not cached, otherwise makes it the most recent row
+  byte* find(int leaf);
+  // Takes a row for leaf, recycling the least recently used one when full.
+  // Its contents are stale and must be overwritten.
+  byte* insert(int leaf);
+
+private:
+  std::vector<byte> rows;
+  std::vector<int> slotOfLeaf;  // -1 when not cached
+  std::vector<int> leafOfSlot;
+  std::vector<int> prev, next;  // recency list, head is the most recent
+  int head = -1, tail = -1;
+  int used = 0;
+
+  void unlink(int slot);
+  void pushFront(int slot);
+};
+
+/*
+ Skyline allocator for lightmap atlas pages. The top edge of everything
+ placed so far is kept as a list of horizontal segments, a block goes where
+ its bottom ends up lowest and ties go to the left, like Quake's AllocBlock
+ without scanning every column.
+ */
+class LightmapSkyline {
+public:
+  void reset(int width, int height);
+  // Places a w x h block, false when it does not fit anywhere on the page
+  bool alloc(int w, int h, int &x, int &y);
+
+private:
+  struct Segment {
+    int x, y, width;
+  };
+  std::vector<Segment> skyline;
+  int width = 0, height = 0;
+};
+
 struct DHeader {
   int version;
   Lump lumps[HEADER_LUMPS];
@@ -429,6 +690,7 @@ struct QModel {
   unsigned int path_id;		// path id of the game directory
   // that this model came from
   bool needload;		// bmodels and sprites don't cache normally
+  uint64_t sourcehash;  // Model::comBlockHash of the file, keys every cache built from it
 
   ModType type;
   int numframes;
@@ -456,23 +718,31 @@ struct QModel {
   int firstmodelsurface, nummodelsurfaces;
 
   int numsubmodels;
-  DModel *submodels;
+  std::vector<DModel> submodels;
 
   int numplanes;
-  MPlane *planes;
+  std::vector<MPlane> planes;
 
   int numleafs;		// number of visible leafs, not counting 0
-  MLeaf *leafs;
+  std::vector<MLeaf> leafs;
 
   int numvertexes;
   std::vector<MVertex> vertexes;
 
   int numedges;
-  std::vector<uint32_t> edges;
   std::vector<MEdge> medges;
 
+  SurfaceTable surftable;
+
+  // Vertex pool for every surface polygon, packed back to back. Subdivided
+  // warp polygons are appended after the surface polygons.
+  std::vector<glm::vec4> polyverts;
+  std::vector<GlPoly> polys;
+  // Triangle fan indices into polyverts for every surface polygon
+  std::vector<uint32_t> polyindexes;
+
   int numnodes;
-  MNode *nodes;
+  std::vector<MNode> nodes;
 
   int numtexinfo;
   std::vector<MTexInfo> texinfo;
@@ -484,25 +754,52 @@ struct QModel {
   std::vector<int> surfedges;
 
   int numclipnodes;
-  MClipNode *clipnodes; //johnfitz -- was dclipnode_t
+  std::vector<MClipNode> clipnodes; //johnfitz -- was dclipnode_t
 
   int nummarksurfaces;
-  int *marksurfaces;
+  std::vector<int> marksurfaces;
 
+  // Mod_PrepareSIMDData, groups of 8 world leafs (leaf i + 1 in slot i, like
+  // PVS bits) and of 8 surfaces. Both point into simddata.
+  std::vector<float> simddata;
   soa_aabb_t *soa_leafbounds;
-  byte *surfvis;
   soa_plane_t *soa_surfplanes;
+  std::vector<byte> leafvis;  // one bit per world leaf, PVS layout
+  std::vector<byte> surfvis;  // one bit per surface
+
+  // R_RenderWorld output, triangle lists into polyverts grouped by texture
+  std::vector<uint32_t> visindexes;
+  std::vector<VisBatch> visbatches;
 
   Hull hulls[MAX_MAP_HULLS];
+  std::vector<MClipNode> hull0clipnodes;  // Mod_MakeHull0, nodes as clipnodes
 
   int numtextures;
   std::vector<QTexture> textures;
-
-  byte *visdata;
-  byte *lightdata;
+  // The BSP file as the file system maps it, miptex pixels are read from here
+  const byte *filebase;
+  size_t filesize;
+
+  std::vector<byte> visdata;
+  std::vector<byte> lightdata;    // RGB, mono lightmaps are expanded on load
+  // GL_BuildLightmaps, numlightmaps atlas pages of LIGHTMAP_PAGE_SIZE squared
+  // RGBA texels, one layer each of the lightmap texture array
+  int numlightmaps;
+  std::vector<byte> lightmaps;
+  // Normalized lightmap coordinates and page of every polyverts entry
+  std::vector<glm::vec3> polylightmapcoords;
+  // Lit surfaces using each lightstyle, and the style values the lightmaps
+  // hold right now
+  std::vector<std::vector<int>> lightstylesurfaces;
+  std::vector<int> lightmapstylevalue;
+  // Tiles of each page changed since the last upload, one mask per tile row
+  std::vector<uint64_t> lightmapdirty;
   char *entities;
 
   bool viswarn; // for Mod_DecompressVis()
+  PVSCache pvscache;
+  std::vector<byte> novis;    // everything visible, for the solid leaf and maps without vis
+  std::vector<byte> fatpvs;   // Mod_FatPVS result
 
   int bspversion;
   int contentstransparent; //spike -- added this so we can disable glitchy wateralpha where its not supported.
@@ -585,11 +882,101 @@ struct PackFile {
   int filepos, filelen;
 };
 
+// Read only view into a memory mapped file, stays valid as long as the owning pack is open
+// data is null only when there is no such file, a zero length file has a
+// non-null data and a size of 0
+struct FileView {
+  const byte *data = nullptr;
+  size_t size = 0;
+
+  bool missing() const {
+    return data == nullptr;
+  }
+};
+
 struct Pack {
   char filename[MAX_OSPATH];
-  FILE *handle;
-  int numfiles;
+  int numfiles = 0;
   std::vector<PackFile> files;
+
+  // The whole archive is mapped once, file contents are handed out as views into this mapping
+  const byte *base = nullptr;
+  size_t size = 0;
+
+  FileView view(const PackFile &file) const;
+};
+
+struct SearchPath {
+  unsigned int path_id;     // identifies the game directory this path belongs to
+  char filename[MAX_OSPATH];  // loose directory, only used when pack is nullptr
+  Pack *pack;               // only one of filename / pack will be used
+};
+
+// A file visible through the search paths, after precedence has been resolved
+struct FileEntry {
+  char name[MAX_QPATH];
+  int searchPath;           // index into FileSystem::searchPaths
+  int filepos, filelen;     // position inside the pack, loose files start at 0
+
+  // Loose files are mapped on first use, FileSystem::looseMappings owns the mapping
+  const byte *mapped;
+};
+
+/*
+ Virtual file system over every mounted pak and game directory
+
+ Search paths are ordered like Quake's com_searchpaths list: the packs of a
+ game directory come before its loose files, higher numbered packs come
+ before lower numbered ones and game directories added later come first.
+ All of them are merged into a single hash index, so a lookup costs one
+ probe sequence no matter how many archives are mounted.
+ */
+class FileSystem {
+public:
+  // Highest precedence first
+  std::vector<SearchPath> searchPaths;
+
+  FileSystem() {
+  }
+  ~FileSystem();
+
+  /*
+   ================
+   COM_AddGameDirectory
+
+   Mounts dir and every dir/pakN.pak found (N = 0, 1, ...) on top of the
+   current search paths and rebuilds the merged index
+   ================
+   */
+  void addGameDirectory(const char *dir);
+
+  const FileEntry* findFile(const char *filename) const;
+
+  // Returns a missing() view when the file does not exist
+  FileView loadFile(const char *filename, unsigned int *path_id);
+
+  Pack* loadPackFile(const char *packfile);
+  void closePackFile(Pack *pack);
+  void shutdown();
+
+  static uint32_t hashName(const char *name);
+
+private:
+  FileSystem(const FileSystem&);
+  FileSystem& operator=(const FileSystem&);
+
+  std::vector<FileEntry> entries;
+  // Open addressing hash index into entries (-1 = empty slot), size is always a power of two
+  std::vector<int> hashIndex;
+  unsigned int nextPathId = 1;
+  char errorBuff[256];
+  // Every loose file mapping handed out. Rebuilding the index forgets the
+  // entries but not these, views stay valid until shutdown
+  std::vector<FileView> looseMappings;
+
+  void addLooseFiles(int searchPath, const char *dir, const char *prefix);
+  void buildIndex();
+  void unmapLooseFiles();
 };
 
 //
@@ -606,6 +993,88 @@ struct DPackHeader {
   int dirlen;
 };
 
+//
+// on-disk map cache (.bspc)
+//
+// Everything the loader derives from a BSP, stored in the layout of the
+// QModel arrays so a cached map is loaded with one mapping and a copy per
+// section into the model's own vectors; the mapping is released as soon as
+// the model is filled. Pointers are stored as indices. The vertexes, edges and surfedges
+// the polygons were built from are not kept. Bump BSPC_VERSION whenever a
+// record layout or anything the loader computes changes.
+//
+#define BSPC_IDENT  (('C'<<24)+('P'<<16)+('S'<<8)+'B')  // "BSPC"
+#define BSPC_VERSION  4
+#define BSPC_ALIGN  16  // sections can be copied straight into GPU staging memory
+
+#define BSPC_POLYVERTS  0
+#define BSPC_POLYINDEXES  1
+#define BSPC_POLYS    2
+#define BSPC_SURF_FIRSTVERT 3
+#define BSPC_SURF_NUMVERTS  4
+#define BSPC_SURF_PLANENUM  5
+#define BSPC_SURF_TEXINFO 6
+#define BSPC_SURF_FLAGS 7
+#define BSPC_SURFACES 8
+#define BSPC_PLANES   9
+#define BSPC_NODES    10
+#define BSPC_LEAFS    11
+#define BSPC_MARKSURFACES 12
+#define BSPC_CLIPNODES  13
+#define BSPC_SUBMODELS  14
+#define BSPC_TEXTURES 15
+#define BSPC_TEXINFO  16
+#define BSPC_VISIBILITY 17
+#define BSPC_LIGHTING 18
+#define BSPC_SECTIONS 19
+
+struct BspcHeader {
+  int ident;
+  int version;
+  unsigned int sourcelen;
+  int bspversion;
+  uint64_t sourcehash;      // Model::comBlockHash of the .bsp the cache was built from
+  uint64_t datahash;        // Model::comBlockHash of everything after the header
+  Lump sections[BSPC_SECTIONS];
+};
+
+struct BspcSurface {
+  int firstedge, numedges;
+  short texturemins[2];
+  short extents[2];
+  int light_s, light_t;
+  int polys;
+  int lightofs;   // into QModel::lightdata, -1 = no lightmap
+  byte styles[MAXLIGHTMAPS];
+};
+
+struct BspcNode {
+  int planenum;
+  int children[2];  // negative numbers are -(leafs + 1)
+  float minmaxs[6];
+  unsigned int firstsurface, numsurfaces;
+};
+
+struct BspcLeaf {
+  int contents;
+  int visofs;     // into QModel::visdata, -1 = no visibility info
+  int firstmarksurface, nummarksurfaces;
+  float minmaxs[6];
+  byte ambient_level[NUM_AMBIENTS];
+};
+
+struct BspcTexture {
+  char name[16];
+  unsigned width, height;
+  unsigned offsets[MIPLEVELS];
+};
+
+struct BspcTexInfo {
+  float vecs[2][4];
+  int texture;    // into QModel::textures
+  int flags;
+};
+
 /*
  glTF texture loading class
  // */
@@ -822,6 +1291,59 @@ enum RenderFlags {
   RenderAlphaBlendedNodes = 0x00000008
 };
 
+/*
+ CPU ray tracing
+
+ A BVH over indexed triangles for testing and baking without a GPU. It is
+ built top down with binned SAH splits, then the binary tree is collapsed
+ so every node tests BVH_WIDTH child boxes at once. Leaves hold triangles
+ BVH_WIDTH at a time in Moller-Trumbore form (v0, edge1, edge2).
+ */
+#define BVH_WIDTH 4
+#define BVH_BINS  16
+#define BVH_MAX_LEAF  16  // triangles, a larger range is always split
+
+struct BVHNode {
+  // [min x, min y, min z, max x, max y, max z][child], empty slots never hit
+  float bounds[6][BVH_WIDTH];
+  // count 0: child is a node index, -1 for an empty slot
+  // count > 0: child is the first of count BVHTriangles packets
+  int child[BVH_WIDTH];
+  int count[BVH_WIDTH];
+};
+
+// BVH_WIDTH triangles, padding lanes are degenerate and never hit
+struct BVHTriangles {
+  float v0[3][BVH_WIDTH];
+  float e1[3][BVH_WIDTH];
+  float e2[3][BVH_WIDTH];
+  uint32_t id[BVH_WIDTH];
+};
+
+struct BVHHit {
+  float t;
+  float u, v;         // weights of vertex 1 and 2, like hitAttributeEXT
+  uint32_t triangle;  // index into the triangles the BVH was built from
+};
+
+class BVH {
+public:
+  std::vector<BVHNode> nodes;   // nodes[0] is the root
+  std::vector<BVHTriangles> triangles;
+  // Expected node and packet tests per ray, relative to the root box
+  float sahCost = 0.0f;
+
+  // Threads 0 uses every hardware thread
+  void build(const glm::vec4 *vertices, const uint32_t *indexes,
+      uint32_t numTriangles, uint32_t threads = 0);
+  // Nearest hit with tmin < t < tmax, kernels follow simdLevel
+  bool intersect(const glm::vec3 &origin, const glm::vec3 &direction,
+      float tmin, float tmax, BVHHit &hit) const;
+  // Any hit with tmin < t < tmax, for shadow rays
+  bool occluded(const glm::vec3 &origin, const glm::vec3 &direction,
+      float tmin, float tmax) const;
+};
+
 /*
  glTF model loading and rendering class
  */
@@ -830,23 +1352,63 @@ private:
   vkglBSP::Texture* getTexture(uint32_t index);
   vkglBSP::Texture emptyTexture;
   void createEmptyTexture(VkQueue transferQueue);
-  byte *loadbuf;
+  const byte *loadbuf;
   int loadsize;
 
   char loadname[32]; // for hunk tags
-  byte *mod_base;
+  const byte *mod_base;
   char errorBuff[256];
-  Pack *pak0;
+  // Used when no shared file system has been handed in
+  FileSystem defaultFileSystem;
   std::vector<MVertex> backupVertex;
   std::vector<uint32_t> backupIndex;
-  QModel mod;
+  // mod_known, every model ever requested through modForName
+  std::vector<QModel*> knownModels;
   VkDescriptorSet descriptorSet;
   MSurface *warpface;
-std::vector<GlPoly> polygons;
+  // R_RecursiveWorldNode stack, kept between frames
+  struct WalkEntry {
+    MNode *node;
+    int clipflags;  // frustum planes the node is not fully inside of
+    int side;       // -1 until the near child has been walked
+  };
+  std::vector<WalkEntry> walkstack;
+  // R_BuildLightMap accumulation, RGB in 8.8 fixed point
+  std::vector<unsigned> blocklights;
+  // R_MarkLights stack, and the surfaces lit by dlights this and last update
+  std::vector<MNode*> markstack;
+  std::vector<int> dlitsurfaces, lastdlitsurfaces;
+  // Surfaces rUpdateLightmaps rebuilds, queued marks the ones already in it
+  std::vector<int> lightmapupdates;
+  std::vector<byte> lightmapqueued;
 
 public:
-  QModel *loadmodel;
-  vks::VulkanDevice *device;
+  QModel *loadmodel = nullptr;
+  vks::VulkanDevice *device = nullptr;
+  // Set before init() to share mounted archives between several models
+  FileSystem *fileSystem = nullptr;
+  std::string gameDir = GAMENAME;
+  std::string mapName = "maps/start.bsp";
+  // Threads used to decode the lumps of a map, 0 uses every hardware thread
+  uint32_t loaderThreads = 0;
+  // Directory for .bspc map caches, empty disables them
+  std::string cacheDir;
+  // Set by init() when the map came from a valid cache instead of the BSP
+  bool loadedFromCache = false;
+
+  // World rendering state, like r_framecount and r_visframecount in Quake
+  int r_framecount = 0;
+  int r_visframecount = 0;
+  int r_dlightframecount = 0;
+  MLeaf *r_viewleaf = nullptr;
+  MLeaf *r_oldviewleaf = nullptr;
+  MPlane frustum[4];
+  // Host visible slots for the visible set, one per frame in flight.
+  // Each slot holds loadmodel->polyindexes.size() indices and one indirect
+  // draw per texture, written by uploadVisibleSet()
+  vks::Buffer visIndexBuffer;
+  vks::Buffer visIndirectBuffer;
+  uint32_t visFrames = 0;
   VkDescriptorPool descriptorPool;
 
   std::vector<Node*> nodes;
@@ -870,6 +1432,29 @@ public:
   bool buffersBound = false;
   std::string path;
 
+  // d_lightstylevalue, 256 is normal brightness
+  std::vector<int> lightstylevalue = std::vector<int>(MAX_LIGHTSTYLES, 264);
+  // cl_lightstyle, the brightness strings R_AnimateLight steps through
+  std::vector<std::string> lightstyles = defaultLightStyles();
+  // cl_dlights, a light is on until its die time
+  std::vector<DLight> dlights = std::vector<DLight>(MAX_DLIGHTS);
+  // loadmodel->lightmaps as a 2D array texture, one layer per page
+  vkglBSP::Texture lightmapTexture;
+  // Host visible copy of loadmodel->lightmaps, changed regions are uploaded from it
+  vks::Buffer lightmapStaging;
+  void createLightmapTexture(vks::VulkanDevice *device, VkQueue transferQueue);
+  // The lightstyles world.qc sets up: normal, flicker, pulse, strobe and so on
+  static std::vector<std::string> defaultLightStyles();
+  // d_8to24table with every index opaque, and with 255 transparent for fence textures
+  std::vector<uint32_t> d_8to24table;
+  std::vector<uint32_t> d_8to24table_fence;
+  // One image per loadmodel->textures entry and the fullbright masks of those
+  // that have fullbright pixels, unused slots have no device
+  std::vector<vkglBSP::Texture> textureImages;
+  std::vector<vkglBSP::Texture> fullbrightImages;
+  void createTextures(vks::VulkanDevice *device, VkQueue transferQueue,
+      uint32_t threads = 0);
+
   Model() {
   }
   ;
@@ -887,8 +1472,14 @@ public:
       VkQueue transferQueue, uint32_t fileLoadingFlags =
           vkglBSP::FileLoadingFlags::None, float scale = 1.0f);
   void bindBuffers(VkCommandBuffer commandBuffer);
-  void draw(const VkCommandBuffer commandBuffer, VkPipeline pipeline,
-      VkPipelineLayout pipelineLayout);
+  void createVisibleSetBuffers(vks::VulkanDevice *device, uint32_t frames);
+  // Copies the last rRenderWorld into the slot of frame, the previous
+  // submission that drew from that slot must have finished
+  void uploadVisibleSet(uint32_t frame);
+  // Records the indirect draws of the slot of frame. They read whatever was
+  // uploaded last, so the command buffer can be recorded once and reused
+  void draw(const VkCommandBuffer commandBuffer, uint32_t frame,
+      VkPipeline pipeline, VkPipelineLayout pipelineLayout);
   void getNodeDimensions(Node *node, glm::vec3 &min, glm::vec3 &max);
   void getSceneDimensions();
   void updateAnimation(uint32_t index, float time);
@@ -905,11 +1496,12 @@ public:
    ==================
    */
   QModel* modForName(const char *name, bool crash);
+  QModel* modFindName(const char *name);
   QModel* modLoadModel(vkglBSP::QModel *mod, bool crash);
 
-  // uses temp hunk if larger than bufsize
-  byte* comLoadStackFile(const char *path, void *buffer, int bufsize,
-      unsigned int *path_id);
+  // Returns a pointer into the file system mappings and sets loadsize, or
+  // nullptr when the file does not exist. Nothing is copied
+  const byte* comLoadStackFile(const char *path, unsigned int *path_id);
 
   /*
    ============
@@ -920,29 +1512,213 @@ public:
    */
   void comFileBase(const char *in, char *out, size_t outsize);
 
-  size_t q_strlcpy(char *dst, const char *src, size_t siz);
-  void modLoadBrushModel(QModel *mod, void *buffer);
+  static size_t q_strlcpy(char *dst, const char *src, size_t siz);
+  void modLoadBrushModel(QModel *mod, const void *buffer);
 
   /*
    =================
    Mod_LoadVertexes
    =================
    */
-  void modLoadVertexes(Lump *l);
+  void modLoadVertexes(const Lump *l);
 
   void init();
-  Pack comLoadPackFile(const char *packfile);
-  int sysFileOpenRead(const char *path, int *hndl);
-  long sysFileLength(FILE *f);
-  PackFile comFindFile(const char *filename);
-  void modLoadEdges(Lump *l);
-  void modLoadSurfedges(Lump *l);
-  void modLoadFaces(Lump *l);
-  void modPolyForUnlitSurface(MSurface *fa);
-  void modLoadTextures (Lump *l);
-  void modLoadTexInfo(Lump *l);
-  void boundPoly (int numverts, std::vector<glm::vec3> &verts, glm::vec3 & mins, glm::vec3 & maxs);
-  void subdividePolygon (int numverts, std::vector<glm::vec3> & verts);
+  void modLoadEdges(const Lump *l, int bsp2);
+  void modLoadSurfedges(const Lump *l);
+  void modLoadFaces(const Lump *l, bool bsp2);
+  void modLoadPlanes(const Lump *l);
+  void modLoadMarksurfaces(const Lump *l, int bsp2);
+  void modLoadLeafs(const Lump *l, int bsp2);
+  void modLoadNodes(const Lump *l, int bsp2);
+  void modLoadClipnodes(const Lump *l, bool bsp2);
+  void modLoadSubmodels(const Lump *l);
+  void modSetParent(MNode *node, MNode *parent);
+  void modBuildIndexes();
+
+  MLeaf* modPointInLeaf(const glm::vec3 &p, QModel *model);
+  // Decompresses one run length coded row into out, (numleafs + 7) / 8 bytes
+  void modDecompressVis(const byte *in, QModel *model, byte *out);
+  // Rows returned below are padded to model->pvscache.rowbytes. A leaf row stays
+  // valid until PVS_CACHE_ROWS other leafs have been requested.
+  byte* modLeafPVS(MLeaf *leaf, QModel *model);
+  byte* modNoVisPVS(QModel *model);
+  // Union of the PVS of every leaf touched by a box of radius around org, for
+  // a viewpoint close to a leaf boundary
+  byte* modFatPVS(const glm::vec3 &org, float radius, QModel *model);
+  // SV_FindTouchedLeafs, replaces leafs with the numbers of the non solid
+  // leafs a box touches, for testing brush entities against a PVS
+  void modBoxLeafs(const glm::vec3 &mins, const glm::vec3 &maxs,
+      QModel *model, std::vector<int> &leafs);
+  // True when one of leafs is set in the PVS row vis, which has a bit for
+  // leafs 1 to numleafs
+  static bool modLeafsVisible(const std::vector<int> &leafs, const byte *vis,
+      int numleafs);
+
+  // SV_HullPointContents
+  static int hullPointContents(const Hull *hull, int num, const glm::vec3 &p);
+  /*
+   SV_RecursiveHullCheck
+
+   Walks the near side of every split first like the recursive original,
+   far sides wait on a fixed stack. Returns false as soon as something was
+   hit. trace has to be set up like modTraceBox does.
+   */
+  static bool hullCheck(const Hull *hull, int num, float p1f, float p2f,
+      const glm::vec3 &p1, const glm::vec3 &p2, Trace &trace);
+  // SV_PointContents, the contents of the world's hull 0 at p
+  static int modPointContents(QModel *model, const glm::vec3 &p);
+  // SV_HullForEntity for a submodel at the origin. Points are moved by
+  // offset before they are tested against the returned hull from headnode.
+  static const Hull* modHullForBox(QModel *model, int submodel,
+      const glm::vec3 &mins, const glm::vec3 &maxs, glm::vec3 &offset,
+      int &headnode);
+  // SV_ClipMoveToEntity, moves a box from start to end through submodel
+  static Trace modTraceBox(QModel *model, int submodel,
+      const glm::vec3 &start, const glm::vec3 &mins, const glm::vec3 &maxs,
+      const glm::vec3 &end);
+  // modTraceBox for count boxes, spread over threads (0 = every hardware
+  // thread) in chunks
+  static void modTraceBoxes(QModel *model, int submodel,
+      const TraceBox *boxes, Trace *traces, size_t count,
+      uint32_t threads = 0);
+  /*
+   SV_FlyMove
+
+   Moves a box from origin by move through the world, sliding along the
+   planes it hits for up to four bumps, and returns where it ends up. A box
+   that is stuck in solid stays where it is.
+   */
+  static glm::vec3 modFlyMove(QModel *model, const glm::vec3 &origin,
+      const glm::vec3 &mins, const glm::vec3 &maxs, const glm::vec3 &move);
+  // SV_WalkMove, modFlyMove for the horizontal part of move that steps up
+  // ledges of up to STEPSIZE onto standable floors and follows the floor
+  // down by at most STEPSIZE. Falling further is left to the caller
+  static glm::vec3 modWalkMove(QModel *model, const glm::vec3 &origin,
+      const glm::vec3 &mins, const glm::vec3 &maxs, const glm::vec3 &move);
+  // dst |= src and dst &= src over size bytes, vectorized at simdLevel
+  static void modUnionPVS(byte *dst, const byte *src, size_t size);
+  static void modIntersectPVS(byte *dst, const byte *src, size_t size);
+
+  void modPrepareSIMDData(QModel *mod);
+  // Clears the bit of every leaf in leafvis whose bounds are outside planes,
+  // planes are vks::Frustum style (inside when dot(n, p) + w >= 0)
+  static void modCullLeafs(QModel *model, const glm::vec4 *planes,
+      int numplanes, byte *leafvis);
+  // Clears the bit of every surface in surfvis that faces away from origin
+  static void modCullBackFaces(QModel *model, const glm::vec3 &origin,
+      byte *surfvis);
+  /*
+   R_MarkVisSurfaces
+
+   Fills model->surfvis with the surfaces of the leafs set in vis that are
+   inside the frustum and face origin
+   */
+  void modMarkVisSurfaces(QModel *model, const byte *vis,
+      const vks::Frustum &frustum, const glm::vec3 &origin);
+
+  /*
+   R_RenderWorld
+
+   Fills loadmodel->visindexes with the world surfaces in the PVS of origin
+   that pass the frustum and face origin, one VisBatch per texture. Planes
+   are vks::Frustum style, only the four side planes are used.
+   */
+  void rRenderWorld(const glm::vec3 &origin, const vks::Frustum &frustum);
+  void rSetFrustum(const vks::Frustum &frustum);
+  // Marks the leafs in the PVS of the view leaf and their parents with
+  // r_visframecount, only when the view leaf changed
+  void rMarkSurfaces(const glm::vec3 &origin);
+  // Returns the planes of clipflags the box is not fully inside of, or -1
+  // when the box is outside one of them
+  int rCullBox(const float *minmaxs, int clipflags);
+  // Front to back walk that chains visible surfaces on QTexture::texturechains
+  void rRecursiveWorldNode(MNode *headnode, const glm::vec3 &origin);
+  void rEmitTextureChains();
+
+  /*
+   R_TraceImage
+
+   Renders loadmodel on the CPU the way raytracingbsp's ray generation and
+   closest hit shaders do: one primary ray per pixel from the camera
+   matrices, plane normal lighting from the direction of lightPos and a
+   shadow ray towards it. Textures are not sampled. rgba holds width *
+   height pixels, rows are split over threads (0 = every hardware thread).
+   */
+  void rTraceImage(const BVH &bvh, const glm::mat4 &view,
+      const glm::mat4 &perspective, const glm::vec4 &lightPos,
+      uint32_t width, uint32_t height, uint32_t threads, uint32_t *rgba);
+
+  // Where a cache of a model lives, cacheDir/maps/name.extension
+  void modCachePath(const char *name, const char *extension, char *out,
+      size_t outsize);
+  // Returns false when the cache is missing, stale or damaged
+  bool modLoadCache(QModel *mod, const char *path, uint64_t sourcehash,
+      size_t sourcelen);
+  void modWriteCache(QModel *mod, const char *path, uint64_t sourcehash,
+      size_t sourcelen);
+  static uint64_t comBlockHash(const byte *data, size_t size);
+  void modPolyForUnlitSurface(MSurface *fa, glm::vec4 *out);
+  void modPolysForUnlitSurfaces();
+  // CalcSurfaceExtents, from the surface polygon in loadmodel->polyverts
+  void calcSurfaceExtents(int surfnum);
+  /*
+   GL_BuildLightmaps
+
+   Packs the lightmap of every lit surface into atlas pages, sets light_s,
+   light_t and lightmaptexturenum, fills mod->lightmaps with the styles at
+   lightstylevalue and mod->polylightmapcoords for the vertex stream.
+   */
+  void modBuildLightmaps(QModel *mod);
+  // R_BuildLightMap, the combined styles and dlights of surf as RGBA rows
+  // stride bytes apart
+  void rBuildLightMap(QModel *mod, MSurface *surf, byte *dest, int stride);
+  // R_AddDynamicLights, adds the dlights marked on surf to blocklights
+  void rAddDynamicLights(MSurface *surf);
+  // R_AnimateLight, lightstylevalue from lightstyles at time in seconds
+  void rAnimateLight(double time);
+  // R_PushDlights, marks the world surfaces touched by the dlights alive at time
+  void rPushDlights(double time);
+  void rMarkLights(const DLight *light, int num, MNode *headnode);
+  /*
+   R_UpdateLightmaps
+
+   Animates the lightstyles, pushes the dlights and rebuilds only the
+   lightmaps whose style values changed or that gained or lost a dlight.
+   regions gets the changed parts of loadmodel->lightmaps merged into
+   rectangles per page, with offsets into lightmapStaging.
+   */
+  void rUpdateLightmaps(double time, std::vector<VkBufferImageCopy> &regions);
+  // Copies regions into lightmapStaging and records their upload, the
+  // previous upload must have finished
+  void recordLightmapUpload(VkCommandBuffer commandBuffer,
+      const std::vector<VkBufferImageCopy> &regions);
+  void modLoadTextures (const Lump *l);
+  // TexMgr_LoadPalette, from gfx/palette.lmp
+  void texLoadPalette();
+  // Mod_CheckFullbrights, true if any of the pixels uses the fullbright colors
+  static bool modCheckFullbrights(const byte *pixels, size_t count);
+  /*
+   Lays out every miptex of mod with pixel data for texDecodeTextures and
+   returns the staging size. Textures with fullbright pixels get a second
+   chain for the mask, as TexMgr_LoadImage does for TEXPREF_NOBRIGHT and
+   TEXPREF_FULLBRIGHT.
+   */
+  static VkDeviceSize texLayoutTextures(QModel *mod,
+      std::vector<TextureDecode> &decodes);
+  /*
+   TexMgr_LoadImage8 for all of decodes at once: expands the indexed mip
+   levels straight from the BSP file into staging, writing the fullbright
+   mask in the same pass. Textures are spread over threads, 0 uses every
+   core.
+   */
+  void texDecodeTextures(QModel *mod, const std::vector<TextureDecode> &decodes,
+      byte *staging, uint32_t threads = 0);
+  void modLoadTexInfo(const Lump *l);
+  void modLoadLighting(const Lump *l);
+  void modLoadVisibility(const Lump *l);
+  void boundPoly (int numverts, const glm::vec3 *verts, glm::vec3 & mins, glm::vec3 & maxs);
+  // verts needs room for numverts + 1 entries, the first vertex is wrapped around
+  void subdividePolygon (int numverts, glm::vec3 *verts);
   void glSubdivideSurface (MSurface *fa);
 
   static inline int q_tolower(int c) {
@@ -953,6 +1729,24 @@ public:
     return (c >= 'A' && c <= 'Z');
   }
 
+  static int q_strcasecmp(const char *s1, const char *s2) {
+    const char *p1 = s1;
+    const char *p2 = s2;
+    char c1, c2;
+
+    if (p1 == p2)
+      return 0;
+
+    do {
+      c1 = q_tolower(*p1++);
+      c2 = q_tolower(*p2++);
+      if (c1 == '\0')
+        break;
+    } while (c1 == c2);
+
+    return (int) (c1 - c2);
+  }
+
   int q_strncasecmp(const char *s1, const char *s2, size_t n) {
     const char *p1 = s1;
     const char *p2 = s2;
@@ -11,6 +11,7 @@
 #include <glm/glm.hpp>
 #include <glm/gtc/quaternion.hpp>
 #include <glm/gtc/matrix_transform.hpp>
+#include <functional>
 
 class Camera
 {
@@ -60,6 +61,9 @@ public:
 	bool updated = false;
 	bool flipY = false;
 
+	// Optional for first person movement, gets the current and the wanted position and returns where the camera ends up, e.g. to clip it against level geometry
+	std::function<glm::vec3(const glm::vec3 &from, const glm::vec3 &to)> clipMovement;
+
 	struct
 	{
 		glm::mat4 perspective;
@@ -161,14 +165,16 @@ public:
 
 				float moveSpeed = deltaTime * movementSpeed;
 
+				glm::vec3 target = position;
 				if (keys.up)
-					position += camFront * moveSpeed;
+					target += camFront * moveSpeed;
 				if (keys.down)
-					position -= camFront * moveSpeed;
+					target -= camFront * moveSpeed;
 				if (keys.left)
-					position -= glm::normalize(glm::cross(camFront, glm::vec3(0.0f, 1.0f, 0.0f))) * moveSpeed;
+					target -= glm::normalize(glm::cross(camFront, glm::vec3(0.0f, 1.0f, 0.0f))) * moveSpeed;
 				if (keys.right)
-					position += glm::normalize(glm::cross(camFront, glm::vec3(0.0f, 1.0f, 0.0f))) * moveSpeed;
+					target += glm::normalize(glm::cross(camFront, glm::vec3(0.0f, 1.0f, 0.0f))) * moveSpeed;
+				position = clipMovement ? clipMovement(position, target) : target;
 
 				updateViewMatrix();
 			}
@@ -199,18 +205,23 @@ public:
 			float rotSpeed = deltaTime * rotationSpeed * 50.0f;
 			 
 			// Move
+			glm::vec3 target = position;
 			if (fabsf(axisLeft.y) > deadZone)
 			{
 				float pos = (fabsf(axisLeft.y) - deadZone) / range;
-				position -= camFront * pos * ((axisLeft.y < 0.0f) ? -1.0f : 1.0f) * moveSpeed;
+				target -= camFront * pos * ((axisLeft.y < 0.0f) ? -1.0f : 1.0f) * moveSpeed;
 				retVal = true;
 			}
 			if (fabsf(axisLeft.x) > deadZone)
 			{
 				float pos = (fabsf(axisLeft.x) - deadZone) / range;
-				position += glm::normalize(glm::cross(camFront, glm::vec3(0.0f, 1.0f, 0.0f))) * pos * ((axisLeft.x < 0.0f) ? -1.0f : 1.0f) * moveSpeed;
+				target += glm::normalize(glm::cross(camFront, glm::vec3(0.0f, 1.0f, 0.0f))) * pos * ((axisLeft.x < 0.0f) ? -1.0f : 1.0f) * moveSpeed;
 				retVal = true;
 			}
+			if (retVal)
+			{
+				position = clipMovement ? clipMovement(position, target) : target;
+			}
 
 			// Rotate
 			if (fabsf(axisRight.x) > deadZone)
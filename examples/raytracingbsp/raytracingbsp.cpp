@@ -1,18 +1,38 @@
 #include "VulkanRaytracingSample.h"
 #include "VulkanglBSP.h"
-#define VERTEX_BUFFER_BIND_ID 0
+// Instance mask bits, primary rays from the ray generation shader only trace
+// RAY_MASK_PRIMARY, shadow rays trace everything
+#define RAY_MASK_PRIMARY 0x01
+#define RAY_MASK_SHADOW 0x02
 
-// Vertex layout for this example
+// Vertex layout for this example, the closest hit shader reads the normal
+// right after the position
 struct Vertex {
   float pos[3];
-  float uv[2];
   float normal[3];
+  float uv[2];
+  float lightmap[3];  // s, t and atlas page in the lightmap texture array
+  float pad;          // the hit shader reads vertices as whole vec4s
 };
 
 class VulkanExample: public VulkanRaytracingSample {
 public:
-  AccelerationStructure bottomLevelAS;
-  AccelerationStructure topLevelAS;
+  // Submodel 0 is the world, the others are brush entities that can move
+  struct BrushModel {
+    AccelerationStructure bottomLevelAS;
+    uint32_t firstTriangle;
+    uint32_t numTriangles;
+    glm::mat4 transform;
+    // World space bounds and the leafs they touch, for PVS and frustum culling
+    glm::vec3 mins, maxs;
+    std::vector<int> leafs;
+    uint8_t mask;
+  };
+  std::vector<BrushModel> brushModels;
+  PersistentTopLevelAS topLevelAS;
+  std::vector<VkAccelerationStructureInstanceKHR> instances;
+  uint32_t numInstances = 0;
+  bool topLevelDirty = false;
   VkPhysicalDeviceRayQueryFeaturesKHR enabledRayQueryFeatures { };
   glm::vec3 lightPos = glm::vec3();
   std::vector<VkRayTracingShaderGroupCreateInfoKHR> shaderGroups { };
@@ -36,43 +56,53 @@ public:
     float lodBias = 0.0f;
   } uboVS;
 
-  struct {
-    VkPipelineVertexInputStateCreateInfo inputState;
-    std::vector<VkVertexInputBindingDescription> bindingDescriptions;
-    std::vector<VkVertexInputAttributeDescription> attributeDescriptions;
-  } vertices;
-
   vkglBSP::GLTexture texture;
   vks::Buffer uniformBufferVS;
-  vks::Buffer ubo;
+  // One uniform buffer per swap chain image, written right before its command buffer is submitted
+  std::vector<vks::Buffer> uniformBuffers;
 
   uint32_t indexCount;
+  uint32_t vertexCount;
 
-  VkPipeline prePipeline;
-  VkPipelineLayout prePipelineLayout;
   VkDescriptorSet preDescriptorSet;
   VkDescriptorSetLayout preDescriptorSetLayout;
   VkDescriptorPool preDescriptorPool = VK_NULL_HANDLE;
-  VkPipelineCache prePipelineCache;
 
   VkPipeline pipeline;
   VkPipelineLayout pipelineLayout;
-  VkDescriptorSet descriptorSet;
+  // Ray tracing descriptor sets, one per swap chain image so each pre-recorded command buffer reads its own uniform buffer
+  std::vector<VkDescriptorSet> descriptorSets;
   VkDescriptorSetLayout descriptorSetLayout;
+  // Small command buffers holding only a TLAS update, recorded and submitted in front of a frame when entities moved
+  std::vector<VkCommandBuffer> topLevelCmdBuffers;
 
   vkglBSP::Model scene;
 
+  // Free camera, or one that is clipped against hull 1 of the world like a flying or walking player
+  enum CameraMode {
+    CAMERA_FREE, CAMERA_FLY, CAMERA_WALK
+  } cameraMode = CAMERA_FREE;
+
+  // Lightstyles animate on their own clock, only the changed lightmap rectangles are uploaded.
+  // The hit shader samples the atlas at binding 6, a map without lightmap pages has nothing to animate
+  bool animateLightmaps = false;
+  double lightTime = 0.0;
+  std::vector<VkBufferImageCopy> lightmapRegions;
+
   // This sample is derived from an extended base class that saves most of the ray tracing setup boiler plate
   VulkanExample() :
       VulkanRaytracingSample() {
     title = "Ray traced BSP";
     timerSpeed *= 0.25f;
     camera.type = Camera::CameraType::firstperson;
+    accelerationStructureCompaction = true;
     camera.setPerspective(60.0f, (float) width / (float) height, 0.1f, 512.0f);
     camera.setRotation(glm::vec3(0.0f, 0.0f, 0.0f));
     camera.setTranslation(glm::vec3(0.0f, 3.0f, -20.0f));
     camera.setMovementSpeed(250.0f);
     rayQueryOnly = false;
+    // Trace straight into the swap chain if its format can be used as a storage image
+    swapChain.optionalImageUsage = VK_IMAGE_USAGE_STORAGE_BIT;
     enableExtensions();
   }
 
@@ -81,14 +111,27 @@ public:
     vkDestroyPipeline(device, pipeline, nullptr);
     vkDestroyPipelineLayout(device, pipelineLayout, nullptr);
     vkDestroyDescriptorSetLayout(device, descriptorSetLayout, nullptr);
-    deleteStorageImage();
-    deleteAccelerationStructure(bottomLevelAS);
-    deleteAccelerationStructure(topLevelAS);
+    deleteStorageImages();
+    for (BrushModel &brushModel : brushModels) {
+      if (brushModel.numTriangles != 0) {
+        deleteAccelerationStructure(brushModel.bottomLevelAS);
+      }
+    }
+    deletePersistentTopLevelAS(topLevelAS);
     shaderBindingTables.raygen.destroy();
     shaderBindingTables.miss.destroy();
     shaderBindingTables.hit.destroy();
-    ubo.destroy();
+    for (vks::Buffer &uniformBuffer : uniformBuffers) {
+      uniformBuffer.destroy();
+    }
+    if (!topLevelCmdBuffers.empty()) {
+      vkFreeCommandBuffers(device, cmdPool,
+          static_cast<uint32_t>(topLevelCmdBuffers.size()),
+          topLevelCmdBuffers.data());
+    }
     uniformBufferVS.destroy();
+    scene.loadmodel->vertexBuffer.destroy();
+    scene.loadmodel->indexBuffer.destroy();
   }
 
   void loadTexture() {
@@ -437,234 +480,304 @@ public:
 
     const uint32_t glTFLoadingFlags = vkglBSP::FileLoadingFlags::None;
 
+    // Same directory bsptool bake writes to, the first launch creates the cache
+    scene.cacheDir = "bspcache";
     scene.loadFromFile(getAssetPath() + "models/vulkanscene_shadow.gltf",
         vulkanDevice, queue, glTFLoadingFlags);
+    scene.createLightmapTexture(vulkanDevice, queue);
+    animateLightmaps = scene.loadmodel->numlightmaps > 0;
+    std::cout << "Lightmap pages: " << scene.loadmodel->numlightmaps
+        << std::endl;
+    auto tStart = std::chrono::high_resolution_clock::now();
+    scene.createTextures(vulkanDevice, queue);
+    auto tEnd = std::chrono::high_resolution_clock::now();
+    std::cout << "Uploaded " << scene.loadmodel->textures.size()
+        << " textures in "
+        << std::chrono::duration<double, std::milli>(tEnd - tStart).count()
+        << " ms" << std::endl;
 
     std::cout << "Loaded from file done " << std::endl;
   }
 
+  /*
+   Finds the triangles of every brush model in the shared index buffer.
+   Surfaces are indexed in order, so each model is one contiguous range.
+   */
+  void setupBrushModels() {
+    const vkglBSP::QModel *mod = scene.loadmodel;
+    const vkglBSP::SurfaceTable &table = mod->surftable;
+
+    std::vector<uint32_t> firstTriangle(table.size() + 1, 0);
+    for (int s = 0; s < table.size(); s++) {
+      uint32_t triangles = 0;
+      if (table.numverts[s] >= 3 && !(table.flags[s] & SURF_TRIGGER)) {
+        triangles = table.numverts[s] - 2;
+      }
+      firstTriangle[s + 1] = firstTriangle[s] + triangles;
+    }
+
+    brushModels.resize(mod->submodels.size());
+    for (size_t i = 0; i < brushModels.size(); i++) {
+      const vkglBSP::DModel &submodel = mod->submodels[i];
+      BrushModel &brushModel = brushModels[i];
+      brushModel.firstTriangle = firstTriangle[submodel.firstface];
+      brushModel.numTriangles = firstTriangle[submodel.firstface
+          + submodel.numfaces] - brushModel.firstTriangle;
+      brushModel.mask = RAY_MASK_PRIMARY | RAY_MASK_SHADOW;
+      setBrushModelTransform((uint32_t) i, glm::mat4(1.0f));
+    }
+  }
+
   /*
    *
-   Create the bottom level acceleration structure contains the scene's actual geometry (vertices, triangles)
+   Create the bottom level acceleration structures, one for the world and one for every brush model (doors, lifts, plats) that has triangles
    */
   void createBottomLevelAccelerationStructure() {
-    // Instead of a simple triangle, we'll be loading a more complex scene for this example
-    // The shaders are accessing the vertex and index buffers of the scene, so the proper usage flag has to be set on the vertex and index buffers for the scene
+    const uint32_t maxVertex = vertexCount - 1;
+    // The geometry never changes, so it can be compacted after the build
+    VkBuildAccelerationStructureFlagsKHR buildFlags =
+        VK_BUILD_ACCELERATION_STRUCTURE_PREFER_FAST_TRACE_BIT_KHR;
+    if (accelerationStructureCompaction) {
+      buildFlags |= VK_BUILD_ACCELERATION_STRUCTURE_ALLOW_COMPACTION_BIT_KHR;
+    }
+
+    // A static world builds the same structures every launch, so they are
+    // serialized next to the .bspc. The key covers everything a build reads:
+    // the source map, the .bspc layout the geometry came from, the vertex
+    // count, the index buffer and the build flags
+    std::vector<AccelerationStructure*> structures;
+    for (BrushModel &brushModel : brushModels) {
+      if (brushModel.numTriangles != 0) {
+        structures.push_back(&brushModel.bottomLevelAS);
+      }
+    }
+    std::string cachePath;
+    const std::vector<uint32_t> &indices = scene.loadmodel->polyindexes;
+    const uint64_t keyFields[] = { scene.loadmodel->sourcehash, BSPC_VERSION,
+        vertexCount, indexCount, buildFlags, vkglBSP::Model::comBlockHash(
+            reinterpret_cast<const byte*>(indices.data()),
+            indices.size() * sizeof(uint32_t)) };
+    const uint64_t cacheKey = vkglBSP::Model::comBlockHash(
+        reinterpret_cast<const byte*>(keyFields), sizeof(keyFields));
+    if (!scene.cacheDir.empty()) {
+      char path[MAX_OSPATH];
+      scene.modCachePath(scene.loadmodel->name, "rtas", path, sizeof(path));
+      cachePath = path;
+      auto tStart = std::chrono::high_resolution_clock::now();
+      if (loadAccelerationStructureCache(cachePath, cacheKey, structures)) {
+        auto tEnd = std::chrono::high_resolution_clock::now();
+        std::cout << "BLAS: " << structures.size() << " models loaded from "
+            << cachePath << " in "
+            << std::chrono::duration<double, std::milli>(tEnd - tStart).count()
+            << " ms" << std::endl;
+        return;
+      }
+    }
 
     VkDeviceOrHostAddressConstKHR vertexBufferDeviceAddress { };
     VkDeviceOrHostAddressConstKHR indexBufferDeviceAddress { };
-    std::cout << "Vertex buffer = " << scene.loadmodel->vertexBuffer.buffer
-        << std::endl;
     vertexBufferDeviceAddress.deviceAddress = getBufferDeviceAddress(
         scene.loadmodel->vertexBuffer.buffer);
     indexBufferDeviceAddress.deviceAddress = getBufferDeviceAddress(
         scene.loadmodel->indexBuffer.buffer);
 
-    // Setup vertices for a single uv-mapped quad made from two triangles
-    std::vector<Vertex> vertices = { { { 1.0f, 1.0f, 0.0f }, { 1.0f, 1.0f }, {
-        0.0f, 0.0f, 1.0f } }, { { -1.0f, 1.0f, 0.0f }, { 0.0f, 1.0f }, { 0.0f,
-        0.0f, 1.0f } }, { { -1.0f, -1.0f, 0.0f }, { 0.0f, 0.0f }, { 0.0f, 0.0f,
-        1.0f } },
-        { { 1.0f, -1.0f, 0.0f }, { 1.0f, 0.0f }, { 0.0f, 0.0f, 1.0f } } };
+    // All models share one scratch arena and are built by a single command
+    AccelerationStructureBuildBatch batch;
+    VkDeviceSize builtSize = 0;
+    uint32_t numTriangles = 0, numStructures = 0;
+    auto tStart = std::chrono::high_resolution_clock::now();
+    for (BrushModel &brushModel : brushModels) {
+      if (brushModel.numTriangles == 0) {
+        continue;
+      }
 
-    // Setup indices
-    std::vector<uint32_t> indices = { 0, 1, 2, 2, 3, 0 };
-    indexCount = static_cast<uint32_t>(indices.size());
+      VkAccelerationStructureGeometryKHR accelerationStructureGeometry =
+          vks::initializers::accelerationStructureGeometryKHR();
+      accelerationStructureGeometry.flags = VK_GEOMETRY_OPAQUE_BIT_KHR;
+      accelerationStructureGeometry.geometryType =
+          VK_GEOMETRY_TYPE_TRIANGLES_KHR;
+      accelerationStructureGeometry.geometry.triangles.sType =
+          VK_STRUCTURE_TYPE_ACCELERATION_STRUCTURE_GEOMETRY_TRIANGLES_DATA_KHR;
+      accelerationStructureGeometry.geometry.triangles.vertexFormat =
+          VK_FORMAT_R32G32B32_SFLOAT;
+      accelerationStructureGeometry.geometry.triangles.vertexData =
+          vertexBufferDeviceAddress;
+      accelerationStructureGeometry.geometry.triangles.maxVertex = maxVertex;
+      accelerationStructureGeometry.geometry.triangles.vertexStride =
+          sizeof(Vertex);
+      accelerationStructureGeometry.geometry.triangles.indexType =
+          VK_INDEX_TYPE_UINT32;
+      accelerationStructureGeometry.geometry.triangles.indexData =
+          indexBufferDeviceAddress;
+      accelerationStructureGeometry.geometry.triangles.transformData.deviceAddress =
+          0;
+      accelerationStructureGeometry.geometry.triangles.transformData.hostAddress =
+          nullptr;
+
+      // The model is a range of the shared index buffer
+      VkAccelerationStructureBuildRangeInfoKHR accelerationStructureBuildRangeInfo { };
+      accelerationStructureBuildRangeInfo.primitiveCount =
+          brushModel.numTriangles;
+      accelerationStructureBuildRangeInfo.primitiveOffset =
+          brushModel.firstTriangle * 3 * sizeof(uint32_t);
+      accelerationStructureBuildRangeInfo.firstVertex = 0;
+      accelerationStructureBuildRangeInfo.transformOffset = 0;
+
+      addAccelerationStructureBuild(batch, brushModel.bottomLevelAS,
+          VK_ACCELERATION_STRUCTURE_TYPE_BOTTOM_LEVEL_KHR, buildFlags,
+          &accelerationStructureGeometry, &accelerationStructureBuildRangeInfo,
+          1);
+
+      builtSize += brushModel.bottomLevelAS.size;
+      numTriangles += brushModel.numTriangles;
+      numStructures++;
+    }
+    const VkDeviceSize scratchSize = batch.scratchSize;
+    buildAccelerationStructures(batch);
+    auto tEnd = std::chrono::high_resolution_clock::now();
+
+    std::cout << "BLAS: " << numStructures << " models, " << numTriangles
+        << " triangles built in "
+        << std::chrono::duration<double, std::milli>(tEnd - tStart).count()
+        << " ms, " << builtSize / 1024 << " KB acceleration structures, "
+        << scratchSize / 1024 << " KB scratch" << std::endl;
+
+    if (accelerationStructureCompaction) {
+      tStart = std::chrono::high_resolution_clock::now();
+      const VkDeviceSize saved = compactAccelerationStructures(structures);
+      tEnd = std::chrono::high_resolution_clock::now();
+      std::cout << "BLAS: compacted from " << builtSize / 1024 << " KB to "
+          << (builtSize - saved) / 1024 << " KB in "
+          << std::chrono::duration<double, std::milli>(tEnd - tStart).count()
+          << " ms" << std::endl;
+    }
 
-//    uint32_t numTriangles = static_cast<uint32_t>(scene.loadmodel->edges.size()
-//        / 3);
-
-    uint32_t numTriangles = 2;
-    uint32_t maxVertex = 6;
-
-    // Build
-    VkAccelerationStructureGeometryKHR accelerationStructureGeometry =
-        vks::initializers::accelerationStructureGeometryKHR();
-    accelerationStructureGeometry.flags = VK_GEOMETRY_OPAQUE_BIT_KHR;
-    accelerationStructureGeometry.geometryType = VK_GEOMETRY_TYPE_TRIANGLES_KHR;
-    accelerationStructureGeometry.geometry.triangles.sType =
-        VK_STRUCTURE_TYPE_ACCELERATION_STRUCTURE_GEOMETRY_TRIANGLES_DATA_KHR;
-    accelerationStructureGeometry.geometry.triangles.vertexFormat =
-        VK_FORMAT_R32G32B32_SFLOAT;
-    accelerationStructureGeometry.geometry.triangles.vertexData =
-        vertexBufferDeviceAddress;
-    accelerationStructureGeometry.geometry.triangles.maxVertex = maxVertex;
-    accelerationStructureGeometry.geometry.triangles.vertexStride =
-        sizeof(Vertex);
-    accelerationStructureGeometry.geometry.triangles.indexType =
-        VK_INDEX_TYPE_UINT32;
-    accelerationStructureGeometry.geometry.triangles.indexData =
-        indexBufferDeviceAddress;
-    accelerationStructureGeometry.geometry.triangles.transformData.deviceAddress =
-        0;
-    accelerationStructureGeometry.geometry.triangles.transformData.hostAddress =
-        nullptr;
-
-    // Get size info
-    VkAccelerationStructureBuildGeometryInfoKHR accelerationStructureBuildGeometryInfo =
-        vks::initializers::accelerationStructureBuildGeometryInfoKHR();
-    accelerationStructureBuildGeometryInfo.type =
-        VK_ACCELERATION_STRUCTURE_TYPE_BOTTOM_LEVEL_KHR;
-    accelerationStructureBuildGeometryInfo.flags =
-        VK_BUILD_ACCELERATION_STRUCTURE_PREFER_FAST_TRACE_BIT_KHR;
-    accelerationStructureBuildGeometryInfo.geometryCount = 1;
-    accelerationStructureBuildGeometryInfo.pGeometries =
-        &accelerationStructureGeometry;
-
-    VkAccelerationStructureBuildSizesInfoKHR accelerationStructureBuildSizesInfo =
-        vks::initializers::accelerationStructureBuildSizesInfoKHR();
-    vkGetAccelerationStructureBuildSizesKHR(device,
-        VK_ACCELERATION_STRUCTURE_BUILD_TYPE_DEVICE_KHR,
-        &accelerationStructureBuildGeometryInfo, &numTriangles,
-        &accelerationStructureBuildSizesInfo);
-
-    createAccelerationStructure(bottomLevelAS,
-        VK_ACCELERATION_STRUCTURE_TYPE_BOTTOM_LEVEL_KHR,
-        accelerationStructureBuildSizesInfo);
-
-    // Create a small scratch buffer used during build of the bottom level acceleration structure
-    ScratchBuffer scratchBuffer = createScratchBuffer(
-        accelerationStructureBuildSizesInfo.buildScratchSize);
-
-    VkAccelerationStructureBuildGeometryInfoKHR accelerationBuildGeometryInfo =
-        vks::initializers::accelerationStructureBuildGeometryInfoKHR();
-    accelerationBuildGeometryInfo.type =
-        VK_ACCELERATION_STRUCTURE_TYPE_BOTTOM_LEVEL_KHR;
-    accelerationBuildGeometryInfo.flags =
-        VK_BUILD_ACCELERATION_STRUCTURE_PREFER_FAST_TRACE_BIT_KHR;
-    accelerationBuildGeometryInfo.mode =
-        VK_BUILD_ACCELERATION_STRUCTURE_MODE_BUILD_KHR;
-    accelerationBuildGeometryInfo.dstAccelerationStructure =
-        bottomLevelAS.handle;
-    accelerationBuildGeometryInfo.geometryCount = 1;
-    accelerationBuildGeometryInfo.pGeometries = &accelerationStructureGeometry;
-    accelerationBuildGeometryInfo.scratchData.deviceAddress =
-        scratchBuffer.deviceAddress;
-
-    VkAccelerationStructureBuildRangeInfoKHR accelerationStructureBuildRangeInfo { };
-    accelerationStructureBuildRangeInfo.primitiveCount = numTriangles;
-    accelerationStructureBuildRangeInfo.primitiveOffset = 0;
-    accelerationStructureBuildRangeInfo.firstVertex = 0;
-    accelerationStructureBuildRangeInfo.transformOffset = 0;
-    std::vector<VkAccelerationStructureBuildRangeInfoKHR*> accelerationBuildStructureRangeInfos =
-        { &accelerationStructureBuildRangeInfo };
-
-    // Build the acceleration structure on the device via a one-time command buffer submission
-    // Some implementations may support acceleration structure building on the host (VkPhysicalDeviceAccelerationStructureFeaturesKHR->accelerationStructureHostCommands), but we prefer device builds
-    VkCommandBuffer commandBuffer = vulkanDevice->createCommandBuffer(
-        VK_COMMAND_BUFFER_LEVEL_PRIMARY, true);
-    vkCmdBuildAccelerationStructuresKHR(commandBuffer, 1,
-        &accelerationBuildGeometryInfo,
-        accelerationBuildStructureRangeInfos.data());
-    vulkanDevice->flushCommandBuffer(commandBuffer, queue);
+    if (!cachePath.empty()) {
+      writeAccelerationStructureCache(cachePath, cacheKey, structures);
+    }
+  }
 
-    deleteScratchBuffer(scratchBuffer);
-    std::cout << "Done with BLAS" << std::endl;
+  // Moves a brush entity, only the TLAS has to be built again
+  void setBrushModelTransform(uint32_t submodel, const glm::mat4 &transform) {
+    BrushModel &brushModel = brushModels[submodel];
+    brushModel.transform = transform;
+    topLevelDirty = true;
+
+    // Bounds of the transformed box and the leafs it now touches
+    const vkglBSP::DModel &model = scene.loadmodel->submodels[submodel];
+    brushModel.mins = glm::vec3(FLT_MAX);
+    brushModel.maxs = glm::vec3(-FLT_MAX);
+    for (int corner = 0; corner < 8; corner++) {
+      const glm::vec3 p(transform
+          * glm::vec4((corner & 1) ? model.maxs[0] : model.mins[0],
+              (corner & 2) ? model.maxs[1] : model.mins[1],
+              (corner & 4) ? model.maxs[2] : model.mins[2], 1.0f));
+      brushModel.mins = glm::min(brushModel.mins, p);
+      brushModel.maxs = glm::max(brushModel.maxs, p);
+    }
+    scene.modBoxLeafs(brushModel.mins, brushModel.maxs, scene.loadmodel,
+        brushModel.leafs);
   }
-//
-//	/*
-//		The top level acceleration structure contains the scene's object instances
-//	*/
+
+  /*
+   Clears RAY_MASK_PRIMARY on the brush models that are outside the PVS of
+   the view leaf or the frustum. Masks are part of the instance data, so a
+   change only costs a TLAS update, not a rebuild. The world is always
+   visible and shadow rays still see everything, so culled entities keep
+   casting shadows into view
+   */
+  void cullBrushModels(const glm::vec3 &origin, vks::Frustum &frustum) {
+    vkglBSP::QModel *mod = scene.loadmodel;
+    const byte *vis = scene.modLeafPVS(scene.modPointInLeaf(origin, mod), mod);
+    for (size_t i = 1; i < brushModels.size(); i++) {
+      BrushModel &brushModel = brushModels[i];
+      if (brushModel.numTriangles == 0) {
+        continue;
+      }
+      const glm::vec3 center = (brushModel.mins + brushModel.maxs) * 0.5f;
+      const float radius = glm::length(brushModel.maxs - center);
+      const bool visible = vkglBSP::Model::modLeafsVisible(brushModel.leafs,
+          vis, mod->numleafs) && frustum.checkSphere(center, radius);
+      const uint8_t mask = RAY_MASK_SHADOW | (visible ? RAY_MASK_PRIMARY : 0);
+      if (mask != brushModel.mask) {
+        brushModel.mask = mask;
+        topLevelDirty = true;
+      }
+    }
+  }
+
+  /*
+   The top level acceleration structure contains the scene's object instances, the world and one instance per brush model.
+   It is created once with room for every brush model and then updated in place from the frame's command buffer
+   */
   void createTopLevelAccelerationStructure() {
-    VkTransformMatrixKHR transformMatrix = { 1.0f, 0.0f, 0.0f, 0.0f, 0.0f, 1.0f,
-        0.0f, 0.0f, 0.0f, 0.0f, 1.0f, 0.0f };
-
-    VkAccelerationStructureInstanceKHR instance { };
-    instance.transform = transformMatrix;
-    instance.instanceCustomIndex = 0;
-    instance.mask = 0xFF;
-    instance.instanceShaderBindingTableRecordOffset = 0;
-    instance.flags = VK_GEOMETRY_INSTANCE_TRIANGLE_FACING_CULL_DISABLE_BIT_KHR;
-    instance.accelerationStructureReference = bottomLevelAS.deviceAddress;
-
-    // Buffer for instance data
-    vks::Buffer instancesBuffer;
-    VK_CHECK_RESULT(
-        vulkanDevice->createBuffer(
-            VK_BUFFER_USAGE_SHADER_DEVICE_ADDRESS_BIT
-                | VK_BUFFER_USAGE_ACCELERATION_STRUCTURE_BUILD_INPUT_READ_ONLY_BIT_KHR,
-            VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT
-                | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT, &instancesBuffer,
-            sizeof(VkAccelerationStructureInstanceKHR), &instance));
-
-    VkDeviceOrHostAddressConstKHR instanceDataDeviceAddress { };
-    instanceDataDeviceAddress.deviceAddress = getBufferDeviceAddress(
-        instancesBuffer.buffer);
-
-    VkAccelerationStructureGeometryKHR accelerationStructureGeometry =
-        vks::initializers::accelerationStructureGeometryKHR();
-    accelerationStructureGeometry.geometryType = VK_GEOMETRY_TYPE_INSTANCES_KHR;
-    accelerationStructureGeometry.flags = VK_GEOMETRY_OPAQUE_BIT_KHR;
-    accelerationStructureGeometry.geometry.instances.sType =
-        VK_STRUCTURE_TYPE_ACCELERATION_STRUCTURE_GEOMETRY_INSTANCES_DATA_KHR;
-    accelerationStructureGeometry.geometry.instances.arrayOfPointers = VK_FALSE;
-    accelerationStructureGeometry.geometry.instances.data =
-        instanceDataDeviceAddress;
-
-    // Get size info
-    VkAccelerationStructureBuildGeometryInfoKHR accelerationStructureBuildGeometryInfo =
-        vks::initializers::accelerationStructureBuildGeometryInfoKHR();
-    accelerationStructureBuildGeometryInfo.type =
-        VK_ACCELERATION_STRUCTURE_TYPE_TOP_LEVEL_KHR;
-    accelerationStructureBuildGeometryInfo.flags =
-        VK_BUILD_ACCELERATION_STRUCTURE_PREFER_FAST_TRACE_BIT_KHR;
-    accelerationStructureBuildGeometryInfo.geometryCount = 1;
-    accelerationStructureBuildGeometryInfo.pGeometries =
-        &accelerationStructureGeometry;
-
-    uint32_t primitive_count = 1;
-
-    VkAccelerationStructureBuildSizesInfoKHR accelerationStructureBuildSizesInfo =
-        vks::initializers::accelerationStructureBuildSizesInfoKHR();
-    vkGetAccelerationStructureBuildSizesKHR(device,
-        VK_ACCELERATION_STRUCTURE_BUILD_TYPE_DEVICE_KHR,
-        &accelerationStructureBuildGeometryInfo, &primitive_count,
-        &accelerationStructureBuildSizesInfo);
-
-    // @todo: as return value?
-    createAccelerationStructure(topLevelAS,
-        VK_ACCELERATION_STRUCTURE_TYPE_TOP_LEVEL_KHR,
-        accelerationStructureBuildSizesInfo);
-
-    // Create a small scratch buffer used during build of the top level acceleration structure
-    ScratchBuffer scratchBuffer = createScratchBuffer(
-        accelerationStructureBuildSizesInfo.buildScratchSize);
-
-    VkAccelerationStructureBuildGeometryInfoKHR accelerationBuildGeometryInfo =
-        vks::initializers::accelerationStructureBuildGeometryInfoKHR();
-    accelerationBuildGeometryInfo.type =
-        VK_ACCELERATION_STRUCTURE_TYPE_TOP_LEVEL_KHR;
-    accelerationBuildGeometryInfo.flags =
-        VK_BUILD_ACCELERATION_STRUCTURE_PREFER_FAST_TRACE_BIT_KHR;
-    accelerationBuildGeometryInfo.mode =
-        VK_BUILD_ACCELERATION_STRUCTURE_MODE_BUILD_KHR;
-    accelerationBuildGeometryInfo.dstAccelerationStructure = topLevelAS.handle;
-    accelerationBuildGeometryInfo.geometryCount = 1;
-    accelerationBuildGeometryInfo.pGeometries = &accelerationStructureGeometry;
-    accelerationBuildGeometryInfo.scratchData.deviceAddress =
-        scratchBuffer.deviceAddress;
-
-    VkAccelerationStructureBuildRangeInfoKHR accelerationStructureBuildRangeInfo { };
-    accelerationStructureBuildRangeInfo.primitiveCount = 1;
-    accelerationStructureBuildRangeInfo.primitiveOffset = 0;
-    accelerationStructureBuildRangeInfo.firstVertex = 0;
-    accelerationStructureBuildRangeInfo.transformOffset = 0;
-    std::vector<VkAccelerationStructureBuildRangeInfoKHR*> accelerationBuildStructureRangeInfos =
-        { &accelerationStructureBuildRangeInfo };
-
-    // Build the acceleration structure on the device via a one-time command buffer submission
+    for (const BrushModel &brushModel : brushModels) {
+      if (brushModel.numTriangles != 0) {
+        numInstances++;
+      }
+    }
+    instances.reserve(numInstances);
+    createPersistentTopLevelAS(topLevelAS, numInstances,
+        static_cast<uint32_t>(drawCmdBuffers.size()));
+
+    // The first build goes through a one-time command buffer so the descriptor can point at a valid structure
     // Some implementations may support acceleration structure building on the host (VkPhysicalDeviceAccelerationStructureFeaturesKHR->accelerationStructureHostCommands), but we prefer device builds
     VkCommandBuffer commandBuffer = vulkanDevice->createCommandBuffer(
         VK_COMMAND_BUFFER_LEVEL_PRIMARY, true);
-    vkCmdBuildAccelerationStructuresKHR(commandBuffer, 1,
-        &accelerationBuildGeometryInfo,
-        accelerationBuildStructureRangeInfos.data());
+    buildTopLevelAccelerationStructure(commandBuffer);
     vulkanDevice->flushCommandBuffer(commandBuffer, queue);
 
-    deleteScratchBuffer(scratchBuffer);
-    instancesBuffer.destroy();
+    // Later updates are recorded per frame, see draw()
+    createTopLevelCommandBuffers();
+    std::cout << "Created TLAS with " << numInstances << " instances"
+        << std::endl;
+  }
 
-    std::cout << "Created TLAS" << std::endl;
+  // One TLAS update command buffer per swap chain image, like drawCmdBuffers
+  void createTopLevelCommandBuffers() {
+    if (!topLevelCmdBuffers.empty()) {
+      vkFreeCommandBuffers(device, cmdPool,
+          static_cast<uint32_t>(topLevelCmdBuffers.size()),
+          topLevelCmdBuffers.data());
+    }
+    topLevelCmdBuffers.resize(drawCmdBuffers.size());
+    VkCommandBufferAllocateInfo cmdBufAllocateInfo =
+        vks::initializers::commandBufferAllocateInfo(cmdPool,
+            VK_COMMAND_BUFFER_LEVEL_PRIMARY,
+            static_cast<uint32_t>(topLevelCmdBuffers.size()));
+    VK_CHECK_RESULT(
+        vkAllocateCommandBuffers(device, &cmdBufAllocateInfo,
+            topLevelCmdBuffers.data()));
+  }
+
+  /*
+   Records a build of the TLAS from the current brush model transforms, the
+   bottom level structures are left alone. Once built this is an in place
+   update, so moving entities costs a memcpy and a few commands
+   */
+  void buildTopLevelAccelerationStructure(VkCommandBuffer commandBuffer) {
+    instances.clear();
+    for (const BrushModel &brushModel : brushModels) {
+      if (brushModel.numTriangles == 0) {
+        continue;
+      }
+      // VkTransformMatrixKHR is the top three rows of the matrix
+      const glm::mat4 transform = glm::transpose(brushModel.transform);
+      VkAccelerationStructureInstanceKHR instance { };
+      memcpy(&instance.transform, &transform, sizeof(instance.transform));
+      // The hit shader offsets gl_PrimitiveID by this to find the triangle
+      instance.instanceCustomIndex = brushModel.firstTriangle;
+      instance.mask = brushModel.mask;
+      instance.instanceShaderBindingTableRecordOffset = 0;
+      instance.flags = VK_GEOMETRY_INSTANCE_TRIANGLE_FACING_CULL_DISABLE_BIT_KHR;
+      instance.accelerationStructureReference =
+          brushModel.bottomLevelAS.deviceAddress;
+      instances.push_back(instance);
+    }
+
+    updatePersistentTopLevelAS(topLevelAS, commandBuffer, instances.data(),
+        static_cast<uint32_t>(instances.size()));
+    topLevelDirty = false;
   }
 //
 //
@@ -715,43 +828,35 @@ public:
 //		Create the descriptor sets used for the ray tracing dispatch
 //	*/
   void createDescriptorSets() {
+    const uint32_t count = static_cast<uint32_t>(drawCmdBuffers.size());
     std::vector<VkDescriptorPoolSize> poolSizes = { {
-        VK_DESCRIPTOR_TYPE_ACCELERATION_STRUCTURE_KHR, 1 }, {
-        VK_DESCRIPTOR_TYPE_STORAGE_IMAGE, 2 }, {
-        VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER, 1 }, {
-        VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, 2 } };
+        VK_DESCRIPTOR_TYPE_ACCELERATION_STRUCTURE_KHR, count }, {
+        VK_DESCRIPTOR_TYPE_STORAGE_IMAGE, 2 * count }, {
+        VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER, count }, {
+        VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, 2 * count }, {
+        VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER, count } };
 
     VkDescriptorPoolCreateInfo descriptorPoolCreateInfo =
-        vks::initializers::descriptorPoolCreateInfo(poolSizes, 1);
+        vks::initializers::descriptorPoolCreateInfo(poolSizes, count);
     VK_CHECK_RESULT(
         vkCreateDescriptorPool(device, &descriptorPoolCreateInfo, nullptr,
             &descriptorPool));
 
+    std::vector<VkDescriptorSetLayout> layouts(count, descriptorSetLayout);
     VkDescriptorSetAllocateInfo descriptorSetAllocateInfo =
         vks::initializers::descriptorSetAllocateInfo(descriptorPool,
-            &descriptorSetLayout, 1);
+            layouts.data(), count);
+    descriptorSets.resize(count);
     VK_CHECK_RESULT(
         vkAllocateDescriptorSets(device, &descriptorSetAllocateInfo,
-            &descriptorSet));
+            descriptorSets.data()));
 
     VkWriteDescriptorSetAccelerationStructureKHR descriptorAccelerationStructureInfo =
         vks::initializers::writeDescriptorSetAccelerationStructureKHR();
     descriptorAccelerationStructureInfo.accelerationStructureCount = 1;
     descriptorAccelerationStructureInfo.pAccelerationStructures =
-        &topLevelAS.handle;
-
-    VkWriteDescriptorSet accelerationStructureWrite { };
-    accelerationStructureWrite.sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET;
-    // The specialized acceleration structure descriptor has to be chained
-    accelerationStructureWrite.pNext = &descriptorAccelerationStructureInfo;
-    accelerationStructureWrite.dstSet = descriptorSet;
-    accelerationStructureWrite.dstBinding = 0;
-    accelerationStructureWrite.descriptorCount = 1;
-    accelerationStructureWrite.descriptorType =
-        VK_DESCRIPTOR_TYPE_ACCELERATION_STRUCTURE_KHR;
-
-    VkDescriptorImageInfo storageImageDescriptor { VK_NULL_HANDLE,
-        storageImage.view, VK_IMAGE_LAYOUT_GENERAL };
+        &topLevelAS.accelerationStructure.handle;
+
     VkDescriptorBufferInfo vertexBufferDescriptor {
         scene.loadmodel->vertexBuffer.buffer, 0,
         VK_WHOLE_SIZE };
@@ -762,27 +867,47 @@ public:
     VkDescriptorImageInfo textureImageDescriptor { VK_NULL_HANDLE, texture.view,
         VK_IMAGE_LAYOUT_GENERAL };
 
-    std::vector<VkWriteDescriptorSet> writeDescriptorSets = {
-        // Binding 0: Top level acceleration structure
-        accelerationStructureWrite,
-        // Binding 1: Ray tracing result image
-        vks::initializers::writeDescriptorSet(descriptorSet,
-            VK_DESCRIPTOR_TYPE_STORAGE_IMAGE, 1, &storageImageDescriptor),
-        // Binding 2: Uniform data
-        vks::initializers::writeDescriptorSet(descriptorSet,
-            VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER, 2, &ubo.descriptor),
-        // Binding 3: Scene vertex buffer
-        vks::initializers::writeDescriptorSet(descriptorSet,
-            VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, 3, &vertexBufferDescriptor),
-        // Binding 4: Scene index buffer
-        vks::initializers::writeDescriptorSet(descriptorSet,
-            VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, 4, &indexBufferDescriptor),
-            // Binding 5: Texture
-        vks::initializers::writeDescriptorSet(descriptorSet,
-            VK_DESCRIPTOR_TYPE_STORAGE_IMAGE, 5, &textureImageDescriptor), };
-    vkUpdateDescriptorSets(device,
-        static_cast<uint32_t>(writeDescriptorSets.size()),
-        writeDescriptorSets.data(), 0, VK_NULL_HANDLE);
+    // The sets only differ in the uniform buffer and storage image they point at
+    for (uint32_t i = 0; i < count; i++) {
+      VkDescriptorImageInfo storageImageDescriptor { VK_NULL_HANDLE,
+          storageImages[i].view, VK_IMAGE_LAYOUT_GENERAL };
+      VkWriteDescriptorSet accelerationStructureWrite { };
+      accelerationStructureWrite.sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET;
+      // The specialized acceleration structure descriptor has to be chained
+      accelerationStructureWrite.pNext = &descriptorAccelerationStructureInfo;
+      accelerationStructureWrite.dstSet = descriptorSets[i];
+      accelerationStructureWrite.dstBinding = 0;
+      accelerationStructureWrite.descriptorCount = 1;
+      accelerationStructureWrite.descriptorType =
+          VK_DESCRIPTOR_TYPE_ACCELERATION_STRUCTURE_KHR;
+
+      std::vector<VkWriteDescriptorSet> writeDescriptorSets = {
+          // Binding 0: Top level acceleration structure
+          accelerationStructureWrite,
+          // Binding 1: Ray tracing result image
+          vks::initializers::writeDescriptorSet(descriptorSets[i],
+              VK_DESCRIPTOR_TYPE_STORAGE_IMAGE, 1, &storageImageDescriptor),
+          // Binding 2: Uniform data
+          vks::initializers::writeDescriptorSet(descriptorSets[i],
+              VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER, 2,
+              &uniformBuffers[i].descriptor),
+          // Binding 3: Scene vertex buffer
+          vks::initializers::writeDescriptorSet(descriptorSets[i],
+              VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, 3, &vertexBufferDescriptor),
+          // Binding 4: Scene index buffer
+          vks::initializers::writeDescriptorSet(descriptorSets[i],
+              VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, 4, &indexBufferDescriptor),
+          // Binding 5: Texture
+          vks::initializers::writeDescriptorSet(descriptorSets[i],
+              VK_DESCRIPTOR_TYPE_STORAGE_IMAGE, 5, &textureImageDescriptor),
+          // Binding 6: Lightmap atlas pages
+          vks::initializers::writeDescriptorSet(descriptorSets[i],
+              VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER, 6,
+              &scene.lightmapTexture.descriptor), };
+      vkUpdateDescriptorSets(device,
+          static_cast<uint32_t>(writeDescriptorSets.size()),
+          writeDescriptorSets.data(), 0, VK_NULL_HANDLE);
+    }
   }
 //
 //	/*
@@ -816,6 +941,10 @@ public:
             vks::initializers::descriptorSetLayoutBinding(
                 VK_DESCRIPTOR_TYPE_STORAGE_IMAGE, VK_SHADER_STAGE_RAYGEN_BIT_KHR,
                 5),
+        // Binding 6: Lightmap texture array
+        vks::initializers::descriptorSetLayoutBinding(
+            VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER,
+            VK_SHADER_STAGE_CLOSEST_HIT_BIT_KHR, 6),
     };
 
     VkDescriptorSetLayoutCreateInfo descriptorSetLayoutCI =
@@ -827,11 +956,10 @@ public:
     std::vector<VkDescriptorSetLayout> rtDescSetLayouts = { descriptorSetLayout,
         preDescriptorSetLayout };
 
-    VkPipelineLayoutCreateInfo pPipelineLayoutCI;
-    pPipelineLayoutCI.sType = VK_STRUCTURE_TYPE_PIPELINE_LAYOUT_CREATE_INFO;
-    pPipelineLayoutCI.setLayoutCount =
-        static_cast<uint32_t>(rtDescSetLayouts.size());
-    pPipelineLayoutCI.pSetLayouts = rtDescSetLayouts.data();
+    // All per frame data comes from the uniform buffer, there are no push constants
+    VkPipelineLayoutCreateInfo pPipelineLayoutCI =
+        vks::initializers::pipelineLayoutCreateInfo(rtDescSetLayouts.data(),
+            static_cast<uint32_t>(rtDescSetLayouts.size()));
 
     VK_CHECK_RESULT(
         vkCreatePipelineLayout(device, &pPipelineLayoutCI, nullptr,
@@ -930,32 +1058,51 @@ public:
   }
 //
 //	/*
-//		Create the uniform buffer used to pass matrices to the ray tracing ray generation shader
+//		Create the uniform buffers used to pass matrices to the ray tracing ray generation shader
 //	*/
   void createUniformBuffer() {
-    VK_CHECK_RESULT(
-        vulkanDevice->createBuffer(VK_BUFFER_USAGE_UNIFORM_BUFFER_BIT,
-            VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT
-                | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT, &ubo,
-            sizeof(uniformData), &uniformData));
-    VK_CHECK_RESULT(ubo.map());
-
     updateUniformBuffers();
+    uniformBuffers.resize(drawCmdBuffers.size());
+    for (vks::Buffer &uniformBuffer : uniformBuffers) {
+      VK_CHECK_RESULT(
+          vulkanDevice->createBuffer(VK_BUFFER_USAGE_UNIFORM_BUFFER_BIT,
+              VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT
+                  | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT, &uniformBuffer,
+              sizeof(uniformData), &uniformData));
+      VK_CHECK_RESULT(uniformBuffer.map());
+    }
   }
 
   /*
    If the window has been resized, we need to recreate the storage image and it's descriptor
    */
   void handleResize() {
-    // Recreate image
-    createStorageImage(swapChain.colorFormat, { width, height, 1 });
-    // Update descriptor
-    VkDescriptorImageInfo storageImageDescriptor { VK_NULL_HANDLE,
-        storageImage.view, VK_IMAGE_LAYOUT_GENERAL };
-    VkWriteDescriptorSet resultImageWrite =
-        vks::initializers::writeDescriptorSet(descriptorSet,
-            VK_DESCRIPTOR_TYPE_STORAGE_IMAGE, 1, &storageImageDescriptor);
-    vkUpdateDescriptorSets(device, 1, &resultImageWrite, 0, VK_NULL_HANDLE);
+    // Recreate images, these may be the new swap chain's images
+    createStorageImages(swapChain.colorFormat, { width, height, 1 });
+
+    // The base class recreated drawCmdBuffers for the new swap chain, which
+    // may have a different number of images. Everything kept per image is
+    // then rebuilt to match, the new sets already point at the new images
+    if (descriptorSets.size() != drawCmdBuffers.size()) {
+      vkDestroyDescriptorPool(device, descriptorPool, nullptr);
+      for (vks::Buffer &uniformBuffer : uniformBuffers) {
+        uniformBuffer.destroy();
+      }
+      createUniformBuffer();
+      createDescriptorSets();
+      createTopLevelCommandBuffers();
+      return;
+    }
+
+    // Update descriptors
+    for (size_t i = 0; i < descriptorSets.size(); i++) {
+      VkDescriptorImageInfo storageImageDescriptor { VK_NULL_HANDLE,
+          storageImages[i].view, VK_IMAGE_LAYOUT_GENERAL };
+      VkWriteDescriptorSet resultImageWrite =
+          vks::initializers::writeDescriptorSet(descriptorSets[i],
+              VK_DESCRIPTOR_TYPE_STORAGE_IMAGE, 1, &storageImageDescriptor);
+      vkUpdateDescriptorSets(device, 1, &resultImageWrite, 0, VK_NULL_HANDLE);
+    }
 
     updateUniformBuffers();
   }
@@ -1095,84 +1242,7 @@ public:
 
     uniformData.lightPos = glm::vec4(-228.209f, 227.337f, 315.972, 0.0f);
     // Pass the vertex size to the shader for unpacking vertices
-    uniformData.vertexSize = sizeof(vkglBSP::MVertex);
-    memcpy(ubo.mapped, &uniformData, sizeof(uniformData));
-
-  }
-
-  void setupVertexDescriptions() {
-
-//    // Binding description
-    vertices.bindingDescriptions.resize(1);
-//    vertices.bindingDescriptions[0] =
-//        vks::initializers::vertexInputBindingDescription(
-//        VERTEX_BUFFER_BIND_ID, sizeof(vkglBSP::QModel), VK_VERTEX_INPUT_RATE_VERTEX);
-//
-//    // Attribute descriptions
-//    // Describes memory layout and shader positions
-    vertices.attributeDescriptions.resize(3);
-//    // Location 0 : Position
-//    vertices.attributeDescriptions[0] =
-//        vks::initializers::vertexInputAttributeDescription(
-//        VERTEX_BUFFER_BIND_ID, 0, VK_FORMAT_R32G32B32_SFLOAT,
-//            offsetof(vkglBSP::QModel, vertexes));
-//    // Location 1 : Texture coordinates
-//    vertices.attributeDescriptions[1] =
-//        vks::initializers::vertexInputAttributeDescription(
-//        VERTEX_BUFFER_BIND_ID, 1, VK_FORMAT_R32G32_SFLOAT,
-//        offsetof(vkglBSP::QModel, texinfo));
-//    // Location 2 : Vertex normal
-//    vertices.attributeDescriptions[2] =
-//        vks::initializers::vertexInputAttributeDescription(
-//        VERTEX_BUFFER_BIND_ID, 2, VK_FORMAT_R32G32B32_SFLOAT,
-//            offsetof(vkglBSP::QModel, vertexes));
-//
-//    vertices.inputState =
-//        vks::initializers::pipelineVertexInputStateCreateInfo();
-//    vertices.inputState.vertexBindingDescriptionCount =
-//        static_cast<uint32_t>(vertices.bindingDescriptions.size());
-//    vertices.inputState.pVertexBindingDescriptions =
-//        vertices.bindingDescriptions.data();
-//    vertices.inputState.vertexAttributeDescriptionCount =
-//        static_cast<uint32_t>(vertices.attributeDescriptions.size());
-//    vertices.inputState.pVertexAttributeDescriptions =
-//        vertices.attributeDescriptions.data();
-
-    // Binding description
-    vertices.bindingDescriptions = {
-        vks::initializers::vertexInputBindingDescription(VERTEX_BUFFER_BIND_ID,
-            sizeof(Vertex), VK_VERTEX_INPUT_RATE_VERTEX) };
-
-    // Attribute descriptions
-    // Describes memory layout and shader positions
-    vertices.attributeDescriptions = {
-    // Location 0: Position
-        vks::initializers::vertexInputAttributeDescription(
-        VERTEX_BUFFER_BIND_ID, 0, VK_FORMAT_R32G32B32_SFLOAT,
-            offsetof(Vertex, pos)),
-        // Location 1: Texture coordinates
-        vks::initializers::vertexInputAttributeDescription(
-        VERTEX_BUFFER_BIND_ID, 1, VK_FORMAT_R32G32_SFLOAT,
-            offsetof(Vertex, uv)),
-
-//        //    // Location 2 : Vertex normal
-        vertices.attributeDescriptions[2] =
-            vks::initializers::vertexInputAttributeDescription(
-            VERTEX_BUFFER_BIND_ID, 2, VK_FORMAT_R32G32B32_SFLOAT,
-                offsetof(Vertex, normal)) };
-
-    // Assign to vertex buffer
-
-    vertices.inputState =
-        vks::initializers::pipelineVertexInputStateCreateInfo();
-    vertices.inputState.vertexBindingDescriptionCount =
-        static_cast<uint32_t>(vertices.bindingDescriptions.size());
-    vertices.inputState.pVertexBindingDescriptions =
-        vertices.bindingDescriptions.data();
-    vertices.inputState.vertexAttributeDescriptionCount =
-        static_cast<uint32_t>(vertices.attributeDescriptions.size());
-    vertices.inputState.pVertexAttributeDescriptions =
-        vertices.attributeDescriptions.data();
+    uniformData.vertexSize = sizeof(Vertex);
 
   }
 
@@ -1205,6 +1275,13 @@ public:
 //        camera.position.z, 0);
     uboVS.viewPos = glm::vec4(-228.209f, 227.337f, 315.972, 0.0f);
     memcpy(uniformBufferVS.mapped, &uboVS, sizeof(uboVS));
+
+    // The frame is ray traced, so the world's visible index lists
+    // (rRenderWorld) aren't built here, only the brush model masks are
+    // updated. The first person camera keeps the negated eye position
+    vks::Frustum frustum;
+    frustum.update(camera.matrices.perspective * camera.matrices.view);
+    cullBrushModels(-camera.position, frustum);
   }
 
   // Prepare and initialize uniform buffer containing shader uniforms
@@ -1240,80 +1317,6 @@ public:
     VK_CHECK_RESULT(
         vkCreateDescriptorSetLayout(device, &descriptorLayout, nullptr,
             &preDescriptorSetLayout));
-
-    VkPipelineLayoutCreateInfo pPipelineLayoutCreateInfo =
-        vks::initializers::pipelineLayoutCreateInfo(&preDescriptorSetLayout, 1);
-
-    VK_CHECK_RESULT(
-        vkCreatePipelineLayout(device, &pPipelineLayoutCreateInfo, nullptr,
-            &prePipelineLayout));
-  }
-
-  void preparePipelines() {
-    VkPipelineInputAssemblyStateCreateInfo inputAssemblyState =
-        vks::initializers::pipelineInputAssemblyStateCreateInfo(
-            VK_PRIMITIVE_TOPOLOGY_TRIANGLE_LIST, 0,
-            VK_FALSE);
-
-    VkPipelineRasterizationStateCreateInfo rasterizationState =
-        vks::initializers::pipelineRasterizationStateCreateInfo(
-            VK_POLYGON_MODE_FILL, VK_CULL_MODE_NONE,
-            VK_FRONT_FACE_COUNTER_CLOCKWISE, 0);
-
-    VkPipelineColorBlendAttachmentState blendAttachmentState =
-        vks::initializers::pipelineColorBlendAttachmentState(0xf,
-        VK_FALSE);
-
-    VkPipelineColorBlendStateCreateInfo colorBlendState =
-        vks::initializers::pipelineColorBlendStateCreateInfo(1,
-            &blendAttachmentState);
-
-    VkPipelineDepthStencilStateCreateInfo depthStencilState =
-        vks::initializers::pipelineDepthStencilStateCreateInfo(
-        VK_TRUE,
-        VK_TRUE, VK_COMPARE_OP_LESS_OR_EQUAL);
-
-    VkPipelineViewportStateCreateInfo viewportState =
-        vks::initializers::pipelineViewportStateCreateInfo(1, 1, 0);
-
-    VkPipelineMultisampleStateCreateInfo multisampleState =
-        vks::initializers::pipelineMultisampleStateCreateInfo(
-            VK_SAMPLE_COUNT_1_BIT, 0);
-
-    std::vector<VkDynamicState> dynamicStateEnables = {
-        VK_DYNAMIC_STATE_VIEWPORT, VK_DYNAMIC_STATE_SCISSOR };
-    VkPipelineDynamicStateCreateInfo dynamicState =
-        vks::initializers::pipelineDynamicStateCreateInfo(
-            dynamicStateEnables.data(),
-            static_cast<uint32_t>(dynamicStateEnables.size()), 0);
-
-    // Load shaders
-    std::array<VkPipelineShaderStageCreateInfo, 2> shaderStages;
-
-    shaderStages[0] = loadShader(
-        getShadersPath() + "raytracingshadows/texture.vert.spv",
-        VK_SHADER_STAGE_VERTEX_BIT);
-    shaderStages[1] = loadShader(
-        getShadersPath() + "raytracingshadows/texture.frag.spv",
-        VK_SHADER_STAGE_FRAGMENT_BIT);
-
-    VkGraphicsPipelineCreateInfo pipelineCreateInfo =
-        vks::initializers::pipelineCreateInfo(prePipelineLayout, renderPass, 0);
-
-    pipelineCreateInfo.pVertexInputState = &vertices.inputState;
-    pipelineCreateInfo.pInputAssemblyState = &inputAssemblyState;
-    pipelineCreateInfo.pRasterizationState = &rasterizationState;
-    pipelineCreateInfo.pColorBlendState = &colorBlendState;
-    pipelineCreateInfo.pMultisampleState = &multisampleState;
-    pipelineCreateInfo.pViewportState = &viewportState;
-    pipelineCreateInfo.pDepthStencilState = &depthStencilState;
-    pipelineCreateInfo.pDynamicState = &dynamicState;
-    pipelineCreateInfo.stageCount = static_cast<uint32_t>(shaderStages.size());
-    pipelineCreateInfo.pStages = shaderStages.data();
-
-    VK_CHECK_RESULT(
-        vkCreateGraphicsPipelines(device, prePipelineCache, 1,
-            &pipelineCreateInfo, nullptr, &prePipeline));
   }
 
   void setupDescriptorPool() {
@@ -1367,32 +1370,29 @@ public:
     std::cout << "Preparing..." << std::endl;
     VulkanRaytracingSample::prepare();
     loadScene();
+    setupCameraClipping();
 
-    /// Rasterizier
+    // Scene buffers, textures and the set 1 resources the hit shader shares
     loadTexture();
-    std::cout << "Generating quad...." << std::endl;
-    generateQuad();
-    std::cout << "Generated quad!" << std::endl;
-    setupVertexDescriptions();
-    std::cout << "Setup Vertex descriptor sets" << std::endl;
+    loadSceneBuffers();
     prepareUniformBuffers();
     std::cout << "Prepared uniform buffer" << std::endl;
     setupDescriptorSetLayout();
     std::cout << "Setup descriptor sets" << std::endl;
-    preparePipelines();
-    std::cout << "Prepared pipeline sets" << std::endl;
     setupDescriptorPool();
     std::cout << "Setup descriptor pool" << std::endl;
     setupDescriptorSet();
     std::cout << "Setup descriptor set" << std::endl;
 
     // Create the acceleration structures used to render the ray traced scene
+    setupBrushModels();
     createBottomLevelAccelerationStructure();
     std::cout << "Created BLAS" << std::endl;
     createTopLevelAccelerationStructure();
     std::cout << "Created TLAS" << std::endl;
-    createStorageImage(swapChain.colorFormat, { width, height, 1 });
-    std::cout << "Created storage image" << std::endl;
+    createStorageImages(swapChain.colorFormat, { width, height, 1 });
+    std::cout << "Created storage images"
+        << (storageImagesInSwapChain ? " (swap chain)" : "") << std::endl;
     createUniformBuffer();
     std::cout << "Created uniform buffer" << std::endl;
     createRayTracingPipeline();
@@ -1409,42 +1409,97 @@ public:
     std::cout << "Prepared!" << std::endl;
   }
 
-  void generateQuad() {
-    VkBufferUsageFlags flag = VK_BUFFER_USAGE_SHADER_DEVICE_ADDRESS_BIT;
-    VkBufferUsageFlags rayTracingFlags = // used also for building acceleration structures
-        flag
-            | VK_BUFFER_USAGE_ACCELERATION_STRUCTURE_BUILD_INPUT_READ_ONLY_BIT_KHR
-            | VK_BUFFER_USAGE_STORAGE_BUFFER_BIT;
+  /*
+   Uploads the world triangles of the map through staging buffers into
+   device local memory, usable as vertex and index buffers, as storage
+   buffers by the hit shader and as acceleration structure build input
+   */
+  void loadSceneBuffers() {
+    const vkglBSP::QModel *mod = scene.loadmodel;
+    const vkglBSP::SurfaceTable &table = mod->surftable;
+
+    // Polygons use the plane normal of their surface, texture coordinates
+    // come from the texinfo vectors, which are still in Quake space
+    std::vector<Vertex> vertices(mod->polyverts.size());
+    for (size_t i = 0; i < vertices.size(); i++) {
+      const glm::vec4 &p = mod->polyverts[i];
+      const glm::vec3 &lm = mod->polylightmapcoords[i];
+      vertices[i] = { { p.x, p.y, p.z }, { 0.0f, 0.0f, 0.0f }, { 0.0f, 0.0f },
+          { lm.x, lm.y, lm.z }, 0.0f };
+    }
+    for (int s = 0; s < table.size(); s++) {
+      const vkglBSP::MTexInfo &tex = mod->texinfo[table.texinfo[s]];
+      glm::vec3 normal = mod->planes[table.planenum[s]].normal;
+      if (table.flags[s] & SURF_PLANEBACK) {
+        normal = -normal;
+      }
+      const float width = (float) std::max(1u, tex.texture->width);
+      const float height = (float) std::max(1u, tex.texture->height);
+      for (int v = 0; v < table.numverts[s]; v++) {
+        Vertex &vertex = vertices[table.firstvert[s] + v];
+        const glm::vec3 quake(vertex.pos[0], -vertex.pos[2], -vertex.pos[1]);
+        vertex.normal[0] = normal.x;
+        vertex.normal[1] = normal.y;
+        vertex.normal[2] = normal.z;
+        vertex.uv[0] = (glm::dot(quake, glm::make_vec3(tex.vecs[0]))
+            + tex.vecs[0][3]) / width;
+        vertex.uv[1] = (glm::dot(quake, glm::make_vec3(tex.vecs[1]))
+            + tex.vecs[1][3]) / height;
+      }
+    }
+    const std::vector<uint32_t> &indices = mod->polyindexes;
+    vertexCount = static_cast<uint32_t>(vertices.size());
+    indexCount = static_cast<uint32_t>(indices.size());
 
-    // Setup vertices for a single uv-mapped quad made from two triangles
-    std::vector<Vertex> vertices = { { { 1.0f, 1.0f, 0.0f }, { 1.0f, 1.0f }, {
-        0.0f, 0.0f, 1.0f } }, { { -1.0f, 1.0f, 0.0f }, { 0.0f, 1.0f }, { 0.0f,
-        0.0f, 1.0f } }, { { -1.0f, -1.0f, 0.0f }, { 0.0f, 0.0f }, { 0.0f, 0.0f,
-        1.0f } },
-        { { 1.0f, -1.0f, 0.0f }, { 1.0f, 0.0f }, { 0.0f, 0.0f, 1.0f } } };
+    const VkDeviceSize vertexBufferSize = vertices.size() * sizeof(Vertex);
+    const VkDeviceSize indexBufferSize = indices.size() * sizeof(uint32_t);
 
-    // Setup indices
-    std::vector<uint32_t> indices = { 0, 1, 2, 2, 3, 0 };
-    indexCount = static_cast<uint32_t>(indices.size());
+    vks::Buffer vertexStaging, indexStaging;
+    VK_CHECK_RESULT(
+        vulkanDevice->createBuffer(VK_BUFFER_USAGE_TRANSFER_SRC_BIT,
+            VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT
+                | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT, &vertexStaging,
+            vertexBufferSize, vertices.data()));
+    VK_CHECK_RESULT(
+        vulkanDevice->createBuffer(VK_BUFFER_USAGE_TRANSFER_SRC_BIT,
+            VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT
+                | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT, &indexStaging,
+            indexBufferSize, (void*) indices.data()));
 
-    // Create buffers
-    // For the sake of simplicity we won't stage the vertex data to the gpu memory
-    // Vertex buffer
+    VkBufferUsageFlags rayTracingFlags = // used also for building acceleration structures
+        VK_BUFFER_USAGE_SHADER_DEVICE_ADDRESS_BIT
+            | VK_BUFFER_USAGE_ACCELERATION_STRUCTURE_BUILD_INPUT_READ_ONLY_BIT_KHR
+            | VK_BUFFER_USAGE_STORAGE_BUFFER_BIT
+            | VK_BUFFER_USAGE_TRANSFER_DST_BIT;
     VK_CHECK_RESULT(
         vulkanDevice->createBuffer(
             VK_BUFFER_USAGE_VERTEX_BUFFER_BIT | rayTracingFlags,
-            VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT
-                | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT,
-            &scene.loadmodel->vertexBuffer, vertices.size() * sizeof(Vertex),
-            vertices.data()));
-    // Index buffer
+            VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT,
+            &scene.loadmodel->vertexBuffer, vertexBufferSize));
     VK_CHECK_RESULT(
         vulkanDevice->createBuffer(
             VK_BUFFER_USAGE_INDEX_BUFFER_BIT | rayTracingFlags,
-            VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT
-                | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT,
-            &scene.loadmodel->indexBuffer, indices.size() * sizeof(uint32_t),
-            indices.data()));
+            VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT,
+            &scene.loadmodel->indexBuffer, indexBufferSize));
+
+    // Both copies go in one submission
+    VkCommandBuffer copyCmd = vulkanDevice->createCommandBuffer(
+        VK_COMMAND_BUFFER_LEVEL_PRIMARY, true);
+    VkBufferCopy copyRegion = { };
+    copyRegion.size = vertexBufferSize;
+    vkCmdCopyBuffer(copyCmd, vertexStaging.buffer,
+        scene.loadmodel->vertexBuffer.buffer, 1, &copyRegion);
+    copyRegion.size = indexBufferSize;
+    vkCmdCopyBuffer(copyCmd, indexStaging.buffer,
+        scene.loadmodel->indexBuffer.buffer, 1, &copyRegion);
+    vulkanDevice->flushCommandBuffer(copyCmd, queue, true);
+
+    vertexStaging.destroy();
+    indexStaging.destroy();
+
+    std::cout << "Uploaded " << vertexCount << " vertices, " << indexCount / 3
+        << " triangles, " << (vertexBufferSize + indexBufferSize) / 1024
+        << " KB" << std::endl;
   }
 
 //  void generateQuad() {
@@ -1523,71 +1578,18 @@ public:
 //
 //  }
 
-  void buildCommandBuffersPre() {
-    VkCommandBufferBeginInfo cmdBufInfo =
-        vks::initializers::commandBufferBeginInfo();
-
-    VkClearValue clearValues[2];
-    clearValues[0].color = defaultClearColor;
-    clearValues[1].depthStencil = { 1.0f, 0 };
-
-    VkRenderPassBeginInfo renderPassBeginInfo =
-        vks::initializers::renderPassBeginInfo();
-    renderPassBeginInfo.renderPass = renderPass;
-    renderPassBeginInfo.renderArea.offset.x = 0;
-    renderPassBeginInfo.renderArea.offset.y = 0;
-    renderPassBeginInfo.renderArea.extent.width = width;
-    renderPassBeginInfo.renderArea.extent.height = height;
-    renderPassBeginInfo.clearValueCount = 2;
-    renderPassBeginInfo.pClearValues = clearValues;
-
-    for (int32_t i = 0; i < drawCmdBuffers.size(); ++i) {
-      // Set target frame buffer
-      renderPassBeginInfo.framebuffer = frameBuffers[i];
-
-      VK_CHECK_RESULT(vkBeginCommandBuffer(drawCmdBuffers[i], &cmdBufInfo));
-
-      vkCmdBeginRenderPass(drawCmdBuffers[i], &renderPassBeginInfo,
-          VK_SUBPASS_CONTENTS_INLINE);
-
-      VkViewport viewport = vks::initializers::viewport((float) width,
-          (float) height, 0.0f, 1.0f);
-      vkCmdSetViewport(drawCmdBuffers[i], 0, 1, &viewport);
-
-      VkRect2D scissor = vks::initializers::rect2D(width, height, 0, 0);
-      vkCmdSetScissor(drawCmdBuffers[i], 0, 1, &scissor);
-
-      vkCmdBindDescriptorSets(drawCmdBuffers[i],
-          VK_PIPELINE_BIND_POINT_GRAPHICS, prePipelineLayout, 0, 1,
-          &preDescriptorSet, 0, NULL);
-      vkCmdBindPipeline(drawCmdBuffers[i], VK_PIPELINE_BIND_POINT_GRAPHICS,
-          prePipeline);
-
-      VkDeviceSize offsets[1] = { 0 };
-      vkCmdBindVertexBuffers(drawCmdBuffers[i], VERTEX_BUFFER_BIND_ID, 1,
-          &scene.loadmodel->vertexBuffer.buffer, offsets);
-      vkCmdBindIndexBuffer(drawCmdBuffers[i],
-          scene.loadmodel->indexBuffer.buffer, 0, VK_INDEX_TYPE_UINT32);
-
-      vkCmdDrawIndexed(drawCmdBuffers[i], indexCount, 1, 0, 0, 0);
-
-      vkCmdEndRenderPass(drawCmdBuffers[i]);
-
-      VK_CHECK_RESULT(vkEndCommandBuffer(drawCmdBuffers[i]));
-    }
-  }
-
+  /*
+   Records the trace and the copy to swap chain image i. Nothing in here
+   changes from frame to frame, so this only runs when the command buffers
+   are (re)built on startup and on resize
+   */
   void rayTrace(size_t i) {
-
-    VkImageSubresourceRange subresourceRange = { VK_IMAGE_ASPECT_COLOR_BIT, 0,
-        1, 0, 1 };
-
     VkCommandBufferBeginInfo cmdBufInfo =
         vks::initializers::commandBufferBeginInfo();
 
     VK_CHECK_RESULT(vkBeginCommandBuffer(drawCmdBuffers[i], &cmdBufInfo));
 
-    std::vector<VkDescriptorSet> descSets { descriptorSet, preDescriptorSet };
+    std::vector<VkDescriptorSet> descSets { descriptorSets[i], preDescriptorSet };
 
     /*
      Dispatch the ray tracing commands
@@ -1599,10 +1601,9 @@ public:
         VK_PIPELINE_BIND_POINT_RAY_TRACING_KHR, pipelineLayout, 0,
         (uint32_t) descSets.size(), descSets.data(), 0, nullptr);
 
-    vkCmdPushConstants(drawCmdBuffers[i], pipelineLayout,
-        VK_SHADER_STAGE_RAYGEN_BIT_KHR | VK_SHADER_STAGE_CLOSEST_HIT_BIT_KHR
-            | VK_SHADER_STAGE_MISS_BIT_KHR, 0, sizeof(UniformData),
-        &uniformData);
+    // Storage image i is swap chain image i or is copied to it, both are
+    // per image so nothing is shared between frames in flight
+    recordStorageImageWriteBarrier(drawCmdBuffers[i], i);
 
     VkStridedDeviceAddressRegionKHR emptySbtEntry = { };
     vkCmdTraceRaysKHR(drawCmdBuffers[i],
@@ -1611,36 +1612,7 @@ public:
         &shaderBindingTables.hit.stridedDeviceAddressRegion, &emptySbtEntry,
         width, height, 1);
 
-//    // Prepare current swap chain image as transfer destination
-    vks::tools::setImageLayout(drawCmdBuffers[i], swapChain.images[i],
-        VK_IMAGE_LAYOUT_UNDEFINED, VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL,
-        subresourceRange);
-
-    //       Prepare ray tracing output image as transfer source
-    vks::tools::setImageLayout(drawCmdBuffers[i], storageImage.image,
-        VK_IMAGE_LAYOUT_GENERAL, VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL,
-        subresourceRange);
-//
-    VkImageCopy copyRegion { };
-    copyRegion.srcSubresource = { VK_IMAGE_ASPECT_COLOR_BIT, 0, 0, 1 };
-    copyRegion.srcOffset = { 0, 0, 0 };
-    copyRegion.dstSubresource = { VK_IMAGE_ASPECT_COLOR_BIT, 0, 0, 1 };
-    copyRegion.dstOffset = { 0, 0, 0 };
-    copyRegion.extent = { width, height, 1 };
-    vkCmdCopyImage(drawCmdBuffers[i], storageImage.image,
-        VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL, swapChain.images[i],
-        VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL, 1, &copyRegion);
-//
-//    // Transition swap chain image back for presentation
-    vks::tools::setImageLayout(drawCmdBuffers[i], swapChain.images[i],
-        VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL, VK_IMAGE_LAYOUT_PRESENT_SRC_KHR,
-        subresourceRange);
-
-    // Transition ray tracing output image back to general layout
-    vks::tools::setImageLayout(drawCmdBuffers[i], storageImage.image,
-        VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL, VK_IMAGE_LAYOUT_GENERAL,
-        subresourceRange);
-//
+    recordStorageImagePresent(drawCmdBuffers[i], i, { width, height });
 
     VK_CHECK_RESULT(vkEndCommandBuffer(drawCmdBuffers[i]));
   }
@@ -1648,19 +1620,80 @@ public:
 //
   void draw() {
     VulkanExampleBase::prepareFrame();
-    submitInfo.commandBufferCount = 1;
-    submitInfo.pCommandBuffers = &drawCmdBuffers[currentBuffer];
-    rayTrace(currentBuffer);
+    memcpy(uniformBuffers[currentBuffer].mapped, &uniformData,
+        sizeof(uniformData));
+
+    // Entities moved or lightmaps changed since the last frame, the TLAS
+    // update and lightmap upload go in their own command buffer ahead of the
+    // pre-recorded trace
+    if (animateLightmaps) {
+      lightTime += frameTimer;
+      scene.rUpdateLightmaps(lightTime, lightmapRegions);
+    }
+    VkCommandBuffer commandBuffers[2];
+    uint32_t commandBufferCount = 0;
+    if (topLevelDirty || !lightmapRegions.empty()) {
+      VkCommandBuffer commandBuffer = topLevelCmdBuffers[currentBuffer];
+      VkCommandBufferBeginInfo cmdBufInfo =
+          vks::initializers::commandBufferBeginInfo();
+      VK_CHECK_RESULT(vkBeginCommandBuffer(commandBuffer, &cmdBufInfo));
+      scene.recordLightmapUpload(commandBuffer, lightmapRegions);
+      if (topLevelDirty) {
+        buildTopLevelAccelerationStructure(commandBuffer);
+      }
+      VK_CHECK_RESULT(vkEndCommandBuffer(commandBuffer));
+      commandBuffers[commandBufferCount++] = commandBuffer;
+    }
+    commandBuffers[commandBufferCount++] = drawCmdBuffers[currentBuffer];
+
+    submitInfo.commandBufferCount = commandBufferCount;
+    submitInfo.pCommandBuffers = commandBuffers;
     VK_CHECK_RESULT(vkQueueSubmit(queue, 1, &submitInfo, VK_NULL_HANDLE));
     VulkanExampleBase::submitFrame();
   }
 
+  // The camera position is the negated eye in render space, the player box sits
+  // around the eye the way it does around a Quake player's view origin
+  void setupCameraClipping() {
+    camera.clipMovement = [this](const glm::vec3 &from, const glm::vec3 &to) {
+      if (cameraMode == CAMERA_FREE) {
+        return to;
+      }
+      vkglBSP::QModel *world = scene.loadmodel;
+      const glm::vec3 viewOffset(0.0f, -DEFAULT_VIEWHEIGHT, 0.0f);
+      glm::vec3 mins = world->hulls[1].clip_mins - viewOffset;
+      glm::vec3 maxs = world->hulls[1].clip_maxs - viewOffset;
+      glm::vec3 move = from - to;
+      if (cameraMode == CAMERA_WALK) {
+        return -vkglBSP::Model::modWalkMove(world, -from, mins, maxs, move);
+      }
+      return -vkglBSP::Model::modFlyMove(world, -from, mins, maxs, move);
+    };
+  }
+
+  virtual void keyPressed(uint32_t key) {
+    if (key == KEY_F) {
+      static const char *names[] = { "free", "fly", "walk" };
+      cameraMode = static_cast<CameraMode>((cameraMode + 1) % 3);
+      std::cout << "Camera mode: " << names[cameraMode] << std::endl;
+    }
+    // Toggles a dynamic light at the eye, like a player's muzzle flash that never fades
+    if (key == KEY_L && animateLightmaps) {
+      vkglBSP::DLight &light = scene.dlights[0];
+      if (light.radius != 0.0f) {
+        light.radius = 0.0f;
+      } else {
+        light.origin = -camera.position;
+        light.radius = 200.0f;
+        light.die = FLT_MAX;
+      }
+    }
+  }
+
   virtual void render() {
     if (!prepared)
       return;
 
-    draw();
-
     if (!paused || camera.updated) {
 //      std::cout << camera.position.x << " " << camera.position.y << " "
 //          << camera.position.z << std::endl;
@@ -1669,6 +1702,8 @@ public:
       updateUniformBuffersPre();
     }
 
+    draw();
+
   }
 };
 
@@ -0,0 +1,1968 @@
+/*
+ * Command line utilities for Quake BSP data
+ *
+ * bsptool bench-load [-game dir] [-runs n] [-threads n] [-cache dir] [map ...]
+ *   Times the BSP loader. Without maps a set of synthetic grid maps with
+ *   doubling face counts is generated, load time should grow linearly.
+ *   -threads sets the lump decoding threads, 1 decodes serially.
+ *   -cache loads through .bspc caches in dir, the first run writes them.
+ *
+ * bsptool bench-pvs [-leafs n] [-runs n]
+ *   Times PVS row decompression, cached row lookups and the union and
+ *   intersection kernels at every SIMD level the CPU supports, on random
+ *   run length coded rows for n leafs.
+ *
+ * bsptool bench-cull [-leafs n] [-surfaces n] [-runs n]
+ *   Times the 8 wide frustum vs leaf box and surface backface kernels at
+ *   every SIMD level the CPU supports, on a random scene, and checks that
+ *   all levels produce the same masks as the scalar code.
+ *
+ * bsptool bench-world [-cells n] [-range n] [-runs n]
+ *   Times the front to back world walk that builds the per texture
+ *   visible index lists, on a n x n cell map where each cell sees the
+ *   cells within range, and checks it against the flat leaf culling.
+ *
+ * bsptool trace [-game dir] [-size w h] [-pos x y z] [-rot x y z]
+ *     [-threads n] [-runs n] [-check n] [-out file.ppm] [map]
+ *   Builds the CPU BVH over the map's triangles and renders it the way
+ *   raytracingbsp does, with the same default camera and light, at every
+ *   SIMD level the CPU supports. -check compares n random rays against a
+ *   brute force test of every triangle, -out writes the image.
+ *
+ * bsptool bench-hull [-game dir] [-cells n] [-traces n] [-threads n]
+ *     [-frames n] [-runs n] [map]
+ *   Times box traces through the clipping hulls, single threaded and
+ *   batched over threads, and checks every trace against the recursive
+ *   SV_RecursiveHullCheck. Without a map the hulls are a synthetic n x n
+ *   grid of floors and pillars. Then times a fly-through of -frames camera
+ *   moves clipped against hull 1 with modFlyMove and modWalkMove.
+ *
+ * bsptool bench-lightmap [-game dir] [-blocks n] [-flicker pct]
+ *     [-dlights n] [-frames n] [-runs n] [map]
+ *   Times CalcSurfaceExtents and packing the lightmaps into atlas pages,
+ *   reports how full the pages are and checks that no two lightmaps
+ *   overlap. Without a map n random lightmap sized blocks are packed.
+ *   With a map the surfaces get random light data, pct percent of them an
+ *   animated lightstyle, and -frames of rUpdateLightmaps with n dynamic
+ *   lights are timed. R_BuildLightMap is checked at every SIMD level.
+ *
+ * bsptool bench-textures [-game dir] [-textures n] [-threads n] [-runs n]
+ *     [map]
+ *   Times Mod_CheckFullbrights and expanding every miptex of the map to
+ *   RGBA8 with its fullbright mask, at each SIMD level and over threads,
+ *   and checks the results against the scalar loop. Without a map n random
+ *   miptex are decoded.
+ *
+ * bsptool bake [-game dir] [-cache dir] [-force] [pak ...]
+ *   Writes a .bspc cache for every map inside the given paks, or in
+ *   every pak of the game directory when none is given. Caches that are
+ *   still valid are left alone unless -force is set.
+ *
+ * This code is licensed under the MIT license (MIT) (http://opensource.org/licenses/MIT)
+ */
+
+#include <algorithm>
+#include <cfloat>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <memory>
+#include <random>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <sys/stat.h>
+#if defined(_WIN32)
+#include <direct.h>
+#endif
+
+#include "VulkanglBSP.h"
+#include "camera.hpp"
+
+using namespace vkglBSP;
+
+static void makeDirectory(const char *path) {
+#if defined(_WIN32)
+  _mkdir(path);
+#else
+  mkdir(path, 0777);
+#endif
+}
+
+static void writeFile(const std::string &path, const std::vector<byte> &data) {
+  FILE *f = fopen(path.c_str(), "wb");
+  if (f == nullptr) {
+    throw std::runtime_error("Could not write " + path);
+  }
+  fwrite(data.data(), 1, data.size(), f);
+  fclose(f);
+}
+
+template<typename T>
+static void appendLump(std::vector<byte> &bsp, int lump, const T *data,
+    size_t count) {
+  while (bsp.size() % 4) {
+    bsp.push_back(0);
+  }
+  DHeader *header = (DHeader*) bsp.data();
+  header->lumps[lump].fileofs = (int) bsp.size();
+  header->lumps[lump].filelen = (int) (count * sizeof(T));
+  const byte *bytes = (const byte*) data;
+  bsp.insert(bsp.end(), bytes, bytes + count * sizeof(T));
+}
+
+/*
+ Synthetic BSP29 with a n x n grid of cell sized quads on the z = 0 plane, all
+ sharing one texture. The world tree is a single node on that plane with an
+ empty leaf above and the solid leaf below.
+ */
+static std::vector<byte> buildGridMap(int n, const char *texture = "wall",
+    int cell = 64) {
+  std::vector<DVertex> vertexes;
+  std::vector<DSEdge> edges(1);   // edge 0 is never used
+  std::vector<int> surfedges;
+  std::vector<DSFace> faces;
+
+  for (int y = 0; y <= n; y++) {
+    for (int x = 0; x <= n; x++) {
+      DVertex v = { { (float) (x * cell), (float) (y * cell), 0.0f } };
+      vertexes.push_back(v);
+    }
+  }
+
+  for (int y = 0; y < n; y++) {
+    for (int x = 0; x < n; x++) {
+      const unsigned short corners[4] = {
+          (unsigned short) (y * (n + 1) + x),
+          (unsigned short) (y * (n + 1) + x + 1),
+          (unsigned short) ((y + 1) * (n + 1) + x + 1),
+          (unsigned short) ((y + 1) * (n + 1) + x) };
+
+      DSFace face = { };
+      face.firstedge = (int) surfedges.size();
+      face.numedges = 4;
+      face.styles[0] = 0;
+      face.styles[1] = face.styles[2] = face.styles[3] = 255;
+      face.lightofs = -1;
+      for (int i = 0; i < 4; i++) {
+        DSEdge edge;
+        edge.v[0] = corners[i];
+        edge.v[1] = corners[(i + 1) % 4];
+        surfedges.push_back((int) edges.size());
+        edges.push_back(edge);
+      }
+      faces.push_back(face);
+    }
+  }
+
+  DPlane plane = { { 0.0f, 0.0f, 1.0f }, 0.0f, PLANE_Z };
+
+  const short extent = (short) std::min(n * cell, 32767);
+  DSNode node = { };
+  node.children[0] = -2;  // leaf 1
+  node.children[1] = -1;  // leaf 0, the solid leaf
+  node.mins[2] = -8;
+  node.maxs[0] = node.maxs[1] = extent;
+  node.maxs[2] = 8;
+  node.numfaces = (unsigned short) std::min(n * n, 65535);
+
+  DSLeaf leafs[2] = { };
+  leafs[0].contents = CONTENTS_SOLID;
+  leafs[0].visofs = -1;
+  leafs[1].contents = CONTENTS_EMPTY;
+  leafs[1].visofs = -1;
+  leafs[1].maxs[0] = leafs[1].maxs[1] = extent;
+  leafs[1].maxs[2] = 8;
+  leafs[1].nummarksurfaces = (unsigned short) std::min(n * n, 65535);
+
+  std::vector<unsigned short> marksurfaces(leafs[1].nummarksurfaces);
+  for (size_t i = 0; i < marksurfaces.size(); i++) {
+    marksurfaces[i] = (unsigned short) i;
+  }
+
+  DSClipNode clipnode = { 0, { CONTENTS_EMPTY, CONTENTS_SOLID } };
+
+  DModel world = { };
+  world.mins[2] = -8;
+  world.maxs[0] = world.maxs[1] = (float) (n * cell);
+  world.maxs[2] = 8;
+  world.visleafs = 1;
+  world.numfaces = n * n;
+
+  TexInfo texinfo = { };
+  texinfo.vecs[0][0] = 1.0f;
+  texinfo.vecs[1][1] = 1.0f;
+
+  // One 16x16 miptex with all four mip levels
+  const unsigned size = 16;
+  std::vector<byte> textures(sizeof(int) * 2 + sizeof(MipTex));
+  int *lumpHeader = (int*) textures.data();
+  lumpHeader[0] = 1;
+  lumpHeader[1] = sizeof(int) * 2;
+  MipTex *mt = (MipTex*) (textures.data() + sizeof(int) * 2);
+  memset(mt, 0, sizeof(MipTex));
+  strncpy(mt->name, texture, sizeof(mt->name) - 1);
+  mt->width = mt->height = size;
+  unsigned offset = sizeof(MipTex);
+  for (int i = 0; i < MIPLEVELS; i++) {
+    mt->offsets[i] = offset;
+    offset += (size >> i) * (size >> i);
+  }
+  for (unsigned i = sizeof(MipTex); i < offset; i++) {
+    textures.push_back((byte) (i * 7));
+  }
+
+  std::vector<byte> bsp(sizeof(DHeader), 0);
+  ((DHeader*) bsp.data())->version = BSPVERSION;
+  appendLump(bsp, LUMP_PLANES, &plane, 1);
+  appendLump(bsp, LUMP_TEXTURES, textures.data(), textures.size());
+  appendLump(bsp, LUMP_VERTEXES, vertexes.data(), vertexes.size());
+  appendLump(bsp, LUMP_NODES, &node, 1);
+  appendLump(bsp, LUMP_TEXINFO, &texinfo, 1);
+  appendLump(bsp, LUMP_FACES, faces.data(), faces.size());
+  appendLump(bsp, LUMP_CLIPNODES, &clipnode, 1);
+  appendLump(bsp, LUMP_LEAFS, leafs, 2);
+  appendLump(bsp, LUMP_MARKSURFACES, marksurfaces.data(), marksurfaces.size());
+  appendLump(bsp, LUMP_EDGES, edges.data(), edges.size());
+  appendLump(bsp, LUMP_SURFEDGES, surfedges.data(), surfedges.size());
+  appendLump(bsp, LUMP_MODELS, &world, 1);
+  return bsp;
+}
+
+static float polyArea(const glm::vec4 *verts, int numverts) {
+  glm::vec3 sum(0.0f);
+  for (int i = 2; i < numverts; i++) {
+    sum += glm::cross(glm::vec3(verts[i - 1] - verts[0]),
+        glm::vec3(verts[i] - verts[0]));
+  }
+  return glm::length(sum) * 0.5f;
+}
+
+/*
+ Warp surfaces have to be covered by polys no wider than one 128 unit cell
+ plus 8 units of slack on either side, every other surface keeps no polys.
+ Returns the number of surfaces that break this.
+ */
+static int badWarpSurfaces(const QModel *mod) {
+  const SurfaceTable &table = mod->surftable;
+  int bad = 0;
+  for (int s = 0; s < mod->numsurfaces; s++) {
+    const int first = mod->surfaces[s].polys;
+    if (!(table.flags[s] & SURF_DRAWTURB)) {
+      bad += first != -1;
+      continue;
+    }
+    float area = 0.0f;
+    bool wide = first == -1;
+    for (int p = first; p != -1; p = mod->polys[p].next) {
+      const GlPoly &poly = mod->polys[p];
+      const glm::vec4 *verts = &mod->polyverts[poly.firstvert];
+      glm::vec3 mins(FLT_MAX), maxs(-FLT_MAX);
+      for (int i = 0; i < poly.numverts; i++) {
+        mins = glm::min(mins, glm::vec3(verts[i]));
+        maxs = glm::max(maxs, glm::vec3(verts[i]));
+      }
+      const glm::vec3 size = maxs - mins;
+      wide |= std::max(size.x, std::max(size.y, size.z)) > 128.0f + 16.0f;
+      area += polyArea(verts, poly.numverts);
+    }
+    const float surfaceArea = polyArea(&mod->polyverts[table.firstvert[s]],
+        table.numverts[s]);
+    if (wide || fabsf(area - surfaceArea) > surfaceArea * 1e-3f) {
+      bad++;
+    }
+  }
+  return bad;
+}
+
+static int benchLoad(int argc, char *argv[]) {
+  std::string gameDir = GAMENAME;
+  int runs = 5;
+  uint32_t threads = 0;
+  std::string cacheDir;
+  std::vector<std::string> maps;
+
+  for (int i = 0; i < argc; i++) {
+    if (!strcmp(argv[i], "-game") && i + 1 < argc) {
+      gameDir = argv[++i];
+    } else if (!strcmp(argv[i], "-cache") && i + 1 < argc) {
+      cacheDir = argv[++i];
+    } else if (!strcmp(argv[i], "-runs") && i + 1 < argc) {
+      runs = std::max(1, atoi(argv[++i]));
+    } else if (!strcmp(argv[i], "-threads") && i + 1 < argc) {
+      threads = (uint32_t) std::max(0, atoi(argv[++i]));
+    } else {
+      maps.push_back(argv[i]);
+    }
+  }
+
+  if (maps.empty()) {
+    // Face counts roughly double per step, up to the 64k vertex limit of BSP29 edges
+    static const int gridSizes[] = { 16, 23, 32, 45, 64, 91, 128, 181, 255 };
+    gameDir = "bsptool_bench";
+    makeDirectory(gameDir.c_str());
+    makeDirectory((gameDir + "/maps").c_str());
+    for (int n : gridSizes) {
+      char name[MAX_QPATH];
+      snprintf(name, sizeof(name), "maps/grid%i.bsp", n);
+      writeFile(gameDir + "/" + name, buildGridMap(n));
+      maps.push_back(name);
+    }
+    // Quads wider than a warp cell so that the subdivision has to cut them
+    writeFile(gameDir + "/maps/water16.bsp", buildGridMap(16, "*water", 200));
+    maps.push_back("maps/water16.bsp");
+  }
+
+  FileSystem fileSystem;
+  fileSystem.addGameDirectory(gameDir.c_str());
+
+  std::cout << "map                          faces      verts   best ms   ns/face"
+      << std::endl;
+  for (const auto &map : maps) {
+    double best = 0.0;
+    int faces = 0;
+    size_t verts = 0;
+    for (int run = 0; run < runs; run++) {
+      Model model;
+      model.fileSystem = &fileSystem;
+      model.mapName = map;
+      model.loaderThreads = threads;
+      model.cacheDir = cacheDir;
+
+      // The loader is chatty, keep its output out of the timings
+      std::streambuf *coutBuffer = std::cout.rdbuf(nullptr);
+      auto tStart = std::chrono::high_resolution_clock::now();
+      try {
+        model.init();
+      } catch (const std::exception &e) {
+        std::cout.rdbuf(coutBuffer);
+        std::cout.clear();
+        std::cerr << map << ": " << e.what() << std::endl;
+        return 1;
+      }
+      auto tEnd = std::chrono::high_resolution_clock::now();
+      std::cout.rdbuf(coutBuffer);
+      std::cout.clear();
+
+      double ms = std::chrono::duration<double, std::milli>(tEnd - tStart).count();
+      if (run == 0 || ms < best) {
+        best = ms;
+      }
+      faces = model.loadmodel->numsurfaces;
+      verts = model.loadmodel->polyverts.size();
+      const int bad = badWarpSurfaces(model.loadmodel);
+      if (bad) {
+        std::cerr << map << ": " << bad << " badly subdivided warp surfaces"
+            << std::endl;
+        return 1;
+      }
+    }
+    printf("%-26s %8i %10zu %9.3f %9.1f\n", map.c_str(), faces, verts, best,
+        faces ? best * 1.0e6 / faces : 0.0);
+  }
+  return 0;
+}
+
+// Quake style run length coding, zero bytes are followed by a repeat count
+static void compressVisRow(const std::vector<byte> &row, std::vector<byte> &out) {
+  for (size_t i = 0; i < row.size(); i++) {
+    out.push_back(row[i]);
+    if (row[i]) {
+      continue;
+    }
+    int rep = 1;
+    while (i + 1 < row.size() && !row[i + 1] && rep < 255) {
+      rep++;
+      i++;
+    }
+    out.push_back((byte) rep);
+  }
+}
+
+template<typename F>
+static double bestNanoseconds(int runs, int iterations, F body) {
+  double best = 0.0;
+  for (int run = 0; run < runs; run++) {
+    auto tStart = std::chrono::high_resolution_clock::now();
+    for (int i = 0; i < iterations; i++) {
+      body(i);
+    }
+    auto tEnd = std::chrono::high_resolution_clock::now();
+    double ns = std::chrono::duration<double, std::nano>(tEnd - tStart).count()
+        / iterations;
+    if (run == 0 || ns < best) {
+      best = ns;
+    }
+  }
+  return best;
+}
+
+static int benchPVS(int argc, char *argv[]) {
+  int numleafs = 8192;
+  int runs = 5;
+  for (int i = 0; i < argc; i++) {
+    if (!strcmp(argv[i], "-leafs") && i + 1 < argc) {
+      numleafs = std::max(8, atoi(argv[++i]));
+    } else if (!strcmp(argv[i], "-runs") && i + 1 < argc) {
+      runs = std::max(1, atoi(argv[++i]));
+    }
+  }
+
+  // A map with numleafs visible leafs plus the solid leaf, each leaf sees a
+  // few random spans of the others like a real PVS does
+  QModel mod = QModel();
+  strcpy(mod.name, "bench");
+  mod.numleafs = numleafs;
+  const int rowsize = (numleafs + 7) >> 3;
+  std::vector<size_t> visofs(numleafs + 1);
+  std::mt19937 random(1);
+  // The uncompressed rows every decompressed or cached row has to match
+  std::vector<byte> reference((size_t) (numleafs + 1) * rowsize);
+  for (int leaf = 1; leaf <= numleafs; leaf++) {
+    byte *row = reference.data() + (size_t) leaf * rowsize;
+    const int spans = 1 + random() % 8;
+    for (int span = 0; span < spans; span++) {
+      const int first = random() % numleafs;
+      const int last = std::min(numleafs, first + 1 + (int) (random() % 256));
+      for (int bit = first; bit < last; bit++) {
+        row[bit >> 3] |= 1 << (bit & 7);
+      }
+    }
+    visofs[leaf] = mod.visdata.size();
+    compressVisRow(std::vector<byte>(row, row + rowsize), mod.visdata);
+  }
+  mod.leafs.assign(numleafs + 1, MLeaf());
+  mod.leafs[0].contents = CONTENTS_SOLID;
+  for (int leaf = 1; leaf <= numleafs; leaf++) {
+    mod.leafs[leaf].contents = CONTENTS_EMPTY;
+    mod.leafs[leaf].compressed_vis = mod.visdata.data() + visofs[leaf];
+  }
+  mod.pvscache.reset(numleafs + 1, rowsize, PVS_CACHE_ROWS);
+  mod.novis.assign(mod.pvscache.rowbytes, 0xff);
+  mod.fatpvs.assign(mod.pvscache.rowbytes, 0);
+
+  Model model;
+  const int rowbytes = mod.pvscache.rowbytes;
+  std::vector<byte> out(rowbytes);
+  printf("%i leafs, %i byte rows, %.1f bytes compressed on average\n", numleafs,
+      rowbytes, (double) mod.visdata.size() / numleafs);
+
+  double ns = bestNanoseconds(runs, numleafs, [&](int i) {
+    model.modDecompressVis(mod.leafs[1 + i].compressed_vis, &mod, out.data());
+  });
+  printf("decompress            %10.1f ns/row\n", ns);
+  int mismatches = 0;
+  for (int leaf = 1; leaf <= numleafs; leaf++) {
+    model.modDecompressVis(mod.leafs[leaf].compressed_vis, &mod, out.data());
+    if (memcmp(out.data(), &reference[(size_t) leaf * rowsize], rowsize)) {
+      std::cerr << "leaf " << leaf << " decompresses differently" << std::endl;
+      mismatches++;
+    }
+  }
+  // Checked after each timing, so the cached rows are compared as hits and
+  // the cycling ones as both hits and misses
+  auto checkLeafPVS = [&](int count, const char *what) {
+    for (int i = 0; i < count; i++) {
+      const byte *vis = model.modLeafPVS(&mod.leafs[1 + i], &mod);
+      if (memcmp(vis, &reference[(size_t) (1 + i) * rowsize], rowsize)) {
+        std::cerr << "leaf " << 1 + i << " " << what << " pvs differs"
+            << std::endl;
+        mismatches++;
+      }
+    }
+  };
+
+  const int hot = std::min(numleafs, PVS_CACHE_ROWS / 2);
+  for (int i = 0; i < hot; i++) {
+    model.modLeafPVS(&mod.leafs[1 + i], &mod);
+  }
+  ns = bestNanoseconds(runs, numleafs, [&](int i) {
+    model.modLeafPVS(&mod.leafs[1 + i % hot], &mod);
+  });
+  printf("leaf pvs, cached      %10.1f ns/row\n", ns);
+  checkLeafPVS(hot, "cached");
+  ns = bestNanoseconds(runs, numleafs, [&](int i) {
+    model.modLeafPVS(&mod.leafs[1 + i], &mod);
+  });
+  printf("leaf pvs, cycling all %10.1f ns/row (%i hits, %i misses)\n", ns,
+      mod.pvscache.hits, mod.pvscache.misses);
+  checkLeafPVS(numleafs, "cycling");
+
+  // Rows are combined in cache sized batches so the kernels, not memory, are timed
+  std::vector<byte> rows((size_t) rowbytes * 64);
+  for (auto &b : rows) {
+    b = (byte) random();
+  }
+  static const char *levelNames[] = { "scalar", "sse2", "avx2" };
+  const SimdLevel supported = simdSupported();
+  // Every level folds the batch into one row and has to match the scalar one,
+  // once at the padded row size and once at the unpadded size with its tail
+  std::vector<byte> unionRows[2], intersectRows[2];
+  for (int level = SimdScalar; level <= supported; level++) {
+    simdLevel = (SimdLevel) level;
+    for (int pass = 0; pass < 2; pass++) {
+      const size_t size = pass ? rowsize : rowbytes;
+      std::vector<byte> unionRow(rows.begin(), rows.begin() + size);
+      std::vector<byte> intersectRow(unionRow);
+      for (int i = 1; i < 64; i++) {
+        model.modUnionPVS(unionRow.data(), rows.data() + (size_t) i * rowbytes,
+            size);
+        // The rows are random bytes, a few more would leave nothing set
+        if (i < 4) {
+          model.modIntersectPVS(intersectRow.data(),
+              rows.data() + (size_t) i * rowbytes, size);
+        }
+      }
+      if (level == SimdScalar) {
+        unionRows[pass] = unionRow;
+        intersectRows[pass] = intersectRow;
+      }
+      if (unionRow != unionRows[pass] || intersectRow != intersectRows[pass]) {
+        std::cerr << levelNames[level] << " combines " << size
+            << " byte rows differently" << std::endl;
+        mismatches++;
+      }
+    }
+    double unionNs = bestNanoseconds(runs, 64 * 256, [&](int i) {
+      model.modUnionPVS(out.data(), rows.data() + (size_t) (i & 63) * rowbytes,
+          rowbytes);
+    });
+    double intersectNs = bestNanoseconds(runs, 64 * 256, [&](int i) {
+      model.modIntersectPVS(out.data(), rows.data() + (size_t) (i & 63) * rowbytes,
+          rowbytes);
+    });
+    printf("union %-6s          %10.1f ns/row %6.1f GB/s\n", levelNames[level],
+        unionNs, rowbytes / unionNs);
+    printf("intersect %-6s      %10.1f ns/row %6.1f GB/s\n", levelNames[level],
+        intersectNs, rowbytes / intersectNs);
+  }
+  simdLevel = supported;
+  return mismatches ? 1 : 0;
+}
+
+static int countBits(const std::vector<byte> &bits) {
+  int count = 0;
+  for (byte b : bits) {
+    for (; b; b &= b - 1) {
+      count++;
+    }
+  }
+  return count;
+}
+
+static int benchCull(int argc, char *argv[]) {
+  int numleafs = 8192;
+  int numsurfaces = 32768;
+  int runs = 5;
+  for (int i = 0; i < argc; i++) {
+    if (!strcmp(argv[i], "-leafs") && i + 1 < argc) {
+      numleafs = std::max(1, atoi(argv[++i]));
+    } else if (!strcmp(argv[i], "-surfaces") && i + 1 < argc) {
+      numsurfaces = std::max(1, atoi(argv[++i]));
+    } else if (!strcmp(argv[i], "-runs") && i + 1 < argc) {
+      runs = std::max(1, atoi(argv[++i]));
+    }
+  }
+
+  // Leaf boxes scattered through a 8192 unit cube around the viewer, every
+  // surface on a random plane and marked by a few leafs
+  std::mt19937 random(1);
+  std::uniform_real_distribution<float> position(-4096.0f, 4096.0f);
+  std::uniform_real_distribution<float> extent(32.0f, 512.0f);
+  std::uniform_real_distribution<float> axis(-1.0f, 1.0f);
+
+  QModel mod = QModel();
+  strcpy(mod.name, "bench");
+  mod.numleafs = numleafs;
+  mod.numsurfaces = numsurfaces;
+  mod.planes.resize(numsurfaces);
+  mod.surfaces.assign(numsurfaces, MSurface());
+  for (int i = 0; i < numsurfaces; i++) {
+    glm::vec3 normal(axis(random), axis(random), axis(random));
+    mod.planes[i].normal = glm::normalize(normal + glm::vec3(1e-3f));
+    mod.planes[i].dist = position(random) * 0.25f;
+    mod.surfaces[i].plane = &mod.planes[i];
+    mod.surfaces[i].flags = (random() & 1) ? SURF_PLANEBACK : 0;
+  }
+  mod.marksurfaces.resize((size_t) numleafs * 4);
+  for (auto &mark : mod.marksurfaces) {
+    mark = random() % numsurfaces;
+  }
+  mod.leafs.assign(numleafs + 1, MLeaf());
+  for (int i = 1; i <= numleafs; i++) {
+    MLeaf &leaf = mod.leafs[i];
+    for (int j = 0; j < 3; j++) {
+      leaf.minmaxs[j] = position(random);
+      leaf.minmaxs[3 + j] = leaf.minmaxs[j] + extent(random);
+    }
+    leaf.firstmarksurface = mod.marksurfaces.data() + (i - 1) * 4;
+    leaf.nummarksurfaces = 4;
+  }
+
+  Model model;
+  model.modPrepareSIMDData(&mod);
+
+  // A 90 degree frustum looking down +x from the origin
+  const float s = sqrtf(0.5f);
+  vks::Frustum frustum;
+  frustum.planes[0] = glm::vec4(s, s, 0.0f, 0.0f);
+  frustum.planes[1] = glm::vec4(s, -s, 0.0f, 0.0f);
+  frustum.planes[2] = glm::vec4(s, 0.0f, s, 0.0f);
+  frustum.planes[3] = glm::vec4(s, 0.0f, -s, 0.0f);
+  const glm::vec3 origin(0.0f);
+
+  std::vector<byte> everything(mod.leafvis.size() + PVS_ROW_ALIGN, 0xff);
+  std::vector<byte> leafvis(mod.leafvis.size());
+  std::vector<byte> surfvis(mod.surfvis.size());
+  std::vector<byte> scalarLeafvis, scalarSurfvis;
+
+  printf("%i leafs, %i surfaces\n", numleafs, numsurfaces);
+  static const char *levelNames[] = { "scalar", "sse2", "avx2" };
+  const SimdLevel supported = simdSupported();
+  int mismatches = 0;
+  for (int level = SimdScalar; level <= supported; level++) {
+    simdLevel = (SimdLevel) level;
+    double leafNs = bestNanoseconds(runs, 16, [&](int) {
+      memcpy(leafvis.data(), everything.data(), leafvis.size());
+      model.modCullLeafs(&mod, frustum.planes.data(), 4, leafvis.data());
+    });
+    double faceNs = bestNanoseconds(runs, 16, [&](int) {
+      memset(surfvis.data(), 0xff, surfvis.size());
+      model.modCullBackFaces(&mod, origin, surfvis.data());
+    });
+    double markNs = bestNanoseconds(runs, 16, [&](int) {
+      model.modMarkVisSurfaces(&mod, everything.data(), frustum, origin);
+    });
+
+    if (level == SimdScalar) {
+      scalarLeafvis = leafvis;
+      scalarSurfvis = surfvis;
+    } else if (leafvis != scalarLeafvis || surfvis != scalarSurfvis) {
+      mismatches++;
+    }
+
+    printf("%-6s  leafs %8.2f ns/leaf  backfaces %8.2f ns/surface  mark %9.1f us"
+        "  (%i leafs, %i surfaces visible)\n", levelNames[level],
+        leafNs / numleafs, faceNs / numsurfaces, markNs / 1000.0,
+        countBits(leafvis), countBits(mod.surfvis));
+  }
+  simdLevel = supported;
+
+  if (mismatches) {
+    std::cerr << "SIMD results differ from the scalar code" << std::endl;
+    return 1;
+  }
+  return 0;
+}
+
+/*
+ World for bench-world, n x n cells of 256 units split in halves down to
+ single cell leafs. Every node carries perside surfaces facing each way,
+ marked by all leafs on the side they face, and every leaf sees the cells
+ within range.
+ */
+struct BenchWorld {
+  QModel mod = QModel();
+  int n, range, perside;
+
+  struct Span {
+    int x0, y0, x1, y1;
+  };
+
+  BenchWorld(int n, int range, int perside, int numtextures) :
+      n(n), range(range), perside(perside) {
+    const int numleafs = n * n;
+    const int numnodes = numleafs - 1;
+    strcpy(mod.name, "bench");
+    mod.numleafs = numleafs;
+    mod.numnodes = numnodes;
+    mod.numplanes = numnodes;
+    mod.numsurfaces = numnodes * perside * 2;
+    mod.numtextures = numtextures;
+    mod.planes.resize(numnodes);
+    mod.nodes.assign(std::max(numnodes, 1), MNode());
+    mod.leafs.assign(numleafs + 1, MLeaf());
+    mod.surfaces.assign(mod.numsurfaces, MSurface());
+    mod.textures.assign(numtextures, QTexture());
+    mod.texinfo.assign(numtextures, MTexInfo());
+    for (int t = 0; t < numtextures; t++) {
+      mod.texinfo[t].texture = &mod.textures[t];
+    }
+    mod.leafs[0].contents = CONTENTS_SOLID;
+
+    std::mt19937 random(1);
+    int nextnode = 0, nextsurf = 0;
+    std::vector<std::vector<int>> marks(numleafs + 1);
+    std::vector<int> seen;
+    build(Span { 0, 0, n, n }, nullptr, nextnode, nextsurf, seen, marks, random);
+
+    std::vector<size_t> markofs(numleafs + 1), visofs(numleafs + 1);
+    const int rowsize = (numleafs + 7) >> 3;
+    std::vector<byte> row(rowsize);
+    for (int leaf = 1; leaf <= numleafs; leaf++) {
+      markofs[leaf] = mod.marksurfaces.size();
+      mod.marksurfaces.insert(mod.marksurfaces.end(), marks[leaf].begin(),
+          marks[leaf].end());
+
+      const int cx = (leaf - 1) % n, cy = (leaf - 1) / n;
+      std::fill(row.begin(), row.end(), 0);
+      for (int y = std::max(0, cy - range); y <= std::min(n - 1, cy + range); y++) {
+        for (int x = std::max(0, cx - range); x <= std::min(n - 1, cx + range); x++) {
+          const int bit = y * n + x;
+          row[bit >> 3] |= 1 << (bit & 7);
+        }
+      }
+      visofs[leaf] = mod.visdata.size();
+      compressVisRow(row, mod.visdata);
+    }
+    mod.nummarksurfaces = (int) mod.marksurfaces.size();
+    for (int leaf = 1; leaf <= numleafs; leaf++) {
+      mod.leafs[leaf].firstmarksurface = mod.marksurfaces.data() + markofs[leaf];
+      mod.leafs[leaf].nummarksurfaces = (int) marks[leaf].size();
+      mod.leafs[leaf].compressed_vis = mod.visdata.data() + visofs[leaf];
+    }
+
+    mod.pvscache.reset(numleafs + 1, rowsize, PVS_CACHE_ROWS);
+    mod.novis.assign(mod.pvscache.rowbytes, 0xff);
+    mod.fatpvs.assign(mod.pvscache.rowbytes, 0);
+  }
+
+  MNode* build(const Span &span, MNode *parent, int &nextnode, int &nextsurf,
+      std::vector<int> &seen, std::vector<std::vector<int>> &marks,
+      std::mt19937 &random) {
+    MNode *node;
+    if (span.x1 - span.x0 == 1 && span.y1 - span.y0 == 1) {
+      const int leafnum = 1 + span.y0 * n + span.x0;
+      MLeaf *leaf = &mod.leafs[leafnum];
+      leaf->contents = CONTENTS_EMPTY;
+      marks[leafnum] = seen;
+      node = (MNode*) leaf;
+    } else {
+      node = &mod.nodes[nextnode];
+      MPlane *plane = &mod.planes[nextnode++];
+      node->contents = 0;
+
+      // Front is the upper half, like the dot >= 0 side of the plane
+      Span front = span, back = span;
+      if (span.x1 - span.x0 >= span.y1 - span.y0) {
+        const int mid = (span.x0 + span.x1) / 2;
+        plane->normal = glm::vec3(1.0f, 0.0f, 0.0f);
+        plane->dist = mid * 256.0f;
+        plane->type = PLANE_X;
+        front.x0 = back.x1 = mid;
+      } else {
+        const int mid = (span.y0 + span.y1) / 2;
+        plane->normal = glm::vec3(0.0f, 1.0f, 0.0f);
+        plane->dist = mid * 256.0f;
+        plane->type = PLANE_ANYY;
+        back.y1 = front.y0 = mid;
+      }
+      plane->signbits = 0;
+
+      node->plane = plane;
+      node->firstsurface = nextsurf;
+      node->numsurfaces = perside * 2;
+      for (int i = 0; i < perside * 2; i++) {
+        const int s = nextsurf++;
+        MSurface &surf = mod.surfaces[s];
+        surf.plane = plane;
+        surf.flags = i < perside ? 0 : SURF_PLANEBACK;
+        surf.texinfo = &mod.texinfo[random() % mod.numtextures];
+        mod.surftable.firstvert.push_back(s * 4);
+        mod.surftable.numverts.push_back(4);
+      }
+
+      const size_t mark = seen.size();
+      for (int i = 0; i < perside; i++) {
+        seen.push_back(node->firstsurface + i);
+      }
+      node->children[0] = build(front, node, nextnode, nextsurf, seen, marks,
+          random);
+      seen.resize(mark);
+      for (int i = 0; i < perside; i++) {
+        seen.push_back(node->firstsurface + perside + i);
+      }
+      node->children[1] = build(back, node, nextnode, nextsurf, seen, marks,
+          random);
+      seen.resize(mark);
+    }
+
+    node->parent = parent;
+    node->minmaxs[0] = span.x0 * 256.0f;
+    node->minmaxs[1] = span.y0 * 256.0f;
+    node->minmaxs[2] = 0.0f;
+    node->minmaxs[3] = span.x1 * 256.0f;
+    node->minmaxs[4] = span.y1 * 256.0f;
+    node->minmaxs[5] = 256.0f;
+    return node;
+  }
+};
+
+static int benchWorld(int argc, char *argv[]) {
+  int cells = 64;
+  int range = 12;
+  int runs = 5;
+  for (int i = 0; i < argc; i++) {
+    if (!strcmp(argv[i], "-cells") && i + 1 < argc) {
+      cells = std::max(2, atoi(argv[++i]));
+    } else if (!strcmp(argv[i], "-range") && i + 1 < argc) {
+      range = std::max(0, atoi(argv[++i]));
+    } else if (!strcmp(argv[i], "-runs") && i + 1 < argc) {
+      runs = std::max(1, atoi(argv[++i]));
+    }
+  }
+
+  BenchWorld world(cells, range, 4, 16);
+  QModel &mod = world.mod;
+  Model model;
+  model.loadmodel = &mod;
+  model.modPrepareSIMDData(&mod);
+
+  // Viewpoints in random cells, 90 degree frustums with a random yaw
+  const int frames = 256;
+  std::mt19937 random(1);
+  std::uniform_real_distribution<float> angle(0.0f, 6.2831853f);
+  std::vector<glm::vec3> origins(frames);
+  std::vector<vks::Frustum> frustums(frames);
+  for (int f = 0; f < frames; f++) {
+    const int cell = random() % (cells * cells);
+    origins[f] = glm::vec3(((cell % cells) + 0.5f) * 256.0f,
+        ((cell / cells) + 0.5f) * 256.0f, 128.0f);
+    const float yaw = angle(random);
+    const glm::vec3 forward(cosf(yaw), sinf(yaw), 0.0f);
+    const glm::vec3 right(-sinf(yaw), cosf(yaw), 0.0f);
+    const glm::vec3 up(0.0f, 0.0f, 1.0f);
+    const glm::vec3 normals[4] = { forward + right, forward - right, forward
+        + up, forward - up };
+    for (int p = 0; p < 4; p++) {
+      const glm::vec3 normal = glm::normalize(normals[p]);
+      frustums[f].planes[p] = glm::vec4(normal, -glm::dot(normal, origins[f]));
+    }
+  }
+
+  printf("%i leafs, %i nodes, %i surfaces, %i triangles\n", mod.numleafs,
+      mod.numnodes, mod.numsurfaces, mod.numsurfaces * 2);
+
+  // The walk has to agree with the flat leaf and backface culling
+  int mismatches = 0;
+  size_t visible = 0;
+  for (int f = 0; f < frames; f++) {
+    model.rRenderWorld(origins[f], frustums[f]);
+    const byte *vis = model.modLeafPVS(model.r_viewleaf, &mod);
+    model.modMarkVisSurfaces(&mod, vis, frustums[f], origins[f]);
+    visible += mod.visindexes.size() / 3;
+    if ((int) mod.visindexes.size() != countBits(mod.surfvis) * 6) {
+      mismatches++;
+    }
+  }
+
+  double walkNs = bestNanoseconds(runs, frames, [&](int f) {
+    model.rRenderWorld(origins[f], frustums[f]);
+  });
+  double stillNs = bestNanoseconds(runs, frames, [&](int) {
+    model.rRenderWorld(origins[0], frustums[0]);
+  });
+  double flatNs = bestNanoseconds(runs, frames, [&](int f) {
+    const byte *vis = model.modLeafPVS(model.modPointInLeaf(origins[f], &mod),
+        &mod);
+    model.modMarkVisSurfaces(&mod, vis, frustums[f], origins[f]);
+  });
+
+  printf("visible %10.1f triangles/frame (%.1f%%)\n", (double) visible / frames,
+      100.0 * visible / frames / (mod.numsurfaces * 2));
+  printf("walk, moving     %8.2f us/frame\n", walkNs / 1000.0);
+  printf("walk, standing   %8.2f us/frame\n", stillNs / 1000.0);
+  printf("flat leaf cull   %8.2f us/frame\n", flatNs / 1000.0);
+
+  if (mismatches) {
+    std::cerr << mismatches << " frames differ from the flat leaf culling"
+        << std::endl;
+    return 1;
+  }
+  return 0;
+}
+
+static bool isMapName(const char *name) {
+  const size_t len = strlen(name);
+  return !strncmp(name, "maps/", 5) && len > 4
+      && !strcmp(name + len - 4, ".bsp");
+}
+
+static int bake(int argc, char *argv[]) {
+  std::string gameDir = GAMENAME;
+  std::string cacheDir = "bspcache";
+  bool force = false;
+  std::vector<std::string> paks;
+
+  for (int i = 0; i < argc; i++) {
+    if (!strcmp(argv[i], "-game") && i + 1 < argc) {
+      gameDir = argv[++i];
+    } else if (!strcmp(argv[i], "-cache") && i + 1 < argc) {
+      cacheDir = argv[++i];
+    } else if (!strcmp(argv[i], "-force")) {
+      force = true;
+    } else {
+      paks.push_back(argv[i]);
+    }
+  }
+
+  FileSystem fileSystem;
+  fileSystem.addGameDirectory(gameDir.c_str());
+
+  // Maps are always loaded through the search paths, so a map that is
+  // overridden by a later pak is cached in the version the game will load
+  std::vector<std::string> maps;
+  if (paks.empty()) {
+    for (const auto &searchPath : fileSystem.searchPaths) {
+      if (searchPath.pack == nullptr) {
+        continue;
+      }
+      for (const auto &file : searchPath.pack->files) {
+        if (isMapName(file.name)) {
+          maps.push_back(file.name);
+        }
+      }
+    }
+  } else {
+    for (const auto &pak : paks) {
+      Pack *pack = fileSystem.loadPackFile(pak.c_str());
+      if (pack == nullptr) {
+        std::cerr << pak << " is not a pack file" << std::endl;
+        return 1;
+      }
+      for (const auto &file : pack->files) {
+        if (isMapName(file.name)) {
+          maps.push_back(file.name);
+        }
+      }
+      fileSystem.closePackFile(pack);
+    }
+  }
+  std::sort(maps.begin(), maps.end());
+  maps.erase(std::unique(maps.begin(), maps.end()), maps.end());
+
+  int baked = 0, current = 0;
+  for (const auto &map : maps) {
+    Model model;
+    model.fileSystem = &fileSystem;
+    model.mapName = map;
+    model.cacheDir = cacheDir;
+
+    char cachePath[MAX_OSPATH];
+    model.modCachePath(map.c_str(), "bspc", cachePath, sizeof(cachePath));
+    if (force) {
+      remove(cachePath);
+    }
+
+    std::streambuf *coutBuffer = std::cout.rdbuf(nullptr);
+    auto tStart = std::chrono::high_resolution_clock::now();
+    try {
+      model.init();
+    } catch (const std::exception &e) {
+      std::cout.rdbuf(coutBuffer);
+      std::cout.clear();
+      std::cerr << map << ": " << e.what() << std::endl;
+      continue;
+    }
+    auto tEnd = std::chrono::high_resolution_clock::now();
+    std::cout.rdbuf(coutBuffer);
+    std::cout.clear();
+
+    const double ms = std::chrono::duration<double, std::milli>(tEnd - tStart).count();
+    if (model.loadedFromCache) {
+      current++;
+      printf("%-26s up to date %9.3f ms\n", map.c_str(), ms);
+    } else {
+      baked++;
+      printf("%-26s -> %s %9.3f ms\n", map.c_str(), cachePath, ms);
+    }
+  }
+  printf("%i maps baked, %i up to date\n", baked, current);
+  return maps.empty() ? 1 : 0;
+}
+
+// Nearest hit over every triangle, the reference for trace -check
+static float bruteForceHit(const QModel *mod, const glm::vec3 &origin,
+    const glm::vec3 &direction, float tmin, float tmax) {
+  float best = tmax;
+  for (size_t i = 0; i + 2 < mod->polyindexes.size(); i += 3) {
+    const glm::vec3 v0 = glm::vec3(mod->polyverts[mod->polyindexes[i]]);
+    const glm::vec3 e1 = glm::vec3(mod->polyverts[mod->polyindexes[i + 1]]) - v0;
+    const glm::vec3 e2 = glm::vec3(mod->polyverts[mod->polyindexes[i + 2]]) - v0;
+    const glm::vec3 p = glm::cross(direction, e2);
+    const float det = glm::dot(e1, p);
+    if (det == 0.0f) {
+      continue;
+    }
+    const glm::vec3 s = origin - v0;
+    const glm::vec3 q = glm::cross(s, e1);
+    const float u = glm::dot(s, p) / det;
+    const float v = glm::dot(direction, q) / det;
+    const float t = glm::dot(e2, q) / det;
+    if (u >= 0.0f && v >= 0.0f && u + v <= 1.0f && t > tmin && t < best) {
+      best = t;
+    }
+  }
+  return best;
+}
+
+static void writePPM(const std::string &path, const std::vector<uint32_t> &rgba,
+    uint32_t width, uint32_t height) {
+  char header[64];
+  const int headerlen = snprintf(header, sizeof(header), "P6\n%u %u\n255\n",
+      width, height);
+  std::vector<byte> data(header, header + headerlen);
+  for (uint32_t pixel : rgba) {
+    data.push_back((byte) pixel);
+    data.push_back((byte) (pixel >> 8));
+    data.push_back((byte) (pixel >> 16));
+  }
+  writeFile(path, data);
+}
+
+// Loads map into model without the loader's progress output
+static void loadMapQuietly(Model &model, FileSystem &fileSystem,
+    const std::string &map) {
+  model.fileSystem = &fileSystem;
+  model.mapName = map;
+  std::streambuf *coutBuffer = std::cout.rdbuf(nullptr);
+  try {
+    model.init();
+  } catch (...) {
+    std::cout.rdbuf(coutBuffer);
+    throw;
+  }
+  std::cout.rdbuf(coutBuffer);
+  std::cout.clear();
+}
+
+static int trace(int argc, char *argv[]) {
+  std::string gameDir = GAMENAME;
+  std::string map = "maps/start.bsp";
+  std::string out;
+  uint32_t width = 1280, height = 720;
+  uint32_t threads = 0;
+  int runs = 3;
+  int checks = 0;
+  // Defaults of raytracingbsp's camera and light
+  glm::vec3 position(0.0f, 3.0f, -20.0f);
+  glm::vec3 rotation(0.0f);
+  const glm::vec4 lightPos(-228.209f, 227.337f, 315.972f, 0.0f);
+
+  for (int i = 0; i < argc; i++) {
+    if (!strcmp(argv[i], "-game") && i + 1 < argc) {
+      gameDir = argv[++i];
+    } else if (!strcmp(argv[i], "-size") && i + 2 < argc) {
+      width = (uint32_t) std::max(1, atoi(argv[++i]));
+      height = (uint32_t) std::max(1, atoi(argv[++i]));
+    } else if (!strcmp(argv[i], "-pos") && i + 3 < argc) {
+      for (int a = 0; a < 3; a++) {
+        position[a] = (float) atof(argv[++i]);
+      }
+    } else if (!strcmp(argv[i], "-rot") && i + 3 < argc) {
+      for (int a = 0; a < 3; a++) {
+        rotation[a] = (float) atof(argv[++i]);
+      }
+    } else if (!strcmp(argv[i], "-threads") && i + 1 < argc) {
+      threads = (uint32_t) std::max(0, atoi(argv[++i]));
+    } else if (!strcmp(argv[i], "-runs") && i + 1 < argc) {
+      runs = std::max(1, atoi(argv[++i]));
+    } else if (!strcmp(argv[i], "-check") && i + 1 < argc) {
+      checks = std::max(0, atoi(argv[++i]));
+    } else if (!strcmp(argv[i], "-out") && i + 1 < argc) {
+      out = argv[++i];
+    } else {
+      map = argv[i];
+    }
+  }
+
+  FileSystem fileSystem;
+  fileSystem.addGameDirectory(gameDir.c_str());
+  Model model;
+  loadMapQuietly(model, fileSystem, map);
+  const QModel *mod = model.loadmodel;
+  const uint32_t numTriangles = (uint32_t) (mod->polyindexes.size() / 3);
+
+  BVH bvh;
+  double buildMs = 0.0;
+  for (int run = 0; run < runs; run++) {
+    auto tStart = std::chrono::high_resolution_clock::now();
+    bvh.build(mod->polyverts.data(), mod->polyindexes.data(), numTriangles,
+        threads);
+    auto tEnd = std::chrono::high_resolution_clock::now();
+    const double ms = std::chrono::duration<double, std::milli>(tEnd - tStart).count();
+    if (run == 0 || ms < buildMs) {
+      buildMs = ms;
+    }
+  }
+  printf("%s: %u triangles, BVH built in %.3f ms, %zu nodes, %zu packets"
+      " (%.1f%% lanes used), SAH cost %.2f\n", map.c_str(), numTriangles,
+      buildMs, bvh.nodes.size(), bvh.triangles.size(),
+      bvh.triangles.empty() ? 0.0 :
+          100.0 * numTriangles / (bvh.triangles.size() * BVH_WIDTH),
+      bvh.sahCost);
+
+  Camera camera;
+  camera.type = Camera::CameraType::firstperson;
+  camera.setPerspective(60.0f, (float) width / (float) height, 0.1f, 512.0f);
+  camera.setRotation(rotation);
+  camera.setTranslation(position);
+
+  std::vector<uint32_t> rgba(width * height);
+  std::vector<uint32_t> scalarImage;
+  static const char *levelNames[] = { "scalar", "sse2", "avx2" };
+  const SimdLevel supported = simdSupported();
+  int mismatches = 0;
+  for (int level = SimdScalar; level <= supported; level++) {
+    simdLevel = (SimdLevel) level;
+    double best = 0.0;
+    for (int run = 0; run < runs; run++) {
+      auto tStart = std::chrono::high_resolution_clock::now();
+      model.rTraceImage(bvh, camera.matrices.view, camera.matrices.perspective,
+          lightPos, width, height, threads, rgba.data());
+      auto tEnd = std::chrono::high_resolution_clock::now();
+      const double ms = std::chrono::duration<double, std::milli>(tEnd - tStart).count();
+      if (run == 0 || ms < best) {
+        best = ms;
+      }
+    }
+    if (level == SimdScalar) {
+      scalarImage = rgba;
+    } else if (rgba != scalarImage) {
+      mismatches++;
+    }
+    printf("%-6s  %9.3f ms/frame  %7.2f Mpixels/s\n", levelNames[level], best,
+        width * height / (best * 1000.0));
+  }
+  simdLevel = supported;
+
+  if (checks > 0 && numTriangles > 0) {
+    // Rays from random points inside the map in random directions
+    glm::vec3 mins(FLT_MAX), maxs(-FLT_MAX);
+    for (const glm::vec4 &v : mod->polyverts) {
+      mins = glm::min(mins, glm::vec3(v));
+      maxs = glm::max(maxs, glm::vec3(v));
+    }
+    std::mt19937 random(1);
+    std::uniform_real_distribution<float> unit(0.0f, 1.0f);
+    int wrong = 0;
+    for (int i = 0; i < checks; i++) {
+      glm::vec3 origin, direction;
+      for (int a = 0; a < 3; a++) {
+        origin[a] = mins[a] + (maxs[a] - mins[a]) * unit(random);
+        direction[a] = unit(random) * 2.0f - 1.0f;
+      }
+      direction = glm::normalize(direction + glm::vec3(1e-4f));
+      const float expected = bruteForceHit(mod, origin, direction, 0.001f, 1e6f);
+      BVHHit hit;
+      const float t = bvh.intersect(origin, direction, 0.001f, 1e6f, hit) ?
+          hit.t : 1e6f;
+      if (fabsf(t - expected) > 1e-3f * std::max(1.0f, expected)
+          || bvh.occluded(origin, direction, 0.001f, 1e6f) != (expected < 1e6f)) {
+        wrong++;
+      }
+    }
+    printf("%i of %i random rays differ from the brute force test\n", wrong,
+        checks);
+    mismatches += wrong;
+  }
+
+  if (!out.empty()) {
+    writePPM(out, rgba, width, height);
+  }
+
+  if (mismatches) {
+    std::cerr << "BVH results differ from the reference" << std::endl;
+    return 1;
+  }
+  return 0;
+}
+
+/*
+ An n x n grid of 256 unit cells, each with a floor at a random height and
+ maybe a pillar, as clipping hulls 0, 1 and 2. The larger hulls are the
+ same tree with the solid planes pushed out by the player and monster boxes.
+ */
+struct BenchHull {
+  QModel mod;
+  std::vector<MClipNode> clipnodes;
+  std::vector<MPlane> planes[3];
+  std::vector<bool> solidBack;  // plane bounds a solid on its back side
+  int n;
+
+  BenchHull(int n) : n(n) {
+    std::mt19937 random(1);
+    build(0, 0, n, n, random);
+
+    // Hull boxes like modInitClipHulls, Quake's player and shambler boxes
+    // in render space
+    const glm::vec3 boxMins[3] = { glm::vec3(0.0f), glm::vec3(-16, -32, -16),
+        glm::vec3(-32, -64, -32) };
+    const glm::vec3 boxMaxs[3] = { glm::vec3(0.0f), glm::vec3(16, 24, 16),
+        glm::vec3(32, 24, 32) };
+    for (int h = 1; h < 3; h++) {
+      planes[h] = planes[0];
+      for (size_t p = 0; p < planes[h].size(); p++) {
+        if (!solidBack[p]) {
+          continue;
+        }
+        // The box touches the solid once its lowest corner along the
+        // normal is behind the plane
+        MPlane &plane = planes[h][p];
+        for (int a = 0; a < 3; a++) {
+          plane.dist -= std::min(plane.normal[a] * boxMins[h][a],
+              plane.normal[a] * boxMaxs[h][a]);
+        }
+      }
+    }
+
+    mod.submodels.resize(1);
+    for (int h = 0; h < 3; h++) {
+      Hull &hull = mod.hulls[h];
+      hull.clipnodes = clipnodes.data();
+      hull.planes = planes[h].data();
+      hull.firstclipnode = 0;
+      hull.lastclipnode = (int) clipnodes.size() - 1;
+      hull.clip_mins = boxMins[h];
+      hull.clip_maxs = boxMaxs[h];
+      mod.submodels[0].headnode[h] = 0;
+    }
+  }
+
+  int plane(const glm::vec3 &normal, float dist, bool solid) {
+    MPlane plane { };
+    plane.normal = normal;
+    plane.dist = dist;
+    plane.type = normal.x == 1.0f ? PLANE_X : PLANE_ANYZ;
+    planes[0].push_back(plane);
+    solidBack.push_back(solid);
+    return (int) planes[0].size() - 1;
+  }
+
+  int node(int planenum, int front, int back) {
+    MClipNode clipnode;
+    clipnode.planenum = planenum;
+    clipnode.children[0] = front;
+    clipnode.children[1] = back;
+    clipnodes.push_back(clipnode);
+    return (int) clipnodes.size() - 1;
+  }
+
+  int build(int x0, int z0, int x1, int z1, std::mt19937 &random) {
+    if (x1 - x0 > 1 || z1 - z0 > 1) {
+      // Children are filled in after their subtrees exist
+      const int num = node(0, 0, 0);
+      int front, back;
+      if (x1 - x0 >= z1 - z0) {
+        const int mid = (x0 + x1) / 2;
+        clipnodes[num].planenum = plane(glm::vec3(1, 0, 0), mid * 256.0f, false);
+        front = build(mid, z0, x1, z1, random);
+        back = build(x0, z0, mid, z1, random);
+      } else {
+        const int mid = (z0 + z1) / 2;
+        clipnodes[num].planenum = plane(glm::vec3(0, 0, 1), mid * 256.0f, false);
+        front = build(x0, mid, x1, z1, random);
+        back = build(x0, z0, x1, mid, random);
+      }
+      clipnodes[num].children[0] = front;
+      clipnodes[num].children[1] = back;
+      return num;
+    }
+
+    // Floor, solid below
+    const int floor = node(plane(glm::vec3(0, 1, 0),
+        (float) (random() % 64), true), 0, CONTENTS_SOLID);
+    if (random() % 2) {
+      clipnodes[floor].children[0] = CONTENTS_EMPTY;
+      return floor;
+    }
+    // Pillar, solid behind all four sides
+    const float px0 = x0 * 256.0f + 32 + random() % 64;
+    const float px1 = px0 + 32 + random() % 96;
+    const float pz0 = z0 * 256.0f + 32 + random() % 64;
+    const float pz1 = pz0 + 32 + random() % 96;
+    int inside = CONTENTS_SOLID;
+    inside = node(plane(glm::vec3(0, 0, -1), -pz0, true), CONTENTS_EMPTY, inside);
+    inside = node(plane(glm::vec3(0, 0, 1), pz1, true), CONTENTS_EMPTY, inside);
+    inside = node(plane(glm::vec3(-1, 0, 0), -px0, true), CONTENTS_EMPTY, inside);
+    inside = node(plane(glm::vec3(1, 0, 0), px1, true), CONTENTS_EMPTY, inside);
+    clipnodes[floor].children[0] = inside;
+    return floor;
+  }
+};
+
+// SV_RecursiveHullCheck as Quake has it, the reference for hullCheck
+static bool recursiveHullCheck(const Hull *hull, int num, float p1f, float p2f,
+    const glm::vec3 &p1, const glm::vec3 &p2, Trace &trace) {
+  if (num < 0) {
+    if (num != CONTENTS_SOLID) {
+      trace.allsolid = false;
+      if (num == CONTENTS_EMPTY)
+        trace.inopen = true;
+      else
+        trace.inwater = true;
+    } else {
+      trace.startsolid = true;
+    }
+    return true;
+  }
+
+  const MClipNode *node = hull->clipnodes + num;
+  const MPlane *plane = hull->planes + node->planenum;
+  float t1, t2;
+  if (plane->type < 3) {
+    t1 = p1[plane->type] - plane->dist;
+    t2 = p2[plane->type] - plane->dist;
+  } else {
+    t1 = glm::dot(plane->normal, p1) - plane->dist;
+    t2 = glm::dot(plane->normal, p2) - plane->dist;
+  }
+  if (t1 >= 0 && t2 >= 0)
+    return recursiveHullCheck(hull, node->children[0], p1f, p2f, p1, p2, trace);
+  if (t1 < 0 && t2 < 0)
+    return recursiveHullCheck(hull, node->children[1], p1f, p2f, p1, p2, trace);
+
+  float frac = t1 < 0 ? (t1 + 0.03125f) / (t1 - t2)
+      : (t1 - 0.03125f) / (t1 - t2);
+  frac = std::min(std::max(frac, 0.0f), 1.0f);
+  float midf = p1f + (p2f - p1f) * frac;
+  glm::vec3 mid = p1 + frac * (p2 - p1);
+  const int side = t1 < 0 ? 1 : 0;
+
+  if (!recursiveHullCheck(hull, node->children[side], p1f, midf, p1, mid, trace))
+    return false;
+  if (Model::hullPointContents(hull, node->children[side ^ 1], mid)
+      != CONTENTS_SOLID)
+    return recursiveHullCheck(hull, node->children[side ^ 1], midf, p2f, mid,
+        p2, trace);
+  if (trace.allsolid)
+    return false;
+
+  trace.plane.normal = side ? -plane->normal : plane->normal;
+  trace.plane.dist = side ? -plane->dist : plane->dist;
+  while (Model::hullPointContents(hull, hull->firstclipnode, mid)
+      == CONTENTS_SOLID) {
+    frac -= 0.1f;
+    if (frac < 0)
+      break;
+    midf = p1f + (p2f - p1f) * frac;
+    mid = p1 + frac * (p2 - p1);
+  }
+  trace.fraction = midf;
+  trace.endpos = mid;
+  return false;
+}
+
+static bool sameTrace(const Trace &a, const Trace &b) {
+  return a.allsolid == b.allsolid && a.startsolid == b.startsolid
+      && a.inopen == b.inopen && a.inwater == b.inwater
+      && a.fraction == b.fraction && a.endpos == b.endpos
+      && (a.fraction == 1.0f || a.allsolid
+          || (a.plane.normal == b.plane.normal && a.plane.dist == b.plane.dist));
+}
+
+static int benchHull(int argc, char *argv[]) {
+  std::string gameDir = GAMENAME;
+  std::string map;
+  int cells = 64;
+  int count = 65536;
+  uint32_t threads = 0;
+  int frames = 4096;
+  int runs = 5;
+  for (int i = 0; i < argc; i++) {
+    if (!strcmp(argv[i], "-game") && i + 1 < argc) {
+      gameDir = argv[++i];
+    } else if (!strcmp(argv[i], "-cells") && i + 1 < argc) {
+      cells = std::max(1, atoi(argv[++i]));
+    } else if (!strcmp(argv[i], "-traces") && i + 1 < argc) {
+      count = std::max(1, atoi(argv[++i]));
+    } else if (!strcmp(argv[i], "-threads") && i + 1 < argc) {
+      threads = (uint32_t) std::max(0, atoi(argv[++i]));
+    } else if (!strcmp(argv[i], "-frames") && i + 1 < argc) {
+      frames = std::max(1, atoi(argv[++i]));
+    } else if (!strcmp(argv[i], "-runs") && i + 1 < argc) {
+      runs = std::max(1, atoi(argv[++i]));
+    } else {
+      map = argv[i];
+    }
+  }
+  if (threads == 0) {
+    threads = std::max(1u, std::thread::hardware_concurrency());
+  }
+
+  FileSystem fileSystem;
+  Model model;
+  std::unique_ptr<BenchHull> grid;
+  QModel *mod;
+  glm::vec3 mins, maxs;
+  if (!map.empty()) {
+    fileSystem.addGameDirectory(gameDir.c_str());
+    loadMapQuietly(model, fileSystem, map);
+    mod = model.loadmodel;
+    mins = glm::make_vec3(mod->submodels[0].mins);
+    maxs = glm::make_vec3(mod->submodels[0].maxs);
+    printf("%s: %zu clipnodes, %zu nodes\n", map.c_str(), mod->clipnodes.size(),
+        mod->nodes.size());
+  } else {
+    grid.reset(new BenchHull(cells));
+    mod = &grid->mod;
+    mins = glm::vec3(0.0f, -32.0f, 0.0f);
+    maxs = glm::vec3(cells * 256.0f, 320.0f, cells * 256.0f);
+    printf("%i x %i cells, %zu clipnodes\n", cells, cells,
+        grid->clipnodes.size());
+  }
+
+  // Moves of up to 512 units from random points, a third each of points,
+  // player boxes and shambler boxes
+  const glm::vec3 boxMins[3] = { glm::vec3(0.0f), mod->hulls[1].clip_mins,
+      mod->hulls[2].clip_mins };
+  const glm::vec3 boxMaxs[3] = { glm::vec3(0.0f), mod->hulls[1].clip_maxs,
+      mod->hulls[2].clip_maxs };
+  std::mt19937 random(1);
+  std::uniform_real_distribution<float> unit(0.0f, 1.0f);
+  std::vector<TraceBox> boxes(count);
+  for (int i = 0; i < count; i++) {
+    TraceBox &box = boxes[i];
+    glm::vec3 move;
+    for (int a = 0; a < 3; a++) {
+      box.start[a] = mins[a] + (maxs[a] - mins[a]) * unit(random);
+      move[a] = unit(random) * 2.0f - 1.0f;
+    }
+    box.end = box.start + glm::normalize(move + glm::vec3(1e-4f)) * 512.0f
+        * unit(random);
+    box.mins = boxMins[i % 3];
+    box.maxs = boxMaxs[i % 3];
+  }
+
+  // Every trace has to match the recursive original exactly
+  std::vector<Trace> traces(count);
+  Model::modTraceBoxes(mod, 0, boxes.data(), traces.data(), count, threads);
+  int mismatches = 0, hits = 0;
+  for (int i = 0; i < count; i++) {
+    const TraceBox &box = boxes[i];
+    Trace expected { };
+    expected.fraction = 1;
+    expected.allsolid = true;
+    expected.endpos = box.end;
+    glm::vec3 offset;
+    int headnode;
+    const Hull *hull = Model::modHullForBox(mod, 0, box.mins, box.maxs, offset,
+        headnode);
+    recursiveHullCheck(hull, headnode, 0, 1, box.start - offset,
+        box.end - offset, expected);
+    if (expected.fraction != 1)
+      expected.endpos += offset;
+    if (!sameTrace(traces[i], expected)) {
+      mismatches++;
+    }
+    hits += traces[i].fraction < 1.0f;
+  }
+
+  double serialNs = bestNanoseconds(runs, 1, [&](int) {
+    Model::modTraceBoxes(mod, 0, boxes.data(), traces.data(), count, 1);
+  }) / count;
+  double threadedNs = bestNanoseconds(runs, 1, [&](int) {
+    Model::modTraceBoxes(mod, 0, boxes.data(), traces.data(), count, threads);
+  }) / count;
+
+  printf("%i traces, %.1f%% blocked\n", count, 100.0 * hits / count);
+  printf("1 thread    %8.1f ns/trace  %7.2f Mtraces/s\n", serialNs,
+      1000.0 / serialNs);
+  printf("%-2u threads  %8.1f ns/trace  %7.2f Mtraces/s  %.2f Mtraces/s/core\n",
+      threads, threadedNs, 1000.0 / threadedNs, 1000.0 / threadedNs / threads);
+
+  // A fly-through like the sample's clipped camera, starting from an open
+  // spot and steering a little every frame, 16 units a frame is 960 units/s
+  // at 60 fps
+  glm::vec3 origin = mins;
+  for (int i = 0; i < 1024; i++) {
+    for (int a = 0; a < 3; a++) {
+      origin[a] = mins[a] + (maxs[a] - mins[a]) * unit(random);
+    }
+    if (!Model::modTraceBox(mod, 0, origin, boxMins[1], boxMaxs[1],
+        origin).startsolid) {
+      break;
+    }
+  }
+  std::vector<glm::vec3> moves(frames);
+  glm::vec3 heading(1.0f, 0.0f, 0.0f);
+  for (int i = 0; i < frames; i++) {
+    glm::vec3 turn;
+    for (int a = 0; a < 3; a++) {
+      turn[a] = unit(random) - 0.5f;
+    }
+    heading = glm::normalize(heading + turn * 0.25f);
+    moves[i] = heading * 16.0f;
+  }
+  // The box starts in the open and no move may leave it in solid, or walk
+  // it up or down by more than a step
+  const char *moveNames[2] = { "fly", "walk" };
+  int badMoves = 0;
+  for (int walk = 0; walk < 2; walk++) {
+    double totalUs = 0.0, worstUs = 0.0;
+    glm::vec3 position = origin;
+    for (int i = 0; i < frames; i++) {
+      const glm::vec3 from = position;
+      auto start = std::chrono::high_resolution_clock::now();
+      position = walk ?
+          Model::modWalkMove(mod, position, boxMins[1], boxMaxs[1], moves[i]) :
+          Model::modFlyMove(mod, position, boxMins[1], boxMaxs[1], moves[i]);
+      const double us = std::chrono::duration<double, std::micro>(
+          std::chrono::high_resolution_clock::now() - start).count();
+      totalUs += us;
+      worstUs = std::max(worstUs, us);
+      if (Model::modTraceBox(mod, 0, position, boxMins[1], boxMaxs[1],
+          position).startsolid
+          || (walk && fabsf(position.y - from.y) > STEPSIZE + 0.1f)) {
+        badMoves++;
+      }
+    }
+    printf("%-4s %i frames  %6.2f us/frame mean  %6.2f us worst\n",
+        moveNames[walk], frames, totalUs / frames, worstUs);
+  }
+  if (badMoves) {
+    std::cerr << badMoves << " moves end in solid or climb more than a step"
+        << std::endl;
+    return 1;
+  }
+
+  if (mismatches) {
+    std::cerr << mismatches << " traces differ from SV_RecursiveHullCheck"
+        << std::endl;
+    return 1;
+  }
+  return 0;
+}
+
+// One lightmap placed on an atlas page
+struct LightmapBlock {
+  int page, x, y, w, h;
+};
+
+// Number of blocks that leave their page or cover a texel of another block
+static int badLightmapBlocks(const std::vector<LightmapBlock> &blocks,
+    int numpages) {
+  const size_t pagesize = (size_t) LIGHTMAP_PAGE_SIZE * LIGHTMAP_PAGE_SIZE;
+  std::vector<byte> used(pagesize * numpages, 0);
+  int bad = 0;
+  for (const LightmapBlock &block : blocks) {
+    if (block.page < 0 || block.page >= numpages || block.x < 0 || block.y < 0
+        || block.x + block.w > LIGHTMAP_PAGE_SIZE
+        || block.y + block.h > LIGHTMAP_PAGE_SIZE) {
+      bad++;
+      continue;
+    }
+    bool overlaps = false;
+    for (int t = block.y; t < block.y + block.h; t++) {
+      byte *row = used.data() + pagesize * block.page
+          + (size_t) t * LIGHTMAP_PAGE_SIZE;
+      for (int s = block.x; s < block.x + block.w; s++) {
+        overlaps |= row[s] != 0;
+        row[s] = 1;
+      }
+    }
+    bad += overlaps;
+  }
+  return bad;
+}
+
+/*
+ Gives every lightmapped surface random light data, style 0 and for pct
+ percent of them one of the animated styles 1 to 11 as a second map. The
+ lightmaps are then built again from it
+ */
+static void randomLightData(Model &model, QModel *mod, int pct) {
+  std::mt19937 random(1);
+  size_t numlightdata = 0;
+  std::vector<int> maps(mod->surfaces.size(), 0);
+  for (size_t i = 0; i < mod->surfaces.size(); i++) {
+    const MSurface &surf = mod->surfaces[i];
+    if (surf.lightmaptexturenum < 0)
+      continue;
+    maps[i] = (int) (random() % 100) < pct ? 2 : 1;
+    numlightdata += (size_t) ((surf.extents[0] >> 4) + 1)
+        * ((surf.extents[1] >> 4) + 1) * 3 * maps[i];
+  }
+  mod->lightdata.resize(numlightdata);
+  for (byte &b : mod->lightdata) {
+    b = (byte) random();
+  }
+  size_t offset = 0;
+  for (size_t i = 0; i < mod->surfaces.size(); i++) {
+    MSurface &surf = mod->surfaces[i];
+    if (!maps[i])
+      continue;
+    surf.samples = mod->lightdata.data() + offset;
+    memset(surf.styles, 255, sizeof(surf.styles));
+    surf.styles[0] = 0;
+    if (maps[i] == 2)
+      surf.styles[1] = (byte) (1 + random() % 11);
+    offset += (size_t) ((surf.extents[0] >> 4) + 1)
+        * ((surf.extents[1] >> 4) + 1) * 3 * maps[i];
+  }
+  model.modBuildLightmaps(mod);
+}
+
+// Times the per frame lightmap update and checks R_BuildLightMap's SIMD kernels
+static int benchLightmapUpdates(Model &model, QModel *mod, int flicker,
+    int numdlights, int frames, int runs) {
+  randomLightData(model, mod, flicker);
+
+  // Every level has to build the same texels as the scalar loop
+  static const char *levelNames[] = { "scalar", "sse2", "avx2" };
+  const SimdLevel supported = simdSupported();
+  model.rAnimateLight(1.3);
+  simdLevel = SimdScalar;
+  model.modBuildLightmaps(mod);
+  const std::vector<byte> reference = mod->lightmaps;
+  int mismatches = 0;
+  for (int level = SimdScalar; level <= supported; level++) {
+    simdLevel = (SimdLevel) level;
+    const double ms = bestNanoseconds(runs, 1, [&](int) {
+      model.modBuildLightmaps(mod);
+    }) / 1e6;
+    const bool same = mod->lightmaps == reference;
+    printf("build all %-6s      %10.3f ms\n", levelNames[level], ms);
+    if (!same) {
+      std::cerr << levelNames[level] << " builds different lightmaps"
+          << std::endl;
+      mismatches++;
+    }
+  }
+  simdLevel = supported;
+
+  // Lights sit a little in front of random surfaces
+  std::mt19937 random(2);
+  std::vector<int> lit;
+  for (size_t i = 0; i < mod->surfaces.size(); i++) {
+    if (mod->surfaces[i].lightmaptexturenum >= 0)
+      lit.push_back((int) i);
+  }
+  for (int i = 0; i < numdlights && !lit.empty(); i++) {
+    const MSurface &surf = mod->surfaces[lit[random() % lit.size()]];
+    glm::vec3 center(0.0f);
+    for (int e = 0; e < surf.numedges; e++) {
+      const int lindex = mod->surfedges[surf.firstedge + e];
+      const int vertex = lindex > 0 ?
+          mod->medges[lindex].v[1] : mod->medges[-lindex].v[0];
+      center += mod->vertexes[vertex].position;
+    }
+    center /= (float) surf.numedges;
+    DLight &light = model.dlights[i];
+    light.origin = center + surf.plane->normal * 16.0f;
+    light.radius = 200.0f;
+    light.die = FLT_MAX;
+  }
+
+  // Ten frames per lightstyle step, like a game running at 100 fps
+  std::vector<VkBufferImageCopy> regions;
+  size_t numregions = 0, texels = 0;
+  int frame = 0;
+  const double ns = bestNanoseconds(runs, frames, [&](int) {
+    model.rUpdateLightmaps(frame++ * 0.01, regions);
+  });
+  // The regions are replayed onto a copy of the atlas, which has to end up
+  // the same as the atlas itself
+  model.rUpdateLightmaps(frame * 0.01, regions);
+  std::vector<byte> uploaded = mod->lightmaps;
+  const size_t stride = LIGHTMAP_PAGE_SIZE * 4;
+  for (int i = 0; i < frames; i++) {
+    model.rUpdateLightmaps(++frame * 0.01, regions);
+    numregions += regions.size();
+    for (const VkBufferImageCopy &region : regions) {
+      texels += (size_t) region.imageExtent.width * region.imageExtent.height;
+      for (uint32_t y = 0; y < region.imageExtent.height; y++) {
+        const size_t offset = region.bufferOffset + y * stride;
+        memcpy(uploaded.data() + offset, mod->lightmaps.data() + offset,
+            region.imageExtent.width * 4);
+      }
+    }
+  }
+  if (uploaded != mod->lightmaps) {
+    std::cerr << "the uploaded regions miss changed texels" << std::endl;
+    mismatches++;
+  }
+  printf("%i%% flickering, %i dlights: %.3f ms/frame, %.1f regions and "
+      "%.1f KB uploaded per frame\n", flicker, numdlights, ns / 1e6,
+      (double) numregions / frames, texels * 4.0 / 1024.0 / frames);
+
+  if (mismatches) {
+    return 1;
+  }
+  return 0;
+}
+
+static int benchLightmap(int argc, char *argv[]) {
+  std::string gameDir = GAMENAME;
+  std::string map;
+  int count = 65536;
+  int flicker = 10;
+  int numdlights = 4;
+  int frames = 1000;
+  int runs = 5;
+  for (int i = 0; i < argc; i++) {
+    if (!strcmp(argv[i], "-game") && i + 1 < argc) {
+      gameDir = argv[++i];
+    } else if (!strcmp(argv[i], "-blocks") && i + 1 < argc) {
+      count = std::max(1, atoi(argv[++i]));
+    } else if (!strcmp(argv[i], "-flicker") && i + 1 < argc) {
+      flicker = std::min(std::max(0, atoi(argv[++i])), 100);
+    } else if (!strcmp(argv[i], "-dlights") && i + 1 < argc) {
+      numdlights = std::min(std::max(0, atoi(argv[++i])), MAX_DLIGHTS);
+    } else if (!strcmp(argv[i], "-frames") && i + 1 < argc) {
+      frames = std::max(1, atoi(argv[++i]));
+    } else if (!strcmp(argv[i], "-runs") && i + 1 < argc) {
+      runs = std::max(1, atoi(argv[++i]));
+    } else {
+      map = argv[i];
+    }
+  }
+
+  std::vector<LightmapBlock> blocks;
+  int numpages = 0;
+  double ms = 0.0;
+  FileSystem fileSystem;
+  Model model;
+  if (!map.empty()) {
+    fileSystem.addGameDirectory(gameDir.c_str());
+    loadMapQuietly(model, fileSystem, map);
+    QModel *mod = model.loadmodel;
+    ms = bestNanoseconds(runs, 1, [&](int) {
+      model.modBuildLightmaps(mod);
+    }) / 1e6;
+    numpages = mod->numlightmaps;
+    for (const MSurface &surf : mod->surfaces) {
+      if (surf.lightmaptexturenum >= 0) {
+        blocks.push_back({ surf.lightmaptexturenum, surf.light_s, surf.light_t,
+            (surf.extents[0] >> 4) + 1, (surf.extents[1] >> 4) + 1 });
+      }
+    }
+    printf("%s: %zu surfaces, %zu lightmapped, %zu bytes of light data\n",
+        map.c_str(), mod->surfaces.size(), blocks.size(), mod->lightdata.size());
+  } else {
+    // Mostly small lightmaps with the odd large one, tallest first the
+    // way modBuildLightmaps packs them
+    std::mt19937 random(1);
+    blocks.resize(count);
+    for (LightmapBlock &block : blocks) {
+      const int limit = random() % 16 ? 18 : 126;
+      block.w = 1 + random() % limit;
+      block.h = 1 + random() % limit;
+    }
+    std::stable_sort(blocks.begin(), blocks.end(),
+        [](const LightmapBlock &a, const LightmapBlock &b) {
+          return a.h != b.h ? a.h > b.h : a.w > b.w;
+        });
+    ms = bestNanoseconds(runs, 1, [&](int) {
+      std::vector<LightmapSkyline> pages;
+      for (LightmapBlock &block : blocks) {
+        block.page = 0;
+        while (block.page < (int) pages.size()
+            && !pages[block.page].alloc(block.w, block.h, block.x, block.y)) {
+          block.page++;
+        }
+        if (block.page == (int) pages.size()) {
+          pages.emplace_back();
+          pages.back().reset(LIGHTMAP_PAGE_SIZE, LIGHTMAP_PAGE_SIZE);
+          pages.back().alloc(block.w, block.h, block.x, block.y);
+        }
+      }
+      numpages = (int) pages.size();
+    }) / 1e6;
+    printf("%i random blocks\n", count);
+  }
+
+  size_t texels = 0;
+  for (const LightmapBlock &block : blocks) {
+    texels += (size_t) block.w * block.h;
+  }
+  const double capacity = (double) numpages * LIGHTMAP_PAGE_SIZE
+      * LIGHTMAP_PAGE_SIZE;
+  printf("%i pages of %i x %i, %.1f%% used, %.3f ms\n", numpages,
+      LIGHTMAP_PAGE_SIZE, LIGHTMAP_PAGE_SIZE,
+      capacity > 0 ? 100.0 * texels / capacity : 0.0, ms);
+
+  const int bad = badLightmapBlocks(blocks, numpages);
+  if (bad) {
+    std::cerr << bad << " lightmaps overlap or leave their page" << std::endl;
+    return 1;
+  }
+  if (!map.empty()) {
+    return benchLightmapUpdates(model, model.loadmodel, flicker, numdlights,
+        frames, runs);
+  }
+  return 0;
+}
+
+// n random miptex of 16 to 256 texels a side in one buffer standing in for the file
+static void randomTextures(QModel &mod, std::vector<byte> &file, int n) {
+  std::mt19937 random(1);
+  mod.textures.assign(n, QTexture());
+  file.assign(16, 0);   // offset 0 means no pixels
+  for (int i = 0; i < n; i++) {
+    QTexture &tx = mod.textures[i];
+    // every eighth a fence texture, every fourth with fullbright colors
+    snprintf(tx.name, sizeof(tx.name), i % 8 ? "tex%i" : "{fence%i", i);
+    tx.width = 16 << (random() % 5);
+    tx.height = 16 << (random() % 5);
+    const int colors = i % 4 ? 224 : 256;
+    for (int j = 0; j < MIPLEVELS; j++) {
+      tx.offsets[j] = (unsigned) file.size();
+      const size_t count = (size_t) (tx.width >> j) * (tx.height >> j);
+      for (size_t k = 0; k < count; k++) {
+        file.push_back((byte) (random() % colors));
+      }
+    }
+  }
+  mod.filebase = file.data();
+  mod.filesize = file.size();
+}
+
+static int benchTextures(int argc, char *argv[]) {
+  std::string gameDir = GAMENAME;
+  std::string map;
+  int count = 256;
+  uint32_t threads = 0;
+  int runs = 5;
+  for (int i = 0; i < argc; i++) {
+    if (!strcmp(argv[i], "-game") && i + 1 < argc) {
+      gameDir = argv[++i];
+    } else if (!strcmp(argv[i], "-textures") && i + 1 < argc) {
+      count = std::max(1, atoi(argv[++i]));
+    } else if (!strcmp(argv[i], "-threads") && i + 1 < argc) {
+      threads = (uint32_t) std::max(0, atoi(argv[++i]));
+    } else if (!strcmp(argv[i], "-runs") && i + 1 < argc) {
+      runs = std::max(1, atoi(argv[++i]));
+    } else {
+      map = argv[i];
+    }
+  }
+  if (threads == 0) {
+    threads = std::max(1u, std::thread::hardware_concurrency());
+  }
+
+  FileSystem fileSystem;
+  Model model;
+  QModel synthetic;
+  std::vector<byte> file;
+  QModel *mod = &synthetic;
+  if (!map.empty()) {
+    fileSystem.addGameDirectory(gameDir.c_str());
+    loadMapQuietly(model, fileSystem, map);
+    mod = model.loadmodel;
+  } else {
+    randomTextures(synthetic, file, count);
+    printf("%i random textures\n", count);
+  }
+  model.texLoadPalette();
+
+  std::vector<TextureDecode> decodes;
+  VkDeviceSize size = 0;
+  const double layoutMs = bestNanoseconds(runs, 1, [&](int) {
+    size = Model::texLayoutTextures(mod, decodes);
+  }) / 1e6;
+  int fullbrights = 0;
+  size_t pixels = 0;
+  for (const TextureDecode &decode : decodes) {
+    const QTexture &tx = mod->textures[decode.texture];
+    fullbrights += (decode.flags & TEXPREF_NOBRIGHT) != 0;
+    pixels += (size_t) tx.width * tx.height * 85 / 64;
+  }
+  printf("%zu textures, %i with fullbrights, %zu pixels, %.1f MB staged\n",
+      decodes.size(), fullbrights, pixels, size / (1024.0 * 1024.0));
+  printf("layout + fullbright check %8.3f ms\n", layoutMs);
+
+  // Each level decodes into its own buffer and has to match the scalar one
+  static const char *levelNames[] = { "scalar", "sse2", "avx2" };
+  const SimdLevel supported = simdSupported();
+  std::vector<byte> reference(size), staging(size);
+  int mismatches = 0;
+  for (int level = SimdScalar; level <= supported; level++) {
+    simdLevel = (SimdLevel) level;
+    std::vector<byte> &out = level == SimdScalar ? reference : staging;
+    const double ms = bestNanoseconds(runs, 1, [&](int) {
+      model.texDecodeTextures(mod, decodes, out.data(), 1);
+    }) / 1e6;
+    printf("decode %-6s            %8.3f ms %7.1f Mpixels/s\n",
+        levelNames[level], ms, pixels / ms / 1e3);
+    if (out != reference) {
+      std::cerr << levelNames[level] << " decodes differently" << std::endl;
+      mismatches++;
+    }
+  }
+  simdLevel = supported;
+  memset(staging.data(), 0, staging.size());
+  const double ms = bestNanoseconds(runs, 1, [&](int) {
+    model.texDecodeTextures(mod, decodes, staging.data(), threads);
+  }) / 1e6;
+  printf("decode %-6s %2u threads %8.3f ms %7.1f Mpixels/s\n",
+      levelNames[supported], threads, ms, pixels / ms / 1e3);
+  if (staging != reference) {
+    std::cerr << "threaded decode differs" << std::endl;
+    mismatches++;
+  }
+  return mismatches ? 1 : 0;
+}
+
+static void usage() {
+  std::cout << "usage: bsptool <command> [options]" << std::endl;
+  std::cout << "  bench-load [-game dir] [-runs n] [-threads n] [-cache dir] [map ...]"
+      << std::endl;
+  std::cout << "  bench-pvs [-leafs n] [-runs n]" << std::endl;
+  std::cout << "  bench-cull [-leafs n] [-surfaces n] [-runs n]" << std::endl;
+  std::cout << "  bench-world [-cells n] [-range n] [-runs n]" << std::endl;
+  std::cout << "  trace [-game dir] [-size w h] [-pos x y z] [-rot x y z]"
+      " [-threads n] [-runs n] [-check n] [-out file.ppm] [map]" << std::endl;
+  std::cout << "  bench-hull [-game dir] [-cells n] [-traces n] [-threads n]"
+      " [-frames n] [-runs n] [map]" << std::endl;
+  std::cout << "  bench-lightmap [-game dir] [-blocks n] [-flicker pct]"
+      " [-dlights n] [-frames n] [-runs n] [map]" << std::endl;
+  std::cout << "  bench-textures [-game dir] [-textures n] [-threads n]"
+      " [-runs n] [map]" << std::endl;
+  std::cout << "  bake [-game dir] [-cache dir] [-force] [pak ...]" << std::endl;
+}
+
+int main(int argc, char *argv[]) {
+  if (argc < 2) {
+    usage();
+    return 1;
+  }
+  const std::string command = argv[1];
+  try {
+    if (command == "bench-load") {
+      return benchLoad(argc - 2, argv + 2);
+    }
+    if (command == "bench-pvs") {
+      return benchPVS(argc - 2, argv + 2);
+    }
+    if (command == "bench-cull") {
+      return benchCull(argc - 2, argv + 2);
+    }
+    if (command == "bench-world") {
+      return benchWorld(argc - 2, argv + 2);
+    }
+    if (command == "bench-hull") {
+      return benchHull(argc - 2, argv + 2);
+    }
+    if (command == "bench-lightmap") {
+      return benchLightmap(argc - 2, argv + 2);
+    }
+    if (command == "bench-textures") {
+      return benchTextures(argc - 2, argv + 2);
+    }
+    if (command == "trace") {
+      return trace(argc - 2, argv + 2);
+    }
+    if (command == "bake") {
+      return bake(argc - 2, argv + 2);
+    }
+  } catch (const std::exception &e) {
+    std::cerr << e.what() << std::endl;
+    return 1;
+  }
+  usage();
+  return 1;
+}